@@ -0,0 +1,1355 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "gap_buffer.h"
+
+// Internal symbols exposed by GAPBUFFER_DEBUG
+size_t getByteCount(GapBuffer *buff);
+void moveBytesAfterGap(GapBuffer *buff, size_t num);
+void moveBytesBeforeGap(GapBuffer *buff, size_t num);
+size_t getBufferMemory(const GapBuffer *buff);
+
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+
+static double getTimeInNanoseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void printLatencies(const char *name, double *samples, size_t count)
+{
+    qsort(samples, count, sizeof(double), compareDoubles);
+
+    double sum = 0;
+    for (size_t i = 0; i < count; i++)
+        sum += samples[i];
+
+    printf("%-32s ops=%-9zu avg=%9.0fns p99=%9.0fns p99.9=%9.0fns max=%9.0fns\n",
+           name, count, sum / count,
+           samples[count * 990 / 1000],
+           samples[count * 999 / 1000],
+           samples[count-1]);
+}
+
+/* Symbol: benchInsertLatency
+**
+**   Type [total] bytes into an initially empty buffer, one
+**   short line at the time, and report the distribution of
+**   the latency of each insertion. The cursor is moved back
+**   and forth every now and then to make sure relocations
+**   happen with text on both sides of the gap.
+*/
+static void benchInsertLatency(const char *name, size_t total,
+                               bool (*insert)(GapBuffer**, const char*, size_t))
+{
+    static const char line[] = "The quick brown fox jumps over the lazy dog\n";
+    size_t len = sizeof(line)-1;
+
+    size_t count = total / len;
+    double *samples = malloc(count * sizeof(double));
+    if (samples == NULL)
+        return;
+
+    GapBuffer *buff = GapBuffer_create(0);
+    for (size_t i = 0; i < count; i++) {
+
+        if (i % 1024 == 0)
+            GapBuffer_moveRelative(buff, (i / 1024) % 2 ? 512 : -512);
+
+        double start = getTimeInNanoseconds();
+        insert(&buff, line, len);
+        samples[i] = getTimeInNanoseconds() - start;
+    }
+    GapBuffer_destroy(buff);
+
+    printLatencies(name, samples, count);
+    free(samples);
+}
+
+/* Symbol: benchMigrationLatency
+**
+**   Fill a buffer of [total] bytes, make it relocate
+**   incrementally with the cursor in the middle of the
+**   text, and report the latency of the first redraw
+**   (iterating the lines of a screen) and of the first
+**   click near the cursor (an absolute move, which scans
+**   the text from its start) while the text is still being
+**   migrated.
+*/
+static void benchMigrationLatency(size_t total, int rounds)
+{
+    static const char line[] = "The quick brown fox jumps over the lazy dog\n";
+    size_t len = sizeof(line)-1;
+
+    double moves[rounds];
+    double redraws[rounds];
+    for (int r = 0; r < rounds; r++) {
+
+        GapBuffer *buff = GapBuffer_create(total);
+        if (buff == NULL)
+            return;
+        while (GapBuffer_insertString(buff, line, len));
+        size_t cursor = GapBuffer_getByteCount(buff) / 2;
+        GapBuffer_moveAbsolute(buff, cursor);
+        GapBuffer_insertStringMaybeRelocateIncrementally(&buff, line, len);
+        cursor += len;
+
+        GapBufferIter iter;
+        GapBufferLine screen;
+        double start = getTimeInNanoseconds();
+        GapBufferIter_init(&iter, buff);
+        for (int i = 0; i < 60 && GapBufferIter_next(&iter, &screen); i++);
+        GapBufferIter_free(&iter);
+        redraws[r] = getTimeInNanoseconds() - start;
+
+        start = getTimeInNanoseconds();
+        GapBuffer_moveAbsolute(buff, cursor + 4096);
+        moves[r] = getTimeInNanoseconds() - start;
+
+        GapBuffer_destroy(buff);
+    }
+    printLatencies("move absolute (migrating)", moves, rounds);
+    printLatencies("iterate 60 lines (migrating)", redraws, rounds);
+}
+
+/* Symbol: runNeighbour
+**
+**   Body of the thread that runs next to the gap moves to
+**   measure how much they disturb it. It chases pointers
+**   in a working set that fits in the last level cache,
+**   counting how many loads it manages to do.
+*/
+typedef struct {
+    volatile bool stop;
+    volatile uint64_t loads;
+    size_t *ring;
+} Neighbour;
+
+static void *runNeighbour(void *arg)
+{
+    Neighbour *n = arg;
+    size_t i = 0;
+    uint64_t loads = 0;
+    while (!n->stop) {
+        for (int k = 0; k < 1024; k++)
+            i = n->ring[i];
+        loads += 1024;
+    }
+    n->loads = loads + (i & 1);
+    return NULL;
+}
+
+static bool startNeighbour(Neighbour *n, pthread_t *thread)
+{
+    // 2MB worth of indices forming a single random cycle
+    size_t count = (2 << 20) / sizeof(size_t);
+    size_t *perm = malloc(count * sizeof(size_t));
+    n->ring = malloc(count * sizeof(size_t));
+    if (perm == NULL || n->ring == NULL) {
+        free(perm);
+        free(n->ring);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++)
+        perm[i] = i;
+    for (size_t i = count-1; i > 0; i--) {
+        size_t j = rand() % (i + 1);
+        size_t t = perm[i]; perm[i] = perm[j]; perm[j] = t;
+    }
+    for (size_t i = 0; i < count; i++)
+        n->ring[perm[i]] = perm[(i + 1) % count];
+    free(perm);
+
+    n->stop = false;
+    n->loads = 0;
+    if (pthread_create(thread, NULL, runNeighbour, n)) {
+        free(n->ring);
+        return false;
+    }
+    return true;
+}
+
+static uint64_t stopNeighbour(Neighbour *n, pthread_t thread)
+{
+    n->stop = true;
+    pthread_join(thread, NULL);
+    free(n->ring);
+    return n->loads;
+}
+
+/* Symbol: benchLargeMoves
+**
+**   Move [text] bytes across a gap of [gap] bytes back and
+**   forth, first with plain memmove and then with the gap
+**   buffer's move engine. For both the move throughput is
+**   reported together with the throughput of a thread that
+**   works on a cache-sized data set at the same time.
+*/
+static void benchLargeMoves(size_t text, size_t gap, int rounds)
+{
+    GapBuffer *buff = GapBuffer_create(text + gap);
+    if (buff == NULL)
+        return;
+
+    // The length of the chunk is a prime so that a move
+    // that misplaces bytes changes the text.
+    char chunk[4093];
+    for (size_t i = 0; i < sizeof(chunk); i++)
+        chunk[i] = 'a' + i % 26;
+    for (size_t i = 0; i < text; i += sizeof(chunk))
+        GapBuffer_insertString(buff, chunk, MIN(sizeof(chunk), text - i));
+
+    char *raw = malloc(text + gap);
+    if (raw == NULL) {
+        GapBuffer_destroy(buff);
+        return;
+    }
+    memset(raw, 'a', text + gap);
+
+    for (int engine = 0; engine < 2; engine++) {
+
+        Neighbour n;
+        pthread_t thread;
+        bool neighbour = startNeighbour(&n, &thread);
+
+        double start = getTimeInNanoseconds();
+        for (int i = 0; i < rounds; i++) {
+            if (engine) {
+                moveBytesAfterGap(buff, text);
+                moveBytesBeforeGap(buff, text);
+            } else {
+                memmove(raw + gap, raw, text);
+                memmove(raw, raw + gap, text);
+            }
+        }
+        double elapsed = getTimeInNanoseconds() - start;
+
+        uint64_t loads = neighbour ? stopNeighbour(&n, thread) : 0;
+
+        printf("%-32s gap=%zuKB %6.2f GB/s, neighbour %6.1f Mloads/s\n",
+               engine ? "move (gap buffer)" : "move (memmove)", gap >> 10,
+               2.0 * rounds * text / elapsed,
+               loads / (elapsed / 1e3));
+    }
+
+    for (size_t i = 0; i < text; ) {
+        size_t len;
+        const char *slice = GapBuffer_getSlice(buff, i, &len);
+        for (size_t j = 0; j < len; j++)
+            if (slice[j] != chunk[(i + j) % sizeof(chunk)]) {
+                fprintf(stderr, "The move engine corrupted the text\n");
+                i = text;
+                break;
+            }
+        i += len;
+    }
+
+    free(raw);
+    GapBuffer_destroy(buff);
+}
+
+/* Symbol: parseLines
+**
+**   Go over the complete lines at the start of the buffer
+**   like a line-based protocol parser would, and return the
+**   number of bytes they take. The last line is ignored if
+**   it's not terminated by a newline.
+*/
+static size_t parseLines(GapBuffer *buff, size_t *lines, size_t *checksum)
+{
+    size_t avail = getByteCount(buff);
+    size_t used = 0;
+
+    GapBufferIter iter;
+    GapBufferLine line;
+    GapBufferIter_init(&iter, buff);
+    while (GapBufferIter_next(&iter, &line)) {
+        if (used + line.len >= avail)
+            break; // Not terminated
+        used += line.len + 1;
+        *checksum += line.len + (unsigned char) line.str[0];
+        (*lines)++;
+    }
+    GapBufferIter_free(&iter);
+    return used;
+}
+
+/* Symbol: benchLineProtocol
+**
+**   Stream [total] bytes of a line-based protocol through a
+**   64KB buffer. Data is received at the end of the buffer
+**   and complete lines are consumed from the front, either
+**   with GapBuffer_consume or by moving the cursor to the
+**   start and removing them.
+*/
+static void benchLineProtocol(size_t total, bool consume)
+{
+    static const char *const words[] = { "GET", "SET", "DEL", "PING", "INCR", "KEYS" };
+
+    // Pregenerate some input to copy from
+    size_t input_len = 1 << 20;
+    char  *input = malloc(input_len + 128);
+    if (input == NULL)
+        return;
+    size_t n = 0;
+    while (n < input_len)
+        n += sprintf(input + n, "%s key:%d %d\n", words[rand() % 6], rand() % 100000, rand());
+    input_len = n;
+
+    GapBuffer *buff = GapBuffer_create(64 * 1024);
+
+    size_t lines = 0;
+    size_t checksum = 0;
+    size_t received = 0;
+    size_t input_offset = 0;
+
+    double start = getTimeInNanoseconds();
+    while (received < total) {
+
+        // Receive as much as fits
+        size_t num = MIN(4096, input_len - input_offset);
+        char *dst = GapBuffer_reserve(buff, num);
+        if (dst) {
+            memcpy(dst, input + input_offset, num);
+            GapBuffer_commit(buff, num);
+            input_offset = (input_offset + num) % input_len;
+            received += num;
+        }
+
+        size_t used = parseLines(buff, &lines, &checksum);
+        if (consume)
+            GapBuffer_consume(buff, used);
+        else {
+            // The input is ASCII so bytes and symbols match
+            GapBuffer_moveAbsolute(buff, used);
+            GapBuffer_removeBackwards(buff, used);
+            GapBuffer_moveAbsolute(buff, SIZE_MAX);
+        }
+    }
+    double elapsed = getTimeInNanoseconds() - start;
+
+    printf("%-32s %6.2f GB/s, %zu lines (checksum %zu)\n",
+           consume ? "protocol (consume)" : "protocol (remove)",
+           received / elapsed, lines, checksum);
+
+    GapBuffer_destroy(buff);
+    free(input);
+}
+
+/* Symbol: loadHeaders
+**   Append to [buff] the headers found in [dir] and its
+**   subdirectories until it holds [max] bytes. Files that
+**   aren't valid UTF-8 are skipped.
+*/
+static void loadHeaders(GapBuffer *buff, const char *dir, size_t max)
+{
+    static char file[1 << 20];
+
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) && getByteCount(buff) < max) {
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        if (entry->d_type == DT_DIR) {
+            loadHeaders(buff, path, max);
+            continue;
+        }
+
+        size_t len = strlen(entry->d_name);
+        if (len < 2 || strcmp(entry->d_name + len - 2, ".h"))
+            continue;
+
+        FILE *f = fopen(path, "rb");
+        if (f == NULL)
+            continue;
+        size_t num = fread(file, 1, MIN(sizeof(file), max - getByteCount(buff)), f);
+        fclose(f);
+        GapBuffer_insertString(buff, file, num);
+    }
+    closedir(d);
+}
+
+/* Symbol: benchCompaction
+**
+**   Compact a buffer holding up to [total] bytes of source
+**   code (the system headers) at different levels and measure the compression ratio,
+**   the time to compact it and the latency of rehydrating
+**   it, which is the time the first GapBufferIter_next
+**   takes to return after the buffer was compacted.
+*/
+static void benchCompaction(size_t total)
+{
+    GapBuffer *buff = GapBuffer_create(total + (1 << 20));
+    if (buff == NULL) {
+        fprintf(stderr, "Couldn't allocate %zu bytes\n", total);
+        return;
+    }
+    loadHeaders(buff, "/usr/include", total);
+    GapBuffer_moveRelative(buff, -(int) (getByteCount(buff) / 2));
+    size_t text = getByteCount(buff);
+
+    static const int levels[] = { 0, 1, 4, 8 };
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+
+        enum { ROUNDS = 5 };
+        double compact[ROUNDS];
+        double rehydrate[ROUNDS];
+        size_t compressed = 0;
+        for (int r = 0; r < ROUNDS; r++) {
+
+            double t0 = getTimeInNanoseconds();
+            GapBuffer_compact(buff, levels[i]);
+            double t1 = getTimeInNanoseconds();
+            compressed = GapBuffer_getCompactedSize(buff);
+
+            GapBufferIter iter;
+            GapBufferLine line;
+            GapBufferIter_init(&iter, buff);
+            GapBufferIter_next(&iter, &line);
+            double t2 = getTimeInNanoseconds();
+            GapBufferIter_free(&iter);
+
+            compact[r] = t1 - t0;
+            rehydrate[r] = t2 - t1;
+        }
+        qsort(compact, ROUNDS, sizeof(double), compareDoubles);
+        qsort(rehydrate, ROUNDS, sizeof(double), compareDoubles);
+
+        char name[64];
+        snprintf(name, sizeof(name), "compact (level %d)", levels[i]);
+        printf("%-32s text=%zuMB ratio=%.2fx compact=%.0fMB/s rehydrate=%.2fms (%.0fMB/s)\n",
+               name, text >> 20, (double) text / compressed,
+               text / compact[ROUNDS/2] * 1e3, rehydrate[ROUNDS/2] / 1e6,
+               text / rehydrate[ROUNDS/2] * 1e3);
+    }
+    GapBuffer_destroy(buff);
+}
+
+/* Symbol: benchLoad
+**
+**   Load a [total] bytes file of mostly ASCII text with
+**   some multi-byte sequences in a chunked buffer, which
+**   validates it and counts its lines and code points, and
+**   insert the same text in a gap buffer, which validates
+**   it. The file is in the page cache, so this measures
+**   the scanning speed.
+*/
+static void benchLoad(size_t total)
+{
+    char *text = malloc(total);
+    GapBuffer *buff = GapBuffer_create(total);
+    FILE *file = tmpfile();
+    if (text == NULL || buff == NULL || file == NULL) {
+        fprintf(stderr, "Couldn't allocate %zu bytes\n", total);
+        free(text);
+        if (buff)
+            GapBuffer_destroy(buff);
+        if (file)
+            fclose(file);
+        return;
+    }
+
+    static const char line[] = "    size_t num = MIN(len, chunk->bytes - off); // caf\xc3\xa9 \xe2\x82\xac\n";
+    for (size_t i = 0; i < total; i++)
+        text[i] = line[i % (sizeof(line) - 1)];
+    size_t len = total - total % (sizeof(line) - 1);
+    fwrite(text, 1, len, file);
+    fflush(file);
+
+    enum { ROUNDS = 5 };
+    double load[ROUNDS];
+    double insert[ROUNDS];
+    for (int r = 0; r < ROUNDS; r++) {
+
+        ChunkedBuffer *cb = ChunkedBuffer_create(64 << 20);
+        double t0 = getTimeInNanoseconds();
+        bool loaded = ChunkedBuffer_loadFile(cb, fileno(file));
+        double t1 = getTimeInNanoseconds();
+        if (!loaded || ChunkedBuffer_getByteCount(cb) != len)
+            fprintf(stderr, "Couldn't load the file\n");
+        ChunkedBuffer_destroy(cb);
+
+        GapBuffer_moveAbsolute(buff, 0);
+        GapBuffer_removeForwards(buff, SIZE_MAX);
+        double t2 = getTimeInNanoseconds();
+        GapBuffer_insertString(buff, text, len);
+        double t3 = getTimeInNanoseconds();
+
+        load[r] = t1 - t0;
+        insert[r] = t3 - t2;
+    }
+    qsort(load, ROUNDS, sizeof(double), compareDoubles);
+    qsort(insert, ROUNDS, sizeof(double), compareDoubles);
+    printf("%-32s text=%zuMB load=%.0fMB/s insert=%.0fMB/s\n", "load",
+           len >> 20, len / load[ROUNDS/2] * 1e3, len / insert[ROUNDS/2] * 1e3);
+
+    fclose(file);
+    GapBuffer_destroy(buff);
+    free(text);
+}
+
+/* Symbol: benchDeduplication
+**
+**   Keep [count] similar configuration documents in memory,
+**   each obtained from a template by changing a few values,
+**   and compare the memory used by one gap buffer per
+**   document with the memory used by a GapBufferStore.
+*/
+static void benchDeduplication(int count)
+{
+    static const char *const sections[] = { "server", "database", "cache", "logging", "metrics", "auth" };
+    static const char *const keys[] = { "host", "port", "timeout", "retries", "enabled", "path", "user", "level" };
+
+    GapBufferStore *store = GapBufferStore_create();
+    GapBufferDocument **docs = malloc(count * sizeof(GapBufferDocument*));
+    if (store == NULL || docs == NULL)
+        return;
+
+    srand(1);
+    char text[16384];
+    size_t buffers = 0;
+    size_t metadata = 0;
+    size_t total = 0;
+    double elapsed = 0;
+    for (int i = 0; i < count; i++) {
+
+        // The same document for all, except for a few
+        // values that are specific to each one.
+        size_t len = 0;
+        for (int s = 0; s < 6; s++) {
+            len += snprintf(text + len, sizeof(text) - len, "[%s]\n", sections[s]);
+            for (int r = 0; r < 8; r++)
+                for (int k = 0; k < 8; k++) {
+                    int value = r * 8 + k;
+                    if (rand() % 100 == 0)
+                        value = i;
+                    len += snprintf(text + len, sizeof(text) - len, "%s.%s_%d = %d\n", sections[s], keys[k], r, value);
+                }
+        }
+
+        GapBuffer *buff = GapBuffer_create(len);
+        GapBuffer_insertString(buff, text, len);
+        double t0 = getTimeInNanoseconds();
+        docs[i] = GapBufferStore_save(store, buff);
+        elapsed += getTimeInNanoseconds() - t0;
+        buffers += getBufferMemory(buff); // Like a clone sized to fit
+        metadata += GapBufferDocument_getMemory(docs[i]);
+        total += len;
+        GapBuffer_destroy(buff);
+    }
+
+    GapBufferStoreStats stats;
+    GapBufferStore_getStats(store, &stats);
+    size_t stored = stats.memory + metadata;
+    printf("%-32s docs=%d text=%zuKB buffers=%zuKB store=%zuKB (%zu chunks, %zuKB metadata) saved=%.1f%% save=%.0fMB/s\n",
+           "deduplication", count, total >> 10, buffers >> 10, stored >> 10, stats.chunks, metadata >> 10,
+           100.0 * (1 - (double) stored / buffers), total / elapsed * 1e3);
+
+    for (int i = 0; i < count; i++)
+        GapBufferDocument_release(docs[i]);
+    GapBufferStore_destroy(store);
+    free(docs);
+}
+
+/* Symbol: benchFollow
+**
+**   Append [lines] log lines to a file in batches of
+**   [batch] lines, polling the followed file after each
+**   batch, and report how many lines per second the
+**   follower takes in. Only the time spent polling is
+**   counted.
+*/
+static void benchFollow(size_t lines, size_t batch)
+{
+    char path[] = "/tmp/gap_buffer_bench_follow_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+
+    GapBufferFollow follow;
+    GapBuffer *buff = GapBuffer_create(0);
+    if (buff == NULL || !GapBufferFollow_open(&follow, path, 0)) {
+        close(fd);
+        unlink(path);
+        return;
+    }
+
+    char *chunk = malloc(batch * 128);
+    if (chunk == NULL)
+        return;
+
+    size_t written = 0;
+    double polling = 0;
+    for (size_t i = 0; i < lines; i += batch) {
+        size_t len = 0;
+        for (size_t j = i; j < MIN(i + batch, lines); j++)
+            len += sprintf(chunk + len, "2026-10-17T12:00:00.%06zu INFO request served in %zu us\n", j % 1000000, j % 997);
+        if (write(fd, chunk, len) != (ssize_t) len)
+            break;
+        written += len;
+
+        double t0 = getTimeInNanoseconds();
+        GapBufferFollow_poll(&follow, &buff, 0);
+        polling += getTimeInNanoseconds() - t0;
+    }
+    if (getByteCount(buff) != written)
+        fprintf(stderr, "The follower missed some bytes\n");
+
+    printf("%-32s lines=%zu batch=%zu %.2fM lines/s (%.0fMB/s)\n",
+           "follow", lines, batch, lines / polling * 1e3, written / polling * 1e3);
+
+    free(chunk);
+    GapBufferFollow_close(&follow);
+    GapBuffer_destroy(buff);
+    close(fd);
+    unlink(path);
+}
+
+// Resident memory of the process, in bytes
+static size_t getResidentMemory(void)
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL)
+        return 0;
+    size_t pages = 0, resident = 0;
+    if (fscanf(file, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+    fclose(file);
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/* Symbol: benchMapFile
+**
+**   Map a [total] bytes file with GapBuffer_mapFile and
+**   report how much the resident memory of the process
+**   grows when the buffer is created, when a line is
+**   inserted 5000 symbols from the end and when the cursor
+**   is then moved to the start, which copies the pages of
+**   the whole file.
+*/
+static void benchMapFile(size_t total)
+{
+    char path[] = "/tmp/gap_buffer_bench_map_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+    unlink(path);
+
+    static const char line[] = "    size_t num = MIN(len, chunk->bytes - off); // caf\xc3\xa9 \xe2\x82\xac\n";
+    char block[sizeof(line) * 1024];
+    size_t block_len = 0;
+    for (int i = 0; i < 1024; i++) {
+        memcpy(block + block_len, line, sizeof(line) - 1);
+        block_len += sizeof(line) - 1;
+    }
+    size_t size = 0;
+    while (size + block_len <= total) {
+        if (write(fd, block, block_len) != (ssize_t) block_len)
+            break;
+        size += block_len;
+    }
+
+    size_t rss0 = getResidentMemory();
+    double t0 = getTimeInNanoseconds();
+    GapBuffer *buff = GapBuffer_mapFile(fd, 1 << 16);
+    double t1 = getTimeInNanoseconds();
+    if (buff == NULL) {
+        fprintf(stderr, "Couldn't map the file\n");
+        close(fd);
+        return;
+    }
+    size_t rss1 = getResidentMemory();
+
+    GapBuffer_moveRelative(buff, -5000);
+    GapBuffer_insertString(buff, line, sizeof(line) - 1);
+    size_t rss2 = getResidentMemory();
+
+    GapBuffer_moveAbsolute(buff, 0);
+    size_t rss3 = getResidentMemory();
+
+    printf("%-32s text=%zuMB open=%.0fMB/s rss: open=+%.1fMB edit=+%.1fMB move to start=+%.1fMB\n",
+           "map file", size >> 20, size / (t1 - t0) * 1e3,
+           (double) (rss1 - rss0) / (1 << 20), (double) (rss2 - rss0) / (1 << 20),
+           (double) (rss3 - rss0) / (1 << 20));
+
+    GapBuffer_destroy(buff);
+    close(fd);
+}
+
+/* Symbol: benchReplication
+**
+**   Record [edits] keystrokes in the edit stream of a
+**   buffer: mostly typed characters, with some backspaces,
+**   newlines and short cursor moves, and a checksum every
+**   1024 edits. Then apply the stream to a follower in 4KB
+**   pieces, like reads from a socket, and report the bytes
+**   taken by each edit and how fast the follower applies
+**   them.
+*/
+static void benchReplication(size_t edits)
+{
+    static const char text[] = "the quick brown fox jumps over the lazy dog caf\xc3\xa9 ";
+
+    GapBuffer *leader = GapBuffer_create(0);
+    GapBuffer *follower = GapBuffer_create(0);
+    GapBufferStream *stream = GapBufferStream_create(1024);
+    if (leader == NULL || follower == NULL || stream == NULL)
+        return;
+    GapBuffer_setStream(leader, stream);
+
+    srand(1);
+    size_t typed = 0;
+    double t0 = getTimeInNanoseconds();
+    for (size_t i = 0; i < edits; i++) {
+        int dice = rand() % 100;
+        if (dice < 5)
+            GapBuffer_removeBackwards(leader, 1);
+        else if (dice < 7)
+            GapBuffer_moveRelative(leader, rand() % 81 - 40);
+        else if (dice < 9)
+            GapBuffer_insertStringMaybeRelocate(&leader, "\n", 1);
+        else {
+            // Multi-byte symbols are typed at once
+            size_t len = text[typed] == '\xc3' ? 2 : 1;
+            GapBuffer_insertStringMaybeRelocate(&leader, text + typed, len);
+            typed = (typed + len) % (sizeof(text) - 1);
+        }
+    }
+    double t1 = getTimeInNanoseconds();
+
+    size_t len;
+    const char *data = GapBufferStream_getData(stream, &len);
+    size_t applied = 0;
+    bool ok = true;
+    double t2 = getTimeInNanoseconds();
+    while (applied < len) {
+        size_t used;
+        size_t piece = MIN(4096, len - applied);
+        ok = ok && GapBuffer_applyStream(&follower, data + applied, piece, &used) == GAPBUFFER_REPLICA_OK;
+        applied += used;
+    }
+    double t3 = getTimeInNanoseconds();
+    if (!ok || getByteCount(follower) != getByteCount(leader))
+        fprintf(stderr, "The follower diverged\n");
+
+    printf("%-32s edits=%zu text=%zuKB stream=%zuKB bytes/edit=%.2f record=%.0fns apply=%.1fM edits/s (%.0fMB/s)\n",
+           "replication", edits, getByteCount(leader) >> 10, len >> 10, (double) len / edits,
+           (t1 - t0) / edits, edits / (t3 - t2) * 1e3, len / (t3 - t2) * 1e3);
+
+    GapBufferStream_destroy(stream);
+    GapBuffer_destroy(leader);
+    GapBuffer_destroy(follower);
+}
+
+typedef struct {
+    ChunkedBuffer *cb;
+    size_t section; // Bytes of text of each writer
+    int    index;
+    size_t rounds;
+} RangeWriter;
+
+/* Symbol: runRangeWriter
+**
+**   Type in the section of the text of a writer: a word is
+**   typed one character at the time and then removed, at
+**   a different place of the section each round, with the
+**   range locked for the whole round.
+*/
+static void *runRangeWriter(void *arg)
+{
+    static const char word[] = "parallel";
+    RangeWriter *w = arg;
+
+    for (size_t r = 0; r < w->rounds; r++) {
+        size_t pos = w->index * w->section + (r * 4099) % (w->section - 4096);
+        ChunkedBufferRange range;
+        if (!ChunkedBuffer_lockRange(w->cb, pos, 4096, &range))
+            break;
+        size_t off = r % 4096;
+        for (size_t i = 0; i < sizeof(word)-1; i++)
+            ChunkedBufferRange_insertString(&range, off + i, word + i, 1);
+        ChunkedBufferRange_remove(&range, off, sizeof(word)-1);
+        ChunkedBuffer_unlockRange(&range);
+    }
+    return NULL;
+}
+
+/* Symbol: benchRangeLocks
+**
+**   Measure the edits per second of 1 to [max_writers]
+**   threads typing in disjoint sections of a text of
+**   [total] bytes through locked ranges.
+*/
+static void benchRangeLocks(size_t total, int max_writers)
+{
+    static const char line[] = "The quick brown fox jumps over the lazy dog, again and again.\n";
+
+    ChunkedBuffer *cb = ChunkedBuffer_create(0);
+    if (cb == NULL)
+        return;
+    char piece[32 * (sizeof(line)-1)];
+    for (size_t i = 0; i < sizeof(piece); i++)
+        piece[i] = line[i % (sizeof(line)-1)];
+    while (ChunkedBuffer_getByteCount(cb) < total)
+        if (!ChunkedBuffer_insertString(cb, ChunkedBuffer_getByteCount(cb), piece, sizeof(piece)))
+            break;
+
+    // The first edit of each chunk moves its gap from the
+    // end, which the measured runs shouldn't pay for.
+    const size_t rounds = 50000;
+    RangeWriter warmup = { .cb=cb, .section=total, .index=0, .rounds=total / 4099 + 1 };
+    runRangeWriter(&warmup);
+
+    double single = 0;
+    for (int n = 1; n <= max_writers; n *= 2) {
+        RangeWriter writers[64];
+        pthread_t threads[64];
+        for (int i = 0; i < n; i++)
+            writers[i] = (RangeWriter) { .cb=cb, .section=total / n, .index=i, .rounds=rounds };
+
+        double t0 = getTimeInNanoseconds();
+        int started = 0;
+        while (started < n && !pthread_create(&threads[started], NULL, runRangeWriter, &writers[started]))
+            started++;
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        double t1 = getTimeInNanoseconds();
+
+        // Each round types the word and removes it
+        double edits = (double) started * rounds * 9 / (t1 - t0) * 1e9;
+        if (n == 1)
+            single = edits;
+        printf("%-32s writers=%d text=%zuMB edits/s=%.1fM speedup=%.2fx\n",
+               "range locks", started, total >> 20, edits / 1e6, edits / single);
+    }
+    ChunkedBuffer_destroy(cb);
+}
+
+/* Symbol: benchVersions
+**
+**   Commit a version after each of [edits] edits to a 1MB
+**   text: mostly typed characters, with some backspaces and
+**   jumps to random places. Keep all of them and report the
+**   memory each one takes compared to the text, the latency
+**   of commits and of reads of 64 bytes from random old
+**   versions, and how fast old versions are iterated.
+*/
+static void benchVersions(size_t edits)
+{
+    static const char line[] = "The quick brown fox jumps over the lazy dog, again and again.\n";
+
+    GapBuffer *buff = GapBuffer_create(1 << 20);
+    GapBufferVersion **versions = malloc((edits + 1) * sizeof(GapBufferVersion*));
+    double *samples = malloc(edits * sizeof(double));
+    if (buff == NULL || versions == NULL || samples == NULL)
+        return;
+    while (getByteCount(buff) + sizeof(line) <= 1 << 20)
+        GapBuffer_insertString(buff, line, sizeof(line)-1);
+    size_t text = getByteCount(buff);
+
+    double t0 = getTimeInNanoseconds();
+    versions[0] = GapBuffer_commitVersion(buff);
+    double first = getTimeInNanoseconds() - t0;
+    if (versions[0] == NULL)
+        return;
+
+    srand(1);
+    size_t memory = 0;
+    size_t committed = 1;
+    for (size_t i = 0; i < edits; i++) {
+        int dice = rand() % 100;
+        if (dice < 5)
+            GapBuffer_removeBackwards(buff, 1);
+        else if (dice < 7)
+            GapBuffer_moveAbsolute(buff, rand() % (getByteCount(buff) + 1));
+        else
+            GapBuffer_insertStringMaybeRelocate(&buff, line + i % (sizeof(line)-1), 1);
+
+        double t1 = getTimeInNanoseconds();
+        GapBufferVersion *version = GapBuffer_commitVersion(buff);
+        samples[i] = getTimeInNanoseconds() - t1;
+        if (version == NULL)
+            break;
+        versions[committed++] = version;
+        memory += GapBufferVersion_getMemory(version);
+    }
+    printf("%-32s edits=%zu text=%zuKB first=%zuKB (%.1fms) per version=%zuB (%.3f%% of the text)\n",
+           "versions", committed - 1, text >> 10, GapBufferVersion_getMemory(versions[0]) >> 10,
+           first / 1e6, memory / (committed - 1), 100.0 * memory / (committed - 1) / text);
+    printLatencies("version commit", samples, committed - 1);
+
+    char dst[64];
+    for (size_t i = 0; i < committed - 1; i++) {
+        GapBufferVersion *version = versions[rand() % committed];
+        size_t off = rand() % (GapBufferVersion_getByteCount(version) + 1);
+        double t1 = getTimeInNanoseconds();
+        GapBufferVersion_copy(version, off, dst, sizeof(dst));
+        samples[i] = getTimeInNanoseconds() - t1;
+    }
+    printLatencies("version read (64B)", samples, committed - 1);
+
+    size_t scanned = 0;
+    size_t lines = 0;
+    double t2 = getTimeInNanoseconds();
+    for (int i = 0; i < 100; i++) {
+        GapBufferVersionIter iter;
+        GapBufferLine l;
+        GapBufferVersionIter_init(&iter, versions[rand() % committed]);
+        while (GapBufferVersionIter_next(&iter, &l)) {
+            scanned += l.len + 1;
+            lines++;
+        }
+    }
+    double t3 = getTimeInNanoseconds();
+    printf("%-32s lines=%zu iterate=%.0fMB/s (%.1fns/line)\n",
+           "version lines", lines, scanned / (t3 - t2) * 1e3, (t3 - t2) / lines);
+
+    for (size_t i = 0; i < committed; i++)
+        GapBufferVersion_release(versions[i]);
+    GapBuffer_destroy(buff);
+    free(versions);
+    free(samples);
+}
+
+/* Symbol: counter_specs
+**
+**   Hardware events counted for each operation by the
+**   "counters" mode. They're opened one by one and not as
+**   a group, so that on machines that only expose some of
+**   them (virtual machines often expose none) the others
+**   are still reported.
+*/
+#define CACHE_READ_MISS(CACHE)                                  \
+    (PERF_COUNT_HW_CACHE_##CACHE                                \
+     | (PERF_COUNT_HW_CACHE_OP_READ << 8)                       \
+     | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+typedef struct {
+    const char *name;
+    uint32_t    type;
+    uint64_t    config;
+} CounterSpec;
+
+static const CounterSpec counter_specs[] = {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "l1d_misses",    PERF_TYPE_HW_CACHE, CACHE_READ_MISS(L1D) },
+    { "llc_misses",    PERF_TYPE_HW_CACHE, CACHE_READ_MISS(LL) },
+    { "dtlb_misses",   PERF_TYPE_HW_CACHE, CACHE_READ_MISS(DTLB) },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+#define NUM_COUNTERS (sizeof(counter_specs) / sizeof(counter_specs[0]))
+
+/* Symbol: cost_names
+**
+**   Work counted by the library itself when it's built with
+**   GAPBUFFER_COST, reported per operation after the
+**   hardware counters. Unlike them it doesn't depend on the
+**   machine, so it's always available to the check.
+*/
+#ifdef GAPBUFFER_COST
+static const char *cost_names[] = { "copied", "scanned", "allocations" };
+#define NUM_COSTS (sizeof(cost_names) / sizeof(cost_names[0]))
+#else
+#define NUM_COSTS 0
+#endif
+
+// Metric 0 is the time, which is always available. Then
+// come the counters, in the order of counter_specs, and
+// the costs, in the order of cost_names.
+#define NUM_METRICS (1 + NUM_COUNTERS + NUM_COSTS)
+#define FIRST_COST  (1 + NUM_COUNTERS)
+
+typedef struct {
+    int fds[NUM_COUNTERS];
+} Counters;
+
+static void openCounters(Counters *c)
+{
+    for (size_t i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_specs[i].type;
+        attr.config = counter_specs[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1; // Allowed with perf_event_paranoid=2
+        attr.exclude_hv = 1;
+        c->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static void closeCounters(Counters *c)
+{
+    for (size_t i = 0; i < NUM_COUNTERS; i++)
+        if (c->fds[i] >= 0)
+            close(c->fds[i]);
+}
+
+static void startCounters(Counters *c)
+{
+    for (size_t i = 0; i < NUM_COUNTERS; i++)
+        if (c->fds[i] >= 0) {
+            ioctl(c->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(c->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+static void stopCounters(Counters *c, uint64_t *values)
+{
+    for (size_t i = 0; i < NUM_COUNTERS; i++)
+        if (c->fds[i] >= 0)
+            ioctl(c->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (size_t i = 0; i < NUM_COUNTERS; i++) {
+        values[i] = 0;
+        if (c->fds[i] >= 0 && read(c->fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+            values[i] = 0;
+    }
+}
+
+/* Symbol: Scenario
+**
+**   An operation measured by the "counters" mode. The
+**   [setup] builds the buffer outside of the measurement
+**   and [run] performs the operations and returns how many
+**   it did, so that the counters can be reported per
+**   operation.
+*/
+#define SCENARIO_TEXT (16 << 20)
+
+typedef struct {
+    const char *name;
+    GapBuffer *(*setup)(void);
+    size_t     (*run)(GapBuffer *buff);
+} Scenario;
+
+static GapBuffer *createTextBuffer(size_t text, size_t capacity)
+{
+    static const char line[] = "The quick brown fox jumps over the lazy dog, again and again.\n";
+    size_t len = sizeof(line)-1;
+
+    GapBuffer *buff = GapBuffer_create(capacity);
+    if (buff == NULL)
+        return NULL;
+    for (size_t i = 0; i + len <= text; i += len)
+        GapBuffer_insertString(buff, line, len);
+    return buff;
+}
+
+static GapBuffer *setupEmpty(void)
+{
+    return GapBuffer_create(2 * SCENARIO_TEXT);
+}
+
+static GapBuffer *setupText(void)
+{
+    return createTextBuffer(SCENARIO_TEXT, 2 * SCENARIO_TEXT);
+}
+
+static GapBuffer *setupTextSplit(void)
+{
+    GapBuffer *buff = setupText();
+    if (buff != NULL)
+        GapBuffer_moveRelative(buff, -(SCENARIO_TEXT / 2));
+    return buff;
+}
+
+static size_t runInsert(GapBuffer *buff)
+{
+    static const char word[] = "lorem ipsum ";
+    size_t len = sizeof(word)-1;
+    size_t count = SCENARIO_TEXT / len;
+    for (size_t i = 0; i < count; i++)
+        GapBuffer_insertString(buff, word, len);
+    return count;
+}
+
+static size_t runMove(GapBuffer *buff)
+{
+    // Back and forth over a megabyte of text, so that each
+    // move copies that much from one side of the gap to the
+    // other.
+    size_t count = 256;
+    for (size_t i = 0; i < count; i++)
+        GapBuffer_moveRelative(buff, (i & 1) ? (1 << 20) : -(1 << 20));
+    return count;
+}
+
+static size_t runRemove(GapBuffer *buff)
+{
+    size_t count = SCENARIO_TEXT / 2 / 16;
+    for (size_t i = 0; i < count; i++) {
+        if (i & 1)
+            GapBuffer_removeForwards(buff, 16);
+        else
+            GapBuffer_removeBackwards(buff, 16);
+    }
+    return count;
+}
+
+static size_t runIterate(GapBuffer *buff)
+{
+    size_t count = 0;
+    size_t checksum = 0;
+    GapBufferIter iter;
+    GapBufferLine line;
+    GapBufferIter_init(&iter, buff);
+    while (GapBufferIter_next(&iter, &line)) {
+        checksum += line.len;
+        count++;
+    }
+    GapBufferIter_free(&iter);
+    if (checksum == 0)
+        count = 0;
+    return count;
+}
+
+static const Scenario scenarios[] = {
+    { "insert",  setupEmpty,     runInsert  },
+    { "move",    setupText,      runMove    },
+    { "remove",  setupTextSplit, runRemove  },
+    { "iterate", setupTextSplit, runIterate },
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* Symbol: measureScenario
+**
+**   Run the scenario a few times and store in [metrics]
+**   the lowest value per operation of each metric, which
+**   is the least affected by noise. A metric is negative
+**   when its counter isn't available.
+*/
+static void measureScenario(const Scenario *scenario, Counters *counters, double *metrics)
+{
+    const int ROUNDS = 5;
+
+    for (size_t m = 0; m < NUM_METRICS; m++)
+        metrics[m] = -1;
+
+    for (int r = 0; r < ROUNDS; r++) {
+        GapBuffer *buff = scenario->setup();
+        if (buff == NULL)
+            return;
+
+        uint64_t values[NUM_COUNTERS];
+#ifdef GAPBUFFER_COST
+        GapBufferCost cost = GapBuffer_cost;
+#endif
+        startCounters(counters);
+        double t0 = getTimeInNanoseconds();
+        size_t ops = scenario->run(buff);
+        double t1 = getTimeInNanoseconds();
+        stopCounters(counters, values);
+#ifdef GAPBUFFER_COST
+        size_t costs[] = {
+            GapBuffer_cost.copied - cost.copied,
+            GapBuffer_cost.scanned - cost.scanned,
+            GapBuffer_cost.allocations - cost.allocations,
+        };
+#endif
+        GapBuffer_destroy(buff);
+
+        if (ops == 0)
+            return;
+
+        double sample[NUM_METRICS];
+        sample[0] = (t1 - t0) / ops;
+        for (size_t i = 0; i < NUM_COUNTERS; i++)
+            sample[i+1] = counters->fds[i] < 0 ? -1 : (double) values[i] / ops;
+#ifdef GAPBUFFER_COST
+        for (size_t i = 0; i < NUM_COSTS; i++)
+            sample[FIRST_COST+i] = (double) costs[i] / ops;
+#endif
+
+        for (size_t m = 0; m < NUM_METRICS; m++)
+            if (sample[m] >= 0 && (metrics[m] < 0 || sample[m] < metrics[m]))
+                metrics[m] = sample[m];
+    }
+}
+
+static const char *getMetricName(size_t m)
+{
+    if (m == 0)
+        return "ns";
+    if (m < FIRST_COST)
+        return counter_specs[m-1].name;
+#ifdef GAPBUFFER_COST
+    return cost_names[m-FIRST_COST];
+#else
+    return NULL;
+#endif
+}
+
+/* Symbol: isGatedMetric
+**
+**   Returns true if the check compares metric [m] with the
+**   baseline. Only the ones that don't depend on the machine
+**   are: the instructions and the costs. The time, cycles
+**   and misses are reported but vary too much between
+**   machines (and runs) to fail a check.
+*/
+static bool isGatedMetric(size_t m)
+{
+    return m >= FIRST_COST || !strcmp(getMetricName(m), "instructions");
+}
+
+/* Symbol: checkBaseline
+**
+**   Compare the measured metrics with the ones in the
+**   baseline file, which has lines like the ones printed
+**   by benchCounters ("operation metric value", with '#'
+**   starting a comment). A metric regresses when it grows
+**   more than [threshold] relative to the baseline, plus
+**   a small absolute slack so that counts close to zero,
+**   like the allocations of an insertion, don't trip it.
+**   Only the metrics for which isGatedMetric is true are
+**   compared, and those that weren't measured on this
+**   machine are skipped. If none could be compared, the
+**   whole check is skipped. Returns the number of
+**   regressions, or -1 if the file couldn't be read.
+*/
+static int checkBaseline(const char *path, double metrics[][NUM_METRICS], double threshold)
+{
+    const double SLACK = 0.5;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Couldn't open baseline '%s'\n", path);
+        return -1;
+    }
+
+    int regressions = 0;
+    int compared = 0;
+    char row[256];
+    while (fgets(row, sizeof(row), file)) {
+        char op[32];
+        char metric[32];
+        double base;
+        if (row[0] == '#' || sscanf(row, "%31s %31s %lf", op, metric, &base) != 3)
+            continue;
+
+        for (size_t s = 0; s < NUM_SCENARIOS; s++) {
+            if (strcmp(op, scenarios[s].name))
+                continue;
+            for (size_t m = 0; m < NUM_METRICS; m++) {
+                if (!isGatedMetric(m) || strcmp(metric, getMetricName(m)) || metrics[s][m] < 0)
+                    continue;
+                double limit = base * (1 + threshold) + SLACK;
+                compared++;
+                if (metrics[s][m] > limit) {
+                    printf("REGRESSION %s %s: %.3f > %.3f (baseline %.3f)\n",
+                           op, metric, metrics[s][m], limit, base);
+                    regressions++;
+                }
+            }
+        }
+    }
+    fclose(file);
+
+    if (compared == 0) {
+        printf("No metric of %s could be measured here, check skipped\n", path);
+        return 0;
+    }
+    printf("%d metrics compared with %s, %d regressions (threshold %.0f%%)\n",
+           compared, path, regressions, threshold * 100);
+    return regressions;
+}
+
+/* Symbol: benchCounters
+**
+**   Measure the time, the hardware counters and the costs
+**   per call of each basic operation and print them in the format of
+**   the baseline file, so that the output of a run can be
+**   checked in as the new baseline. If a baseline is given,
+**   returns false if any of the metrics regressed.
+*/
+static bool benchCounters(const char *baseline, double threshold)
+{
+    Counters counters;
+    openCounters(&counters);
+
+    double metrics[NUM_SCENARIOS][NUM_METRICS];
+    for (size_t s = 0; s < NUM_SCENARIOS; s++)
+        measureScenario(&scenarios[s], &counters, metrics[s]);
+    closeCounters(&counters);
+
+    printf("# operation metric value-per-operation\n");
+    for (size_t s = 0; s < NUM_SCENARIOS; s++)
+        for (size_t m = 0; m < NUM_METRICS; m++)
+            if (metrics[s][m] >= 0)
+                printf("%-8s %-14s %.3f\n", scenarios[s].name, getMetricName(m), metrics[s][m]);
+
+    for (size_t i = 0; i < NUM_COUNTERS; i++)
+        if (counters.fds[i] < 0)
+            fprintf(stderr, "Counter '%s' isn't available on this machine\n", counter_specs[i].name);
+
+    if (baseline == NULL)
+        return true;
+    return checkBaseline(baseline, metrics, threshold) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "counters")) {
+        const char *baseline = argc > 2 ? argv[2] : NULL;
+        double threshold = argc > 3 ? strtod(argv[3], NULL) : 0.25;
+        return benchCounters(baseline, threshold) ? 0 : 1;
+    }
+
+    size_t megabytes = 256;
+    if (argc > 1)
+        megabytes = strtoul(argv[1], NULL, 10);
+    size_t total = megabytes << 20;
+
+    size_t protocol_gigabytes = 10;
+    if (argc > 2)
+        protocol_gigabytes = strtoul(argv[2], NULL, 10);
+
+    benchInsertLatency("insert (relocate)", total, GapBuffer_insertStringMaybeRelocate);
+    benchInsertLatency("insert (relocate incrementally)", total, GapBuffer_insertStringMaybeRelocateIncrementally);
+    benchMigrationLatency(total, 8);
+    benchLargeMoves(total, total / 4, 4);
+    benchLargeMoves(total, 64 << 10, 4);
+    benchLineProtocol(protocol_gigabytes << 30, true);
+    benchLineProtocol(protocol_gigabytes << 30, false);
+    benchCompaction(64 << 20);
+    benchDeduplication(10000);
+    benchLoad(total);
+    benchMapFile((size_t) 1 << 30);
+    benchReplication(1000000);
+    benchFollow(10000000, 1);
+    benchFollow(10000000, 1000);
+    benchRangeLocks(64 << 20, 8);
+    benchVersions(100000);
+    return 0;
+}
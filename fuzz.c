@@ -0,0 +1,432 @@
+/* Fuzzing harness that looks for slow paths.
+**
+** The input is a program for a gap buffer, made of 3 byte
+** instructions: an opcode and a 16 bit argument. The
+** program is run against a fresh buffer 1, 4 and 16 times
+** in a row while the library counts the work it does (see
+** GAPBUFFER_COST). Each operation also has an expected
+** cost, which is the work it needs by definition, like
+** copying the inserted bytes or moving the gap across the
+** text. An input is flagged when the ratio between the
+** actual and the expected cost grows with the number of
+** repetitions, which means that some operation gets slower
+** as the text grows when it shouldn't (for instance, when
+** a buffer is reallocated on every insertion).
+**
+** With libFuzzer (make fuzz) flagged inputs make the
+** harness abort, so they're saved as crashes and can be
+** minimized with -minimize_crash=1. AFL can run the
+** standalone build (make fuzz_driver) with "@@".
+**
+** The standalone build also replays inputs and does its
+** own random search:
+**
+**   ./fuzz_driver FILE...
+**       Print the program in FILE and its costs. Aborts
+**       if it's flagged.
+**
+**   ./fuzz_driver -search NUM [SEED]
+**       Try NUM random programs. Flagged ones are minimized
+**       by removing instructions while they're still flagged
+**       and saved as slow-N.bin, which can be replayed as
+**       benchmark cases.
+*/
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "gap_buffer.h"
+
+#ifndef GAPBUFFER_COST
+#error "The harness needs the library built with GAPBUFFER_COST"
+#endif
+
+// Internal symbols exposed by GAPBUFFER_DEBUG
+size_t getByteCount(GapBuffer *buff);
+
+#define MAX_OPS 64
+#define CONSOLE_SIZE 4096
+
+// Fixed cost of each operation, covering the checks
+// and bookkeeping that don't depend on the text.
+#define OP_COST 64
+
+// A program is flagged when the cost ratio of its longest
+// run is this many times the one of its shortest run.
+#define MAX_GROWTH 4.0
+
+typedef enum {
+    OP_INSERT,
+    OP_INSERT_RELOCATE,
+    OP_INSERT_RELOCATE_INCREMENTALLY,
+    OP_MOVE_ABSOLUTE,
+    OP_MOVE_RELATIVE,
+    OP_REMOVE_FORWARDS,
+    OP_REMOVE_BACKWARDS,
+    OP_CONSUME,
+    OP_RESERVE_COMMIT,
+    OP_APPEND_DROPPING_LINES,
+    OP_ITERATE,
+    NUM_OPCODES,
+} Opcode;
+
+static const char *names[NUM_OPCODES] = {
+    [OP_INSERT]                        = "insert",
+    [OP_INSERT_RELOCATE]               = "insert (relocate)",
+    [OP_INSERT_RELOCATE_INCREMENTALLY] = "insert (relocate incrementally)",
+    [OP_MOVE_ABSOLUTE]                 = "move absolute",
+    [OP_MOVE_RELATIVE]                 = "move relative",
+    [OP_REMOVE_FORWARDS]               = "remove forwards",
+    [OP_REMOVE_BACKWARDS]              = "remove backwards",
+    [OP_CONSUME]                       = "consume",
+    [OP_RESERVE_COMMIT]                = "reserve and commit",
+    [OP_APPEND_DROPPING_LINES]         = "append dropping lines",
+    [OP_ITERATE]                       = "iterate",
+};
+
+typedef struct {
+    Opcode   code;
+    uint16_t arg;
+} Op;
+
+typedef struct {
+    double actual;
+    double expected;
+} Cost;
+
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+
+// Text inserted by the programs, with short lines and
+// some multi-byte sequences.
+static const char text[] =
+    "int x = 0; // caf\xc3\xa9 \xe2\x82\xac\n"
+    "return y + 1; // \xf0\x9f\x98\x80\n"
+    "while (x < 10) x++; // \xc3\xa9\n"
+    "} else { x = y; }\n"
+    "for (int i = 0; i < n; i++) sum += v[i];\n";
+
+// Returns the longest prefix of [text] that's at most
+// [len] bytes and doesn't cut a UTF-8 sequence.
+static size_t getText(size_t len, const char **str)
+{
+    len = MIN(len, sizeof(text) - 1);
+    while (len > 0 && (text[len] & 0xC0) == 0x80)
+        len--;
+    *str = text;
+    return len;
+}
+
+static size_t decodeProgram(const uint8_t *data, size_t size, Op *ops)
+{
+    size_t num = 0;
+    for (size_t i = 0; i + 3 <= size && num < MAX_OPS; i += 3) {
+        ops[num].code = data[i] % NUM_OPCODES;
+        ops[num].arg  = data[i+1] | (data[i+2] << 8);
+        num++;
+    }
+    return num;
+}
+
+static double getActualCost(void)
+{
+    return GapBuffer_cost.copied + GapBuffer_cost.scanned
+         + GapBuffer_cost.allocations * (double) OP_COST;
+}
+
+/* Symbol: runOp
+**
+**   Run an instruction and return its expected cost. The
+**   gap can be anywhere, so operations that move it are
+**   expected to move it across the whole text.
+*/
+static double runOp(GapBuffer **buff, GapBuffer *console, Op op)
+{
+    size_t bytes = getByteCount(*buff);
+    double expected = OP_COST;
+
+    switch (op.code) {
+
+        case OP_INSERT:
+        case OP_INSERT_RELOCATE:
+        case OP_INSERT_RELOCATE_INCREMENTALLY:
+        {
+            const char *str;
+            size_t len = getText(op.arg % 128 + 1, &str);
+            if (op.code == OP_INSERT)
+                GapBuffer_insertString(*buff, str, len);
+            else if (op.code == OP_INSERT_RELOCATE)
+                GapBuffer_insertStringMaybeRelocate(buff, str, len);
+            else
+                GapBuffer_insertStringMaybeRelocateIncrementally(buff, str, len);
+            // Validation, copy and the relocations
+            // amortized over the inserted bytes.
+            expected += 4 * len;
+            break;
+        }
+
+        case OP_MOVE_ABSOLUTE:
+            // Positions are a fraction of the text
+            GapBuffer_moveAbsolute(*buff, op.arg * (bytes + 1) / 65536);
+            expected += 2 * bytes;
+            break;
+
+        case OP_MOVE_RELATIVE:
+            GapBuffer_moveRelative(*buff, (int8_t) op.arg);
+            expected += 8 * 128;
+            break;
+
+        case OP_REMOVE_FORWARDS:
+            GapBuffer_removeForwards(*buff, op.arg % 256);
+            expected += 4 * (op.arg % 256);
+            break;
+
+        case OP_REMOVE_BACKWARDS:
+            GapBuffer_removeBackwards(*buff, op.arg % 256);
+            expected += 4 * (op.arg % 256);
+            break;
+
+        case OP_CONSUME:
+            // Compacting the consumed bytes moves the text
+            // before the gap, and is amortized over them.
+            GapBuffer_consume(*buff, op.arg % 256);
+            expected += 4 * (op.arg % 256);
+            break;
+
+        case OP_RESERVE_COMMIT:
+        {
+            const char *str;
+            size_t len = getText(op.arg % 128 + 1, &str);
+            char *dst = GapBuffer_reserve(*buff, len);
+            if (dst) {
+                memcpy(dst, str, len);
+                GapBuffer_commit(*buff, len);
+            }
+            expected += 2 * len;
+            break;
+        }
+
+        case OP_APPEND_DROPPING_LINES:
+        {
+            // The dropped lines are scanned once
+            const char *str;
+            size_t len = getText(op.arg % 128 + 1, &str);
+            size_t before = getByteCount(console);
+            GapBuffer_appendDroppingLines(console, str, len);
+            size_t dropped = before + len - getByteCount(console);
+            expected += 2 * len + dropped;
+            break;
+        }
+
+        case OP_ITERATE:
+        {
+            GapBufferIter iter;
+            GapBufferLine line;
+            GapBufferIter_init(&iter, *buff);
+            while (GapBufferIter_next(&iter, &line));
+            GapBufferIter_free(&iter);
+            expected += 2 * bytes;
+            break;
+        }
+
+        case NUM_OPCODES:
+            break;
+    }
+    return expected;
+}
+
+/* Symbol: runProgram
+**
+**   Run [repeat] times in a row the first [num] instructions
+**   of [ops] on a new buffer. If [trace] isn't NULL, the cost
+**   of each instruction of the last repetition is printed
+**   to it.
+*/
+static Cost runProgram(const Op *ops, size_t num, int repeat, FILE *trace)
+{
+    GapBuffer *buff = GapBuffer_create(0);
+    GapBuffer *console = GapBuffer_create(CONSOLE_SIZE);
+    assert(buff != NULL && console != NULL);
+
+    Cost cost = { 0, 0 };
+    double start = getActualCost();
+    for (int r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < num; i++) {
+            double before = getActualCost();
+            double expected = runOp(&buff, console, ops[i]);
+            cost.expected += expected;
+            if (trace && r == repeat-1)
+                fprintf(trace, "  %3zu %-32s %5u actual=%-8.0f expected=%.0f\n",
+                        i, names[ops[i].code], ops[i].arg, getActualCost() - before, expected);
+        }
+    }
+    cost.actual = getActualCost() - start;
+
+    GapBuffer_destroy(buff);
+    GapBuffer_destroy(console);
+    return cost;
+}
+
+static const int repeats[] = { 1, 4, 16 };
+#define NUM_REPEATS (int) (sizeof(repeats) / sizeof(repeats[0]))
+
+/* Symbol: getGrowth
+**
+**   Returns how much the ratio between actual and expected
+**   cost grows from the shortest to the longest run of the
+**   program.
+*/
+static double getGrowth(const Op *ops, size_t num, Cost *costs)
+{
+    for (int i = 0; i < NUM_REPEATS; i++)
+        costs[i] = runProgram(ops, num, repeats[i], NULL);
+
+    Cost first = costs[0];
+    Cost last  = costs[NUM_REPEATS-1];
+    return (last.actual / last.expected) / (first.actual / first.expected);
+}
+
+/* Symbol: isFlagged
+**
+**   Programs are flagged when their cost ratio grows too
+**   fast. Those doing less work than expected are never
+**   flagged, since the expected cost is an upper bound
+**   for most operations.
+*/
+static bool isFlagged(const Op *ops, size_t num)
+{
+    if (num == 0)
+        return false;
+    Cost costs[NUM_REPEATS];
+    double growth = getGrowth(ops, num, costs);
+    Cost last = costs[NUM_REPEATS-1];
+    return growth > MAX_GROWTH && last.actual > last.expected;
+}
+
+static void printReport(const Op *ops, size_t num, FILE *stream)
+{
+    Cost costs[NUM_REPEATS];
+    double growth = getGrowth(ops, num, costs);
+    for (int i = 0; i < NUM_REPEATS; i++)
+        fprintf(stream, "x%d: actual=%.0f expected=%.0f ratio=%.2f\n", repeats[i],
+                costs[i].actual, costs[i].expected, costs[i].actual / costs[i].expected);
+    fprintf(stream, "growth=%.2f (max %.2f)\n", growth, MAX_GROWTH);
+    fprintf(stream, "last run of x%d:\n", repeats[NUM_REPEATS-1]);
+    runProgram(ops, num, repeats[NUM_REPEATS-1], stream);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    Op ops[MAX_OPS];
+    size_t num = decodeProgram(data, size, ops);
+    if (isFlagged(ops, num)) {
+        printReport(ops, num, stderr);
+        abort();
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+static void encodeProgram(const Op *ops, size_t num, FILE *stream)
+{
+    for (size_t i = 0; i < num; i++) {
+        fputc(ops[i].code, stream);
+        fputc(ops[i].arg & 0xFF, stream);
+        fputc(ops[i].arg >> 8, stream);
+    }
+}
+
+/* Symbol: minimizeProgram
+**
+**   Remove instructions from a flagged program as long as
+**   it stays flagged. Returns the new number of them.
+*/
+static size_t minimizeProgram(Op *ops, size_t num)
+{
+    bool removed;
+    do {
+        removed = false;
+        for (size_t i = num; i-- > 0;) {
+            Op op = ops[i];
+            memmove(&ops[i], &ops[i+1], (num - i - 1) * sizeof(Op));
+            if (isFlagged(ops, num - 1)) {
+                num--;
+                removed = true;
+            } else {
+                memmove(&ops[i+1], &ops[i], (num - i - 1) * sizeof(Op));
+                ops[i] = op;
+            }
+        }
+    } while (removed);
+    return num;
+}
+
+static int search(long count, unsigned int seed)
+{
+    srand(seed);
+    int found = 0;
+    for (long n = 0; n < count; n++) {
+
+        Op ops[MAX_OPS];
+        size_t num = 1 + rand() % 32;
+        for (size_t i = 0; i < num; i++) {
+            ops[i].code = rand() % NUM_OPCODES;
+            ops[i].arg  = rand() & 0xFFFF;
+        }
+        if (!isFlagged(ops, num))
+            continue;
+
+        num = minimizeProgram(ops, num);
+
+        char path[64];
+        snprintf(path, sizeof(path), "slow-%d.bin", found++);
+        FILE *file = fopen(path, "wb");
+        if (file) {
+            encodeProgram(ops, num, file);
+            fclose(file);
+        }
+        fprintf(stderr, "%s:\n", path);
+        printReport(ops, num, stderr);
+    }
+    fprintf(stderr, "%ld programs, %d flagged\n", count, found);
+    return found > 0;
+}
+
+static int replay(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        return 1;
+    }
+    uint8_t data[3 * MAX_OPS];
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+
+    Op ops[MAX_OPS];
+    size_t num = decodeProgram(data, size, ops);
+    fprintf(stderr, "%s:\n", path);
+    printReport(ops, num, stderr);
+    if (isFlagged(ops, num))
+        abort();
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2 && !strcmp(argv[1], "-search")) {
+        unsigned int seed = (argc > 3) ? strtoul(argv[3], NULL, 10) : (unsigned int) time(NULL);
+        return search(strtol(argv[2], NULL, 10), seed);
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s FILE... | -search NUM [SEED]\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++)
+        replay(argv[i]);
+    return 0;
+}
+#endif
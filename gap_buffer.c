@@ -1,8 +1,34 @@
+#if defined(__linux__) && !defined(GAPBUFFER_NOPOSIX) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // For O_TMPFILE and fallocate
+#endif
+
 #include <stdint.h>
+#include <limits.h>
 #include <assert.h>
 #include <string.h>
 #include "gap_buffer.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if GAPBUFFER_THREADS > 1
+#include <pthread.h>
+#endif
+
+#ifndef GAPBUFFER_NOMALLOC
+#include <stdlib.h>
+#endif
+
+#ifndef GAPBUFFER_NOPOSIX
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#if !defined(GAPBUFFER_NOQUEUE) || defined(GAPBUFFER_SHARED) || defined(GAPBUFFER_TRACE)
+#include <stdatomic.h>
+#endif
+
 #ifdef GAPBUFFER_DEBUG
 #define PRIVATE
 #else
@@ -10,6 +36,156 @@
 #endif
 
 #define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+
+#if defined(GAPBUFFER_TRACE) && (defined(GAPBUFFER_NOMALLOC) || defined(GAPBUFFER_NOPOSIX))
+#error "GAPBUFFER_TRACE needs malloc and POSIX"
+#endif
+
+#if defined(GAPBUFFER_SHARED) && (defined(GAPBUFFER_NOMALLOC) || defined(GAPBUFFER_NOPOSIX))
+#error "GAPBUFFER_SHARED needs malloc and POSIX"
+#endif
+
+// Operations that change the memory of a buffer created
+// with GapBuffer_createShared start with SHARED_WRITE,
+// which makes the readers in other processes retry until
+// the operation returns.
+#ifdef GAPBUFFER_SHARED
+PRIVATE GapBuffer *beginSharedWrite(GapBuffer *buff);
+PRIVATE void endSharedWrite(GapBuffer **buff);
+
+#define SHARED_WRITE(BUFF) \
+    GapBuffer *shared_write __attribute__((cleanup(endSharedWrite))) = beginSharedWrite(BUFF)
+#else
+#define SHARED_WRITE(BUFF) ((void) 0)
+#endif
+
+// Record types of the edit stream of GapBufferStream. The
+// type takes the low 3 bits of the first byte of a record.
+enum {
+    STREAM_INSERT = 1,       // Length, then the inserted bytes
+    STREAM_REMOVE_FORWARDS,  // Bytes removed after the cursor
+    STREAM_REMOVE_BACKWARDS, // Bytes removed before the cursor
+    STREAM_MOVE,             // Zigzag encoded bytes the cursor moved by
+    STREAM_CONSUME,          // Bytes consumed from the front
+    STREAM_CHECKSUM,         // Length, cursor and hash of the text
+    STREAM_SNAPSHOT,         // Length, cursor, then the whole text
+};
+
+// Operations that change the text of a buffer with an
+// edit stream append to it what they did, in bytes, once
+// they did it. The same records tell buffers with committed
+// versions which part of the text changed.
+#ifndef GAPBUFFER_NOMALLOC
+PRIVATE void streamEdit(GapBuffer *buff, int type, size_t num, const char *str);
+PRIVATE void trackEdit(GapBuffer *buff, int type, size_t num);
+#define STREAM(BUFF, TYPE, NUM, STR)                                   \
+    ((BUFF)->stream ? streamEdit(BUFF, TYPE, NUM, STR) : (void) 0,    \
+     (BUFF)->committed ? trackEdit(BUFF, TYPE, NUM) : (void) 0)
+#else
+#define STREAM(BUFF, TYPE, NUM, STR) ((void) (NUM), (void) (STR))
+#endif
+
+#ifdef GAPBUFFER_TRACE
+// Names of a traced function and of its arguments
+typedef struct {
+    const char *name;
+    const char *arg_names[2];
+} TraceSite;
+
+/* Symbol: TraceSpan
+**
+**   A call to a GapBuffer_* function being recorded. It's
+**   started by the TRACE macro at the top of the function
+**   and recorded in the ring of the calling thread when
+**   the function returns, through the cleanup attribute.
+**   The work done by the call is the difference between
+**   the counters of the thread at the start and at the
+**   end of it.
+*/
+typedef struct {
+    const TraceSite *site;
+    const void      *buff;
+    int64_t          args[2];
+    uint64_t         start;
+    GapBufferCost    cost;
+    bool             sampled;
+} TraceSpan;
+
+PRIVATE _Thread_local GapBufferCost trace_cost;
+
+PRIVATE TraceSpan beginTraceSpan(const TraceSite *site, const void *buff, int64_t arg0, int64_t arg1);
+PRIVATE void endTraceSpan(TraceSpan *span);
+
+#define TRACE(BUFF, ARG0, A, ARG1, B)                                   \
+    static const TraceSite trace_site = { __func__, { ARG0, ARG1 } };   \
+    TraceSpan trace_span __attribute__((cleanup(endTraceSpan)))         \
+        = beginTraceSpan(&trace_site, BUFF, (int64_t) (A), (int64_t) (B))
+#else
+#define TRACE(BUFF, ARG0, A, ARG1, B) ((void) 0)
+#endif
+
+// When built with GAPBUFFER_COST, the work done by the
+// operations is counted in [GapBuffer_cost]. It's used
+// by the fuzzing harness to find slow paths. The trace
+// recorder counts it per thread.
+#ifdef GAPBUFFER_COST
+GapBufferCost GapBuffer_cost;
+#define COUNT_COST(FIELD, NUM) (GapBuffer_cost.FIELD += (NUM))
+#else
+#define COUNT_COST(FIELD, NUM) ((void) 0)
+#endif
+
+#ifdef GAPBUFFER_TRACE
+#define COST(FIELD, NUM) (COUNT_COST(FIELD, NUM), trace_cost.FIELD += (NUM))
+#else
+#define COST(FIELD, NUM) COUNT_COST(FIELD, NUM)
+#endif
+
+// Static tracepoints for perf, bpftrace and the like,
+// compiled in when building with GAPBUFFER_USDT. Probes
+// are named gap_buffer:NAME and their first argument is
+// the buffer.
+#ifdef GAPBUFFER_USDT
+#include "gap_buffer_sdt.h"
+#define PROBE2(NAME, A, B)    GAPBUFFER_SDT_PROBE2(gap_buffer, NAME, A, B)
+#define PROBE3(NAME, A, B, C) GAPBUFFER_SDT_PROBE3(gap_buffer, NAME, A, B, C)
+#else
+#define PROBE2(NAME, A, B)    ((void) 0)
+#define PROBE3(NAME, A, B, C) ((void) 0)
+#endif
+
+// Number of bytes migrated by each operation on a buffer
+// that's being relocated incrementally. It bounds the
+// extra latency any single call pays for a relocation.
+#ifndef GAPBUFFER_RELOCATION_STEP
+#define GAPBUFFER_RELOCATION_STEP (64 * 1024)
+#endif
+
+// Moves of at least this many bytes bypass the cache
+// using non-temporal stores, so that moving the gap
+// across a big text doesn't evict everything else.
+#ifndef GAPBUFFER_STREAMING_THRESHOLD
+#define GAPBUFFER_STREAMING_THRESHOLD (4 * 1024 * 1024)
+#endif
+
+// Moves, UTF-8 validations and file loads of at least
+// this many bytes are split between [GAPBUFFER_THREADS]
+// threads. Threads are only used if the library is built
+// with GAPBUFFER_THREADS > 1.
+#ifndef GAPBUFFER_PARALLEL_THRESHOLD
+#define GAPBUFFER_PARALLEL_THRESHOLD (64 * 1024 * 1024)
+#endif
+
+// Bytes of text processed by each step of a job, unless
+// the job is given a different slice.
+#ifndef GAPBUFFER_JOB_SLICE
+#define GAPBUFFER_JOB_SLICE (256 * 1024)
+#endif
+
+#ifndef GAPBUFFER_THREADS
+#define GAPBUFFER_THREADS 1
+#endif
 
 typedef struct {
     const char *data;
@@ -21,12 +197,135 @@ struct GapBuffer {
     size_t gap_offset;
     size_t gap_length;
     size_t total;
+
+    // Number of bytes at the start of [data] that were
+    // consumed by GapBuffer_consume. The text before the
+    // gap starts after them.
+    size_t head;
+
+    // Incremental relocation state. When [old] isn't NULL,
+    // the bytes from [head] to [old_head] and the last
+    // [old_tail] bytes still live only in [old] and the
+    // corresponding bytes of [data] are uninitialized.
+    GapBuffer *old;
+    size_t old_head;
+    size_t old_tail;
+
+    // Number of bytes at the start of the gap holding an
+    // incomplete UTF-8 sequence written through the gap
+    // by GapBuffer_reserve and held back by GapBuffer_commit.
+    size_t pending;
+
+    // When true, the text after the gap comes before the
+    // text before it. This happens when text appended by
+    // GapBuffer_appendDroppingLines wraps around the end
+    // of the buffer.
+    bool   rotated;
+
+    // Incremented by the operations that change the text,
+    // so that jobs can tell whether it changed between
+    // their steps.
+    size_t version;
+
+    // Header of the shared memory the buffer lives in, if
+    // it was created by GapBuffer_createShared.
+    struct SharedHeader *shared;
+
+    // Stream the edits are appended to, if the buffer is
+    // replicated (see GapBuffer_setStream).
+    GapBufferStream *stream;
+
+    // Set by GapBuffer_applyStream when the text of the
+    // follower stopped matching the one of the leader.
+    // Records other than snapshots are skipped until one
+    // arrives.
+    bool diverged;
+
+    // Last version created by GapBuffer_commitVersion, and
+    // the number of bytes at the start and at the end of
+    // the text that didn't change since then.
+    GapBufferVersion *committed;
+    size_t unchanged_head;
+    size_t unchanged_tail;
+
+    // When not NULL, the buffer was compacted by GapBuffer_compact
+    // and [data] doesn't hold the text. The text before the gap
+    // and the text after it are compressed one after the other
+    // in [compressed], the first one taking [compressed_before]
+    // bytes.
+    char  *compressed;
+    size_t compressed_before;
+    size_t compressed_size;
+
     char   data[];
 };
 
+/* Symbol: GapBufferStream
+**
+**   The edits done to a buffer, encoded compactly so that
+**   they can be sent to follower processes that apply them
+**   to their copy of the text with GapBuffer_applyStream.
+**   Every record is one byte holding its type and, when it
+**   fits in 5 bits, its first argument, followed by the
+**   other arguments as LEB128 varints. Edits are described
+**   in bytes, so the followers don't need to scan the text
+**   to find the symbols they span.
+**
+**   Every [checksum_period] edits a checksum of the text
+**   is added, so that followers can find out if they
+**   diverged. A snapshot of the whole text is added when
+**   the stream is attached, when one is requested and when
+**   an edit couldn't be recorded.
+*/
+struct GapBufferStream {
+    GapBuffer *buff; // Buffer the stream is attached to
+    char      *data;
+    size_t     size;
+    size_t     capacity;
+    size_t     checksum_period;
+    size_t     edits; // Since the last checksum
+
+    // The next record must be a snapshot. Edits done
+    // until then are part of it, so they aren't recorded.
+    bool snapshot;
+};
+
 PRIVATE size_t getByteCount(GapBuffer *buff)
 {
-    return buff->total - buff->gap_length;
+    return buff->total - buff->gap_length - buff->head;
+}
+
+/* Symbol: initBuffer
+**
+**   Set up the header of an empty buffer with [capacity]
+**   bytes of data, shared by all of the constructors.
+**
+** Notes:
+**   - The fields are set one by one since assigning the
+**     whole struct would also write its padding, which
+**     overlaps the first bytes of the text when the data
+**     is mapped right after the header (GapBuffer_mapFile).
+*/
+PRIVATE void initBuffer(GapBuffer *buff, size_t capacity, void (*free)(void*))
+{
+    buff->free = free;
+    buff->gap_offset = 0;
+    buff->gap_length = capacity;
+    buff->total = capacity;
+    buff->head = 0;
+    buff->old = NULL;
+    buff->old_head = 0;
+    buff->old_tail = 0;
+    buff->pending = 0;
+    buff->rotated = false;
+    buff->compressed = NULL;
+    buff->version = 0;
+    buff->shared = NULL;
+    buff->stream = NULL;
+    buff->diverged = false;
+    buff->committed = NULL;
+    buff->unchanged_head = 0;
+    buff->unchanged_tail = 0;
 }
 
 /* Symbol: GapBuffer_createUsingMemory
@@ -46,18 +345,14 @@ PRIVATE size_t getByteCount(GapBuffer *buff)
 */
 GapBuffer *GapBuffer_createUsingMemory(void *mem, size_t len, void (*free)(void*))
 {
+    TRACE(NULL, "len", len, NULL, 0);
     if (mem == NULL || len < sizeof(GapBuffer)) {
         if (free) free(mem);
         return NULL;
     }
     
-    size_t capacity = len - sizeof(GapBuffer);
-
     GapBuffer *buff = mem;
-    buff->gap_offset = 0;
-    buff->gap_length = capacity;
-    buff->total = capacity;
-    buff->free = free;
+    initBuffer(buff, len - sizeof(GapBuffer), free);
     return buff;
 }
 
@@ -66,10 +361,37 @@ GapBuffer *GapBuffer_createUsingMemory(void *mem, size_t len, void (*free)(void*
 */
 void GapBuffer_destroy(GapBuffer *buff)
 {
+    TRACE(buff, NULL, 0, NULL, 0);
+    if (buff->old)
+        GapBuffer_destroy(buff->old);
+#ifndef GAPBUFFER_NOMALLOC
+    free(buff->compressed);
+    if (buff->stream)
+        buff->stream->buff = NULL;
+    if (buff->committed)
+        GapBufferVersion_release(buff->committed);
+#endif
     if (buff->free)
         buff->free(buff);
 }
 
+/* Symbol: handOverEdits
+**   Move the edit stream and the committed version of
+**   [from] to [to], which is replacing it.
+*/
+PRIVATE void handOverEdits(GapBuffer *from, GapBuffer *to)
+{
+    to->stream = from->stream;
+    from->stream = NULL;
+    if (to->stream)
+        to->stream->buff = to;
+
+    to->committed = from->committed;
+    to->unchanged_head = from->unchanged_head;
+    to->unchanged_tail = from->unchanged_tail;
+    from->committed = NULL;
+}
+
 /* Symbol: getStringBeforeGap
 **   Returns a slice to the memory region before the gap
 **   in the form of a (pointer, length) pair.
@@ -78,11 +400,11 @@ PRIVATE String getStringBeforeGap(const GapBuffer *buff)
 {
     return (String) {
 
-        .data=buff->data, // The start of the buffer is also the
-                          // start of the region before the gap.
+        .data=buff->data + buff->head, // The region before the gap starts
+                                       // after the consumed bytes.
 
-        .size=buff->gap_offset, // The offset of the gap is the the length
-                                // of the region that comes before it.
+        .size=buff->gap_offset - buff->head, // The offset of the gap is the the end
+                                             // of the region that comes before it.
     };
 }
 
@@ -106,12 +428,429 @@ PRIVATE String getStringAfterGap(const GapBuffer *buff)
     };
 }
 
+/* Symbol: compactDeadPrefix
+**
+**   Give the bytes consumed by GapBuffer_consume back to
+**   the gap by moving the text before the gap to the start
+**   of the buffer. Bytes held back by GapBuffer_commit are
+**   moved with it. It's not possible while the buffer is
+**   being relocated since the text before the gap must
+**   keep its offsets.
+*/
+PRIVATE void compactDeadPrefix(GapBuffer *buff)
+{
+    if (buff->head == 0 || buff->old)
+        return;
+
+    memmove(buff->data, buff->data + buff->head, buff->gap_offset - buff->head + buff->pending);
+    COST(copied, buff->gap_offset - buff->head + buff->pending);
+    buff->gap_offset -= buff->head;
+    buff->gap_length += buff->head;
+    buff->head = 0;
+}
+
+PRIVATE void reverseBytes(char *data, size_t len)
+{
+    for (size_t i = 0; i < len / 2; i++) {
+        char tmp = data[i];
+        data[i] = data[len - i - 1];
+        data[len - i - 1] = tmp;
+    }
+}
+
+/* Symbol: unrotate
+**
+**   Bring a buffer that wrapped around back to the usual
+**   layout, with the text before the gap coming first.
+**   Operations other than GapBuffer_appendDroppingLines
+**   do this before touching the buffer.
+**
+**   The buffer goes from [B][gap][A] to [A][B][gap] by
+**   rotating all of its memory, which is done in place
+**   by reversing [B][gap] and [A] and then reversing the
+**   whole buffer. The cursor ends up at the end of the
+**   text.
+*/
+PRIVATE void unrotate(GapBuffer *buff)
+{
+    if (!buff->rotated)
+        return;
+
+    size_t a = buff->total - buff->gap_offset - buff->gap_length;
+    size_t b = buff->gap_offset;
+    reverseBytes(buff->data, b + buff->gap_length);
+    reverseBytes(buff->data + b + buff->gap_length, a);
+    reverseBytes(buff->data, buff->total);
+    COST(copied, 2 * buff->total);
+
+    buff->gap_offset = a + b;
+    buff->rotated = false;
+}
+
+#if !defined(GAPBUFFER_NOMALLOC) && !defined(GAPBUFFER_NOPOSIX)
+
+/* Symbol: compressLZ
+**
+**   Compress [len] bytes of [src] into [dst], which must
+**   have space for getCompressBound(len) bytes, using a
+**   byte-oriented LZ77 format similar to LZ4's:
+**
+**     [token][literal length][literals][offset][match length]
+**
+**   The high nibble of the token is the number of literals
+**   and the low nibble is the match length minus 4. When a
+**   nibble is 15, more bytes follow, each adding to the
+**   length, until one lower than 255. The offset takes 2
+**   little-endian bytes. The last sequence only has the
+**   literals.
+**
+**   At [level] 0 the first candidate match found through
+**   a hash of the next 4 bytes is taken and the search
+**   speeds up over incompressible regions. Higher levels
+**   follow chains of previous occurrences of the hash,
+**   up to 2^level candidates, and keep the longest match.
+**
+** Returns:
+**   The number of bytes written to [dst].
+*/
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 16
+#define LZ_WINDOW    65535
+
+typedef struct {
+    size_t   table[1 << LZ_HASH_BITS]; // Last position + 1 of each hash
+    uint16_t chain[LZ_WINDOW + 1];     // Distance to the previous position with the same hash
+} LZState;
+
+PRIVATE size_t getCompressBound(size_t len)
+{
+    return len + len / 255 + 16;
+}
+
+PRIVATE uint32_t hashSequence(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+PRIVATE char *writeLZLength(char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = (char) 255;
+        len -= 255;
+    }
+    *op++ = (char) len;
+    return op;
+}
+
+PRIVATE char *writeLZSequence(char *op, const char *lit, size_t num_lit, size_t off, size_t match_len)
+{
+    size_t ml = match_len - LZ_MIN_MATCH;
+    *op++ = (char) ((MIN(num_lit, 15) << 4) | (match_len ? MIN(ml, 15) : 0));
+    if (num_lit >= 15)
+        op = writeLZLength(op, num_lit - 15);
+    memcpy(op, lit, num_lit);
+    op += num_lit;
+
+    if (match_len) {
+        *op++ = (char) (off & 0xff);
+        *op++ = (char) (off >> 8);
+        if (ml >= 15)
+            op = writeLZLength(op, ml - 15);
+    }
+    return op;
+}
+
+PRIVATE size_t compressLZ(const char *src, size_t len, char *dst, int level, LZState *state)
+{
+    memset(state->table, 0, sizeof(state->table));
+
+    int max_probes = 1 << MIN(MAX(level, 0), 12);
+    char *op = dst;
+    const char *anchor = src;
+    const char *ip = src;
+    const char *end = src + len;
+
+    // Positions where a 4-byte sequence starts
+    const char *limit = (len >= LZ_MIN_MATCH) ? end - LZ_MIN_MATCH + 1 : src;
+
+    while (ip < limit) {
+
+        size_t   pos  = ip - src;
+        uint32_t hash = hashSequence(ip);
+        size_t   cand = state->table[hash];
+
+        size_t best_len = 0;
+        size_t best_off = 0;
+        int probes = max_probes;
+        while (cand > 0 && probes-- > 0) {
+
+            size_t cpos = cand - 1;
+            if (pos - cpos > LZ_WINDOW)
+                break;
+
+            const char *m = src + cpos;
+            if (!memcmp(m, ip, LZ_MIN_MATCH)) {
+                size_t n = LZ_MIN_MATCH;
+                while (ip + n < end && m[n] == ip[n])
+                    n++;
+                if (n > best_len) {
+                    best_len = n;
+                    best_off = pos - cpos;
+                }
+            }
+
+            uint16_t delta = state->chain[cpos & LZ_WINDOW];
+            if (level == 0 || delta == 0 || delta > cpos)
+                break;
+            cand = cpos - delta + 1;
+        }
+
+        size_t prev = state->table[hash];
+        state->chain[pos & LZ_WINDOW] = (prev > 0 && pos - (prev - 1) <= LZ_WINDOW) ? (uint16_t) (pos - (prev - 1)) : 0;
+        state->table[hash] = pos + 1;
+
+        if (best_len == 0) {
+            // Skip faster over data that doesn't compress
+            ip += (level == 0) ? 1 + ((size_t) (ip - anchor) >> 6) : 1;
+            continue;
+        }
+
+        op = writeLZSequence(op, anchor, ip - anchor, best_off, best_len);
+
+        // Index the positions covered by the match too, so
+        // that later matches can refer to them.
+        if (level > 0) {
+            const char *stop = MIN(ip + best_len, limit);
+            for (const char *p = ip + 1; p < stop; p++) {
+                size_t   ppos  = p - src;
+                uint32_t phash = hashSequence(p);
+                size_t   pprev = state->table[phash];
+                state->chain[ppos & LZ_WINDOW] = (pprev > 0 && ppos - (pprev - 1) <= LZ_WINDOW) ? (uint16_t) (ppos - (pprev - 1)) : 0;
+                state->table[phash] = ppos + 1;
+            }
+        }
+
+        ip += best_len;
+        anchor = ip;
+    }
+
+    op = writeLZSequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+PRIVATE bool readLZLength(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t byte;
+    do {
+        if (*ip == iend)
+            return false;
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/* Symbol: decompressLZ
+**
+**   Decompress the output of compressLZ. Literals and
+**   matches are copied 16 bytes at a time when there's
+**   room to do so, which is what makes decoding fast.
+**
+** Returns:
+**   [false] if the input is malformed or doesn't
+**   decompress to exactly [dst_len] bytes.
+*/
+PRIVATE bool decompressLZ(const char *src, size_t len, char *dst, size_t dst_len)
+{
+    const uint8_t *ip = (const uint8_t*) src;
+    const uint8_t *iend = ip + len;
+    char *op = dst;
+    char *oend = dst + dst_len;
+
+    while (ip < iend) {
+
+        // Most sequences have few literals and a short match
+        // at a distance of at least 16 bytes. Far from the ends
+        // of the buffers, they're decoded with fixed-size copies
+        // and no bound checks.
+        if (iend - ip >= 32 && oend - op >= 64) {
+            unsigned token = ip[0];
+            size_t num_lit = token >> 4;
+            size_t match_len = token & 15;
+            if (num_lit < 15) {
+                size_t off = ip[1 + num_lit] | (size_t) ip[2 + num_lit] << 8;
+                if (off >= 16 && off <= (size_t) (op - dst) + num_lit) {
+                    memcpy(op, ip + 1, 16);
+                    ip += 3 + num_lit;
+                    op += num_lit;
+                    if (match_len < 15) {
+                        memcpy(op, op - off, 16);
+                        memcpy(op + 16, op - off + 16, 2);
+                        op += match_len + LZ_MIN_MATCH;
+                        continue;
+                    }
+                    if (!readLZLength(&ip, iend, &match_len))
+                        return false;
+                    match_len += LZ_MIN_MATCH;
+                    if (match_len > (size_t) (oend - op))
+                        return false;
+                    if (match_len + 16 <= (size_t) (oend - op)) {
+                        for (size_t i = 0; i < match_len; i += 16)
+                            memcpy(op + i, op - off + i, 16);
+                    } else {
+                        for (size_t i = 0; i < match_len; i++)
+                            op[i] = op[i - off];
+                    }
+                    op += match_len;
+                    continue;
+                }
+            }
+        }
+
+        unsigned token = *ip++;
+
+        size_t num_lit = token >> 4;
+        if (num_lit == 15 && !readLZLength(&ip, iend, &num_lit))
+            return false;
+        if (num_lit > (size_t) (iend - ip) || num_lit > (size_t) (oend - op))
+            return false;
+
+        if (num_lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, num_lit);
+        op += num_lit;
+        ip += num_lit;
+
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+        size_t off = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !readLZLength(&ip, iend, &match_len))
+            return false;
+        match_len += LZ_MIN_MATCH;
+
+        if (off == 0 || off > (size_t) (op - dst) || match_len > (size_t) (oend - op))
+            return false;
+
+        // Copies may write up to 16 bytes past the match
+        // when there's room for it, since the following
+        // sequence overwrites them.
+        const char *m = op - off;
+        if ((size_t) (oend - op) < match_len + 16) {
+            for (size_t i = 0; i < match_len; i++)
+                op[i] = m[i];
+        } else if (off >= 16) {
+            // Each 16-byte copy only reads bytes written
+            // before it, so overlapping is fine.
+            for (size_t i = 0; i < match_len; i += 16)
+                memcpy(op + i, m + i, 16);
+        } else if (off >= 8) {
+            for (size_t i = 0; i < match_len; i += 8)
+                memcpy(op + i, m + i, 8);
+        } else {
+            // The match repeats a pattern of [off] bytes. Once
+            // it's written out a few times, the rest can be
+            // copied 8 bytes at a time from a multiple of
+            // [off] bytes before, which doesn't overlap.
+            for (size_t i = 0; i < 16; i++)
+                op[i] = m[i];
+            size_t step = (8 + off - 1) / off * off;
+            for (size_t i = 16; i < match_len; i += 8)
+                memcpy(op + i, op + i - step, 8);
+        }
+        op += match_len;
+    }
+    return op == oend;
+}
+
+// Returns the first and last page fully contained in
+// the memory of a buffer.
+PRIVATE void getDroppablePages(const GapBuffer *buff, uintptr_t *start, uintptr_t *end)
+{
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    *start = ((uintptr_t) buff->data + page - 1) & ~(page - 1);
+    *end   = ((uintptr_t) buff->data + buff->total) & ~(page - 1);
+    if (*end < *start)
+        *end = *start;
+}
+
+PRIVATE size_t getDroppableBytes(const GapBuffer *buff)
+{
+    uintptr_t start, end;
+    getDroppablePages(buff, &start, &end);
+    return end - start;
+}
+
+/* Symbol: dropPages
+**   Give the pages fully contained in the memory of a
+**   buffer back to the system. Their contents become
+**   undefined.
+*/
+PRIVATE void dropPages(GapBuffer *buff)
+{
+    uintptr_t start, end;
+    getDroppablePages(buff, &start, &end);
+    if (end > start)
+        madvise((void*) start, end - start, MADV_DONTNEED);
+}
+
+#endif
+
+/* Symbol: rehydrate
+**   Decompress the text of a buffer compacted with
+**   GapBuffer_compact back at its place. Public operations
+**   do this before touching the buffer.
+*/
+PRIVATE void rehydrate(GapBuffer *buff)
+{
+#if !defined(GAPBUFFER_NOMALLOC) && !defined(GAPBUFFER_NOPOSIX)
+    if (buff->compressed == NULL)
+        return;
+
+#ifdef MADV_POPULATE_WRITE
+    // Faulting in the pages given back by GapBuffer_compact
+    // all at once is much cheaper than one at a time.
+    uintptr_t start, end;
+    getDroppablePages(buff, &start, &end);
+    if (end > start)
+        madvise((void*) start, end - start, MADV_POPULATE_WRITE);
+#endif
+
+    size_t after = buff->total - buff->gap_offset - buff->gap_length;
+    const char *blob = buff->compressed;
+    bool ok = decompressLZ(blob, buff->compressed_before, buff->data + buff->head, buff->gap_offset - buff->head)
+           && decompressLZ(blob + buff->compressed_before, buff->compressed_size - buff->compressed_before,
+                           buff->data + buff->total - after, after);
+    assert(ok);
+    (void) ok;
+
+    free(buff->compressed);
+    buff->compressed = NULL;
+#else
+    (void) buff;
+#endif
+}
+
 PRIVATE bool insertBytesBeforeCursor(GapBuffer *buff, String str)
 {
+    if (buff->gap_length < str.size)
+        compactDeadPrefix(buff);
+
     if (buff->gap_length < str.size)
         return false;
     
+    buff->pending = 0;
     memcpy(buff->data + buff->gap_offset, str.data, str.size);
+    COST(copied, str.size);
     buff->gap_offset += str.size;
     buff->gap_length -= str.size;
     return true;
@@ -122,7 +861,9 @@ PRIVATE bool insertBytesAfterCursor(GapBuffer *buff, String str)
     if (buff->gap_length < str.size)
         return false;
 
+    buff->pending = 0;
     memcpy(buff->data + buff->gap_offset + buff->gap_length - str.size, str.data, str.size);
+    COST(copied, str.size);
     buff->gap_length -= str.size;
     return true;
 }
@@ -152,18 +893,57 @@ GapBuffer *GapBuffer_cloneUsingMemory(void *mem, size_t len,
                                       void (*free)(void*),
                                       const GapBuffer *src)
 {
+    TRACE(src, "len", len, NULL, 0);
     GapBuffer *clone = GapBuffer_createUsingMemory(mem, len, free);
     if (!clone)
         return NULL;
 
-    String before = getStringBeforeGap(src);
-    if (!insertBytesBeforeCursor(clone, before))
+    if (getByteCount((GapBuffer*) src) > clone->total)
         goto oopsie;
+    clone->version = src->version;
+
+    // Reading a compacted buffer is using it, so it's
+    // decompressed like by any other operation.
+    rehydrate((GapBuffer*) src);
+
+    // If [src] is being relocated, the edges of its
+    // text are still stored in the old buffer.
+    if (src->rotated) {
+        // The text after the gap comes first. The old buffer
+        // can't be set since relocating undoes the rotation.
+        insertBytesBeforeCursor(clone, getStringAfterGap(src));
+        insertBytesBeforeCursor(clone, getStringBeforeGap(src));
+        return clone;
+    }
+
+    size_t migrated_from = src->head;
+    if (src->old) {
+        String head = {
+            .data = src->old->data + src->head,
+            .size = src->old_head - src->head,
+        };
+        insertBytesBeforeCursor(clone, head);
+        migrated_from = src->old_head;
+    }
+
+    String before = {
+        .data = src->data + migrated_from,
+        .size = src->gap_offset - migrated_from,
+    };
+    insertBytesBeforeCursor(clone, before);
+
+    if (src->old) {
+        String tail = {
+            .data = src->old->data + src->old->total - src->old_tail,
+            .size = src->old_tail,
+        };
+        insertBytesAfterCursor(clone, tail);
+    }
 
     String after = getStringAfterGap(src);
-    if (!insertBytesAfterCursor(clone, after))
-        goto oopsie;
-        
+    after.size -= src->old_tail;
+    insertBytesAfterCursor(clone, after);
+
     return clone;
 
 oopsie:
@@ -171,12 +951,181 @@ oopsie:
     return NULL;
 }
 
-// Returns true if and only if the [byte] is in the form 10xxxxxx
-PRIVATE bool isSymbolAuxiliaryByte(uint8_t byte)
+/* Symbol: GapBuffer_relocateUsingMemory
+**
+**   Start relocating a gap buffer object into the provided
+**   memory region without copying its contents up front.
+**
+**   The returned object takes ownership of [src] and
+**   migrates its text a bounded number of bytes at a time,
+**   on each following operation or when calling
+**   GapBuffer_continueRelocation. The bytes around the
+**   cursor are migrated first, so edits near it never
+**   wait for the whole text to be copied. Once the
+**   migration is complete, [src] is destroyed.
+**
+** Arguments:
+**   - mem: Address of the memory region.
+**
+**   - len: Length (in bytes) of the memory region
+**          referred by [mem].
+**
+**   - free: Function to be called on the [mem] pointer
+**           when the gap buffer object is destroyed.
+**
+**   - src: Gap buffer object to be relocated. It must
+**          not be used after this call succeeds.
+**
+** Returns:
+**   The relocated object or NULL if the memory region
+**   isn't big enough to hold the contents of [src] or
+**   [src] was created by GapBuffer_createShared, since
+**   readers in other processes map its memory. On
+**   failure [src] is left untouched.
+*/
+GapBuffer *GapBuffer_relocateUsingMemory(void *mem, size_t len,
+                                         void (*free)(void*),
+                                         GapBuffer *src)
 {
-    //   Hex    Binary
-    // +-----+----------+
-    // | C0  | 11000000 |
+    TRACE(src, "len", len, NULL, 0);
+    if (src->shared) {
+        if (free) free(mem);
+        return NULL;
+    }
+
+    // Only one relocation can be in progress at the
+    // time, so finish the one [src] is doing.
+    if (src->old)
+        GapBuffer_continueRelocation(src, SIZE_MAX);
+    rehydrate(src);
+    unrotate(src);
+
+    GapBuffer *buff = GapBuffer_createUsingMemory(mem, len, free);
+    if (!buff)
+        return NULL;
+
+    // Bytes held back by GapBuffer_commit move along
+    size_t count = getByteCount(src);
+    if (count + src->head + src->pending > buff->total) {
+        GapBuffer_destroy(buff);
+        return NULL;
+    }
+
+    // The text before the gap will have the same offsets
+    // in the new buffer (consumed bytes included) while
+    // the text after the gap is aligned to the end of it.
+    buff->head = src->head;
+    buff->version = src->version;
+    buff->gap_offset = src->gap_offset;
+    buff->gap_length = buff->total - count - src->head;
+    buff->old = src;
+    buff->old_head = src->gap_offset;
+    buff->old_tail = src->total - src->gap_offset - src->gap_length;
+    buff->pending = src->pending;
+    memcpy(buff->data + buff->gap_offset, src->data + src->gap_offset, src->pending);
+    handOverEdits(src, buff);
+    return buff;
+}
+
+/* Symbol: migrateBytes
+**
+**   Copy up to [head] bytes of the text before the gap
+**   and up to [tail] bytes of the text after the gap from
+**   the buffer being relocated, starting from the bytes
+**   closest to the gap. When the old buffer has no more
+**   bytes to give, it's destroyed.
+*/
+PRIVATE void migrateBytes(GapBuffer *buff, size_t head, size_t tail)
+{
+    GapBuffer *old = buff->old;
+    if (old == NULL)
+        return;
+
+    head = MIN(head, buff->old_head - buff->head);
+    memcpy(buff->data + buff->old_head - head,
+           old->data  + buff->old_head - head,
+           head);
+    buff->old_head -= head;
+
+    tail = MIN(tail, buff->old_tail);
+    memcpy(buff->data + buff->total - buff->old_tail,
+           old->data  + old->total  - buff->old_tail,
+           tail);
+    buff->old_tail -= tail;
+    COST(copied, head + tail);
+
+    if (buff->old_head == buff->head && buff->old_tail == 0) {
+        buff->old = NULL;
+        GapBuffer_destroy(old);
+    }
+}
+
+/* Symbol: migrateAroundCursor
+**
+**   Make sure at least [before] bytes preceding the cursor
+**   and [after] bytes following it are stored in the buffer
+**   and not in the one being relocated. Operations call it
+**   before reading the bytes around the cursor.
+*/
+PRIVATE void migrateAroundCursor(GapBuffer *buff, size_t before, size_t after)
+{
+    if (buff->old == NULL)
+        return;
+
+    size_t migrated_before = buff->gap_offset - buff->old_head;
+    size_t migrated_after  = buff->total - buff->gap_offset - buff->gap_length - buff->old_tail;
+
+    migrateBytes(buff, 
+        before > migrated_before ? before - migrated_before : 0,
+        after  > migrated_after  ? after  - migrated_after  : 0);
+}
+
+/* Symbol: relocationStep
+**
+**   Migrate a bounded number of bytes from the buffer
+**   being relocated. Each operation on the buffer calls
+**   this once.
+*/
+PRIVATE void relocationStep(GapBuffer *buff, size_t num)
+{
+    if (buff->old == NULL)
+        return;
+
+    size_t head = MIN(num, buff->old_head - buff->head);
+    migrateBytes(buff, head, num - head);
+}
+
+/* Symbol: GapBuffer_continueRelocation
+**
+**   Migrate up to [num] bytes of the text of a buffer
+**   created with GapBuffer_relocateUsingMemory. It's
+**   meant to be called when the program is idle, to
+**   complete the relocation without slowing down the
+**   next operations. Passing SIZE_MAX completes it.
+**
+** Returns:
+**   [true] if the relocation still isn't complete.
+*/
+bool GapBuffer_continueRelocation(GapBuffer *buff, size_t num)
+{
+    TRACE(buff, "num", num, NULL, 0);
+    relocationStep(buff, num);
+    return buff->old != NULL;
+}
+
+// Multiplies by 4 the number of symbols [num] to get
+// the maximum number of bytes they can occupy.
+PRIVATE size_t maxBytesOfSymbols(size_t num)
+{
+    return num > SIZE_MAX / 4 ? SIZE_MAX : num * 4;
+}
+
+// Returns true if and only if the [byte] is in the form 10xxxxxx
+PRIVATE bool isSymbolAuxiliaryByte(uint8_t byte)
+{
+    //   Hex    Binary
+    // +-----+----------+
+    // | C0  | 11000000 |
     // +-----+----------+
     // | 80  | 10000000 |
     // +-----+----------+
@@ -184,6 +1133,18 @@ PRIVATE bool isSymbolAuxiliaryByte(uint8_t byte)
     return (byte & 0xC0) == 0x80;
 }
 
+PRIVATE size_t getSymbolLengthFromFirstByte(uint8_t first)
+{
+    // NOTE: It's assumed a valid first byte
+    if (first >= 0xf0)
+        return 4;
+    if (first >= 0xe0)
+        return 3;
+    if (first >= 0xc0)
+        return 2;
+    return 1;
+}
+
 PRIVATE int getSymbolRune(const char *sym, size_t symlen, uint32_t *rune)
 {
     if(symlen == 0)
@@ -275,18 +1236,206 @@ PRIVATE int getSymbolRune(const char *sym, size_t symlen, uint32_t *rune)
     return 1;
 }
 
-PRIVATE bool isValidUTF8(const char *str, size_t len)
+typedef struct {
+    size_t lines;   // Number of newlines
+    size_t symbols; // Number of code points
+} TextCounts;
+
+#ifdef __SSE2__
+/* Symbol: scanASCII
+**
+**   Count the newlines in the run of ASCII bytes at the
+**   start of [str], 16 bytes at a time, and add them and
+**   the length of the run to [counts]. The run stops at
+**   the first block of 16 bytes holding a non-ASCII byte
+**   or at the last incomplete one.
+**
+** Returns:
+**   The number of bytes of the run.
+*/
+PRIVATE size_t scanASCII(const char *str, size_t len, TextCounts *counts)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    size_t i = 0;
+    for (;;) {
+
+        // Newlines are counted in each byte of [acc], which
+        // are summed up before they can overflow.
+        __m128i acc = zero;
+        int rounds = 0;
+        while (rounds < 255 && len - i >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (str + i));
+            if (_mm_movemask_epi8(v))
+                break;
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, newline));
+            rounds++;
+            i += 16;
+        }
+        __m128i sum = _mm_sad_epu8(acc, zero);
+        counts->lines += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+
+        if (rounds < 255)
+            break;
+    }
+    counts->symbols += i;
+    return i;
+}
+#endif
+
+/* Symbol: scanText
+**
+**   Validate the UTF-8 text [str] and count its newlines
+**   and code points in the same pass.
+**
+** Returns:
+**   [false] if the text isn't valid UTF-8. In that case
+**   [counts] is left unchanged.
+*/
+PRIVATE bool scanText(const char *str, size_t len, TextCounts *counts)
 {
+    TextCounts temp = {0, 0};
     size_t i = 0;
     while (i < len) {
+#ifdef __SSE2__
+        i += scanASCII(str + i, len - i, &temp);
+        if (i == len)
+            break;
+#endif
         uint32_t rune; // Unused
         int n = getSymbolRune(str + i, len - i, &rune);
         if (n < 0)
             return false;
+        if (str[i] == '\n')
+            temp.lines++;
+        temp.symbols++;
         i += n;
     }
+    *counts = temp;
+    return true;
+}
+
+#if !defined(GAPBUFFER_NOQUEUE) || (!defined(GAPBUFFER_NOMALLOC) && !defined(GAPBUFFER_NOPOSIX))
+// Cuts [len] to at most [max] bytes without splitting
+// UTF-8 sequences.
+PRIVATE size_t cutAtSymbol(const char *str, size_t len, size_t max)
+{
+    if (len <= max)
+        return len;
+    size_t n = max;
+    while (n > 0 && isSymbolAuxiliaryByte(str[n]))
+        n--;
+    return n;
+}
+#endif
+
+#if GAPBUFFER_THREADS > 1 || (!defined(GAPBUFFER_NOMALLOC) && !defined(GAPBUFFER_NOPOSIX))
+/* Symbol: alignToSymbol
+**
+**   Returns the first offset not before [pos] where a
+**   UTF-8 sequence of [str] can start. Since sequences
+**   have at most 3 continuation bytes, at most 3 bytes
+**   are skipped. If [str] isn't valid UTF-8, the offset
+**   may still point to a continuation byte.
+*/
+PRIVATE size_t alignToSymbol(const char *str, size_t len, size_t pos)
+{
+    size_t end = MIN(len, pos + 3);
+    while (pos < end && isSymbolAuxiliaryByte(str[pos]))
+        pos++;
+    return pos;
+}
+#endif
+
+#if GAPBUFFER_THREADS > 1
+/* Symbol: runJobs
+**
+**   Call [run] on each of the GAPBUFFER_THREADS elements
+**   of [jobs] (which are [size] bytes long) in parallel.
+**   The calling thread runs the last job. If a thread
+**   can't be spawned, its job is also run by the calling
+**   thread.
+*/
+PRIVATE void runJobs(void *(*run)(void*), void *jobs, size_t size)
+{
+    pthread_t threads[GAPBUFFER_THREADS-1];
+    bool      spawned[GAPBUFFER_THREADS-1];
+    char     *base = jobs;
+
+    for (int i = 0; i < GAPBUFFER_THREADS-1; i++)
+        spawned[i] = pthread_create(&threads[i], NULL, run, base + i * size) == 0;
+
+    run(base + (GAPBUFFER_THREADS-1) * size);
+
+    for (int i = 0; i < GAPBUFFER_THREADS-1; i++) {
+        if (spawned[i])
+            pthread_join(threads[i], NULL);
+        else
+            run(base + i * size);
+    }
+}
+
+typedef struct {
+    const char *str;
+    size_t      len;
+    bool        valid;
+    TextCounts  counts;
+} ScanJob;
+
+PRIVATE void *runScanJob(void *arg)
+{
+    ScanJob *job = arg;
+    job->valid = scanText(job->str, job->len, &job->counts);
+    return NULL;
+}
+
+/* Symbol: scanTextParallel
+**
+**   Behaves like scanText, but the text is split in one
+**   block per thread. Blocks are cut where a sequence
+**   starts, so sequences never straddle two blocks and
+**   each one can be validated on its own. If the text is
+**   invalid around a cut, the block after it starts with
+**   a continuation byte and fails validation. The counts
+**   of the blocks are then summed up.
+*/
+PRIVATE bool scanTextParallel(const char *str, size_t len, TextCounts *counts)
+{
+    ScanJob jobs[GAPBUFFER_THREADS];
+
+    size_t slice = len / GAPBUFFER_THREADS;
+    size_t start = 0;
+    for (int i = 0; i < GAPBUFFER_THREADS; i++) {
+        size_t end = (i == GAPBUFFER_THREADS-1) ? len : alignToSymbol(str, len, (i+1) * slice);
+        jobs[i] = (ScanJob) { .str = str + start, .len = end - start };
+        start = end;
+    }
+
+    runJobs(runScanJob, jobs, sizeof(ScanJob));
+
+    TextCounts temp = {0, 0};
+    for (int i = 0; i < GAPBUFFER_THREADS; i++) {
+        if (!jobs[i].valid)
+            return false;
+        temp.lines   += jobs[i].counts.lines;
+        temp.symbols += jobs[i].counts.symbols;
+    }
+    *counts = temp;
     return true;
 }
+#endif
+
+PRIVATE bool isValidUTF8(const char *str, size_t len)
+{
+    TextCounts counts; // Unused
+    COST(scanned, len);
+#if GAPBUFFER_THREADS > 1
+    if (len >= GAPBUFFER_PARALLEL_THRESHOLD)
+        return scanTextParallel(str, len, &counts);
+#endif
+    return scanText(str, len, &counts);
+}
 
 /* Symbol: GapBuffer_insertString
 **
@@ -308,9 +1457,216 @@ PRIVATE bool isValidUTF8(const char *str, size_t len)
 */
 bool GapBuffer_insertString(GapBuffer *buff, const char *str, size_t len)
 {
-    if (!isValidUTF8(str, len))
+    TRACE(buff, "len", len, NULL, 0);
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    if (!isValidUTF8(str, len)) {
+        PROBE2(invalid_utf8, buff, len);
+        return false;
+    }
+    relocationStep(buff, MAX(GAPBUFFER_RELOCATION_STEP, 2 * len));
+    if (!insertBytesBeforeCursor(buff, (String) {.data=str, .size=len}))
         return false;
-    return insertBytesBeforeCursor(buff, (String) {.data=str, .size=len});
+    if (len > 0)
+        buff->version++;
+    STREAM(buff, STREAM_INSERT, len, str);
+    return true;
+}
+
+/* Symbol: GapBuffer_reserve
+**
+**   Get a pointer to [num] bytes of the gap where text can
+**   be written directly, for instance by a read() call,
+**   avoiding the copy GapBuffer_insertString would do.
+**   The written bytes become part of the text when they
+**   are passed to GapBuffer_commit.
+**
+** Returns:
+**   The pointer to the writable memory or NULL if the
+**   gap is smaller than [num] bytes.
+**
+** Notes:
+**   - Any operation other than GapBuffer_commit on the
+**     buffer invalidates the returned pointer.
+*/
+char *GapBuffer_reserve(GapBuffer *buff, size_t num)
+{
+    TRACE(buff, "num", num, NULL, 0);
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    if (buff->gap_length - buff->pending < num)
+        compactDeadPrefix(buff);
+
+    if (buff->gap_length - buff->pending < num)
+        return NULL;
+    return buff->data + buff->gap_offset + buff->pending;
+}
+
+/* Symbol: getIncompleteSymbolLength
+**
+**   If [str] is the start of a UTF-8 sequence cut short,
+**   returns its length. Otherwise returns 0.
+*/
+PRIVATE size_t getIncompleteSymbolLength(const char *str, size_t len)
+{
+    // Bytes outside of C2-F4 can't start a valid sequence
+    if (len == 0 || (uint8_t) str[0] < 0xC2 || (uint8_t) str[0] > 0xF4)
+        return 0;
+
+    size_t expected = getSymbolLengthFromFirstByte(str[0]);
+    if (len >= expected)
+        return 0;
+
+    for (size_t i = 1; i < len; i++)
+        if (!isSymbolAuxiliaryByte(str[i]))
+            return 0;
+    return len;
+}
+
+/* Symbol: GapBuffer_commit
+**
+**   Insert into the text the first [num] bytes written
+**   in the memory returned by GapBuffer_reserve. They're
+**   validated in place. If they end with an incomplete
+**   UTF-8 sequence, it's held back until the following
+**   commit provides the rest of it.
+**
+** Returns:
+**   [true] if the bytes were valid UTF-8 and have been
+**   inserted. If they aren't, only the bytes before the
+**   first invalid one are inserted and the others are
+**   dropped.
+*/
+bool GapBuffer_commit(GapBuffer *buff, size_t num)
+{
+    TRACE(buff, "num", num, NULL, 0);
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    assert(num <= buff->gap_length - buff->pending);
+
+    char  *str = buff->data + buff->gap_offset;
+    size_t len = buff->pending + num;
+    COST(scanned, len);
+
+    size_t i = 0;
+    while (i < len) {
+#ifdef __SSE2__
+        TextCounts counts = {0, 0}; // Unused
+        i += scanASCII(str + i, len - i, &counts);
+        if (i == len)
+            break;
+#endif
+        uint32_t rune; // Unused
+        int n = getSymbolRune(str + i, len - i, &rune);
+        if (n < 0)
+            break;
+        i += n;
+    }
+
+    size_t held = len - i;
+    bool valid = (held == 0 || getIncompleteSymbolLength(str + i, held) == held);
+    if (!valid) {
+        PROBE2(invalid_utf8, buff, len);
+        held = 0;
+    }
+
+    if (i > 0) {
+        relocationStep(buff, MAX(GAPBUFFER_RELOCATION_STEP, 2 * i));
+        buff->version++;
+        buff->gap_offset += i;
+        buff->gap_length -= i;
+        STREAM(buff, STREAM_INSERT, i, str);
+    }
+    buff->pending = held;
+    return valid;
+}
+
+// Consumed bytes are given back to the gap when they
+// are more than 1/GAPBUFFER_DEAD_PREFIX_RATIO of the
+// capacity or when the gap is too small for an insertion.
+#ifndef GAPBUFFER_DEAD_PREFIX_RATIO
+#define GAPBUFFER_DEAD_PREFIX_RATIO 2
+#endif
+
+/* Symbol: getTextByte
+**   Returns the byte at offset [i] of the buffer's memory,
+**   reading it from the old buffer if it wasn't migrated
+**   yet.
+*/
+PRIVATE char getTextByte(const GapBuffer *buff, size_t i)
+{
+    if (buff->old) {
+        if (i < buff->old_head)
+            return buff->old->data[i];
+        if (i >= buff->total - buff->old_tail)
+            return buff->old->data[i - buff->total + buff->old->total];
+    }
+    return buff->data[i];
+}
+
+/* Symbol: GapBuffer_consume
+**
+**   Remove the first [num] bytes of the text in constant
+**   time, regardless of where the cursor is. It's meant
+**   for using the buffer as a queue, appending at the end
+**   and consuming from the front.
+**
+**   If the removed region ends in the middle of a UTF-8
+**   sequence, the rest of it is removed too.
+**
+** Notes:
+**   - The consumed memory isn't reused right away. It's
+**     given back to the gap lazily, when it's a big enough
+**     fraction of the buffer or when the gap is full.
+*/
+void GapBuffer_consume(GapBuffer *buff, size_t num)
+{
+    TRACE(buff, "num", num, NULL, 0);
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    relocationStep(buff, GAPBUFFER_RELOCATION_STEP);
+
+    size_t count = getByteCount(buff);
+    size_t before = buff->gap_offset - buff->head;
+    if (num < before) {
+
+        size_t i = buff->head + num;
+        while (i < buff->gap_offset && isSymbolAuxiliaryByte(getTextByte(buff, i)))
+            i++;
+        buff->head = i;
+
+        if (buff->old && buff->old_head < buff->head)
+            buff->old_head = buff->head;
+
+    } else {
+
+        // All of the text before the gap is consumed, so
+        // the rest comes from the start of the text after
+        // it, which can be removed by growing the gap.
+        size_t after = buff->total - buff->gap_offset - buff->gap_length;
+        size_t i = buff->gap_offset + buff->gap_length + MIN(num - before, after);
+        while (i < buff->total && isSymbolAuxiliaryByte(getTextByte(buff, i)))
+            i++;
+        buff->gap_length = i - buff->gap_offset;
+        buff->head = buff->gap_offset;
+
+        if (buff->old) {
+            buff->old_head = buff->head;
+            buff->old_tail = MIN(buff->old_tail, buff->total - i);
+            migrateBytes(buff, 0, 0); // Drops the old buffer if nothing is left
+        }
+    }
+
+    if (buff->head > buff->total / GAPBUFFER_DEAD_PREFIX_RATIO
+        || buff->head == buff->gap_offset) // Compacting is free if there's no text before the gap
+        compactDeadPrefix(buff);
+    if (count > getByteCount(buff))
+        buff->version++;
+    STREAM(buff, STREAM_CONSUME, count - getByteCount(buff), NULL);
 }
 
 /* Symbol: getPrecedingSymbol
@@ -335,13 +1691,13 @@ PRIVATE size_t getPrecedingSymbol(GapBuffer *buff, size_t num)
 {
     size_t i = buff->gap_offset;
 
-    while (num > 0 && i > 0) {
+    while (num > 0 && i > buff->head) {
 
         // Consume the auxiliary bytes of the
         // UTF-8 sequence (those in the form
         // 10xxxxxx) preceding the cursor
         do {
-            assert(i > 0); // FIXME: This triggers sometimes
+            assert(i > buff->head); // FIXME: This triggers sometimes
             i--;
             // The index can never be negative because
             // this loop only iterates over the auxiliary
@@ -354,21 +1710,10 @@ PRIVATE size_t getPrecedingSymbol(GapBuffer *buff, size_t num)
         num--;
     }
 
+    COST(scanned, buff->gap_offset - i);
     return i;
 }
 
-PRIVATE size_t getSymbolLengthFromFirstByte(uint8_t first)
-{
-    // NOTE: It's assumed a valid first byte
-    if (first >= 0xf0)
-        return 4;
-    if (first >= 0xe0)
-        return 3;
-    if (first >= 0xc0)
-        return 2;
-    return 1;
-}
-
 /* Symbol: getFollowingSymbol
 **
 **   Calculate the absolute byte offset of the 
@@ -394,88 +1739,848 @@ PRIVATE size_t getFollowingSymbol(GapBuffer *buff, size_t num)
         i += getSymbolLengthFromFirstByte(buff->data[i]);
         num--;
     }
+    COST(scanned, i - buff->gap_offset - buff->gap_length);
     return i;
 }
 
 void GapBuffer_removeForwards(GapBuffer *buff, size_t num)
 {
+    TRACE(buff, "num", num, NULL, 0);
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    relocationStep(buff, GAPBUFFER_RELOCATION_STEP);
+    migrateAroundCursor(buff, 0, maxBytesOfSymbols(num));
     size_t i = getFollowingSymbol(buff, num);
+    size_t removed = i - buff->gap_offset - buff->gap_length;
     buff->gap_length = i - buff->gap_offset;
+    if (removed > 0)
+        buff->version++;
+    STREAM(buff, STREAM_REMOVE_FORWARDS, removed, NULL);
+}
+
+/* Symbol: removeBytesBeforeGap
+**
+**   Remove the [num] bytes preceding the cursor, which
+**   must have been migrated if the buffer is relocating.
+*/
+PRIVATE void removeBytesBeforeGap(GapBuffer *buff, size_t num)
+{
+    assert(num <= buff->gap_offset);
+    buff->gap_length += num;
+    buff->gap_offset -= num;
+    if (num > 0)
+        buff->version++;
+    STREAM(buff, STREAM_REMOVE_BACKWARDS, num, NULL);
 }
 
 void GapBuffer_removeBackwards(GapBuffer *buff, size_t num)
 {
+    TRACE(buff, "num", num, NULL, 0);
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    buff->pending = 0;
+    relocationStep(buff, GAPBUFFER_RELOCATION_STEP);
+    migrateAroundCursor(buff, maxBytesOfSymbols(num), 0);
     size_t i = getPrecedingSymbol(buff, num);
-    buff->gap_length += buff->gap_offset - i;
-    buff->gap_offset = i;
+    removeBytesBeforeGap(buff, buff->gap_offset - i);
 }
 
-PRIVATE void moveBytesAfterGap(GapBuffer *buff, size_t num)
+/* Symbol: copyStreaming
+**
+**   Copy [num] bytes from [src] to [dst] (which must not
+**   overlap) using non-temporal stores, which don't
+**   pull the destination into the cache. The source is
+**   prefetched ahead of the loads for the same reason.
+**
+** Notes:
+**   - Non-temporal stores are weakly ordered, so the
+**     caller needs to issue a store fence before the
+**     copied bytes are read.
+*/
+PRIVATE void copyStreaming(char *dst, const char *src, size_t num)
 {
-    assert(buff->gap_offset >= num);
-
-    assert(buff->gap_offset <= buff->total);
-    assert(buff->gap_offset <= buff->total);
-    assert(buff->gap_offset + buff->gap_length <= buff->total);
+#ifdef __SSE2__
+    // Stream stores need a 16 byte aligned destination
+    size_t head = MIN(num, (16 - ((uintptr_t) dst & 15)) & 15);
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    num -= head;
 
-    memmove(buff->data + buff->gap_offset + buff->gap_length - num,
-            buff->data + buff->gap_offset - num,
-            num);
-    buff->gap_offset -= num;
+    while (num >= 64) {
+        _mm_prefetch(src + 512, _MM_HINT_NTA);
+        __m128i a = _mm_loadu_si128((const __m128i*) src + 0);
+        __m128i b = _mm_loadu_si128((const __m128i*) src + 1);
+        __m128i c = _mm_loadu_si128((const __m128i*) src + 2);
+        __m128i d = _mm_loadu_si128((const __m128i*) src + 3);
+        _mm_stream_si128((__m128i*) dst + 0, a);
+        _mm_stream_si128((__m128i*) dst + 1, b);
+        _mm_stream_si128((__m128i*) dst + 2, c);
+        _mm_stream_si128((__m128i*) dst + 3, d);
+        dst += 64;
+        src += 64;
+        num -= 64;
+    }
+#endif
+    memcpy(dst, src, num);
 }
 
-PRIVATE void moveBytesBeforeGap(GapBuffer *buff, size_t num)
+PRIVATE void storeFence(void)
 {
-    assert(buff->total - buff->gap_offset - buff->gap_length >= num); // FIXME: This triggers sometimes
+#ifdef __SSE2__
+    _mm_sfence();
+#endif
+}
 
-    assert(buff->gap_offset <= buff->total);
-    assert(buff->gap_offset <= buff->total);
-    assert(buff->gap_offset + buff->gap_length <= buff->total);
+#if GAPBUFFER_THREADS > 1
+typedef struct {
+    char       *dst;
+    const char *src;
+    size_t      num;
+} CopyJob;
 
-    memmove(buff->data + buff->gap_offset, 
-            buff->data + buff->gap_offset + buff->gap_length,
-            num);
-    buff->gap_offset += num;
+PRIVATE void *runCopyJob(void *arg)
+{
+    CopyJob *job = arg;
+    copyStreaming(job->dst, job->src, job->num);
+    storeFence();
+    return NULL;
 }
 
-void GapBuffer_moveRelative(GapBuffer *buff, int off)
+/* Symbol: copyParallel
+**
+**   Copy [num] bytes from [src] to [dst] (which must not
+**   overlap) splitting the work between GAPBUFFER_THREADS
+**   threads.
+*/
+PRIVATE void copyParallel(char *dst, const char *src, size_t num)
 {
-    if (off < 0) {
-        size_t i = getPrecedingSymbol(buff, -off);
-        moveBytesAfterGap(buff, buff->gap_offset - i);
-    } else {
-        size_t i = getFollowingSymbol(buff, off);
-        moveBytesBeforeGap(buff, i - buff->gap_offset - buff->gap_length);
+    CopyJob jobs[GAPBUFFER_THREADS];
+
+    // Slices are multiples of 64 bytes so that they
+    // don't share cache lines.
+    size_t slice = (num / GAPBUFFER_THREADS) & ~(size_t) 63;
+
+    for (int i = 0; i < GAPBUFFER_THREADS; i++) {
+        size_t offset = i * slice;
+        jobs[i].dst = dst + offset;
+        jobs[i].src = src + offset;
+        jobs[i].num = (i == GAPBUFFER_THREADS-1) ? num - offset : slice;
     }
+
+    runJobs(runCopyJob, jobs, sizeof(CopyJob));
 }
+#endif
 
-void GapBuffer_moveAbsolute(GapBuffer *buff, size_t num)
+PRIVATE void copyLarge(char *dst, const char *src, size_t num, bool parallel)
 {
-    size_t i;
-    if (buff->gap_offset > 0)
-        i = 0;
-    else
-        i = buff->gap_length;
+#if GAPBUFFER_THREADS > 1
+    if (parallel && num >= GAPBUFFER_STREAMING_THRESHOLD) {
+        copyParallel(dst, src, num);
+        return;
+    }
+#else
+    (void) parallel;
+#endif
+    copyStreaming(dst, src, num);
+}
 
-    while (num > 0 && i < buff->total) {
+/* Symbol: moveInRounds
+**
+**   Since the source and destination of a gap move are
+**   [gap_length] bytes apart, they overlap when the gap
+**   is smaller than the moved text. In that case the move
+**   is done in rounds of at most [gap_length] bytes, each
+**   of which doesn't overlap with itself. When moving
+**   towards higher addresses, the rounds go from the end
+**   so that no round overwrites bytes that weren't moved
+**   yet, and viceversa. Rounds are split between threads
+**   if [parallel] is set.
+*/
+PRIVATE void moveInRounds(char *dst, const char *src, size_t num, bool parallel)
+{
+    size_t distance = dst > src ? (size_t) (dst - src) : (size_t) (src - dst);
 
-        i += getSymbolLengthFromFirstByte(buff->data[i]);
+    // Tiny rounds would make the move slower than
+    // a plain memmove. 
+    if (num < GAPBUFFER_STREAMING_THRESHOLD || distance < 4096) {
+        memmove(dst, src, num);
+        return;
+    }
 
-        // If the cursor reached the gap, jump over it.
-        if (i == buff->gap_offset)
-            i += buff->gap_length;
+    size_t round = MIN(distance, num);
 
-        num--;
+    if (dst > src) {
+        size_t end = num;
+        while (end > 0) {
+            size_t n = MIN(round, end);
+            end -= n;
+            copyLarge(dst + end, src + end, n, parallel);
+        }
+    } else {
+        size_t offset = 0;
+        while (offset < num) {
+            size_t n = MIN(round, num - offset);
+            copyLarge(dst + offset, src + offset, n, parallel);
+            offset += n;
+        }
     }
-    
-    if (i <= buff->gap_offset)
-        moveBytesAfterGap(buff, buff->gap_offset - i);
+}
+
+#if GAPBUFFER_THREADS > 1 && !defined(GAPBUFFER_NOMALLOC)
+typedef struct {
+    char       *dst;
+    const char *src;
+    size_t      num;
+    size_t      distance;
+    char       *saved; // The [distance] bytes of the band other bands overwrite
+} BandJob;
+
+PRIVATE void *runSaveBandJob(void *arg)
+{
+    BandJob *job = arg;
+    const char *edge = job->dst > job->src ? job->src : job->src + job->num - job->distance;
+    memcpy(job->saved, edge, job->distance);
+    return NULL;
+}
+
+PRIVATE void *runMoveBandJob(void *arg)
+{
+    BandJob *job = arg;
+    size_t d = job->distance;
+    size_t n = job->num - d;
+    if (job->dst > job->src) {
+        moveInRounds(job->dst + d, job->src + d, n, false);
+        memcpy(job->dst, job->saved, d);
+    } else {
+        moveInRounds(job->dst, job->src, n, false);
+        memcpy(job->dst + n, job->saved, d);
+    }
+    storeFence();
+    return NULL;
+}
+
+/* Symbol: moveParallel
+**
+**   Move [num] bytes from [src] to [dst], which overlap
+**   and are less than a band apart, splitting the whole
+**   move in GAPBUFFER_THREADS contiguous bands.
+**
+**   When moving towards higher addresses, a band only
+**   overwrites its own bytes and the first [distance]
+**   bytes of the following band (and viceversa), so those
+**   are saved by all threads first. Then each thread moves
+**   the rest of its band like memmove would and puts the
+**   saved bytes at the start of its destination.
+**
+** Returns:
+**   [false] if the memory for the saved bytes couldn't be
+**   allocated, in which case nothing was moved.
+*/
+PRIVATE bool moveParallel(char *dst, const char *src, size_t num)
+{
+    size_t distance = dst > src ? (size_t) (dst - src) : (size_t) (src - dst);
+    char *saved = malloc(GAPBUFFER_THREADS * distance);
+    if (saved == NULL)
+        return false;
+
+    // Bands are multiples of 64 bytes so that they
+    // don't share cache lines.
+    size_t band = (num / GAPBUFFER_THREADS) & ~(size_t) 63;
+
+    BandJob jobs[GAPBUFFER_THREADS];
+    for (int i = 0; i < GAPBUFFER_THREADS; i++) {
+        size_t offset = i * band;
+        jobs[i].dst = dst + offset;
+        jobs[i].src = src + offset;
+        jobs[i].num = (i == GAPBUFFER_THREADS-1) ? num - offset : band;
+        jobs[i].distance = distance;
+        jobs[i].saved = saved + i * distance;
+    }
+
+    runJobs(runSaveBandJob, jobs, sizeof(BandJob));
+    runJobs(runMoveBandJob, jobs, sizeof(BandJob));
+    free(saved);
+    return true;
+}
+#endif
+
+/* Symbol: moveMemory
+**
+**   Behaves like memmove, but moves big enough to evict
+**   the cache are done with non-temporal stores and, if
+**   enabled, by multiple threads.
+**
+**   Moves of at least GAPBUFFER_PARALLEL_THRESHOLD bytes
+**   are split between threads as a whole when the gap is
+**   small compared to them, which is the common case, so
+**   the threads are started once per move. Otherwise the
+**   move is done in rounds (see moveInRounds) which are
+**   big enough to be split themselves.
+*/
+PRIVATE void moveMemory(char *dst, const char *src, size_t num)
+{
+    COST(copied, num);
+
+    bool parallel = false;
+#if GAPBUFFER_THREADS > 1
+    parallel = (num >= GAPBUFFER_PARALLEL_THRESHOLD);
+#ifndef GAPBUFFER_NOMALLOC
+    size_t distance = dst > src ? (size_t) (dst - src) : (size_t) (src - dst);
+    if (parallel && distance <= num / (8 * GAPBUFFER_THREADS) && moveParallel(dst, src, num))
+        return;
+#endif
+#endif
+    moveInRounds(dst, src, num, parallel);
+    storeFence();
+}
+
+PRIVATE void moveBytesAfterGap(GapBuffer *buff, size_t num)
+{
+    buff->pending = 0;
+
+    assert(buff->gap_offset >= num);
+
+    assert(buff->gap_offset <= buff->total);
+    assert(buff->gap_offset <= buff->total);
+    assert(buff->gap_offset + buff->gap_length <= buff->total);
+
+    PROBE2(move_bytes_after_gap, buff, num);
+    moveMemory(buff->data + buff->gap_offset + buff->gap_length - num,
+               buff->data + buff->gap_offset - num,
+               num);
+    buff->gap_offset -= num;
+    if (num > 0)
+        STREAM(buff, STREAM_MOVE, 2 * num - 1, NULL); // Zigzag encoding of -num
+}
+
+PRIVATE void moveBytesBeforeGap(GapBuffer *buff, size_t num)
+{
+    buff->pending = 0;
+
+    assert(buff->total - buff->gap_offset - buff->gap_length >= num); // FIXME: This triggers sometimes
+
+    assert(buff->gap_offset <= buff->total);
+    assert(buff->gap_offset <= buff->total);
+    assert(buff->gap_offset + buff->gap_length <= buff->total);
+
+    PROBE2(move_bytes_before_gap, buff, num);
+    moveMemory(buff->data + buff->gap_offset, 
+               buff->data + buff->gap_offset + buff->gap_length,
+               num);
+    buff->gap_offset += num;
+    STREAM(buff, STREAM_MOVE, 2 * num, NULL);
+}
+
+PRIVATE String getTextSlice(const GapBuffer *buff, size_t off);
+
+/* Symbol: dropOldestLine
+**
+**   Remove the first line of the text (newline included)
+**   or all of the text if there is no newline. Used by
+**   GapBuffer_appendDroppingLines on buffers whose cursor
+**   is at the end of the text.
+**
+** Returns:
+**   [false] if the buffer was already empty.
+*/
+PRIVATE bool dropOldestLine(GapBuffer *buff)
+{
+    if (buff->rotated) {
+        // The oldest text is the one after the gap
+        String after = getStringAfterGap(buff);
+        const char *newline = memchr(after.data, '\n', after.size);
+        COST(scanned, newline ? (size_t) (newline - after.data + 1) : after.size);
+        if (newline) {
+            buff->gap_length += newline - after.data + 1;
+            if (buff->gap_offset + buff->gap_length == buff->total)
+                buff->rotated = false;
+            return true;
+        }
+
+        // The line continues in the text before the gap.
+        // Once the text after the gap is gone, the layout
+        // is the usual one again.
+        buff->gap_length = buff->total - buff->gap_offset;
+        buff->rotated = false;
+    }
+
+    size_t before = buff->gap_offset - buff->head;
+    if (before == 0)
+        return false;
+
+    // The text may still be partly in the buffer being
+    // relocated, so it's read a slice at the time.
+    size_t off = 0;
+    while (off < before) {
+        String slice = getTextSlice(buff, off);
+        size_t n = MIN(slice.size, before - off);
+        const char *newline = memchr(slice.data, '\n', n);
+        if (newline) {
+            off += newline - slice.data + 1;
+            break;
+        }
+        off += n;
+    }
+    COST(scanned, off);
+    buff->head += off;
+
+    if (buff->head == buff->gap_offset) {
+        buff->head = 0;
+        buff->gap_offset = 0;
+        buff->gap_length = buff->total;
+    }
+    if (buff->old) {
+        buff->old_head = (buff->head == 0) ? 0 : MAX(buff->old_head, buff->head);
+        migrateBytes(buff, 0, 0); // Drops the old buffer if nothing is left
+    }
+    return true;
+}
+
+/* Symbol: GapBuffer_appendDroppingLines
+**
+**   Append text at the end of a buffer used as a bounded
+**   console: when there's not enough space for it, the
+**   oldest lines are dropped to make room. Both appending
+**   and dropping lines don't move the rest of the text,
+**   because when the end of the buffer is reached the text
+**   wraps around to the memory freed at the start of it.
+**
+** Arguments:
+**   - buff: Gap buffer object to append to. It should be
+**           created with the maximum number of bytes the
+**           console can hold as capacity.
+**
+**   - str: Address to the UTF8-encoded string
+**
+**   - len: Length of the sequence [str]
+**
+** Returns:
+**   [false] if the string isn't valid UTF-8 or doesn't fit
+**   in the buffer even when it's empty.
+**
+** Notes:
+**   - The cursor is moved at the end of the text. It's
+**     cheaper to keep it there, since any operation other
+**     than this one (and iteration) undoes the wrapping
+**     by moving all of the text.
+*/
+bool GapBuffer_appendDroppingLines(GapBuffer *buff, const char *str, size_t len)
+{
+    TRACE(buff, "len", len, NULL, 0);
+    SHARED_WRITE(buff);
+    if (!isValidUTF8(str, len)) {
+        PROBE2(invalid_utf8, buff, len);
+        return false;
+    }
+
+    rehydrate(buff);
+
+    if (len > buff->total)
+        return false;
+
+    if (len > 0)
+        buff->version++;
+
+    buff->pending = 0;
+
+    // Move the cursor to the end of the text. Only the
+    // bytes it moves over need to be migrated.
+    if (!buff->rotated) {
+        size_t after = buff->total - buff->gap_offset - buff->gap_length;
+        relocationStep(buff, MAX(GAPBUFFER_RELOCATION_STEP, 2 * len));
+        migrateAroundCursor(buff, 0, after);
+        moveBytesBeforeGap(buff, after);
+    }
+
+    // Followers drop the same lines by consuming as many
+    // bytes from the front of the text.
+    size_t count = getByteCount(buff);
+    for (;;) {
+        size_t space = buff->gap_length;
+        if (!buff->rotated)
+            space += buff->head;
+        if (space >= len)
+            break;
+        dropOldestLine(buff);
+    }
+    STREAM(buff, STREAM_CONSUME, count - getByteCount(buff), NULL);
+
+    String appended = { .data=str, .size=len };
+
+    if (!buff->rotated && buff->gap_length < len) {
+
+        // Buffers being relocated can't wrap around. Since
+        // each call migrates twice the bytes it appends, the
+        // relocation is only left to complete here when it
+        // left a gap smaller than half of the text.
+        migrateBytes(buff, SIZE_MAX, SIZE_MAX);
+
+        // Fill the end of the buffer and wrap around. The
+        // text before the gap becomes the one after it.
+        size_t num = buff->gap_length;
+        memcpy(buff->data + buff->gap_offset, str, num);
+        COST(copied, num);
+        str += num;
+        len -= num;
+
+        buff->gap_offset = 0;
+        buff->gap_length = buff->head;
+        buff->head = 0;
+        buff->rotated = true;
+    }
+
+    memcpy(buff->data + buff->gap_offset, str, len);
+    COST(copied, len);
+    buff->gap_offset += len;
+    buff->gap_length -= len;
+    STREAM(buff, STREAM_INSERT, appended.size, appended.data);
+    return true;
+}
+
+void GapBuffer_moveRelative(GapBuffer *buff, int off)
+{
+    TRACE(buff, "off", off, NULL, 0);
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    relocationStep(buff, GAPBUFFER_RELOCATION_STEP);
+    if (off < 0)
+        migrateAroundCursor(buff, maxBytesOfSymbols(-(size_t) off), 0);
     else
+        migrateAroundCursor(buff, 0, maxBytesOfSymbols(off));
+
+    if (off < 0) {
+        size_t i = getPrecedingSymbol(buff, -(size_t) off);
+        moveBytesAfterGap(buff, buff->gap_offset - i);
+    } else {
+        size_t i = getFollowingSymbol(buff, off);
         moveBytesBeforeGap(buff, i - buff->gap_offset - buff->gap_length);
+    }
+}
+
+void GapBuffer_moveAbsolute(GapBuffer *buff, size_t num)
+{
+    TRACE(buff, "num", num, NULL, 0);
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    relocationStep(buff, GAPBUFFER_RELOCATION_STEP);
+
+    // The scan starts from the beginning of the text and
+    // reads it a slice at the time, so the bytes of a
+    // relocation in progress are read where they are. Only
+    // the ones the gap moves over are migrated.
+    size_t count = getByteCount(buff);
+    size_t off = 0;
+    while (num > 0 && off < count) {
+        String slice = getTextSlice(buff, off);
+        const char *p = slice.data;
+        const char *end = slice.data + slice.size;
+        while (num > 0 && p < end) {
+            p += getSymbolLengthFromFirstByte(*p);
+            num--;
+        }
+        off += p - slice.data;
+    }
+    off = MIN(off, count);
+    COST(scanned, off);
+
+    size_t cursor = buff->gap_offset - buff->head;
+    if (off <= cursor) {
+        migrateAroundCursor(buff, cursor - off, 0);
+        moveBytesAfterGap(buff, cursor - off);
+    } else {
+        migrateAroundCursor(buff, 0, off - cursor);
+        moveBytesBeforeGap(buff, off - cursor);
+    }
+}
+
+/* Symbol: getTextAroundCursor
+**   Get the number of bytes of text before and after the
+**   cursor as they will be once the buffer is unrotated.
+*/
+PRIVATE void getTextAroundCursor(const GapBuffer *buff, size_t *before, size_t *after)
+{
+    if (buff->rotated) {
+        *before = getByteCount((GapBuffer*) buff);
+        *after = 0;
+    } else {
+        *before = buff->gap_offset - buff->head;
+        *after = buff->total - buff->gap_offset - buff->gap_length;
+    }
+}
+
+PRIVATE size_t getRelocationBacklog(const GapBuffer *buff)
+{
+    return buff->old ? buff->old_head - buff->head + buff->old_tail : 0;
+}
+
+/* Symbol: estimateRehydration
+**   Start an estimate with the work of decompressing a
+**   compacted buffer.
+*/
+PRIVATE void estimateRehydration(const GapBuffer *buff, GapBufferCost *cost)
+{
+    *cost = (GapBufferCost) {0};
+    if (buff->compressed) {
+        cost->scanned += buff->compressed_size;
+        cost->copied += getByteCount((GapBuffer*) buff);
+    }
+}
+
+/* Symbol: estimatePreamble
+**
+**   Start an estimate with the work the operations do
+**   before their own: decompressing a compacted buffer,
+**   undoing a rotation and migrating up to [migrate]
+**   bytes of a relocation in progress.
+*/
+PRIVATE void estimatePreamble(const GapBuffer *buff, size_t migrate, GapBufferCost *cost)
+{
+    estimateRehydration(buff, cost);
+    if (buff->rotated)
+        cost->copied += 2 * buff->total;
+    cost->copied += MIN(migrate, getRelocationBacklog(buff));
+}
+
+PRIVATE size_t finishEstimate(const GapBufferCost *estimate, GapBufferCost *cost)
+{
+    if (cost)
+        *cost = *estimate;
+    return estimate->copied + estimate->scanned;
+}
+
+/* Symbol: GapBuffer_estimateInsert
+**
+**   Estimate the work GapBuffer_insertString would do to
+**   insert [len] bytes, without doing it. Like the other
+**   estimates, it takes constant time and it's an upper
+**   bound, in the units of GapBufferCost. Operations on
+**   symbols are estimated as if all of them took 4 bytes.
+**
+** Arguments:
+**   - cost: Where the estimate is stored, or NULL.
+**
+** Returns:
+**   The bytes that would be copied plus the bytes that
+**   would be scanned.
+*/
+size_t GapBuffer_estimateInsert(const GapBuffer *buff, size_t len, GapBufferCost *cost)
+{
+    TRACE(buff, "len", len, NULL, 0);
+    GapBufferCost estimate;
+    estimatePreamble(buff, MAX(GAPBUFFER_RELOCATION_STEP, 2 * len), &estimate);
+    estimate.scanned += len;
+    estimate.copied += len;
+    return finishEstimate(&estimate, cost);
+}
+
+size_t GapBuffer_estimateRemoveForwards(const GapBuffer *buff, size_t num, GapBufferCost *cost)
+{
+    TRACE(buff, "num", num, NULL, 0);
+    size_t before, after;
+    getTextAroundCursor(buff, &before, &after);
+    size_t bytes = MIN(maxBytesOfSymbols(num), after);
+
+    GapBufferCost estimate;
+    estimatePreamble(buff, GAPBUFFER_RELOCATION_STEP + bytes, &estimate);
+    estimate.scanned += bytes;
+    return finishEstimate(&estimate, cost);
+}
+
+size_t GapBuffer_estimateRemoveBackwards(const GapBuffer *buff, size_t num, GapBufferCost *cost)
+{
+    TRACE(buff, "num", num, NULL, 0);
+    size_t before, after;
+    getTextAroundCursor(buff, &before, &after);
+    size_t bytes = MIN(maxBytesOfSymbols(num), before);
+
+    GapBufferCost estimate;
+    estimatePreamble(buff, GAPBUFFER_RELOCATION_STEP + bytes, &estimate);
+    estimate.scanned += bytes;
+    return finishEstimate(&estimate, cost);
+}
+
+size_t GapBuffer_estimateMoveRelative(const GapBuffer *buff, int off, GapBufferCost *cost)
+{
+    TRACE(buff, "off", off, NULL, 0);
+    size_t before, after;
+    getTextAroundCursor(buff, &before, &after);
+    size_t bytes;
+    if (off < 0)
+        bytes = MIN(maxBytesOfSymbols(-(size_t) off), before);
+    else
+        bytes = MIN(maxBytesOfSymbols(off), after);
+
+    // The symbols are scanned and then moved to the
+    // other side of the gap.
+    GapBufferCost estimate;
+    estimatePreamble(buff, GAPBUFFER_RELOCATION_STEP + bytes, &estimate);
+    estimate.scanned += bytes;
+    estimate.copied += bytes;
+    return finishEstimate(&estimate, cost);
+}
+
+/* Symbol: GapBuffer_estimateMoveAbsolute
+**
+**   Estimate the work GapBuffer_moveAbsolute would do. The
+**   text is scanned from its start, and of the relocation
+**   in progress, if any, only a step and the bytes the gap
+**   moves over are migrated. The destination
+**   is somewhere between [num] and 4 times [num] bytes
+**   from the start, and the estimate assumes the one that
+**   is farthest from the cursor.
+*/
+size_t GapBuffer_estimateMoveAbsolute(const GapBuffer *buff, size_t num, GapBufferCost *cost)
+{
+    TRACE(buff, "num", num, NULL, 0);
+    size_t before, after;
+    getTextAroundCursor(buff, &before, &after);
+    size_t count = before + after;
+    size_t nearest  = MIN(num, count);
+    size_t farthest = MIN(maxBytesOfSymbols(num), count);
+
+    size_t moved;
+    if (farthest <= before)
+        moved = before - nearest;
+    else if (nearest >= before)
+        moved = farthest - before;
+    else
+        moved = MAX(before - nearest, farthest - before);
+
+    GapBufferCost estimate;
+    estimatePreamble(buff, GAPBUFFER_RELOCATION_STEP + moved, &estimate);
+    estimate.scanned += farthest;
+    estimate.copied += moved;
+    return finishEstimate(&estimate, cost);
+}
+
+/* Symbol: GapBuffer_estimateClone
+**   Estimate the work GapBuffer_cloneUsingMemory would do
+**   to clone [buff]. The allocation, if any, is up to the
+**   caller.
+*/
+size_t GapBuffer_estimateClone(const GapBuffer *buff, GapBufferCost *cost)
+{
+    TRACE(buff, NULL, 0, NULL, 0);
+    // Cloning doesn't undo rotations nor migrate bytes
+    // but reads the text, so it has to decompress it.
+    GapBufferCost estimate;
+    estimateRehydration(buff, &estimate);
+    estimate.copied += getByteCount((GapBuffer*) buff);
+    return finishEstimate(&estimate, cost);
+}
+
+/* Symbol: GapBuffer_moveAbsoluteBudgeted
+**
+**   Start moving the cursor like GapBuffer_moveAbsolute,
+**   doing at most about [budget] bytes of work (copies and
+**   scans, like the estimates). If the move isn't complete
+**   within the budget, the state needed to continue it is
+**   stored in [move] and it can be continued later with
+**   GapBuffer_continueMove, for example on the next frame
+**   of a user interface.
+**
+**   The work is done in this order: completing the
+**   relocation in progress, finding the destination by
+**   scanning the text from its start and moving the gap
+**   there. Between the calls the buffer is valid and can
+**   be read, with the cursor between the old position and
+**   the destination, but it must not be modified or the
+**   move will end up in the wrong place.
+**
+** Returns:
+**   [true] if the move still isn't complete.
+**
+** Notes:
+**   - Decompressing a compacted buffer and undoing a
+**     rotation can't be split, so they're done at once
+**     and count against the budget.
+*/
+bool GapBuffer_moveAbsoluteBudgeted(GapBuffer *buff, size_t num, size_t budget, GapBufferMove *move)
+{
+    TRACE(buff, "num", num, "budget", budget);
+    move->symbols = num;
+    move->offset = 0;
+    move->found = false;
+    return GapBuffer_continueMove(buff, move, budget);
+}
+
+PRIVATE size_t spendBudget(size_t budget, size_t num)
+{
+    return budget > num ? budget - num : 0;
+}
+
+/* Symbol: GapBuffer_continueMove
+**
+**   Continue a move started by GapBuffer_moveAbsoluteBudgeted,
+**   doing at most about [budget] more bytes of work.
+**
+** Returns:
+**   [true] if the move still isn't complete.
+*/
+bool GapBuffer_continueMove(GapBuffer *buff, GapBufferMove *move, size_t budget)
+{
+    TRACE(buff, "symbols", move->symbols, "budget", budget);
+    SHARED_WRITE(buff);
+    GapBufferCost preamble;
+    estimatePreamble(buff, 0, &preamble);
+    budget = spendBudget(budget, preamble.copied + preamble.scanned);
+    rehydrate(buff);
+    unrotate(buff);
+
+    if (buff->old) {
+        size_t backlog = getRelocationBacklog(buff);
+        relocationStep(buff, MAX(budget, 1));
+        budget = spendBudget(budget, backlog - getRelocationBacklog(buff));
+        if (buff->old)
+            return true;
+    }
+
+    size_t count = getByteCount(buff);
+    if (!move->found) {
+        size_t start = move->offset;
+        while (move->symbols > 0 && move->offset < count && move->offset - start < MAX(budget, 1)) {
+            size_t i = buff->head + move->offset;
+            if (i >= buff->gap_offset)
+                i += buff->gap_length;
+            move->offset += getSymbolLengthFromFirstByte(buff->data[i]);
+            move->symbols--;
+        }
+        COST(scanned, move->offset - start);
+        budget = spendBudget(budget, move->offset - start);
+
+        move->found = move->symbols == 0 || move->offset >= count;
+        if (!move->found)
+            return true;
+        move->offset = MIN(move->offset, count);
+    }
+
+    // Move the gap towards the destination without leaving
+    // a symbol split between the two sides.
+    size_t cursor = buff->gap_offset - buff->head;
+    if (move->offset < cursor) {
+        size_t i = buff->gap_offset - MIN(cursor - move->offset, MAX(budget, 1));
+        while (i > buff->head + move->offset && isSymbolAuxiliaryByte(buff->data[i]))
+            i--;
+        moveBytesAfterGap(buff, buff->gap_offset - i);
+    } else if (move->offset > cursor) {
+        size_t first = buff->gap_offset + buff->gap_length;
+        size_t i = first + MIN(move->offset - cursor, MAX(budget, 1));
+        while (i < buff->total && isSymbolAuxiliaryByte(buff->data[i]))
+            i++;
+        moveBytesBeforeGap(buff, i - first);
+    }
+    return buff->gap_offset - buff->head != move->offset;
 }
 
 void GapBufferIter_init(GapBufferIter *iter, GapBuffer *buff)
 {
+    TRACE(buff, NULL, 0, NULL, 0);
+    rehydrate(buff);
     iter->crossed_gap = false;
     iter->buff = buff;
     iter->cur = 0;
@@ -487,49 +2592,78 @@ void GapBufferIter_free(GapBufferIter *iter)
     iter->mem = NULL;
 }
 
-bool GapBufferIter_next(GapBufferIter *iter, GapBufferLine *line)
+/* Symbol: getSegmentsInOrder
+**   Returns the two regions of text in the order they
+**   appear in the text. Usually that's the region before
+**   the gap followed by the one after it, but it's the
+**   other way around when the buffer wrapped around (see
+**   GapBuffer_appendDroppingLines).
+*/
+PRIVATE void getSegmentsInOrder(const GapBuffer *buff, String *first, String *second)
+{
+    if (buff->rotated) {
+        *first  = getStringAfterGap(buff);
+        *second = getStringBeforeGap(buff);
+    } else {
+        *first  = getStringBeforeGap(buff);
+        *second = getStringAfterGap(buff);
+    }
+}
+
+/* Symbol: iterateSegments
+**
+**   Get the next line of the text made of [first] and
+**   [second]. The [cur] field of the iterator is relative
+**   to the segment currently being iterated.
+**
+** Notes:
+**   - A line spanning both segments is copied in the
+**     iterator's scratch memory. If it doesn't fit, it's
+**     truncated.
+*/
+PRIVATE bool iterateSegments(GapBufferIter *iter, String first, String second, GapBufferLine *line)
 {
     iter->mem = NULL;
 
     size_t i = iter->cur;
-    size_t total = iter->buff->total;
-    size_t gap_offset = iter->buff->gap_offset;
-    char *data = iter->buff->data;
 
     if (iter->crossed_gap) {
         
         size_t line_offset = iter->cur;
-        while (i < total && data[i] != '\n')
+        while (i < second.size && second.data[i] != '\n')
             i++;
         size_t line_length = i - line_offset;
+        COST(scanned, line_length);
 
-        if (i < total)
+        if (i < second.size)
             i++;
         else {
             if (line_length == 0)
                 return false;
         }
 
-        line->str = data + line_offset;
+        line->str = second.data + line_offset;
         line->len = line_length;
     
     } else {
 
         size_t line_offset = i;
-        while (i < gap_offset && data[i] != '\n')
+        while (i < first.size && first.data[i] != '\n')
             i++;
         size_t line_length = i - line_offset;
+        COST(scanned, line_length);
 
-        if (i == gap_offset) {
+        if (i == first.size) {
             
-            i += iter->buff->gap_length;
+            i = 0;
 
             size_t line_offset_2 = i;
-            while (i < total && data[i] != '\n')
+            while (i < second.size && second.data[i] != '\n')
                 i++;
             size_t line_length_2 = i - line_offset_2;
+            COST(scanned, line_length_2);
 
-            if (i < total)
+            if (i < second.size)
                 i++; // Consume "\n"
             else {
                 if (line_length + line_length_2 == 0)
@@ -538,27 +2672,28 @@ bool GapBufferIter_next(GapBufferIter *iter, GapBufferLine *line)
 
             iter->crossed_gap = true;
 
-            if (line_length + line_length_2 > sizeof(iter->maybe)) {
-                // Line will be truncated
-                if (line_length > sizeof(iter->maybe))
-                    memcpy(iter->maybe, data + line_offset, sizeof(iter->maybe));
-                else {
-                    memcpy(iter->maybe,               data + line_offset,   line_length);
-                    memcpy(iter->maybe + line_offset, data + line_offset_2, sizeof(iter->maybe) - line_length);
-                }
-                line->str = iter->maybe;
-                line->len = line_length + line_length_2;
+            if (line_length_2 == 0) {
+                // The line doesn't actually cross the gap
+                line->str = first.data + line_offset;
+                line->len = line_length;
+            } else if (line_length == 0) {
+                line->str = second.data + line_offset_2;
+                line->len = line_length_2;
             } else {
-                memcpy(iter->maybe,               data + line_offset,   line_length);
-                memcpy(iter->maybe + line_length, data + line_offset_2, line_length_2);
+                // Line will be truncated if it doesn't fit
+                size_t copy   = MIN(line_length,   sizeof(iter->maybe));
+                size_t copy_2 = MIN(line_length_2, sizeof(iter->maybe) - copy);
+                PROBE3(iter_copy, iter->buff, copy + copy_2, line_length + line_length_2);
+                memcpy(iter->maybe,        first.data  + line_offset,   copy);
+                memcpy(iter->maybe + copy, second.data + line_offset_2, copy_2);
                 line->str = iter->maybe;
-                line->len = line_length + line_length_2;
+                line->len = copy + copy_2;
             }
 
         } else {
             i++; // Consume "\n"
 
-            line->str = data + line_offset;
+            line->str = first.data + line_offset;
             line->len = line_length;
         }
     }
@@ -566,34 +2701,6590 @@ bool GapBufferIter_next(GapBufferIter *iter, GapBufferLine *line)
     return true;
 }
 
-#ifndef GAPBUFFER_NOMALLOC
-#include <stdlib.h>
-GapBuffer *GapBuffer_create(size_t capacity)
-{
+/* Symbol: iterateSlices
+**
+**   Like iterateSegments, for a buffer being relocated
+**   incrementally. Its text is read from both buffers with
+**   getTextSlice instead of being migrated, and the lines
+**   spanning more than one slice are copied. The iterator
+**   keeps the same state as in iterateSegments, so the
+**   relocation can complete between two calls.
+*/
+PRIVATE bool iterateSlices(GapBufferIter *iter, GapBufferLine *line)
+{
+    iter->mem = NULL;
+
+    GapBuffer *buff = iter->buff;
+    size_t before = buff->gap_offset - buff->head;
+    size_t count = getByteCount(buff);
+    size_t off = iter->crossed_gap ? before + iter->cur : iter->cur;
+    if (off >= count)
+        return false;
+
+    size_t start = off;
+    size_t copied = 0;
+    bool   spans_slices = false;
+    bool   newline = false;
+    const char *str = NULL;
+    while (off < count) {
+        String slice = getTextSlice(buff, off);
+        const char *p = memchr(slice.data, '\n', slice.size);
+        size_t num = p ? (size_t) (p - slice.data) : slice.size;
+
+        if (off == start)
+            str = slice.data;
+        else {
+            if (!spans_slices) {
+                // The line didn't end in the previous slice
+                spans_slices = true;
+                copied = MIN(off - start, sizeof(iter->maybe));
+                memcpy(iter->maybe, str, copied);
+            }
+            size_t n = MIN(num, sizeof(iter->maybe) - copied);
+            memcpy(iter->maybe + copied, slice.data, n);
+            copied += n;
+        }
+        off += num;
+
+        if (p) {
+            newline = true;
+            break;
+        }
+    }
+    COST(scanned, off - start);
+
+    if (spans_slices) {
+        PROBE3(iter_copy, buff, copied, off - start);
+        line->str = iter->maybe;
+        line->len = copied;
+    } else {
+        line->str = str;
+        line->len = off - start;
+    }
+
+    if (newline)
+        off++;
+    iter->crossed_gap = off >= before;
+    iter->cur = iter->crossed_gap ? off - before : off;
+    return true;
+}
+
+/* Symbol: GapBufferIter_next
+**   Get the next line of the text. Lines spanning the
+**   gap are copied, as explained in iterateSegments.
+*/
+bool GapBufferIter_next(GapBufferIter *iter, GapBufferLine *line)
+{
+    if (iter->buff->old)
+        return iterateSlices(iter, line);
+
+    String first, second;
+    getSegmentsInOrder(iter->buff, &first, &second);
+    return iterateSegments(iter, first, second, line);
+}
+
+size_t GapBuffer_getVersion(const GapBuffer *buff)
+{
+    return buff->version;
+}
+
+/* Symbol: getTextSlice
+**
+**   Returns the longest contiguous piece of the text that
+**   starts [off] bytes from its start, which ends at the
+**   gap, at the end of the text or where the bytes that
+**   weren't migrated from the old buffer start or end.
+*/
+PRIVATE String getTextSlice(const GapBuffer *buff, size_t off)
+{
+    size_t i = buff->head + off;
+    size_t end = buff->gap_offset;
+    if (i >= buff->gap_offset) {
+        i += buff->gap_length;
+        end = buff->total;
+    }
+
+    if (buff->old) {
+        if (i < buff->old_head)
+            return (String) { .data=buff->old->data + i, .size=buff->old_head - i };
+
+        size_t tail = buff->total - buff->old_tail;
+        if (i >= tail)
+            return (String) { .data=buff->old->data + i - buff->total + buff->old->total, .size=buff->total - i };
+        end = MIN(end, tail);
+    }
+    return (String) { .data=buff->data + i, .size=end - i };
+}
+
+/* Symbol: getOrderedSlice
+**   Like getTextSlice, but also for buffers that wrapped
+**   around (which are never being relocated).
+*/
+PRIVATE String getOrderedSlice(const GapBuffer *buff, size_t off)
+{
+    if (!buff->rotated)
+        return getTextSlice(buff, off);
+
+    String first, second;
+    getSegmentsInOrder(buff, &first, &second);
+    if (off < first.size)
+        return (String) { .data=first.data + off, .size=first.size - off };
+    off -= first.size;
+    return (String) { .data=second.data + off, .size=second.size - off };
+}
+
+/* Symbol: GapBuffer_getSlice
+**
+**   Get the longest contiguous piece of the text that
+**   starts [off] bytes from its start, without copying
+**   it. The whole text is covered by two pieces, the text
+**   before and after the gap, unless the buffer is being
+**   relocated incrementally. It's meant for writing the
+**   text with a vectored write, for instance.
+**
+** Returns:
+**   The address of the piece, whose length is stored in
+**   [len]. It's valid until the next operation that
+**   changes the buffer. If [off] is past the end of the
+**   text, [len] is 0.
+*/
+const char *GapBuffer_getSlice(GapBuffer *buff, size_t off, size_t *len)
+{
+    TRACE(buff, "off", off, NULL, 0);
+    rehydrate(buff);
+    size_t count = getByteCount(buff);
+    String slice = getOrderedSlice(buff, MIN(off, count));
+    *len = slice.size;
+    return slice.data;
+}
+
+size_t GapBuffer_getByteCount(const GapBuffer *buff)
+{
+    return getByteCount((GapBuffer*) buff);
+}
+
+/* Symbol: matchText
+**   Returns true if [needle] occurs in the text at
+**   offset [off], which may span more than one slice.
+*/
+PRIVATE bool matchText(const GapBuffer *buff, size_t off, const char *needle, size_t len)
+{
+    while (len > 0) {
+        String slice = getTextSlice(buff, off);
+        size_t n = MIN(slice.size, len);
+        if (n == 0 || memcmp(slice.data, needle, n))
+            return false;
+        off += n;
+        needle += n;
+        len -= n;
+    }
+    return true;
+}
+
+PRIVATE void initJob(GapBufferJob *job, GapBufferJobKind kind, GapBuffer **buff)
+{
+    memset(job, 0, sizeof(GapBufferJob));
+    job->kind = kind;
+    job->status = GAPBUFFER_JOB_RUNNING;
+    job->buff = buff;
+    job->version = (*buff)->version;
+    job->slice = GAPBUFFER_JOB_SLICE;
+    job->found = SIZE_MAX;
+}
+
+/* Symbol: GapBufferJob_find
+**
+**   Prepare a job that finds the first occurrence of
+**   [needle] at or after byte offset [from] of the text
+**   of [buff]. When it's done, [found] holds the offset
+**   of the occurrence or SIZE_MAX if there isn't one.
+**   The needle isn't copied.
+**
+** Notes:
+**   - Like all jobs, it does nothing until it's run by
+**     GapBufferJob_step. Before that, its [slice] and
+**     [cancel] fields can be changed.
+**   - Like all jobs, it reads the buffer through [buff]
+**     at each step, so it follows the buffer when it's
+**     relocated by GapBuffer_insertStringMaybeRelocate.
+*/
+void GapBufferJob_find(GapBufferJob *job, GapBuffer **buff, size_t from, const char *needle, size_t len)
+{
+    initJob(job, GAPBUFFER_JOB_FIND, buff);
+    job->offset = from;
+    job->needle = needle;
+    job->needle_len = len;
+}
+
+/* Symbol: GapBufferJob_copy
+**   Prepare a job that copies the text of [buff] into the
+**   [cap] bytes at [dst], which makes it contiguous. It
+**   fails if the text doesn't fit.
+*/
+void GapBufferJob_copy(GapBufferJob *job, GapBuffer **buff, char *dst, size_t cap)
+{
+    initJob(job, GAPBUFFER_JOB_COPY, buff);
+    job->dst = dst;
+    job->cap = cap;
+}
+
+PRIVATE GapBufferJobStatus stepFindJob(GapBufferJob *job, size_t end)
+{
+    GapBuffer *buff = *job->buff;
+    size_t count = getByteCount(buff);
+    if (job->needle_len > count || job->offset > count - job->needle_len)
+        return GAPBUFFER_JOB_DONE;
+
+    // Only the occurrences starting before [end] are
+    // looked for, but they can extend past it.
+    end = MIN(end, count - job->needle_len + 1);
+    if (job->needle_len == 0) {
+        job->found = job->offset;
+        return GAPBUFFER_JOB_DONE;
+    }
+
+    while (job->offset < end) {
+        String slice = getTextSlice(buff, job->offset);
+        size_t n = MIN(slice.size, end - job->offset);
+        const char *p = slice.data;
+        while ((p = memchr(p, job->needle[0], slice.data + n - p))) {
+            size_t off = job->offset + (p - slice.data);
+            if (matchText(buff, off, job->needle, job->needle_len)) {
+                COST(scanned, off - job->offset + job->needle_len);
+                job->found = off;
+                job->offset = off;
+                return GAPBUFFER_JOB_DONE;
+            }
+            p++;
+        }
+        COST(scanned, n);
+        job->offset += n;
+    }
+    return job->offset == count - job->needle_len + 1 ? GAPBUFFER_JOB_DONE : GAPBUFFER_JOB_RUNNING;
+}
+
+PRIVATE GapBufferJobStatus stepCopyJob(GapBufferJob *job, size_t end)
+{
+    GapBuffer *buff = *job->buff;
+    size_t count = getByteCount(buff);
+    if (count > job->cap)
+        return GAPBUFFER_JOB_FAILED;
+
+    while (job->offset < end) {
+        String slice = getTextSlice(buff, job->offset);
+        size_t n = MIN(slice.size, end - job->offset);
+        memcpy(job->dst + job->offset, slice.data, n);
+        COST(copied, n);
+        job->offset += n;
+    }
+    return job->offset == count ? GAPBUFFER_JOB_DONE : GAPBUFFER_JOB_RUNNING;
+}
+
+#ifndef GAPBUFFER_NOPOSIX
+PRIVATE GapBufferJobStatus stepWriteJob(GapBufferJob *job, size_t end);
+#endif
+
+/* Symbol: GapBufferJob_step
+**
+**   Run the next step of a job, which processes up to
+**   [slice] bytes of the text. Jobs don't complete a
+**   relocation in progress nor move the gap, so each step
+**   takes time proportional to the slice, except that like
+**   any other call it first decompresses a compacted buffer
+**   and undoes a rotation, which takes time proportional
+**   to the whole text. Between steps the buffer can be
+**   used normally, but if its text is changed the job
+**   stops with GAPBUFFER_JOB_CONFLICT and has to be
+**   started again. Edits that don't change the text, like
+**   removing 0 bytes, don't stop it. If the buffer was
+**   relocated, the job goes on with the new one, which
+**   has the same version as long as the text didn't
+**   change.
+**
+** Returns:
+**   The status of the job. Stepping a job that isn't
+**   running anymore does nothing.
+**
+** Notes:
+**   - The buffer must not be destroyed while the job is
+**     running.
+*/
+GapBufferJobStatus GapBufferJob_step(GapBufferJob *job)
+{
+    if (job->status != GAPBUFFER_JOB_RUNNING)
+        return job->status;
+
+    GapBuffer *buff = *job->buff;
+    TRACE(buff, "kind", job->kind, "offset", job->offset);
+    SHARED_WRITE(buff);
+    if (job->cancel && *job->cancel)
+        return job->status = GAPBUFFER_JOB_CANCELLED;
+    if (buff->version != job->version)
+        return job->status = GAPBUFFER_JOB_CONFLICT;
+
+    rehydrate(buff);
+    unrotate(buff);
+
+    size_t end = getByteCount(buff);
+    if (job->slice < end - MIN(job->offset, end))
+        end = job->offset + job->slice;
+
+    switch (job->kind) {
+        case GAPBUFFER_JOB_FIND: job->status = stepFindJob(job, end); break;
+        case GAPBUFFER_JOB_COPY: job->status = stepCopyJob(job, end); break;
+#ifndef GAPBUFFER_NOPOSIX
+        case GAPBUFFER_JOB_WRITE: job->status = stepWriteJob(job, end); break;
+#endif
+        default: job->status = GAPBUFFER_JOB_FAILED; break;
+    }
+    return job->status;
+}
+
+#ifndef GAPBUFFER_NOQUEUE
+/* Symbol: GapBufferQueue
+**
+**   A lock-free ring of edits from a producer thread (for
+**   example the one handling the input) to the consumer
+**   thread that owns a gap buffer. There must be only one
+**   of each.
+**
+**   The producer advances [tail] after writing the edits
+**   and the consumer advances [head] after applying them.
+**   Each one keeps a copy of the other's index, which it
+**   only reloads when the ring looks full or empty, so the
+**   two cache lines only bounce when needed.
+**
+**   Edits are fixed size records. Insertions carry their
+**   text inline, split in as many records as needed, and
+**   the consumer merges consecutive ones back.
+*/
+#define QUEUED_EDIT_INLINE 22
+
+typedef struct {
+    uint8_t kind;
+    uint8_t len;                      // Bytes of [str] used by insertions
+    char    str[QUEUED_EDIT_INLINE];
+    int64_t num;                      // Symbols removed or moved
+} QueuedEdit;
+
+enum {
+    QUEUED_INSERT,
+    QUEUED_REMOVE_FORWARDS,
+    QUEUED_REMOVE_BACKWARDS,
+    QUEUED_MOVE_RELATIVE,
+    QUEUED_MOVE_ABSOLUTE,
+};
+
+#define CACHE_LINE 64
+
+struct GapBufferQueue {
+    void (*free)(void*);
+    size_t mask;
+
+    char pad0[CACHE_LINE];
+    _Atomic size_t tail;   // Written by the producer
+    size_t cached_head;
+    char pad1[CACHE_LINE];
+    _Atomic size_t head;   // Written by the consumer
+    size_t cached_tail;
+    char pad2[CACHE_LINE];
+
+    QueuedEdit edits[];
+};
+
+/* Symbol: GapBufferQueue_createUsingMemory
+**   Initialize a queue in the provided memory region. It
+**   holds the largest power of 2 of edits that fits.
+*/
+GapBufferQueue *GapBufferQueue_createUsingMemory(void *mem, size_t len, void (*free)(void*))
+{
+    if (mem == NULL || len < sizeof(GapBufferQueue) + sizeof(QueuedEdit)) {
+        if (free) free(mem);
+        return NULL;
+    }
+
+    size_t capacity = 1;
+    while (2 * capacity <= (len - sizeof(GapBufferQueue)) / sizeof(QueuedEdit))
+        capacity *= 2;
+
+    GapBufferQueue *queue = mem;
+    queue->free = free;
+    queue->mask = capacity - 1;
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+    queue->cached_head = 0;
+    queue->cached_tail = 0;
+    return queue;
+}
+
+void GapBufferQueue_destroy(GapBufferQueue *queue)
+{
+    if (queue->free)
+        queue->free(queue);
+}
+
+/* Symbol: reserveEdits
+**   Returns the index of the first of [num] free records
+**   of the queue or SIZE_MAX if it's too full. Called by
+**   the producer.
+*/
+PRIVATE size_t reserveEdits(GapBufferQueue *queue, size_t num)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t capacity = queue->mask + 1;
+    if (tail - queue->cached_head + num > capacity) {
+        queue->cached_head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail - queue->cached_head + num > capacity)
+            return SIZE_MAX;
+    }
+    return tail;
+}
+
+PRIVATE void publishEdits(GapBufferQueue *queue, size_t tail)
+{
+    atomic_store_explicit(&queue->tail, tail, memory_order_release);
+}
+
+PRIVATE bool pushEdit(GapBufferQueue *queue, uint8_t kind, int64_t num)
+{
+    size_t tail = reserveEdits(queue, 1);
+    if (tail == SIZE_MAX)
+        return false;
+    QueuedEdit *edit = &queue->edits[tail & queue->mask];
+    edit->kind = kind;
+    edit->len = 0;
+    edit->num = num;
+    publishEdits(queue, tail + 1);
+    return true;
+}
+
+/* Symbol: GapBufferQueue_insertString
+**
+**   Queue the insertion of a string. It's validated here,
+**   so that the consumer doesn't have to reject it later.
+**   Nothing is queued unless the result is
+**   GAPBUFFER_QUEUE_QUEUED.
+**
+** Returns:
+**   GAPBUFFER_QUEUE_FULL if the queue doesn't have room
+**   for the string right now, GAPBUFFER_QUEUE_TOO_LARGE if
+**   it wouldn't fit even in an empty queue (it takes one
+**   record for each 22 bytes), so that retrying is
+**   pointless, and GAPBUFFER_QUEUE_INVALID if it isn't
+**   valid UTF-8.
+*/
+GapBufferQueueStatus GapBufferQueue_insertString(GapBufferQueue *queue, const char *str, size_t len)
+{
+    if (!isValidUTF8(str, len))
+        return GAPBUFFER_QUEUE_INVALID;
+
+    // Strings don't need to be split at symbols since the
+    // pieces are joined again, but doing it lets each one
+    // be inserted on its own.
+    size_t num = 0;
+    for (size_t i = 0; i < len; i += cutAtSymbol(str + i, len - i, QUEUED_EDIT_INLINE))
+        num++;
+
+    if (num > queue->mask + 1)
+        return GAPBUFFER_QUEUE_TOO_LARGE;
+
+    size_t tail = reserveEdits(queue, num);
+    if (tail == SIZE_MAX)
+        return GAPBUFFER_QUEUE_FULL;
+
+    for (size_t i = 0, n; i < len; i += n) {
+        n = cutAtSymbol(str + i, len - i, QUEUED_EDIT_INLINE);
+        QueuedEdit *edit = &queue->edits[tail++ & queue->mask];
+        edit->kind = QUEUED_INSERT;
+        edit->len = n;
+        edit->num = 0;
+        memcpy(edit->str, str + i, n);
+    }
+    publishEdits(queue, tail);
+    return GAPBUFFER_QUEUE_QUEUED;
+}
+
+bool GapBufferQueue_removeForwards(GapBufferQueue *queue, size_t num)
+{
+    return pushEdit(queue, QUEUED_REMOVE_FORWARDS, MIN(num, INT64_MAX));
+}
+
+bool GapBufferQueue_removeBackwards(GapBufferQueue *queue, size_t num)
+{
+    return pushEdit(queue, QUEUED_REMOVE_BACKWARDS, MIN(num, INT64_MAX));
+}
+
+bool GapBufferQueue_moveRelative(GapBufferQueue *queue, int off)
+{
+    return pushEdit(queue, QUEUED_MOVE_RELATIVE, off);
+}
+
+bool GapBufferQueue_moveAbsolute(GapBufferQueue *queue, size_t num)
+{
+    return pushEdit(queue, QUEUED_MOVE_ABSOLUTE, MIN(num, INT64_MAX));
+}
+
+/* Symbol: canMergeEdits
+**
+**   Returns true if [next] can be applied together with
+**   the run of edits [merged] stands for. Moves and
+**   removals stop at the ends of the text, so only the
+**   ones going in the same direction add up. Only the
+**   last of a run of absolute moves matters.
+*/
+PRIVATE bool canMergeEdits(const QueuedEdit *merged, const QueuedEdit *next)
+{
+    if (merged->kind != next->kind)
+        return false;
+
+    switch (merged->kind) {
+        case QUEUED_MOVE_RELATIVE:
+        if ((merged->num < 0) != (next->num < 0))
+            return false;
+        return merged->num + next->num >= INT_MIN && merged->num + next->num <= INT_MAX;
+
+        case QUEUED_REMOVE_FORWARDS:
+        case QUEUED_REMOVE_BACKWARDS:
+        return merged->num <= INT64_MAX - next->num;
+
+        default:
+        return true;
+    }
+}
+
+/* Symbol: applyInsertions
+**
+**   Insert the text of the run of [num] insertion records
+**   starting at [head] at once, copying it straight into
+**   the gap. If it doesn't all
+**   fit, only the records that fit are inserted.
+**
+** Returns:
+**   The number of records inserted.
+*/
+PRIVATE size_t applyInsertions(GapBufferQueue *queue, size_t head, size_t num, GapBuffer *buff)
+{
+    // Like GapBuffer_insertString, drop the incomplete
+    // sequence held back by GapBuffer_commit.
+    rehydrate(buff);
+    buff->pending = 0;
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < num; i++)
+        bytes += queue->edits[(head + i) & queue->mask].len;
+
+    char *dst = GapBuffer_reserve(buff, bytes);
+    if (dst == NULL) {
+        // GapBuffer_reserve made as much room as possible
+        size_t room = buff->gap_length;
+        size_t fit = 0;
+        bytes = 0;
+        while (fit < num && bytes + queue->edits[(head + fit) & queue->mask].len <= room)
+            bytes += queue->edits[(head + fit++) & queue->mask].len;
+        if (fit == 0)
+            return 0;
+        num = fit;
+        dst = GapBuffer_reserve(buff, bytes);
+    }
+
+    size_t copied = 0;
+    for (size_t i = 0; i < num; i++) {
+        QueuedEdit *edit = &queue->edits[(head + i) & queue->mask];
+        memcpy(dst + copied, edit->str, edit->len);
+        copied += edit->len;
+    }
+    COST(copied, bytes);
+
+    // Like GapBuffer_commit, but the text was validated
+    // by the producer.
+    relocationStep(buff, MAX(GAPBUFFER_RELOCATION_STEP, 2 * bytes));
+    buff->version++;
+    buff->gap_offset += bytes;
+    buff->gap_length -= bytes;
+    STREAM(buff, STREAM_INSERT, bytes, dst);
+    return num;
+}
+
+/* Symbol: GapBufferQueue_apply
+**
+**   Apply the queued edits to [buff], merging consecutive
+**   edits of the same kind into a single operation, like
+**   the characters of a word typed one at the time into a
+**   single insertion. Called by the consumer.
+**
+** Returns:
+**   [true] if the queue was emptied. It stops at the first
+**   insertion that doesn't fit in the buffer, which stays
+**   queued so that it can be applied once there is room
+**   (for example after relocating the buffer), and then it
+**   returns [false].
+*/
+bool GapBufferQueue_apply(GapBufferQueue *queue, GapBuffer *buff)
+{
+    TRACE(buff, NULL, 0, NULL, 0);
+    SHARED_WRITE(buff);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    for (;;) {
+        if (head == queue->cached_tail) {
+            queue->cached_tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+            if (head == queue->cached_tail)
+                break;
+        }
+
+        QueuedEdit merged = queue->edits[head & queue->mask];
+        size_t run = 1;
+        while (head + run != queue->cached_tail) {
+            const QueuedEdit *next = &queue->edits[(head + run) & queue->mask];
+            if (!canMergeEdits(&merged, next))
+                break;
+            if (merged.kind == QUEUED_MOVE_ABSOLUTE)
+                merged.num = next->num;
+            else
+                merged.num += next->num;
+            run++;
+        }
+
+        switch (merged.kind) {
+            case QUEUED_INSERT:
+            {
+                size_t applied = applyInsertions(queue, head, run, buff);
+                if (applied < run) {
+                    head += applied;
+                    atomic_store_explicit(&queue->head, head, memory_order_release);
+                    return false;
+                }
+                break;
+            }
+            case QUEUED_REMOVE_FORWARDS:  GapBuffer_removeForwards(buff, merged.num); break;
+            case QUEUED_REMOVE_BACKWARDS: GapBuffer_removeBackwards(buff, merged.num); break;
+            case QUEUED_MOVE_RELATIVE:    GapBuffer_moveRelative(buff, merged.num); break;
+            case QUEUED_MOVE_ABSOLUTE:    GapBuffer_moveAbsolute(buff, merged.num); break;
+        }
+
+        // Give the records back as soon as they're applied
+        head += run;
+        atomic_store_explicit(&queue->head, head, memory_order_release);
+    }
+    return true;
+}
+#endif
+
+/* Symbol: MultiGapBuffer
+**
+**   A variant of the gap buffer with up to GAPBUFFER_MAX_GAPS
+**   gaps, meant for editing a text in many distant places
+**   at once. Each place gets its own gap, so switching from
+**   one to the other doesn't move the text in between.
+**
+**   The gaps are sorted by offset and never overlap. The
+**   text is split by them in [num_gaps+1] segments. There
+**   is always at least one gap, even if it's empty.
+**
+**   Unlike GapBuffer, offsets are expressed in bytes and
+**   are relative to the start of the text (gaps excluded).
+**   Offsets that fall inside a UTF-8 sequence are moved
+**   to the start of it.
+*/
+struct MultiGapBuffer {
+    void (*free)(void*);
+    size_t total;
+    int    num_gaps;
+    struct {
+        size_t offset;
+        size_t length;
+    } gaps[GAPBUFFER_MAX_GAPS];
+    char   data[];
+};
+
+// Edits closer than this many bytes to an existing gap
+// reuse it instead of creating a new one. 
+#ifndef GAPBUFFER_GAP_REUSE_DISTANCE
+#define GAPBUFFER_GAP_REUSE_DISTANCE 4096
+#endif
+
+// Gaps closer than this many bytes are merged.
+#ifndef GAPBUFFER_GAP_MERGE_DISTANCE
+#define GAPBUFFER_GAP_MERGE_DISTANCE 256
+#endif
+
+// Gaps smaller than this aren't split to create new ones.
+#ifndef GAPBUFFER_GAP_MIN_SPLIT
+#define GAPBUFFER_GAP_MIN_SPLIT 64
+#endif
+
+/* Symbol: MultiGapBuffer_createUsingMemory
+**
+**   Initialize a multi-gap buffer object using the provided
+**   memory region. It behaves like GapBuffer_createUsingMemory.
+*/
+MultiGapBuffer *MultiGapBuffer_createUsingMemory(void *mem, size_t len, void (*free)(void*))
+{
+    if (mem == NULL || len < sizeof(MultiGapBuffer)) {
+        if (free) free(mem);
+        return NULL;
+    }
+
+    MultiGapBuffer *buff = mem;
+    buff->free = free;
+    buff->total = len - sizeof(MultiGapBuffer);
+    buff->num_gaps = 1;
+    buff->gaps[0].offset = 0;
+    buff->gaps[0].length = buff->total;
+    return buff;
+}
+
+void MultiGapBuffer_destroy(MultiGapBuffer *buff)
+{
+    if (buff->free)
+        buff->free(buff);
+}
+
+PRIVATE size_t getMultiGapLength(const MultiGapBuffer *buff)
+{
+    size_t length = 0;
+    for (int i = 0; i < buff->num_gaps; i++)
+        length += buff->gaps[i].length;
+    return length;
+}
+
+size_t MultiGapBuffer_getByteCount(const MultiGapBuffer *buff)
+{
+    return buff->total - getMultiGapLength(buff);
+}
+
+/* Symbol: getMultiGapSegment
+**   Returns the [i]-th region of text delimited by the gaps.
+**   There are [num_gaps+1] of them.
+*/
+PRIVATE String getMultiGapSegment(const MultiGapBuffer *buff, int i)
+{
+    size_t start = (i == 0) ? 0 : buff->gaps[i-1].offset + buff->gaps[i-1].length;
+    size_t end   = (i == buff->num_gaps) ? buff->total : buff->gaps[i].offset;
+    return (String) { .data=buff->data + start, .size=end - start };
+}
+
+/* Symbol: getMultiGapPosition
+**   Returns the offset of the [i]-th gap relative to the
+**   start of the text.
+*/
+PRIVATE size_t getMultiGapPosition(const MultiGapBuffer *buff, int i)
+{
+    size_t position = buff->gaps[i].offset;
+    for (int j = 0; j < i; j++)
+        position -= buff->gaps[j].length;
+    return position;
+}
+
+/* Symbol: getMultiGapByte
+**   Returns the byte at offset [pos] of the text, which
+**   must be lower than the byte count.
+*/
+PRIVATE char getMultiGapByte(const MultiGapBuffer *buff, size_t pos)
+{
+    for (int i = 0; i < buff->num_gaps; i++) {
+        String segment = getMultiGapSegment(buff, i);
+        if (pos < segment.size)
+            return segment.data[pos];
+        pos -= segment.size;
+    }
+    return getMultiGapSegment(buff, buff->num_gaps).data[pos];
+}
+
+// Moves [pos] back to the start of the UTF-8 sequence it's in.
+PRIVATE size_t alignMultiGapOffset(const MultiGapBuffer *buff, size_t pos)
+{
+    size_t count = MultiGapBuffer_getByteCount(buff);
+    if (pos > count)
+        pos = count;
+    while (pos > 0 && pos < count && isSymbolAuxiliaryByte(getMultiGapByte(buff, pos)))
+        pos--;
+    return pos;
+}
+
+PRIVATE void removeMultiGap(MultiGapBuffer *buff, int i)
+{
+    memmove(&buff->gaps[i], &buff->gaps[i+1], (buff->num_gaps - i - 1) * sizeof(buff->gaps[0]));
+    buff->num_gaps--;
+}
+
+/* Symbol: moveMultiGap
+**
+**   Move the [i]-th gap to offset [pos] of the text. The
+**   offset must lie between the positions of the previous
+**   and next gap.
+*/
+PRIVATE void moveMultiGap(MultiGapBuffer *buff, int i, size_t pos)
+{
+    size_t current = getMultiGapPosition(buff, i);
+    size_t offset = buff->gaps[i].offset;
+    size_t length = buff->gaps[i].length;
+    if (pos < current) {
+        size_t num = current - pos;
+        moveMemory(buff->data + offset + length - num, buff->data + offset - num, num);
+        buff->gaps[i].offset -= num;
+    } else {
+        size_t num = pos - current;
+        moveMemory(buff->data + offset, buff->data + offset + length, num);
+        buff->gaps[i].offset += num;
+    }
+}
+
+/* Symbol: mergeMultiGaps
+**
+**   Merge the [i]-th and [i+1]-th gap by moving the text
+**   between them. If [keep_left] is true, the merged gap
+**   is where the [i]-th gap was, else it's where the
+**   [i+1]-th gap was.
+*/
+PRIVATE void mergeMultiGaps(MultiGapBuffer *buff, int i, bool keep_left)
+{
+    size_t left_offset  = buff->gaps[i].offset;
+    size_t left_length  = buff->gaps[i].length;
+    size_t right_offset = buff->gaps[i+1].offset;
+    size_t right_length = buff->gaps[i+1].length;
+    size_t between = right_offset - left_offset - left_length;
+
+    if (keep_left)
+        moveMemory(buff->data + right_offset + right_length - between,
+                   buff->data + left_offset + left_length, between);
+    else {
+        moveMemory(buff->data + left_offset,
+                   buff->data + left_offset + left_length, between);
+        buff->gaps[i].offset += between;
+    }
+    buff->gaps[i].length += right_length;
+    removeMultiGap(buff, i+1);
+}
+
+/* Symbol: mergeCloseMultiGaps
+**   Merge the neighbours of the [i]-th gap into it if
+**   they are close enough. Returns the new index of the
+**   [i]-th gap.
+*/
+PRIVATE int mergeCloseMultiGaps(MultiGapBuffer *buff, int i)
+{
+    if (i+1 < buff->num_gaps && getMultiGapPosition(buff, i+1) - getMultiGapPosition(buff, i) <= GAPBUFFER_GAP_MERGE_DISTANCE)
+        mergeMultiGaps(buff, i, true);
+
+    if (i > 0 && getMultiGapPosition(buff, i) - getMultiGapPosition(buff, i-1) <= GAPBUFFER_GAP_MERGE_DISTANCE) {
+        mergeMultiGaps(buff, i-1, false);
+        i--;
+    }
+    return i;
+}
+
+/* Symbol: splitMultiGap
+**
+**   Create a new gap at offset [pos] of the text using half
+**   of the space of the [i]-th gap, which must be one of
+**   the gaps closest to [pos]. Returns the index of the
+**   new gap.
+*/
+PRIVATE int splitMultiGap(MultiGapBuffer *buff, int i, size_t pos)
+{
+    size_t current = getMultiGapPosition(buff, i);
+    size_t offset = buff->gaps[i].offset;
+    size_t length = buff->gaps[i].length;
+    size_t half = length / 2;
+
+    int k; // Index of the new gap
+    if (pos > current) {
+        size_t num = pos - current;
+        moveMemory(buff->data + offset + length - half,
+                   buff->data + offset + length, num);
+        buff->gaps[i].length -= half;
+        k = i+1;
+    } else {
+        size_t num = current - pos;
+        moveMemory(buff->data + offset - num + half,
+                   buff->data + offset - num, num);
+        buff->gaps[i].offset += half;
+        buff->gaps[i].length -= half;
+        k = i;
+    }
+
+    memmove(&buff->gaps[k+1], &buff->gaps[k], (buff->num_gaps - k) * sizeof(buff->gaps[0]));
+    buff->num_gaps++;
+
+    if (pos > current)
+        buff->gaps[k].offset = offset + length - half + pos - current;
+    else
+        buff->gaps[k].offset = offset - (current - pos);
+    buff->gaps[k].length = half;
+    return k;
+}
+
+/* Symbol: placeMultiGap
+**
+**   Get a gap to offset [pos] of the text, either by reusing
+**   the closest gap or by creating a new one, and return its
+**   index. Close gaps are merged afterwards.
+*/
+PRIVATE int placeMultiGap(MultiGapBuffer *buff, size_t pos)
+{
+    // The closest gap is always the last one before [pos]
+    // or the first one after it, so moving it there never
+    // crosses other gaps.
+    int closest = 0;
+    size_t closest_distance = SIZE_MAX;
+    for (int i = 0; i < buff->num_gaps; i++) {
+        size_t position = getMultiGapPosition(buff, i);
+        size_t distance = position > pos ? position - pos : pos - position;
+        if (distance < closest_distance) {
+            closest = i;
+            closest_distance = distance;
+        }
+    }
+
+    if (closest_distance == 0)
+        return closest;
+
+    if (closest_distance <= GAPBUFFER_GAP_REUSE_DISTANCE
+        || buff->num_gaps == GAPBUFFER_MAX_GAPS
+        || buff->gaps[closest].length < GAPBUFFER_GAP_MIN_SPLIT) {
+        moveMultiGap(buff, closest, pos);
+        return mergeCloseMultiGaps(buff, closest);
+    }
+
+    return splitMultiGap(buff, closest, pos);
+}
+
+/* Symbol: compactMultiGaps
+**   Merge all gaps into the [i]-th one. This moves all
+**   of the text between them, so it's only done when a
+**   single gap doesn't have enough space.
+*/
+PRIVATE void compactMultiGaps(MultiGapBuffer *buff, int i)
+{
+    while (i+1 < buff->num_gaps)
+        mergeMultiGaps(buff, i, true);
+    while (i > 0) {
+        mergeMultiGaps(buff, i-1, false);
+        i--;
+    }
+}
+
+/* Symbol: MultiGapBuffer_insertString
+**
+**   Insert a UTF8-encoded string at byte offset [pos] of
+**   the text. If the gap used for the insertion doesn't
+**   have enough space, all gaps are merged into it.
+**
+** Returns:
+**   [false] if there wasn't enough space in the buffer 
+**   or the provided string isn't valid UTF8. Returns
+**   [true] if all went well.
+*/
+bool MultiGapBuffer_insertString(MultiGapBuffer *buff, size_t pos, const char *str, size_t len)
+{
+    if (!isValidUTF8(str, len)) {
+        PROBE2(invalid_utf8, buff, len);
+        return false;
+    }
+    if (len > buff->total - MultiGapBuffer_getByteCount(buff))
+        return false;
+
+    pos = alignMultiGapOffset(buff, pos);
+
+    int i = placeMultiGap(buff, pos);
+    if (buff->gaps[i].length < len) {
+        compactMultiGaps(buff, i);
+        i = 0;
+    }
+
+    memcpy(buff->data + buff->gaps[i].offset, str, len);
+    buff->gaps[i].offset += len;
+    buff->gaps[i].length -= len;
+    return true;
+}
+
+/* Symbol: MultiGapBuffer_remove
+**
+**   Remove [len] bytes starting from byte offset [pos]. The
+**   range is extended to include any UTF-8 sequence it cuts
+**   in half. Gaps that end up touching are merged.
+*/
+void MultiGapBuffer_remove(MultiGapBuffer *buff, size_t pos, size_t len)
+{
+    size_t count = MultiGapBuffer_getByteCount(buff);
+    pos = alignMultiGapOffset(buff, pos);
+    size_t end = (len > count - pos) ? count : pos + len;
+    while (end < count && isSymbolAuxiliaryByte(getMultiGapByte(buff, end)))
+        end++;
+    len = end - pos;
+
+    int i = placeMultiGap(buff, pos);
+    while (len > 0) {
+        size_t start = buff->gaps[i].offset + buff->gaps[i].length;
+        size_t limit = (i+1 < buff->num_gaps) ? buff->gaps[i+1].offset : buff->total;
+        size_t num = MIN(len, limit - start);
+        buff->gaps[i].length += num;
+        len -= num;
+
+        // Swallow the next gap if there's no more text between them
+        if (i+1 < buff->num_gaps && buff->gaps[i].offset + buff->gaps[i].length == buff->gaps[i+1].offset) {
+            buff->gaps[i].length += buff->gaps[i+1].length;
+            removeMultiGap(buff, i+1);
+        }
+    }
+}
+
+/* Symbol: MultiGapBuffer_find
+**
+**   Find the first occurrence of [needle] starting from
+**   byte offset [from], including the ones spanning more
+**   than one segment.
+**
+** Returns:
+**   The byte offset of the occurrence or SIZE_MAX if
+**   there isn't one.
+*/
+size_t MultiGapBuffer_find(const MultiGapBuffer *buff, size_t from, const char *needle, size_t len)
+{
+    size_t count = MultiGapBuffer_getByteCount(buff);
+    if (len == 0)
+        return from <= count ? from : SIZE_MAX;
+
+    size_t base = 0; // Offset of the segment's first byte
+    for (int i = 0; i <= buff->num_gaps; i++) {
+
+        String segment = getMultiGapSegment(buff, i);
+        size_t j = (from > base) ? from - base : 0;
+
+        while (j < segment.size) {
+
+            const char *p = memchr(segment.data + j, needle[0], segment.size - j);
+            if (p == NULL)
+                break;
+            j = p - segment.data;
+
+            size_t pos = base + j;
+            if (len > count - pos)
+                return SIZE_MAX;
+
+            // Compare the rest of the needle, which may
+            // continue in the following segments.
+            size_t k = 0;
+            int seg = i;
+            size_t off = j;
+            while (k < len) {
+                String s = getMultiGapSegment(buff, seg);
+                size_t n = MIN(len - k, s.size - off);
+                if (memcmp(s.data + off, needle + k, n))
+                    break;
+                k += n;
+                seg++;
+                off = 0;
+            }
+            if (k == len)
+                return pos;
+            j++;
+        }
+        base += segment.size;
+    }
+    return SIZE_MAX;
+}
+
+void MultiGapBufferIter_init(MultiGapBufferIter *iter, MultiGapBuffer *buff)
+{
+    iter->buff = buff;
+    iter->segment = 0;
+    iter->cur = 0;
+}
+
+void MultiGapBufferIter_free(MultiGapBufferIter *iter)
+{
+    (void) iter;
+}
+
+/* Symbol: MultiGapBufferIter_next
+**
+**   Get the next line of the text. Lines spanning more than
+**   one segment are copied in the iterator's scratch memory,
+**   and if they don't fit they're truncated.
+**
+** Returns:
+**   [false] if there are no more lines.
+*/
+bool MultiGapBufferIter_next(MultiGapBufferIter *iter, GapBufferLine *line)
+{
+    MultiGapBuffer *buff = iter->buff;
+
+    size_t copied = 0;
+    size_t length = 0;
+    bool   spans_segments = false;
+    const char *str = NULL;
+
+    while (iter->segment <= buff->num_gaps) {
+
+        String segment = getMultiGapSegment(buff, iter->segment);
+
+        const char *start = segment.data + iter->cur;
+        size_t left = segment.size - iter->cur;
+        const char *newline = memchr(start, '\n', left);
+        size_t num = newline ? (size_t) (newline - start) : left;
+
+        if (length == 0 && !spans_segments)
+            str = start;
+        else if (!spans_segments) {
+            // The line didn't end in the previous segment
+            spans_segments = true;
+            copied = MIN(length, sizeof(iter->maybe));
+            memcpy(iter->maybe, str, copied);
+        }
+
+        if (spans_segments) {
+            size_t n = MIN(num, sizeof(iter->maybe) - copied);
+            memcpy(iter->maybe + copied, start, n);
+            copied += n;
+        }
+        length += num;
+
+        if (newline) {
+            iter->cur += num + 1;
+            break;
+        }
+
+        iter->segment++;
+        iter->cur = 0;
+
+        if (iter->segment > buff->num_gaps && length == 0)
+            return false;
+    }
+
+    if (str == NULL)
+        return false;
+
+    if (spans_segments) {
+        line->str = iter->maybe;
+        line->len = copied;
+    } else {
+        line->str = str;
+        line->len = length;
+    }
+    return true;
+}
+
+#ifndef GAPBUFFER_NOMALLOC
+#include <stdlib.h>
+GapBuffer *GapBuffer_create(size_t capacity)
+{
+    TRACE(NULL, "capacity", capacity, NULL, 0);
     size_t len = sizeof(GapBuffer) + capacity;
     void  *mem = malloc(len);
+    COST(allocations, 1);
+    COST(allocated, len);
     return GapBuffer_createUsingMemory(mem, len, free);
 }
-bool GapBuffer_insertStringMaybeRelocate(GapBuffer **buff, const char *str, size_t len)
+
+// Capacity of the buffer a full buffer holding [count]
+// bytes is moved to when [len] more bytes are inserted.
+// Growing geometrically keeps the cost of relocations
+// constant when amortized over the insertions.
+PRIVATE size_t getRelocationCapacity(size_t count, size_t len)
+{
+    return MAX(2 * (count + len), 64);
+}
+
+bool GapBuffer_insertStringMaybeRelocate(GapBuffer **buff, const char *str, size_t len)
+{
+    TRACE(*buff, "len", len, NULL, 0);
+    if (!GapBuffer_insertString(*buff, str, len)) {
+
+        if (!isValidUTF8(str, len))
+            return false; // Relocating wouldn't help
+
+        // Readers in other processes map the memory of
+        // shared buffers, so they can't be moved.
+        if ((*buff)->shared)
+            return false;
+
+        // Need to relocate
+        size_t capacity = getRelocationCapacity(getByteCount(*buff), len);
+        PROBE3(relocate, *buff, getByteCount(*buff), capacity);
+        size_t mem_len = sizeof(GapBuffer) + capacity;
+        void  *mem = malloc(mem_len);
+        COST(allocations, 1);
+        COST(allocated, mem_len);
+        GapBuffer *buff2 = GapBuffer_cloneUsingMemory(mem, mem_len, free, *buff);
+        if (buff2 == NULL)
+            return false; // Failed to create new location
+
+        handOverEdits(*buff, buff2);
+        if (!GapBuffer_insertString(buff2, str, len)) {
+            // Insertion failed unexpectedly. The gap was created
+            // with enough free memory to hold the new text..
+            handOverEdits(buff2, *buff);
+            GapBuffer_destroy(buff2);
+            return false;
+        }
+
+        // Swap the parent buffer with the new one
+        GapBuffer_destroy(*buff);
+        *buff = buff2;
+    }
+
+    return true;
+}
+
+/* Symbol: GapBuffer_insertStringMaybeRelocateIncrementally
+**
+**   Behaves like GapBuffer_insertStringMaybeRelocate, but
+**   when the buffer is full its contents are moved to the
+**   new location incrementally (see GapBuffer_relocateUsingMemory)
+**   instead of all at once. This bounds the latency of
+**   every call, regardless of the size of the text.
+*/
+bool GapBuffer_insertStringMaybeRelocateIncrementally(GapBuffer **buff, const char *str, size_t len)
+{
+    TRACE(*buff, "len", len, NULL, 0);
+    if (GapBuffer_insertString(*buff, str, len))
+        return true;
+
+    if (!isValidUTF8(str, len) || (*buff)->shared)
+        return false; // Relocating wouldn't help or isn't possible
+
+    size_t capacity = getRelocationCapacity(getByteCount(*buff), len);
+    PROBE3(relocate_incrementally, *buff, getByteCount(*buff), capacity);
+    size_t mem_len = sizeof(GapBuffer) + capacity;
+    void  *mem = malloc(mem_len);
+    COST(allocations, 1);
+    COST(allocated, mem_len);
+    GapBuffer *buff2 = GapBuffer_relocateUsingMemory(mem, mem_len, free, *buff);
+    if (buff2 == NULL)
+        return false;
+    *buff = buff2;
+
+    return GapBuffer_insertString(buff2, str, len);
+}
+
+MultiGapBuffer *MultiGapBuffer_create(size_t capacity)
+{
+    size_t len = sizeof(MultiGapBuffer) + capacity;
+    void  *mem = malloc(len);
+    COST(allocations, 1);
+    COST(allocated, len);
+    return MultiGapBuffer_createUsingMemory(mem, len, free);
+}
+
+#ifndef GAPBUFFER_NOQUEUE
+/* Symbol: GapBufferQueue_create
+**   Create a queue that holds at least [capacity] edits.
+**   Insertions take one for each 22 bytes of text.
+*/
+GapBufferQueue *GapBufferQueue_create(size_t capacity)
+{
+    size_t records = 1;
+    while (records < capacity)
+        records *= 2;
+    size_t len = sizeof(GapBufferQueue) + records * sizeof(QueuedEdit);
+    void  *mem = malloc(len);
+    COST(allocations, 1);
+    COST(allocated, len);
+    return GapBufferQueue_createUsingMemory(mem, len, free);
+}
+#endif
+
+/* Symbol: GapBufferStream_create
+**
+**   Create an edit stream, to be attached to a buffer with
+**   GapBuffer_setStream. A checksum of the text is added
+**   every [checksum_period] edits, or never if it's 0.
+**   Computing it takes time proportional to the size of
+**   the text, so the period should be at least in the
+**   hundreds for big texts.
+*/
+GapBufferStream *GapBufferStream_create(size_t checksum_period)
+{
+    GapBufferStream *stream = malloc(sizeof(GapBufferStream));
+    COST(allocations, 1);
+    COST(allocated, sizeof(GapBufferStream));
+    if (stream == NULL)
+        return NULL;
+
+    stream->buff = NULL;
+    stream->data = NULL;
+    stream->size = 0;
+    stream->capacity = 0;
+    stream->checksum_period = checksum_period;
+    stream->edits = 0;
+    stream->snapshot = false;
+    return stream;
+}
+
+void GapBufferStream_destroy(GapBufferStream *stream)
+{
+    if (stream->buff)
+        stream->buff->stream = NULL;
+    free(stream->data);
+    free(stream);
+}
+
+/* Symbol: GapBuffer_setStream
+**
+**   Start appending the edits done to [buff] to [stream],
+**   beginning with a snapshot of its text. A buffer has at
+**   most one stream and a stream records one buffer at the
+**   time, so the previous attachments of both are undone.
+**   Passing NULL as [stream] stops the recording.
+**
+** Notes:
+**   - The stream follows the buffer when it's relocated
+**     by the functions that relocate buffers, but it's
+**     detached when the buffer is destroyed.
+*/
+void GapBuffer_setStream(GapBuffer *buff, GapBufferStream *stream)
+{
+    TRACE(buff, NULL, 0, NULL, 0);
+    if (buff->stream)
+        buff->stream->buff = NULL;
+    buff->stream = stream;
+    if (stream == NULL)
+        return;
+
+    if (stream->buff)
+        stream->buff->stream = NULL;
+    stream->buff = buff;
+    stream->snapshot = true;
+}
+
+// Arguments up to this value are stored in the first
+// byte of a record. Bigger ones follow it as a varint,
+// minus STREAM_INLINE_MAX+1.
+#define STREAM_INLINE_MAX 30
+
+// Bytes taken by the header of a record in the worst
+// case, the first byte and a 64 bit varint.
+#define STREAM_MAX_HEADER 11
+
+PRIVATE char *writeVarint(char *p, uint64_t num)
+{
+    while (num >= 0x80) {
+        *p++ = (char) (num | 0x80);
+        num >>= 7;
+    }
+    *p++ = (char) num;
+    return p;
+}
+
+PRIVATE char *writeRecordHeader(char *p, int type, size_t num)
+{
+    if (num <= STREAM_INLINE_MAX) {
+        *p++ = (char) (type | num << 3);
+        return p;
+    }
+    *p++ = (char) (type | (STREAM_INLINE_MAX + 1) << 3);
+    return writeVarint(p, num - STREAM_INLINE_MAX - 1);
+}
+
+PRIVATE void writeLE64(char *p, uint64_t num)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (char) (num >> (8 * i));
+}
+
+PRIVATE uint64_t readLE64(const char *p)
+{
+    uint64_t num = 0;
+    for (int i = 7; i >= 0; i--)
+        num = num << 8 | (uint8_t) p[i];
+    return num;
+}
+
+/* Symbol: reserveStream
+**   Make room for [num] more bytes at the end of the
+**   stream. Returns where to write them or NULL if
+**   memory ran out.
+*/
+PRIVATE char *reserveStream(GapBufferStream *stream, size_t num)
+{
+    if (stream->capacity - stream->size < num) {
+        size_t capacity = MAX(2 * stream->capacity, stream->size + num);
+        capacity = MAX(capacity, 4096);
+        char *data = realloc(stream->data, capacity);
+        if (data == NULL)
+            return NULL;
+        COST(allocations, 1);
+        COST(allocated, capacity);
+        stream->data = data;
+        stream->capacity = capacity;
+    }
+    return stream->data + stream->size;
+}
+
+// Bytes of text before the cursor, which is at the end
+// of the text if the buffer wrapped around.
+PRIVATE size_t getCursorOffset(const GapBuffer *buff)
+{
+    if (buff->rotated)
+        return getByteCount((GapBuffer*) buff);
+    return buff->gap_offset - buff->head;
+}
+
+// Bytes hashed at the time by hashText, 8 for each of
+// its 4 lanes.
+#define HASH_BLOCK 32
+
+PRIVATE void mixBlock(uint64_t lanes[4], const char *p)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t word;
+        memcpy(&word, p + 8 * i, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        uint64_t hash = (lanes[i] ^ word) * 0xbf58476d1ce4e5b9;
+        lanes[i] = hash ^ (hash >> 31);
+    }
+}
+
+/* Symbol: hashText
+**
+**   Hash the text of a buffer with the steps of hashChunk,
+**   but in 4 independent lanes so that the multiplications
+**   overlap. The bytes of a block cut by the end of a slice
+**   are carried over to the next one, so that the hash
+**   doesn't depend on where the gap is.
+*/
+PRIVATE uint64_t hashText(const GapBuffer *buff)
+{
+    size_t count = getByteCount((GapBuffer*) buff);
+    uint64_t lanes[4];
+    for (int i = 0; i < 4; i++)
+        lanes[i] = (count + i) * 0x9e3779b97f4a7c15;
+
+    char   block[HASH_BLOCK];
+    size_t filled = 0;
+    for (size_t off = 0; off < count;) {
+        String slice = getOrderedSlice(buff, off);
+        off += slice.size;
+
+        size_t i = 0;
+        if (filled > 0) {
+            i = MIN(HASH_BLOCK - filled, slice.size);
+            memcpy(block + filled, slice.data, i);
+            filled += i;
+            if (filled < HASH_BLOCK)
+                continue;
+            mixBlock(lanes, block);
+        }
+        for (; i + HASH_BLOCK <= slice.size; i += HASH_BLOCK)
+            mixBlock(lanes, slice.data + i);
+        filled = slice.size - i;
+        memcpy(block, slice.data + i, filled);
+    }
+    memset(block + filled, 0, HASH_BLOCK - filled);
+    mixBlock(lanes, block);
+    COST(scanned, count);
+
+    uint64_t hash = 0;
+    for (int i = 0; i < 4; i++)
+        hash = (hash ^ lanes[i]) * 0x94d049bb133111eb;
+    return hash ^ (hash >> 29);
+}
+
+PRIVATE void writeSnapshot(GapBufferStream *stream)
+{
+    GapBuffer *buff = stream->buff;
+    rehydrate(buff);
+
+    size_t count = getByteCount(buff);
+    char *p = reserveStream(stream, 2 * STREAM_MAX_HEADER + count);
+    if (p == NULL)
+        return; // Tried again on the next edit
+
+    p = writeRecordHeader(p, STREAM_SNAPSHOT, count);
+    p = writeVarint(p, getCursorOffset(buff));
+    for (size_t off = 0; off < count;) {
+        String slice = getOrderedSlice(buff, off);
+        memcpy(p, slice.data, slice.size);
+        p += slice.size;
+        off += slice.size;
+    }
+    COST(copied, count);
+    stream->size = p - stream->data;
+    stream->snapshot = false;
+    stream->edits = 0;
+}
+
+PRIVATE void writeChecksum(GapBufferStream *stream)
+{
+    GapBuffer *buff = stream->buff;
+    char *p = reserveStream(stream, 2 * STREAM_MAX_HEADER + 8);
+    if (p == NULL) {
+        stream->snapshot = true;
+        return;
+    }
+
+    p = writeRecordHeader(p, STREAM_CHECKSUM, getByteCount(buff));
+    p = writeVarint(p, getCursorOffset(buff));
+    writeLE64(p, hashText(buff));
+    stream->size = p + 8 - stream->data;
+    stream->edits = 0;
+}
+
+/* Symbol: streamEdit
+**
+**   Append to the stream of [buff] the record of an edit
+**   of [num] bytes, the text of insertions being [str].
+**   If the stream is waiting for a snapshot, the snapshot
+**   is written instead, since it includes the edit.
+*/
+PRIVATE void streamEdit(GapBuffer *buff, int type, size_t num, const char *str)
+{
+    GapBufferStream *stream = buff->stream;
+    if (stream->snapshot) {
+        writeSnapshot(stream);
+        return;
+    }
+
+    if (num == 0)
+        return;
+
+    char *p = reserveStream(stream, STREAM_MAX_HEADER + (type == STREAM_INSERT ? num : 0));
+    if (p == NULL) {
+        stream->snapshot = true;
+        return;
+    }
+
+    p = writeRecordHeader(p, type, num);
+    if (type == STREAM_INSERT) {
+        memcpy(p, str, num);
+        COST(copied, num);
+        p += num;
+    }
+    stream->size = p - stream->data;
+
+    if (++stream->edits == stream->checksum_period)
+        writeChecksum(stream);
+}
+
+/* Symbol: GapBufferStream_getData
+**
+**   Get the records that weren't consumed yet, to send
+**   them to the followers. If a snapshot was requested,
+**   it's added first. The pointer is valid until the
+**   next edit or call on the stream.
+*/
+const char *GapBufferStream_getData(GapBufferStream *stream, size_t *len)
+{
+    if (stream->snapshot && stream->buff)
+        writeSnapshot(stream);
+    *len = stream->size;
+    return stream->data;
+}
+
+/* Symbol: GapBufferStream_consume
+**   Drop the first [num] bytes of the stream, once they
+**   were sent.
+*/
+void GapBufferStream_consume(GapBufferStream *stream, size_t num)
+{
+    assert(num <= stream->size);
+    memmove(stream->data, stream->data + num, stream->size - num);
+    COST(copied, stream->size - num);
+    stream->size -= num;
+}
+
+/* Symbol: GapBufferStream_requestSnapshot
+**   Make the stream add a snapshot of the text, for a
+**   follower that diverged or that just joined.
+*/
+void GapBufferStream_requestSnapshot(GapBufferStream *stream)
+{
+    stream->snapshot = true;
+}
+
+typedef struct {
+    int         type;
+    size_t      num;    // First argument
+    size_t      cursor; // STREAM_CHECKSUM and STREAM_SNAPSHOT
+    uint64_t    hash;   // STREAM_CHECKSUM
+    const char *str;    // STREAM_INSERT and STREAM_SNAPSHOT
+    size_t      size;   // Bytes taken by the record
+} StreamRecord;
+
+// Results of parseRecord
+enum {
+    RECORD_MALFORMED = -1,
+    RECORD_TRUNCATED,
+    RECORD_COMPLETE,
+};
+
+PRIVATE int readVarint(const uint8_t **p, const uint8_t *end, size_t *num)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p == end)
+            return RECORD_TRUNCATED;
+        uint8_t byte = *(*p)++;
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            if (result > SIZE_MAX)
+                return RECORD_MALFORMED;
+            *num = result;
+            return RECORD_COMPLETE;
+        }
+    }
+    return RECORD_MALFORMED;
+}
+
+/* Symbol: parseRecord
+**   Decode the record at the start of [data], which may
+**   be cut short by the end of it.
+*/
+PRIVATE int parseRecord(const char *data, size_t len, StreamRecord *record)
+{
+    const uint8_t *p = (const uint8_t*) data;
+    const uint8_t *end = p + len;
+    if (p == end)
+        return RECORD_TRUNCATED;
+
+    record->type = *p & 7;
+    record->num = *p++ >> 3;
+    if (record->num > STREAM_INLINE_MAX) {
+        size_t num;
+        int result = readVarint(&p, end, &num);
+        if (result != RECORD_COMPLETE)
+            return result;
+        if (num > SIZE_MAX - STREAM_INLINE_MAX - 1)
+            return RECORD_MALFORMED;
+        record->num = num + STREAM_INLINE_MAX + 1;
+    }
+
+    switch (record->type) {
+
+        case STREAM_INSERT:
+        if ((size_t) (end - p) < record->num)
+            return RECORD_TRUNCATED;
+        record->str = (const char*) p;
+        p += record->num;
+        break;
+
+        case STREAM_REMOVE_FORWARDS:
+        case STREAM_REMOVE_BACKWARDS:
+        case STREAM_MOVE:
+        case STREAM_CONSUME:
+        break;
+
+        case STREAM_CHECKSUM:
+        case STREAM_SNAPSHOT:
+        {
+            int result = readVarint(&p, end, &record->cursor);
+            if (result != RECORD_COMPLETE)
+                return result;
+            if (record->cursor > record->num)
+                return RECORD_MALFORMED;
+
+            size_t rest = record->type == STREAM_CHECKSUM ? 8 : record->num;
+            if ((size_t) (end - p) < rest)
+                return RECORD_TRUNCATED;
+            if (record->type == STREAM_CHECKSUM)
+                record->hash = readLE64((const char*) p);
+            else
+                record->str = (const char*) p;
+            p += rest;
+            break;
+        }
+
+        default:
+        return RECORD_MALFORMED;
+    }
+
+    record->size = p - (const uint8_t*) data;
+    return RECORD_COMPLETE;
+}
+
+/* Symbol: isSymbolBoundary
+**   Tells whether [off] bytes from the start of the text
+**   of an unrotated buffer is not in the middle of a UTF-8
+**   sequence.
+*/
+PRIVATE bool isSymbolBoundary(const GapBuffer *buff, size_t off)
+{
+    if (off == getByteCount((GapBuffer*) buff))
+        return true;
+
+    size_t i = buff->head + off;
+    if (i >= buff->gap_offset)
+        i += buff->gap_length;
+    return !isSymbolAuxiliaryByte(getTextByte(buff, i));
+}
+
+/* Symbol: replayRecord
+**
+**   Update the bytes of text [before] and [after] the
+**   cursor of a follower as the removal, consumption or
+**   move [record] would.
+**
+** Returns:
+**   [false] if the record doesn't fit the text.
+*/
+PRIVATE bool replayRecord(const StreamRecord *record, size_t *before, size_t *after)
+{
+    size_t num = record->num;
+    switch (record->type) {
+
+        case STREAM_REMOVE_FORWARDS:
+        if (num > *after)
+            return false;
+        *after -= num;
+        break;
+
+        case STREAM_REMOVE_BACKWARDS:
+        if (num > *before)
+            return false;
+        *before -= num;
+        break;
+
+        case STREAM_CONSUME:
+        if (num > *before + *after)
+            return false;
+        if (num > *before) {
+            *after -= num - *before;
+            *before = 0;
+        } else
+            *before -= num;
+        break;
+
+        case STREAM_MOVE:
+        if (num & 1) {
+            num = num / 2 + 1; // Backwards
+            if (num > *before)
+                return false;
+            *before -= num;
+            *after += num;
+        } else {
+            num /= 2;
+            if (num > *after)
+                return false;
+            *after -= num;
+            *before += num;
+        }
+        break;
+    }
+    return true;
+}
+
+/* Symbol: applyStreamedInsertions
+**
+**   Copy the text of the run of insertion records between
+**   [start] and [end] into the gap, validate it in place
+**   and insert it at once.
+**
+** Returns:
+**   [false] if the text isn't valid UTF-8.
+*/
+PRIVATE bool applyStreamedInsertions(GapBuffer *buff, const char *data, size_t start, size_t end, size_t bytes)
+{
+    buff->pending = 0;
+    char  *dst = buff->data + buff->gap_offset;
+    size_t copied = 0;
+    StreamRecord record;
+    for (size_t i = start; i < end; i += record.size) {
+        parseRecord(data + i, end - i, &record);
+        memcpy(dst + copied, record.str, record.num);
+        copied += record.num;
+    }
+    COST(copied, bytes);
+
+    if (!isValidUTF8(dst, bytes))
+        return false;
+
+    buff->version++;
+    buff->gap_offset += bytes;
+    buff->gap_length -= bytes;
+    STREAM(buff, STREAM_INSERT, bytes, dst);
+    return true;
+}
+
+/* Symbol: applySnapshot
+**   Replace the text of the follower with the one of a
+**   snapshot that fits in it.
+*/
+PRIVATE bool applySnapshot(GapBuffer *buff, const StreamRecord *record)
+{
+    size_t len = record->num;
+    size_t cursor = record->cursor;
+    if (!isValidUTF8(record->str, len) || (cursor < len && isSymbolAuxiliaryByte(record->str[cursor])))
+        return false;
+
+    // The text of a relocation in progress is replaced
+    if (buff->old) {
+        GapBuffer_destroy(buff->old);
+        buff->old = NULL;
+    }
+
+    memcpy(buff->data, record->str, cursor);
+    memcpy(buff->data + buff->total - len + cursor, record->str + cursor, len - cursor);
+    COST(copied, len);
+    buff->head = 0;
+    buff->pending = 0;
+    buff->gap_offset = cursor;
+    buff->gap_length = buff->total - len;
+    buff->version++;
+    buff->diverged = false;
+    buff->unchanged_head = 0;
+    buff->unchanged_tail = 0;
+
+    // Followers of this follower need a snapshot too
+    if (buff->stream)
+        buff->stream->snapshot = true;
+    return true;
+}
+
+/* Symbol: applyRecords
+**
+**   Apply the complete records of [data] from [*used] on
+**   to [buff], advancing [*used] past them. Runs of records
+**   of the same kind are applied as one operation, like in
+**   GapBufferQueue_apply. Records that don't fit the text
+**   mark the follower as diverged.
+**
+**   It stops when an insertion or a snapshot needs more
+**   room than the buffer has, storing in [*room] the bytes
+**   of text the buffer must be able to hold. Otherwise
+**   [*room] is 0.
+**
+**   Like the other operations, it only migrates a step of
+**   a relocation in progress and the bytes it edits or
+**   moves the gap over.
+*/
+PRIVATE GapBufferReplicaStatus applyRecords(GapBuffer *buff, const char *data, size_t len, size_t *used, size_t *room)
+{
+    SHARED_WRITE(buff);
+    rehydrate(buff);
+    unrotate(buff);
+    relocationStep(buff, GAPBUFFER_RELOCATION_STEP);
+
+    *room = 0;
+    StreamRecord record;
+    for (int result; (result = parseRecord(data + *used, len - *used, &record)) != RECORD_TRUNCATED;) {
+
+        if (result == RECORD_MALFORMED)
+            return GAPBUFFER_REPLICA_INVALID;
+
+        if (buff->diverged && record.type != STREAM_SNAPSHOT) {
+            *used += record.size;
+            continue;
+        }
+
+        size_t count  = getByteCount(buff);
+        size_t cursor = buff->gap_offset - buff->head;
+        size_t end    = *used + record.size;
+        bool   ok     = true;
+        switch (record.type) {
+
+            case STREAM_INSERT:
+            {
+                size_t bytes = record.num;
+                StreamRecord next;
+                while (parseRecord(data + end, len - end, &next) == RECORD_COMPLETE && next.type == STREAM_INSERT) {
+                    bytes += next.num;
+                    end += next.size;
+                }
+
+                if (buff->gap_length < bytes)
+                    compactDeadPrefix(buff);
+                if (buff->gap_length < bytes) {
+                    *room = count + bytes;
+                    return GAPBUFFER_REPLICA_OK;
+                }
+                ok = applyStreamedInsertions(buff, data, *used, end, bytes);
+                break;
+            }
+
+            case STREAM_CHECKSUM:
+            ok = record.num == count && record.cursor == cursor && record.hash == hashText(buff);
+            break;
+
+            case STREAM_SNAPSHOT:
+            if (record.num > buff->total) {
+                *room = record.num;
+                return GAPBUFFER_REPLICA_OK;
+            }
+            ok = applySnapshot(buff, &record);
+            break;
+
+            default:
+            {
+                // Add up the run of records, then make the
+                // text and the cursor match the result.
+                size_t before = cursor;
+                size_t after  = count - cursor;
+                StreamRecord next = record;
+                for (;;) {
+                    ok = replayRecord(&next, &before, &after);
+                    if (!ok || parseRecord(data + end, len - end, &next) != RECORD_COMPLETE || next.type != record.type)
+                        break;
+                    end += next.size;
+                }
+                if (!ok)
+                    break;
+
+                size_t removed;
+                switch (record.type) {
+
+                    case STREAM_REMOVE_FORWARDS:
+                    removed = count - cursor - after;
+                    ok = isSymbolBoundary(buff, cursor + removed);
+                    if (ok) {
+                        migrateAroundCursor(buff, 0, removed);
+                        buff->gap_length += removed;
+                        buff->version++;
+                        STREAM(buff, STREAM_REMOVE_FORWARDS, removed, NULL);
+                    }
+                    break;
+
+                    case STREAM_REMOVE_BACKWARDS:
+                    removed = cursor - before;
+                    ok = isSymbolBoundary(buff, before);
+                    if (ok) {
+                        migrateAroundCursor(buff, removed, 0);
+                        buff->pending = 0;
+                        buff->gap_offset -= removed;
+                        buff->gap_length += removed;
+                        buff->version++;
+                        STREAM(buff, STREAM_REMOVE_BACKWARDS, removed, NULL);
+                    }
+                    break;
+
+                    case STREAM_CONSUME:
+                    removed = count - before - after;
+                    ok = isSymbolBoundary(buff, removed);
+                    if (ok)
+                        GapBuffer_consume(buff, removed);
+                    break;
+
+                    case STREAM_MOVE:
+                    ok = isSymbolBoundary(buff, before);
+                    if (ok && before < cursor) {
+                        migrateAroundCursor(buff, cursor - before, 0);
+                        moveBytesAfterGap(buff, cursor - before);
+                    }
+                    if (ok && before > cursor) {
+                        migrateAroundCursor(buff, 0, before - cursor);
+                        moveBytesBeforeGap(buff, before - cursor);
+                    }
+                    break;
+                }
+                break;
+            }
+        }
+
+        if (!ok)
+            buff->diverged = true;
+        *used = end;
+    }
+    return buff->diverged ? GAPBUFFER_REPLICA_DIVERGED : GAPBUFFER_REPLICA_OK;
+}
+
+/* Symbol: GapBuffer_applyStream
+**
+**   Apply to the follower [buff] the records at the start
+**   of [data], received from the stream of the leader.
+**   Only complete records are applied: [used] is set to
+**   the bytes they take, and the rest of [data] should be
+**   passed again once more bytes of the stream arrived.
+**
+**   When the text of the follower stops matching the one
+**   of the leader, which is detected by the checksums or by
+**   an edit that doesn't fit the text, the follower ignores
+**   the records until the next snapshot. Meanwhile the
+**   calls return GAPBUFFER_REPLICA_DIVERGED, and the leader
+**   should be asked for a snapshot.
+**
+** Arguments:
+**   - buff: Gap buffer object receiving the edits. When it
+**           doesn't have enough space, it's relocated and
+**           the pointer is updated.
+**
+** Returns:
+**   GAPBUFFER_REPLICA_INVALID if the stream is malformed,
+**   in which case [used] is set to the bad record, or if
+**   memory ran out. Buffers created by
+**   GapBuffer_createShared can't be relocated, so they
+**   also get it when they run out of space.
+*/
+GapBufferReplicaStatus GapBuffer_applyStream(GapBuffer **buff, const char *data, size_t len, size_t *used)
+{
+    TRACE(*buff, "len", len, NULL, 0);
+    *used = 0;
+    for (;;) {
+        size_t room;
+        GapBufferReplicaStatus status = applyRecords(*buff, data, len, used, &room);
+        if (room == 0 || status == GAPBUFFER_REPLICA_INVALID)
+            return status;
+        if ((*buff)->shared)
+            return GAPBUFFER_REPLICA_INVALID;
+
+        size_t capacity = getRelocationCapacity(room, 0);
+        size_t mem_len = sizeof(GapBuffer) + capacity;
+        void  *mem = malloc(mem_len);
+        COST(allocations, 1);
+        COST(allocated, mem_len);
+        GapBuffer *buff2 = GapBuffer_cloneUsingMemory(mem, mem_len, free, *buff);
+        if (buff2 == NULL)
+            return GAPBUFFER_REPLICA_INVALID;
+        buff2->diverged = (*buff)->diverged;
+        handOverEdits(*buff, buff2);
+        GapBuffer_destroy(*buff);
+        *buff = buff2;
+    }
+}
+#endif
+
+#ifndef GAPBUFFER_NOPOSIX
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+/* Symbol: GapBuffer_readFrom
+**
+**   Read up to [max] bytes from the file descriptor [fd]
+**   directly into the gap, without intermediate copies.
+**   The bytes are validated and inserted at the cursor
+**   like GapBuffer_commit does, so an incomplete UTF-8
+**   sequence at the end of the read is held back until
+**   the next read completes it.
+**
+** Returns:
+**   The number of bytes read, 0 at end of file or -1 on
+**   error. When the bytes aren't valid UTF-8 errno is
+**   set to EILSEQ and the bytes that came before the
+**   first invalid one are still inserted. When the gap
+**   is full it's set to ENOBUFS.
+*/
+ssize_t GapBuffer_readFrom(GapBuffer *buff, int fd, size_t max)
+{
+    TRACE(buff, "fd", fd, "max", max);
+    size_t num = MIN(max, buff->gap_length - buff->pending);
+    if (num == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    struct iovec iov = {
+        .iov_base = GapBuffer_reserve(buff, num),
+        .iov_len  = num,
+    };
+    ssize_t n = readv(fd, &iov, 1);
+    if (n <= 0)
+        return n;
+
+    if (!GapBuffer_commit(buff, n)) {
+        errno = EILSEQ;
+        return -1;
+    }
+    return n;
+}
+
+/* Symbol: GapBufferJob_write
+**   Prepare a job that writes the text of [buff] to [fd]
+**   (to save it, for example). If [fd] is non-blocking and
+**   isn't ready, the step writes nothing and the job keeps
+**   running. Other errors fail the job with errno set.
+*/
+void GapBufferJob_write(GapBufferJob *job, GapBuffer **buff, int fd)
+{
+    initJob(job, GAPBUFFER_JOB_WRITE, buff);
+    job->fd = fd;
+}
+
+PRIVATE GapBufferJobStatus stepWriteJob(GapBufferJob *job, size_t end)
+{
+    while (job->offset < end) {
+        String slice = getTextSlice(*job->buff, job->offset);
+        ssize_t n = write(job->fd, slice.data, MIN(slice.size, end - job->offset));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return GAPBUFFER_JOB_RUNNING;
+            return GAPBUFFER_JOB_FAILED;
+        }
+        job->offset += n;
+    }
+    return job->offset == getByteCount(*job->buff) ? GAPBUFFER_JOB_DONE : GAPBUFFER_JOB_RUNNING;
+}
+
+/* Symbol: GapBufferFollow_open
+**
+**   Start following the file at [path], like "tail -f"
+**   does, from byte [offset]. New bytes are appended to
+**   a gap buffer by GapBufferFollow_poll.
+**
+**   On Linux, inotify is used to wait for the file to
+**   change. Elsewhere GapBufferFollow_poll only checks
+**   for new data, so the caller needs to call it
+**   periodically.
+**
+** Returns:
+**   [false] if the file couldn't be opened.
+**
+** Notes:
+**   - The [path] string must stay valid until the call
+**     to GapBufferFollow_close since it's used to detect
+**     rotations.
+*/
+bool GapBufferFollow_open(GapBufferFollow *follow, const char *path, off_t offset)
+{
+    follow->path = path;
+    follow->offset = offset;
+    follow->appended = 0;
+    follow->moved = false;
+    follow->inotify = -1;
+    follow->watch = -1;
+
+    follow->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (follow->fd < 0)
+        return false;
+
+    struct stat buf;
+    if (fstat(follow->fd, &buf)) {
+        close(follow->fd);
+        return false;
+    }
+    follow->dev = buf.st_dev;
+    follow->ino = buf.st_ino;
+
+#ifdef __linux__
+    follow->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow->inotify >= 0) {
+        // The file itself is watched for appends and
+        // truncations and its directory would be needed
+        // to catch rotations, but those are also detected
+        // by comparing inodes every time the file changes
+        // or the wait times out.
+        follow->watch = inotify_add_watch(follow->inotify, path,
+            IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+    }
+#endif
+    return true;
+}
+
+void GapBufferFollow_close(GapBufferFollow *follow)
+{
+    if (follow->inotify >= 0)
+        close(follow->inotify);
+    if (follow->fd >= 0)
+        close(follow->fd);
+    follow->inotify = -1;
+    follow->fd = -1;
+}
+
+/* Symbol: readEvents
+**
+**   Read all pending notifications of the followed file
+**   without waiting, so that a burst of writes results in
+**   a single wakeup, and remember if the file may have been
+**   renamed or deleted.
+*/
+PRIVATE void readEvents(GapBufferFollow *follow)
+{
+#ifdef __linux__
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(follow->inotify, events, sizeof(events));
+        if (n <= 0)
+            break;
+        for (ssize_t i = 0; i < n; ) {
+            struct inotify_event *event = (struct inotify_event*) (events + i);
+            if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB | IN_IGNORED | IN_Q_OVERFLOW))
+                follow->moved = true;
+            i += sizeof(struct inotify_event) + event->len;
+        }
+
+        // If there was room for one more event, there are
+        // no more.
+        if (n + sizeof(struct inotify_event) + NAME_MAX + 1 <= sizeof(events))
+            break;
+    }
+#else
+    (void) follow;
+#endif
+}
+
+/* Symbol: waitForChanges
+**   Wait up to [timeout] milliseconds for the followed
+**   file to change.
+**
+** Returns:
+**   [false] if there's no way to wait for changes.
+*/
+PRIVATE bool waitForChanges(GapBufferFollow *follow, int timeout)
+{
+#ifdef __linux__
+    if (follow->inotify < 0)
+        return false;
+
+    struct pollfd pfd = { .fd = follow->inotify, .events = POLLIN };
+    if (poll(&pfd, 1, timeout) > 0)
+        readEvents(follow);
+    return true;
+#else
+    (void) follow;
+    (void) timeout;
+    return false;
+#endif
+}
+
+// Waits of GapBufferFollow_poll are cut in slices of this
+// many milliseconds to check whether the file was rotated,
+// since only the open file is watched and the one later
+// created at its path doesn't wake it up.
+#ifndef GAPBUFFER_FOLLOW_RECHECK
+#define GAPBUFFER_FOLLOW_RECHECK 1000
+#endif
+
+PRIVATE bool isRotated(const GapBufferFollow *follow, struct stat *buf)
+{
+    if (stat(follow->path, buf))
+        return false; // Renamed but not replaced yet
+    return buf->st_dev != follow->dev || buf->st_ino != follow->ino;
+}
+
+// Returns whether there's anything for GapBufferFollow_poll
+// to do: new bytes, a truncation or a rotation.
+PRIVATE bool hasChanged(const GapBufferFollow *follow)
+{
+    struct stat buf;
+    if (fstat(follow->fd, &buf) || buf.st_size != follow->offset)
+        return true;
+    return isRotated(follow, &buf);
+}
+
+PRIVATE int64_t getMilliseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Symbol: reopenIfRotated
+**
+**   If the file at the followed path isn't the one that's
+**   open anymore, follow the new one from its start. When
+**   the file is watched, the path is only looked up after
+**   the file was renamed or deleted, which inotify reports.
+**
+** Returns:
+**   [true] if the file was reopened.
+*/
+PRIVATE bool reopenIfRotated(GapBufferFollow *follow)
+{
+    if (follow->watch >= 0) {
+        readEvents(follow);
+        if (!follow->moved)
+            return false;
+    }
+
+    struct stat buf;
+    if (stat(follow->path, &buf))
+        return false; // Renamed but not replaced yet
+
+    if (buf.st_dev == follow->dev && buf.st_ino == follow->ino) {
+        follow->moved = false; // Only its attributes changed
+        return false;
+    }
+
+    int fd = open(follow->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    close(follow->fd);
+    follow->fd = fd;
+    follow->dev = buf.st_dev;
+    follow->ino = buf.st_ino;
+    follow->offset = 0;
+    follow->appended = 0;
+    follow->moved = false;
+
+#ifdef __linux__
+    if (follow->inotify >= 0) {
+        if (follow->watch >= 0)
+            inotify_rm_watch(follow->inotify, follow->watch);
+        follow->watch = inotify_add_watch(follow->inotify, follow->path,
+            IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+    }
+#endif
+    return true;
+}
+
+/* Symbol: reserveForFollow
+**
+**   Make sure there's a free region at the cursor where at
+**   least [num] bytes can be read, growing the buffer if
+**   malloc is available. Bytes held back by a previous
+**   commit are carried over to the new buffer.
+**
+** Returns:
+**   The number of bytes that can be read. Shared buffers
+**   are never grown.
+*/
+PRIVATE size_t reserveForFollow(GapBuffer **buff, size_t num)
+{
+    GapBuffer *b = *buff;
+    if (b->gap_length - b->pending >= num)
+        return num;
+
+    compactDeadPrefix(b);
+
+#ifndef GAPBUFFER_NOMALLOC
+    if (b->gap_length - b->pending < num && !b->shared) {
+
+        size_t capacity = getRelocationCapacity(getByteCount(b), num + b->pending);
+        size_t mem_len = sizeof(GapBuffer) + capacity;
+        void  *mem = malloc(mem_len);
+        GapBuffer *b2 = GapBuffer_cloneUsingMemory(mem, mem_len, free, b);
+        if (b2) {
+            memcpy(b2->data + b2->gap_offset, b->data + b->gap_offset, b->pending);
+            b2->pending = b->pending;
+            handOverEdits(b, b2);
+            GapBuffer_destroy(b);
+            *buff = b = b2;
+        }
+    }
+#endif
+    return MIN(num, b->gap_length - b->pending);
+}
+
+/* Symbol: dropFollowedText
+**
+**   Remove from the end of the text the bytes appended
+**   from the followed file, which was truncated in place,
+**   so that it can be read again from the start.
+*/
+PRIVATE void dropFollowedText(GapBufferFollow *follow, GapBuffer *buff)
+{
+    // The cursor is at the end of the text, after the
+    // appended bytes.
+    size_t num = MIN(follow->appended, buff->gap_offset);
+    buff->pending = 0;
+    migrateAroundCursor(buff, num, 0);
+    removeBytesBeforeGap(buff, num);
+    follow->offset = 0;
+    follow->appended = 0;
+}
+
+/* Symbol: GapBufferFollow_poll
+**
+**   Wait up to [timeout] milliseconds for the followed file
+**   to change (only with inotify), then append all of the
+**   bytes added to it since the last call at the cursor.
+**
+**   Truncations are detected by the file getting smaller
+**   than the current offset and rotations by the path not
+**   referring to the open file anymore. A truncated file
+**   doesn't match the text that came from it anymore, so
+**   that text is removed and the file is read again from
+**   the start. Before switching to a rotated file, the
+**   rest of the old one is appended.
+**
+**   A UTF-8 sequence cut by the end of the file is held back
+**   until the rest of it is written. Lines don't need any
+**   special treatment since the new bytes are appended to
+**   the partial line at the end of the text.
+**
+** Arguments:
+**   - follow: The file to follow.
+**
+**   - buff: Gap buffer object whose text is appended to.
+**           When the gap isn't big enough, the buffer is
+**           relocated and the pointer is updated.
+**
+**   - timeout: Milliseconds to wait for changes. Pass 0 to
+**              check for new bytes without waiting or a
+**              negative value to wait until there are some.
+**
+** Returns:
+**   The number of bytes appended to the text or -1 on
+**   error. If the file contained invalid UTF-8, errno is
+**   set to EILSEQ, the invalid bytes are skipped and the
+**   valid ones around them are still appended.
+**
+** Notes:
+**   - The cursor is moved to the end of the text.
+**   - Truncations assume that the text appended from the
+**     file wasn't edited.
+*/
+ssize_t GapBufferFollow_poll(GapBufferFollow *follow, GapBuffer **buff, int timeout)
+{
+    TRACE(*buff, "timeout", timeout, NULL, 0);
+    // Only wait if there's nothing to read already
+    int64_t start = (timeout > 0) ? getMilliseconds() : 0;
+    while (timeout != 0 && !hasChanged(follow)) {
+        int slice = GAPBUFFER_FOLLOW_RECHECK;
+        if (timeout > 0) {
+            int64_t left = timeout - (getMilliseconds() - start);
+            if (left <= 0)
+                break;
+            slice = MIN(slice, left);
+        }
+        if (!waitForChanges(follow, slice))
+            break;
+    }
+
+    // Shared buffers are never grown, so *buff stays the
+    // same buffer until the write ends.
+    GapBuffer *b = *buff;
+    SHARED_WRITE(b);
+    rehydrate(b);
+    unrotate(b);
+    relocationStep(b, GAPBUFFER_RELOCATION_STEP);
+    size_t after = b->total - b->gap_offset - b->gap_length;
+    if (after > 0) {
+        migrateAroundCursor(b, 0, after);
+        moveBytesBeforeGap(b, after);
+    }
+
+    ssize_t appended = 0;
+    bool invalid = false;
+    for (;;) {
+
+        struct stat buf;
+        if (fstat(follow->fd, &buf))
+            return -1;
+
+        if (buf.st_size < follow->offset)
+            dropFollowedText(follow, *buff);
+
+        while (follow->offset < buf.st_size) {
+
+            size_t num = reserveForFollow(buff, buf.st_size - follow->offset);
+            if (num == 0)
+                break; // No space left
+
+            char  *dst = GapBuffer_reserve(*buff, num);
+            size_t held = (*buff)->pending;
+            ssize_t n = pread(follow->fd, dst, num, follow->offset);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (n == 0)
+                break;
+
+            size_t count = getByteCount(*buff);
+            bool valid = GapBuffer_commit(*buff, n);
+            size_t inserted = getByteCount(*buff) - count;
+            follow->appended += inserted;
+            appended += inserted;
+            follow->offset += n;
+
+            if (!valid) {
+                // Skip the first invalid byte and read again
+                // what came after it.
+                invalid = true;
+                follow->offset -= n + held;
+                follow->offset += inserted + 1;
+            }
+        }
+
+        // The old file is done. Move to the new one if
+        // it was rotated.
+        if (!reopenIfRotated(follow))
+            break;
+        (*buff)->pending = 0;
+    }
+
+    if (invalid) {
+        errno = EILSEQ;
+        return -1;
+    }
+    return appended;
+}
+
+// Bytes validated by GapBuffer_mapFile before their pages
+// are dropped from memory.
+#define GAPBUFFER_MAP_VALIDATION_WINDOW (1 << 20)
+
+PRIVATE size_t getPageSize(void)
+{
+    return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+PRIVATE size_t getMappingSize(size_t total)
+{
+    size_t page = getPageSize();
+    return page + (total + page - 1) / page * page;
+}
+
+PRIVATE void unmapBuffer(void *mem)
+{
+    GapBuffer *buff = mem;
+    munmap(buff->data - getPageSize(), getMappingSize(buff->total));
+}
+
+/* Symbol: GapBuffer_mapFile
+**
+**   Create a gap buffer holding the contents of the file
+**   [fd] without copying it. The file is mapped privately
+**   (copy-on-write) right after the header and the gap is
+**   placed at the end of the text, followed by [extra]
+**   bytes of anonymous memory. Pages of the file are only
+**   copied when an edit moves text over them, so an edit
+**   near the end of a large file touches a few pages.
+**
+**   The file is validated as UTF-8 when the buffer is
+**   created, dropping the pages after reading them so
+**   that they don't stay resident.
+**
+** Returns:
+**   NULL if the file couldn't be mapped or isn't valid
+**   UTF-8. The buffer is destroyed with GapBuffer_destroy.
+**
+** Notes:
+**   - Changes to the file made after the buffer was
+**     created may or may not be visible in untouched
+**     pages, so it shouldn't be modified while it's
+**     being edited.
+**   - Every page the gap moves over becomes a private
+**     copy and stays resident, so moving the cursor to
+**     the start of the text costs as much memory as
+**     reading the whole file. For the same reason mapped
+**     buffers can't be compacted with GapBuffer_compact.
+*/
+GapBuffer *GapBuffer_mapFile(int fd, size_t extra)
+{
+    TRACE(NULL, "fd", fd, "extra", extra);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return NULL;
+    size_t size = st.st_size;
+
+    if (extra > SIZE_MAX - size - 2 * getPageSize())
+        return NULL;
+
+    // The header goes at the end of the first page so that
+    // the text starts at a page boundary, where the file
+    // can be mapped.
+    size_t page = getPageSize();
+    size_t total = size + extra;
+    size_t mapping_size = getMappingSize(total);
+    char *base = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (size > 0 && mmap(base + page, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, mapping_size);
+        return NULL;
+    }
+
+    // The text of the file is already before the gap
+    GapBuffer *buff = (GapBuffer*) (base + page - offsetof(GapBuffer, data));
+    initBuffer(buff, total, unmapBuffer);
+    buff->gap_offset = size;
+    buff->gap_length = extra;
+
+    size_t i = 0;
+    size_t dropped = 0;
+    while (i < size) {
+        uint32_t rune; // Unused
+        int k = getSymbolRune(buff->data + i, size - i, &rune);
+        if (k < 0) {
+            munmap(base, mapping_size);
+            return NULL;
+        }
+        i += k;
+
+        // None of the pages were written yet, so dropping them
+        // is safe. They'll be read again from the file.
+        if (i - dropped >= GAPBUFFER_MAP_VALIDATION_WINDOW) {
+            size_t end = i / page * page;
+            madvise(buff->data + dropped, end - dropped, MADV_DONTNEED);
+            dropped = end;
+        }
+    }
+    return buff;
+}
+
+#ifdef GAPBUFFER_SHARED
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+
+/* Symbol: SharedHeader
+**
+**   Start of the memory of a buffer created by
+**   GapBuffer_createShared, which other processes map
+**   to read the text. It's followed by the GapBuffer
+**   struct, placed so that the text starts on the next
+**   page like for GapBuffer_mapFile.
+**
+**   The fields describing the text are a copy of the ones
+**   of the buffer, protected by a sequence lock: the writer
+**   makes [sequence] odd before changing the memory of the
+**   buffer and even again after updating the copy, and
+**   readers check that it was even and didn't change while
+**   they were reading.
+*/
+#define SHARED_MAGIC "gapbuff"
+
+struct SharedHeader {
+    char   magic[8];
+    size_t data_offset;  // From the start of the mapping
+    size_t mapping_size;
+    size_t depth;        // Nesting of the writer's operations
+
+    _Atomic size_t sequence;
+    _Atomic size_t head;
+    _Atomic size_t gap_offset;
+    _Atomic size_t gap_length;
+    _Atomic size_t total;
+    _Atomic size_t rotated;
+    _Atomic size_t version;
+};
+
+typedef struct SharedHeader SharedHeader;
+
+PRIVATE void unmapShared(void *mem)
+{
+    GapBuffer *buff = mem;
+    munmap(buff->shared, buff->shared->mapping_size);
+}
+
+PRIVATE void publishShared(GapBuffer *buff)
+{
+    SharedHeader *header = buff->shared;
+    atomic_store_explicit(&header->head,       buff->head,       memory_order_relaxed);
+    atomic_store_explicit(&header->gap_offset, buff->gap_offset, memory_order_relaxed);
+    atomic_store_explicit(&header->gap_length, buff->gap_length, memory_order_relaxed);
+    atomic_store_explicit(&header->total,      buff->total,      memory_order_relaxed);
+    atomic_store_explicit(&header->rotated,    buff->rotated,    memory_order_relaxed);
+    atomic_store_explicit(&header->version,    buff->version,    memory_order_relaxed);
+}
+
+PRIVATE GapBuffer *beginSharedWrite(GapBuffer *buff)
+{
+    SharedHeader *header = buff->shared;
+    if (header == NULL)
+        return NULL;
+
+    if (header->depth++ == 0) {
+        size_t sequence = atomic_load_explicit(&header->sequence, memory_order_relaxed);
+        atomic_store_explicit(&header->sequence, sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release); // The odd sequence is visible before any change
+    }
+    return buff;
+}
+
+PRIVATE void endSharedWrite(GapBuffer **buff)
+{
+    if (*buff == NULL)
+        return;
+
+    SharedHeader *header = (*buff)->shared;
+    if (--header->depth == 0) {
+        publishShared(*buff);
+        size_t sequence = atomic_load_explicit(&header->sequence, memory_order_relaxed);
+        atomic_store_explicit(&header->sequence, sequence + 1, memory_order_release);
+    }
+}
+
+/* Symbol: openSharedMemory
+**
+**   Create an anonymous shared memory object of [size]
+**   bytes. Returns a read-write descriptor and stores in
+**   [reader] a read-only one for the other processes, or
+**   -1 if it can't be made, in which case the read-write
+**   one is used for both.
+*/
+PRIVATE int openSharedMemory(size_t size, int *reader)
+{
+    int fd;
+    *reader = -1;
+#ifdef __linux__
+    fd = memfd_create("gap_buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    // The size can't change anymore, so readers can trust
+    // it. The contents can, through the writer's mapping.
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    *reader = open(path, O_RDONLY | O_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/gap_buffer-%ld-%d", (long) getpid(), rand());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return -1;
+    *reader = shm_open(name, O_RDONLY, 0);
+    shm_unlink(name);
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        if (*reader >= 0)
+            close(*reader);
+        return -1;
+    }
+#endif
+    return fd;
+}
+
+/* Symbol: GapBuffer_createShared
+**
+**   Create a gap buffer with [capacity] bytes in shared
+**   memory, which other processes can map with
+**   GapBufferView_open to read the text without copying
+**   it. The descriptor to pass them (through a UNIX
+**   socket or by inheritance) is stored in [fd], and it's
+**   read-only where the system allows it. It's up to the
+**   caller to close it.
+**
+** Notes:
+**   - The capacity can't grow: the functions that relocate
+**     a buffer would move the text out of shared memory.
+**
+**   - Shared buffers can't be compacted.
+*/
+GapBuffer *GapBuffer_createShared(size_t capacity, int *fd)
+{
+    TRACE(NULL, "capacity", capacity, NULL, 0);
+    if (capacity > SIZE_MAX - 2 * getPageSize())
+        return NULL;
+
+    size_t page = getPageSize();
+    size_t mapping_size = getMappingSize(capacity);
+    int reader;
+    int writer = openSharedMemory(mapping_size, &reader);
+    if (writer < 0)
+        return NULL;
+
+    char *base = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, writer, 0);
+    if (base == MAP_FAILED) {
+        close(writer);
+        if (reader >= 0)
+            close(reader);
+        return NULL;
+    }
+    if (reader < 0)
+        reader = writer;
+    else
+        close(writer);
+
+    SharedHeader *header = (SharedHeader*) base;
+    memcpy(header->magic, SHARED_MAGIC, sizeof(header->magic));
+    header->data_offset = page;
+    header->mapping_size = mapping_size;
+    header->depth = 0;
+    atomic_init(&header->sequence, 0);
+
+    GapBuffer *buff = (GapBuffer*) (base + page - offsetof(GapBuffer, data));
+    initBuffer(buff, capacity, unmapShared);
+    buff->shared = header;
+    publishShared(buff);
+
+    *fd = reader;
+    return buff;
+}
+
+struct GapBufferView {
+    const SharedHeader *header;
+    const char *data;
+    size_t      size;
+};
+
+/* Symbol: GapBufferView_open
+**   Map read-only the buffer shared through [fd] by
+**   GapBuffer_createShared. The descriptor can be closed
+**   afterwards.
+**
+** Returns:
+**   NULL if [fd] can't be mapped or isn't a shared buffer.
+*/
+GapBufferView *GapBufferView_open(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(SharedHeader))
+        return NULL;
+
+    GapBufferView *view = malloc(sizeof(GapBufferView));
+    if (view == NULL)
+        return NULL;
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(view);
+        return NULL;
+    }
+
+    const SharedHeader *header = base;
+    if (memcmp(header->magic, SHARED_MAGIC, sizeof(header->magic))
+        || header->mapping_size != (size_t) st.st_size
+        || header->data_offset > header->mapping_size
+        || atomic_load(&header->total) > header->mapping_size - header->data_offset) {
+        munmap(base, st.st_size);
+        free(view);
+        return NULL;
+    }
+    view->header = header;
+    view->data = (const char*) base + header->data_offset;
+    view->size = st.st_size;
+    return view;
+}
+
+void GapBufferView_close(GapBufferView *view)
+{
+    munmap((void*) view->header, view->size);
+    free(view);
+}
+
+/* Symbol: GapBufferView_getVersion
+**   Returns the version of the text of the shared buffer
+**   (see GapBuffer_getVersion), which tells readers if
+**   it changed since they last read it.
+*/
+size_t GapBufferView_getVersion(const GapBufferView *view)
+{
+    return atomic_load_explicit(&view->header->version, memory_order_acquire);
+}
+
+/* Symbol: GapBufferViewIter_init
+**
+**   Start iterating over the lines of the text of a shared
+**   buffer, like GapBufferIter_init. The lines point into
+**   the shared memory. If the writer is changing the buffer,
+**   it waits for it to be done.
+**
+**   Since the writer doesn't wait for the readers, the text
+**   can change while it's being iterated. The lines read
+**   are only guaranteed to be consistent if
+**   GapBufferViewIter_isValid returns true after reading
+**   them. Otherwise the iteration must be started again.
+*/
+void GapBufferViewIter_init(GapBufferViewIter *iter, const GapBufferView *view)
+{
+    const SharedHeader *header = view->header;
+    size_t total_size = view->size - header->data_offset;
+    for (;;) {
+        size_t sequence = atomic_load_explicit(&header->sequence, memory_order_acquire);
+        if (sequence & 1) {
+            sched_yield();
+            continue;
+        }
+
+        size_t head       = atomic_load_explicit(&header->head,       memory_order_relaxed);
+        size_t gap_offset = atomic_load_explicit(&header->gap_offset, memory_order_relaxed);
+        size_t gap_length = atomic_load_explicit(&header->gap_length, memory_order_relaxed);
+        size_t total      = atomic_load_explicit(&header->total,      memory_order_relaxed);
+        bool   rotated    = atomic_load_explicit(&header->rotated,    memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&header->sequence, memory_order_relaxed) != sequence)
+            continue;
+
+        // A writer that's not a GapBuffer could store
+        // anything in the header.
+        if (head > gap_offset || gap_offset > total || gap_length > total - gap_offset || total > total_size)
+            head = gap_offset = gap_length = total = 0;
+
+        String before = { .data=view->data + head, .size=gap_offset - head };
+        String after  = { .data=view->data + gap_offset + gap_length, .size=total - gap_offset - gap_length };
+        String first  = rotated ? after : before;
+        String second = rotated ? before : after;
+        iter->first = first.data;
+        iter->first_len = first.size;
+        iter->second = second.data;
+        iter->second_len = second.size;
+        iter->view = view;
+        iter->sequence = sequence;
+        break;
+    }
+
+    iter->iter.buff = NULL;
+    iter->iter.crossed_gap = false;
+    iter->iter.cur = 0;
+    iter->iter.mem = NULL;
+}
+
+bool GapBufferViewIter_next(GapBufferViewIter *iter, GapBufferLine *line)
+{
+    String first  = { .data=iter->first,  .size=iter->first_len };
+    String second = { .data=iter->second, .size=iter->second_len };
+    return iterateSegments(&iter->iter, first, second, line);
+}
+
+/* Symbol: GapBufferViewIter_isValid
+**   Returns true if the text didn't change since the
+**   iteration started, so that the lines read so far are
+**   consistent.
+*/
+bool GapBufferViewIter_isValid(const GapBufferViewIter *iter)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&iter->view->header->sequence, memory_order_relaxed) == iter->sequence;
+}
+#endif
+
+#ifndef GAPBUFFER_NOMALLOC
+/* Symbol: GapBuffer_compact
+**
+**   Compress the text of an idle buffer and give the
+**   memory of the buffer (gap included) back to the system
+**   until it's used again. The buffer keeps its address
+**   and any later call on it decompresses the text back
+**   in place before doing anything else.
+**
+** Arguments:
+**   - level: Compression effort, from 0 (fastest) to 12.
+**            Decompression speed doesn't depend on it.
+**
+** Returns:
+**   [false] if there wasn't memory to compress the text
+**   or the buffer holds an incomplete UTF-8 sequence
+**   written through GapBuffer_reserve, or if the buffer
+**   was created by GapBuffer_createShared or
+**   GapBuffer_mapFile.
+**
+** Notes:
+**   - Only whole pages of the buffer's memory can be
+**     given back, so it's pointless for small buffers.
+*/
+bool GapBuffer_compact(GapBuffer *buff, int level)
+{
+    TRACE(buff, "level", level, NULL, 0);
+    if (buff->compressed)
+        return true;
+
+    // Readers in other processes map the memory of shared
+    // buffers, so it can't be given back.
+    if (buff->shared)
+        return false;
+
+    // Decompressing the text back in place would write every
+    // page of a mapped file, making them all private copies.
+    if (buff->free == unmapBuffer)
+        return false;
+
+    unrotate(buff);
+    migrateBytes(buff, SIZE_MAX, SIZE_MAX);
+    if (buff->pending > 0)
+        return false;
+
+    String before = getStringBeforeGap(buff);
+    String after  = getStringAfterGap(buff);
+
+    LZState *state = malloc(sizeof(LZState));
+    char *blob = malloc(getCompressBound(before.size) + getCompressBound(after.size));
+    if (state == NULL || blob == NULL) {
+        free(state);
+        free(blob);
+        return false;
+    }
+
+    size_t n = compressLZ(before.data, before.size, blob, level, state);
+    size_t m = compressLZ(after.data, after.size, blob + n, level, state);
+    free(state);
+
+    char *shrunk = realloc(blob, n + m);
+    if (shrunk)
+        blob = shrunk;
+
+    buff->compressed = blob;
+    buff->compressed_before = n;
+    buff->compressed_size = n + m;
+    dropPages(buff);
+    return true;
+}
+
+/* Symbol: GapBuffer_getCompactedSize
+**   Returns the size of the compressed text of a buffer
+**   compacted with GapBuffer_compact, or 0 if it isn't
+**   compacted (anymore).
+*/
+size_t GapBuffer_getCompactedSize(const GapBuffer *buff)
+{
+    return buff->compressed ? buff->compressed_size : 0;
+}
+#endif
+#endif
+
+#if !defined(GAPBUFFER_NOMALLOC) && !defined(GAPBUFFER_NOPOSIX)
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/* Symbol: ChunkedBuffer
+**
+**   A text stored as a sequence of small gap buffers (the
+**   chunks), meant for texts that don't fit in memory.
+**
+**   Only some of the chunks are kept in memory, within a
+**   budget given at creation time. When the budget is
+**   exceeded, the least recently used chunks are evicted
+**   using the CLOCK algorithm. Chunks that weren't changed
+**   since they were read from the file being edited (the
+**   source) are just freed, while the others are written
+**   to an anonymous temporary file (the spill file) first.
+**   Evicted chunks are read back when they're needed by
+**   an edit, an iteration or a search.
+**
+**   Like for MultiGapBuffer, offsets are expressed in bytes.
+**
+**   Many threads can edit the text at the same time through
+**   locked ranges (see ChunkedBufferRange).
+**
+** Notes:
+**   - The source file must not be modified while it's
+**     being edited.
+**   - Apart from the ones counting the text, the functions
+**     not involving ranges must not be called while ranges
+**     are locked.
+*/
+
+// Capacity of each chunk
+#ifndef GAPBUFFER_CHUNK_SIZE
+#define GAPBUFFER_CHUNK_SIZE (64 * 1024)
+#endif
+
+// Chunks are filled up to this many bytes when they're
+// created, to leave space for edits.
+#define CHUNK_FILL (GAPBUFFER_CHUNK_SIZE / 4 * 3)
+
+// Chunks can't be split while ranges are locked, so they
+// grow instead, but not beyond this many bytes.
+#ifndef GAPBUFFER_CHUNK_MAX
+#define GAPBUFFER_CHUNK_MAX (16 * GAPBUFFER_CHUNK_SIZE)
+#endif
+
+typedef enum {
+    BACKING_NONE,
+    BACKING_SOURCE,
+    BACKING_SPILL,
+} ChunkBacking;
+
+typedef struct {
+    GapBuffer   *buff;       // NULL when evicted
+    size_t       bytes;
+    size_t       lines;      // Number of newlines
+    size_t       symbols;    // Number of code points
+    ChunkBacking backing;    // Where the chunk is stored when evicted
+    off_t        backing_offset;
+    bool         dirty;      // The chunk changed since it was last stored
+    bool         referenced; // Used by the CLOCK algorithm
+    int          pins;       // Pinned chunks can't be evicted
+    size_t       slot;       // Slot in the spill file or SIZE_MAX
+    bool         locked;     // Part of a locked range
+    size_t       memory;     // Bytes of memory counted in the resident total
+} Chunk;
+
+struct ChunkedBuffer {
+    Chunk  *chunks;
+    size_t  num_chunks;
+    size_t  max_chunks;
+
+    size_t  budget;   // Maximum number of bytes of resident chunks
+    size_t  resident; // Bytes of memory of resident chunks
+    size_t  clock;    // Hand of the CLOCK algorithm
+
+    int     source_fd;
+    int     spill_fd;
+
+    // The spill file is divided in slots of GAPBUFFER_CHUNK_SIZE
+    // bytes. Chunks keep their slot until they're dropped.
+    size_t  num_slots;
+    size_t *free_slots;
+    size_t  num_free_slots;
+
+    size_t  bytes;
+    size_t  lines;
+    size_t  symbols;
+
+    // The chunk found by the last lookup and the offset
+    // of its first byte. Lookups start from here, so that
+    // edits close to each other are cheap to locate.
+    size_t  hint_chunk;
+    size_t  hint_offset;
+
+    // Guards the chunk table and the counts while ranges
+    // are locked.
+    pthread_mutex_t lock;
+    pthread_cond_t  unlocked;
+    size_t  ranges;     // Number of locked ranges
+    bool    unbalanced; // Some chunks are oversized or empty
+};
+
+#define CHUNK_MEMORY (sizeof(GapBuffer) + GAPBUFFER_CHUNK_SIZE)
+
+/* Symbol: updateChunkMemory
+**
+**   Count in the resident total the memory the [i]-th chunk
+**   takes now. Chunks are created with CHUNK_MEMORY bytes
+**   but grow in locked ranges, up to GAPBUFFER_CHUNK_MAX
+**   bytes, until they're split again.
+*/
+PRIVATE void updateChunkMemory(ChunkedBuffer *cb, Chunk *chunk)
+{
+    size_t memory = chunk->buff ? sizeof(GapBuffer) + chunk->buff->total : 0;
+    cb->resident += memory - chunk->memory;
+    chunk->memory = memory;
+}
+
+PRIVATE size_t countLines(const char *str, size_t len)
+{
+    size_t count = 0;
+    const char *end = str + len;
+    while ((str = memchr(str, '\n', end - str))) {
+        count++;
+        str++;
+    }
+    return count;
+}
+
+PRIVATE size_t countSymbols(const char *str, size_t len)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++)
+        if (!isSymbolAuxiliaryByte(str[i]))
+            count++;
+    return count;
+}
+
+PRIVATE void releaseSlot(ChunkedBuffer *cb, Chunk *chunk)
+{
+    if (chunk->slot == SIZE_MAX)
+        return;
+
+    // There are never more free slots than slots, so
+    // the array was sized when the slot was created.
+    cb->free_slots[cb->num_free_slots++] = chunk->slot;
+    chunk->slot = SIZE_MAX;
+}
+
+PRIVATE bool acquireSlot(ChunkedBuffer *cb, Chunk *chunk)
+{
+    if (chunk->slot != SIZE_MAX)
+        return true;
+
+    if (cb->spill_fd < 0) {
+        const char *dir = getenv("TMPDIR");
+        if (dir == NULL)
+            dir = "/tmp";
+#ifdef O_TMPFILE
+        cb->spill_fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+        if (cb->spill_fd < 0) {
+            // No O_TMPFILE. Create a file and unlink it
+            // right away, which has the same effect.
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/gap_buffer_XXXXXX", dir);
+            cb->spill_fd = mkstemp(path);
+            if (cb->spill_fd < 0)
+                return false;
+            unlink(path);
+        }
+    }
+
+    if (cb->num_free_slots > 0) {
+        chunk->slot = cb->free_slots[--cb->num_free_slots];
+        return true;
+    }
+
+    size_t *free_slots = realloc(cb->free_slots, (cb->num_slots + 1) * sizeof(size_t));
+    if (free_slots == NULL)
+        return false;
+    cb->free_slots = free_slots;
+    chunk->slot = cb->num_slots++;
+    return true;
+}
+
+/* Symbol: evictChunk
+**
+**   Free the memory of a resident chunk, writing it to the
+**   spill file first if it changed since it was last read.
+**
+** Returns:
+**   [false] if the chunk couldn't be written.
+*/
+PRIVATE bool evictChunk(ChunkedBuffer *cb, Chunk *chunk)
+{
+    if (chunk->dirty || chunk->backing == BACKING_NONE) {
+
+        if (!acquireSlot(cb, chunk))
+            return false;
+
+        String before = getStringBeforeGap(chunk->buff);
+        String after  = getStringAfterGap(chunk->buff);
+        struct iovec iov[2] = {
+            { .iov_base = (void*) before.data, .iov_len = before.size },
+            { .iov_base = (void*) after.data,  .iov_len = after.size  },
+        };
+        off_t offset = (off_t) chunk->slot * GAPBUFFER_CHUNK_SIZE;
+        if (pwritev(cb->spill_fd, iov, 2, offset) != (ssize_t) chunk->bytes)
+            return false;
+
+        chunk->backing = BACKING_SPILL;
+        chunk->backing_offset = offset;
+        chunk->dirty = false;
+    }
+
+    GapBuffer_destroy(chunk->buff);
+    chunk->buff = NULL;
+    updateChunkMemory(cb, chunk);
+    return true;
+}
+
+/* Symbol: makeRoomForChunk
+**
+**   Evict chunks until there's space in the budget for one
+**   more. If all resident chunks are pinned or can't be
+**   written, the budget is exceeded.
+**
+**   When ranges are locked it's called with the lock held,
+**   and the chunks of the ranges are skipped without
+**   looking at their memory, which their writers may be
+**   replacing.
+*/
+PRIVATE void makeRoomForChunk(ChunkedBuffer *cb)
+{
+    if (cb->budget == 0)
+        return;
+
+    // Each chunk is visited at most twice: the first time
+    // its reference bit is cleared and the second time
+    // it's evicted.
+    size_t steps = 2 * cb->num_chunks;
+    while (cb->resident + CHUNK_MEMORY > cb->budget && steps-- > 0) {
+
+        Chunk *chunk = &cb->chunks[cb->clock];
+        cb->clock = (cb->clock + 1) % cb->num_chunks;
+
+        // Chunks that grew in a locked range don't fit in a
+        // slot of the spill file until they're split.
+        if (chunk->locked || chunk->pins > 0 || chunk->buff == NULL || chunk->bytes > GAPBUFFER_CHUNK_SIZE)
+            continue;
+
+        if (chunk->referenced) {
+            chunk->referenced = false;
+            continue;
+        }
+
+        evictChunk(cb, chunk);
+    }
+}
+
+/* Symbol: faultInChunk
+**   Make sure the [i]-th chunk is in memory, reading it
+**   from where it was stored if it was evicted.
+*/
+PRIVATE bool faultInChunk(ChunkedBuffer *cb, size_t i)
+{
+    Chunk *chunk = &cb->chunks[i];
+    chunk->referenced = true;
+    if (chunk->buff)
+        return true;
+
+    chunk->pins++; // Don't pick this chunk for eviction
+    makeRoomForChunk(cb);
+    chunk->pins--;
+
+    GapBuffer *buff = GapBuffer_create(GAPBUFFER_CHUNK_SIZE);
+    if (buff == NULL)
+        return false;
+
+    int fd = (chunk->backing == BACKING_SOURCE) ? cb->source_fd : cb->spill_fd;
+    size_t copied = 0;
+    while (copied < chunk->bytes) {
+        ssize_t n = pread(fd, buff->data + copied, chunk->bytes - copied, chunk->backing_offset + copied);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            GapBuffer_destroy(buff);
+            return false;
+        }
+        copied += n;
+    }
+    buff->gap_offset = chunk->bytes;
+    buff->gap_length -= chunk->bytes;
+
+    chunk->buff = buff;
+    chunk->dirty = false;
+    updateChunkMemory(cb, chunk);
+    return true;
+}
+
+PRIVATE bool pinChunk(ChunkedBuffer *cb, size_t i)
+{
+    if (!faultInChunk(cb, i))
+        return false;
+    cb->chunks[i].pins++;
+    return true;
+}
+
+PRIVATE void unpinChunk(ChunkedBuffer *cb, size_t i)
+{
+    cb->chunks[i].pins--;
+}
+
+/* Symbol: createChunk
+**   Insert a new empty chunk at index [i], which is kept
+**   in memory until the next eviction.
+*/
+PRIVATE bool createChunk(ChunkedBuffer *cb, size_t i)
+{
+    makeRoomForChunk(cb);
+
+    if (cb->num_chunks == cb->max_chunks) {
+        size_t max_chunks = MAX(2 * cb->max_chunks, 16);
+        Chunk *chunks = realloc(cb->chunks, max_chunks * sizeof(Chunk));
+        if (chunks == NULL)
+            return false;
+        cb->chunks = chunks;
+        cb->max_chunks = max_chunks;
+    }
+
+    GapBuffer *buff = GapBuffer_create(GAPBUFFER_CHUNK_SIZE);
+    if (buff == NULL)
+        return false;
+
+    memmove(&cb->chunks[i+1], &cb->chunks[i], (cb->num_chunks - i) * sizeof(Chunk));
+    cb->num_chunks++;
+
+    cb->chunks[i] = (Chunk) {
+        .buff = buff,
+        .backing = BACKING_NONE,
+        .dirty = true,
+        .referenced = true,
+        .slot = SIZE_MAX,
+    };
+    updateChunkMemory(cb, &cb->chunks[i]);
+    return true;
+}
+
+PRIVATE void dropChunk(ChunkedBuffer *cb, size_t i)
+{
+    Chunk *chunk = &cb->chunks[i];
+    if (chunk->buff) {
+        GapBuffer_destroy(chunk->buff);
+        chunk->buff = NULL;
+        updateChunkMemory(cb, chunk);
+    }
+    releaseSlot(cb, chunk);
+
+    memmove(&cb->chunks[i], &cb->chunks[i+1], (cb->num_chunks - i - 1) * sizeof(Chunk));
+    cb->num_chunks--;
+    if (cb->clock >= cb->num_chunks)
+        cb->clock = 0;
+}
+
+/* Symbol: ChunkedBuffer_create
+**
+**   Create an empty chunked buffer that keeps at most
+**   [budget] bytes of chunks in memory. A budget of 0
+**   means no limit.
+*/
+ChunkedBuffer *ChunkedBuffer_create(size_t budget)
+{
+    ChunkedBuffer *cb = malloc(sizeof(ChunkedBuffer));
+    if (cb == NULL)
+        return NULL;
+
+    *cb = (ChunkedBuffer) {
+        .budget = budget,
+        .source_fd = -1,
+        .spill_fd = -1,
+    };
+
+    if (!createChunk(cb, 0)) {
+        free(cb);
+        return NULL;
+    }
+    pthread_mutex_init(&cb->lock, NULL);
+    pthread_cond_init(&cb->unlocked, NULL);
+    return cb;
+}
+
+void ChunkedBuffer_destroy(ChunkedBuffer *cb)
+{
+    for (size_t i = 0; i < cb->num_chunks; i++)
+        if (cb->chunks[i].buff)
+            GapBuffer_destroy(cb->chunks[i].buff);
+    if (cb->source_fd >= 0)
+        close(cb->source_fd);
+    if (cb->spill_fd >= 0)
+        close(cb->spill_fd);
+    pthread_cond_destroy(&cb->unlocked);
+    pthread_mutex_destroy(&cb->lock);
+    free(cb->free_slots);
+    free(cb->chunks);
+    free(cb);
+}
+
+// The counts are read with the lock held since writers
+// of ranges may be adding to them.
+PRIVATE size_t readCount(const ChunkedBuffer *cb, const size_t *count)
+{
+    pthread_mutex_t *lock = (pthread_mutex_t*) &cb->lock;
+    pthread_mutex_lock(lock);
+    size_t value = *count;
+    pthread_mutex_unlock(lock);
+    return value;
+}
+
+size_t ChunkedBuffer_getByteCount(const ChunkedBuffer *cb)
+{
+    return readCount(cb, &cb->bytes);
+}
+
+size_t ChunkedBuffer_getLineCount(const ChunkedBuffer *cb)
+{
+    return readCount(cb, &cb->lines) + 1;
+}
+
+size_t ChunkedBuffer_getSymbolCount(const ChunkedBuffer *cb)
+{
+    return readCount(cb, &cb->symbols);
+}
+
+size_t ChunkedBuffer_getResidentBytes(const ChunkedBuffer *cb)
+{
+    return readCount(cb, &cb->resident);
+}
+
+/* Symbol: readChunks
+**
+**   Build the chunks of an empty chunked buffer by reading
+**   its source file in order. Used when the file can't be
+**   mapped.
+*/
+PRIVATE bool readChunks(ChunkedBuffer *cb)
+{
+    off_t offset = 0;
+    for (;;) {
+
+        if (!createChunk(cb, cb->num_chunks))
+            return false;
+
+        Chunk *chunk = &cb->chunks[cb->num_chunks-1];
+        GapBuffer *buff = chunk->buff;
+
+        ssize_t n;
+        do
+            n = pread(cb->source_fd, buff->data, CHUNK_FILL, offset);
+        while (n < 0 && errno == EINTR);
+        if (n < 0)
+            return false;
+
+        // Find the longest valid prefix, leaving any UTF-8
+        // sequence cut by the end of the read to the next
+        // chunk.
+        size_t i = 0;
+        while (i < (size_t) n) {
+            uint32_t rune; // Unused
+            int k = getSymbolRune(buff->data + i, n - i, &rune);
+            if (k < 0)
+                break;
+            i += k;
+        }
+        if (i < (size_t) n && getIncompleteSymbolLength(buff->data + i, n - i) != n - i)
+            return false; // Invalid UTF-8
+
+        if (i == 0) {
+            dropChunk(cb, cb->num_chunks-1);
+            if (n == 0)
+                return true;
+            return false; // File ends with an incomplete sequence
+        }
+
+        buff->gap_offset = i;
+        buff->gap_length -= i;
+        chunk->bytes = i;
+        chunk->lines = countLines(buff->data, i);
+        chunk->symbols = countSymbols(buff->data, i);
+        chunk->backing = BACKING_SOURCE;
+        chunk->backing_offset = offset;
+        chunk->dirty = false;
+
+        cb->bytes += i;
+        cb->lines += chunk->lines;
+        cb->symbols += chunk->symbols;
+        offset += i;
+    }
+}
+
+// Chunks of a mapped file start at multiples of CHUNK_FILL,
+// moved forward to the start of a UTF-8 sequence.
+PRIVATE size_t getChunkStart(const char *text, size_t size, size_t i)
+{
+    return alignToSymbol(text, size, MIN(i * CHUNK_FILL, size));
+}
+
+typedef struct {
+    Chunk      *chunks;
+    const char *text;
+    size_t      size;
+    size_t      first;
+    size_t      last;
+    bool        valid;
+} IndexJob;
+
+/* Symbol: runIndexJob
+**
+**   Validate the chunks from [first] to [last] (excluded)
+**   of a mapped file and set their counts. The chunks are
+**   left evicted, so they're only read when needed.
+*/
+PRIVATE void *runIndexJob(void *arg)
+{
+    IndexJob *job = arg;
+    job->valid = true;
+    for (size_t i = job->first; i < job->last; i++) {
+
+        size_t start = getChunkStart(job->text, job->size, i);
+        size_t end   = getChunkStart(job->text, job->size, i+1);
+
+        TextCounts counts;
+        if (!scanText(job->text + start, end - start, &counts)) {
+            job->valid = false;
+            break;
+        }
+
+        job->chunks[i] = (Chunk) {
+            .bytes = end - start,
+            .lines = counts.lines,
+            .symbols = counts.symbols,
+            .backing = BACKING_SOURCE,
+            .backing_offset = start,
+            .slot = SIZE_MAX,
+        };
+    }
+    return NULL;
+}
+
+/* Symbol: indexChunks
+**
+**   Build the chunks of an empty chunked buffer from the
+**   mapping [text] of its source file, without reading
+**   them in memory. Since the position of each chunk only
+**   depends on the bytes around it, the chunks are split
+**   between GAPBUFFER_THREADS threads when the file is
+**   big, and each thread validates and counts its own.
+**   Their counts are then summed up in order.
+*/
+PRIVATE bool indexChunks(ChunkedBuffer *cb, const char *text, size_t size)
+{
+    size_t num = (size + CHUNK_FILL - 1) / CHUNK_FILL;
+    if (num > cb->max_chunks) {
+        Chunk *chunks = realloc(cb->chunks, num * sizeof(Chunk));
+        if (chunks == NULL)
+            return false;
+        cb->chunks = chunks;
+        cb->max_chunks = num;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise((void*) text, size, MADV_SEQUENTIAL);
+#endif
+
+    IndexJob job = {
+        .chunks = cb->chunks,
+        .text = text,
+        .size = size,
+        .first = 0,
+        .last = num,
+    };
+
+#if GAPBUFFER_THREADS > 1
+    if (size >= GAPBUFFER_PARALLEL_THRESHOLD) {
+        IndexJob jobs[GAPBUFFER_THREADS];
+        for (int i = 0; i < GAPBUFFER_THREADS; i++) {
+            jobs[i] = job;
+            jobs[i].first = num * i / GAPBUFFER_THREADS;
+            jobs[i].last  = num * (i+1) / GAPBUFFER_THREADS;
+        }
+        runJobs(runIndexJob, jobs, sizeof(IndexJob));
+        for (int i = 0; i < GAPBUFFER_THREADS; i++)
+            if (!jobs[i].valid)
+                return false;
+    } else
+#endif
+    {
+        runIndexJob(&job);
+        if (!job.valid)
+            return false;
+    }
+
+    // The last chunk is empty when the file ends with a
+    // sequence that starts before its nominal offset.
+    if (cb->chunks[num-1].bytes == 0)
+        num--;
+    cb->num_chunks = num;
+
+    for (size_t i = 0; i < num; i++) {
+        cb->bytes   += cb->chunks[i].bytes;
+        cb->lines   += cb->chunks[i].lines;
+        cb->symbols += cb->chunks[i].symbols;
+    }
+    return true;
+}
+
+/* Symbol: ChunkedBuffer_loadFile
+**
+**   Append the contents of the file [fd] to an empty chunked
+**   buffer. The file is scanned once to validate it and
+**   count the bytes, lines and code points of each chunk,
+**   but chunks are only read in memory when needed and
+**   unchanged ones are read back from the file, so [fd] is
+**   kept open (it's duplicated) until the buffer is
+**   destroyed. Regular files are mapped and scanned in
+**   parallel if the library is built with threads.
+**
+** Returns:
+**   [false] if the file couldn't be read or isn't valid
+**   UTF-8. In that case the buffer is left empty.
+*/
+bool ChunkedBuffer_loadFile(ChunkedBuffer *cb, int fd)
+{
+    if (cb->bytes > 0 || cb->source_fd >= 0)
+        return false;
+
+    cb->source_fd = dup(fd);
+    if (cb->source_fd < 0)
+        return false;
+
+    // The buffer starts with one empty chunk, which is
+    // replaced by the ones holding the file.
+    dropChunk(cb, 0);
+
+    struct stat buf;
+    void *text = MAP_FAILED;
+    if (fstat(cb->source_fd, &buf) == 0 && S_ISREG(buf.st_mode) && buf.st_size > 0)
+        text = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, cb->source_fd, 0);
+
+    bool ok;
+    if (text == MAP_FAILED)
+        ok = readChunks(cb);
+    else {
+        ok = indexChunks(cb, text, buf.st_size);
+        munmap(text, buf.st_size);
+    }
+    if (!ok)
+        goto fail;
+
+    if (cb->num_chunks == 0 && !createChunk(cb, 0))
+        goto fail;
+
+    cb->hint_chunk = 0;
+    cb->hint_offset = 0;
+    return true;
+
+fail:
+    while (cb->num_chunks > 0)
+        dropChunk(cb, cb->num_chunks-1);
+    close(cb->source_fd);
+    cb->source_fd = -1;
+    cb->bytes = 0;
+    cb->lines = 0;
+    cb->symbols = 0;
+    createChunk(cb, 0);
+    cb->hint_chunk = 0;
+    cb->hint_offset = 0;
+    return false;
+}
+
+/* Symbol: locateChunk
+**
+**   Find the chunk holding the byte at offset [pos] and
+**   the offset of its first byte. If [pos] is the end of
+**   the text, the last chunk is returned.
+*/
+PRIVATE size_t locateChunk(ChunkedBuffer *cb, size_t pos, size_t *start)
+{
+    size_t i = cb->hint_chunk;
+    size_t offset = cb->hint_offset;
+    if (i >= cb->num_chunks) {
+        i = 0;
+        offset = 0;
+    }
+
+    while (pos < offset) {
+        i--;
+        offset -= cb->chunks[i].bytes;
+    }
+    while (pos >= offset + cb->chunks[i].bytes && i+1 < cb->num_chunks) {
+        offset += cb->chunks[i].bytes;
+        i++;
+    }
+
+    cb->hint_chunk = i;
+    cb->hint_offset = offset;
+    *start = offset;
+    return i;
+}
+
+/* Symbol: moveChunkGap
+**   Move the gap of a chunk to byte offset [pos]. Chunks
+**   never have consumed bytes, so that's the offset in
+**   their memory too.
+*/
+PRIVATE void moveChunkGap(GapBuffer *buff, size_t pos)
+{
+    if (pos < buff->gap_offset)
+        moveBytesAfterGap(buff, buff->gap_offset - pos);
+    else
+        moveBytesBeforeGap(buff, pos - buff->gap_offset);
+}
+
+// Byte at offset [off] of the text of a resident chunk
+PRIVATE char getChunkByte(GapBuffer *buff, size_t off)
+{
+    if (off < buff->gap_offset)
+        return buff->data[off];
+    return buff->data[off + buff->gap_length];
+}
+
+/* Symbol: getChunkedByte
+**   Returns the byte at offset [pos], which must be lower
+**   than the byte count, or 0 if it couldn't be read.
+*/
+PRIVATE char getChunkedByte(ChunkedBuffer *cb, size_t pos)
+{
+    size_t start;
+    size_t i = locateChunk(cb, pos, &start);
+    if (!faultInChunk(cb, i))
+        return 0;
+    return getChunkByte(cb->chunks[i].buff, pos - start);
+}
+
+/* Symbol: appendToChunk
+**   Insert [str] at the end of the [i]-th chunk, which
+**   must be resident and have enough space.
+*/
+PRIVATE void appendToChunk(ChunkedBuffer *cb, size_t i, const char *str, size_t len)
+{
+    Chunk *chunk = &cb->chunks[i];
+    moveChunkGap(chunk->buff, chunk->bytes);
+    insertBytesBeforeCursor(chunk->buff, (String) { .data=str, .size=len });
+
+    size_t lines = countLines(str, len);
+    size_t symbols = countSymbols(str, len);
+    chunk->bytes += len;
+    chunk->lines += lines;
+    chunk->symbols += symbols;
+    chunk->dirty = true;
+    cb->bytes += len;
+    cb->lines += lines;
+    cb->symbols += symbols;
+}
+
+/* Symbol: ChunkedBuffer_insertString
+**
+**   Insert a UTF8-encoded string at byte offset [pos]. If
+**   the chunk at that offset doesn't have enough space,
+**   it's split and new chunks are created for the string.
+**
+** Returns:
+**   [false] if the string isn't valid UTF-8 or a chunk
+**   couldn't be read or allocated. In that case the text
+**   is left unchanged.
+*/
+bool ChunkedBuffer_insertString(ChunkedBuffer *cb, size_t pos, const char *str, size_t len)
+{
+    if (!isValidUTF8(str, len)) {
+        PROBE2(invalid_utf8, cb, len);
+        return false;
+    }
+
+    if (pos > cb->bytes)
+        pos = cb->bytes;
+    while (pos > 0 && pos < cb->bytes && isSymbolAuxiliaryByte(getChunkedByte(cb, pos)))
+        pos--;
+
+    size_t start;
+    size_t i = locateChunk(cb, pos, &start);
+    if (!pinChunk(cb, i))
+        return false;
+
+    Chunk *chunk = &cb->chunks[i];
+    GapBuffer *buff = chunk->buff;
+    size_t off = pos - start;
+
+    if (len <= buff->gap_length) {
+        moveChunkGap(buff, off);
+        insertBytesBeforeCursor(buff, (String) { .data=str, .size=len });
+        size_t lines = countLines(str, len);
+        size_t symbols = countSymbols(str, len);
+        chunk->bytes += len;
+        chunk->lines += lines;
+        chunk->symbols += symbols;
+        chunk->dirty = true;
+        cb->bytes += len;
+        cb->lines += lines;
+        cb->symbols += symbols;
+        unpinChunk(cb, i);
+        return true;
+    }
+
+    // Create all the chunks the string needs before changing
+    // any text, so that if one can't be allocated the buffer
+    // is left as it was. They're pinned so that creating the
+    // next one doesn't evict them.
+    size_t tail = chunk->bytes - off;
+    size_t num = cutAtSymbol(str, len, buff->gap_length + tail);
+    size_t needed = (tail > 0);
+    for (size_t n = num; n < len; needed++)
+        n += cutAtSymbol(str + n, len - n, CHUNK_FILL);
+
+    for (size_t j = i+1; j <= i+needed; j++) {
+        if (!createChunk(cb, j)) {
+            while (j-- > i+1)
+                dropChunk(cb, j);
+            unpinChunk(cb, i);
+            return false;
+        }
+        cb->chunks[j].pins++;
+    }
+    chunk = &cb->chunks[i];
+
+    // Move the text following [pos] to the last new chunk,
+    // then fill this chunk and the others with the string.
+    moveChunkGap(buff, off);
+    if (tail > 0) {
+        String rest = getStringAfterGap(buff);
+        appendToChunk(cb, i+needed, rest.data, rest.size);
+        size_t lines = countLines(rest.data, rest.size);
+        size_t symbols = countSymbols(rest.data, rest.size);
+        buff->gap_length += tail;
+        chunk->bytes -= tail;
+        chunk->lines -= lines;
+        chunk->symbols -= symbols;
+        cb->bytes -= tail;
+        cb->lines -= lines;
+        cb->symbols -= symbols;
+    }
+
+    appendToChunk(cb, i, str, num);
+    for (size_t j = i+1; num < len; j++) {
+        size_t n = cutAtSymbol(str + num, len - num, CHUNK_FILL);
+        appendToChunk(cb, j, str + num, n);
+        num += n;
+    }
+
+    for (size_t j = i; j <= i+needed; j++)
+        unpinChunk(cb, j);
+    return true;
+}
+
+/* Symbol: mergeChunks
+**   Move the text of the [i+1]-th chunk at the end of the
+**   [i]-th one if they're both small, and drop it.
+*/
+PRIVATE void mergeChunks(ChunkedBuffer *cb, size_t i)
+{
+    if (i+1 >= cb->num_chunks)
+        return;
+
+    if (cb->chunks[i].bytes + cb->chunks[i+1].bytes > GAPBUFFER_CHUNK_SIZE / 2)
+        return;
+
+    if (!pinChunk(cb, i))
+        return;
+    if (!pinChunk(cb, i+1)) {
+        unpinChunk(cb, i);
+        return;
+    }
+
+    GapBuffer *next = cb->chunks[i+1].buff;
+    String before = getStringBeforeGap(next);
+    String after  = getStringAfterGap(next);
+    appendToChunk(cb, i, before.data, before.size);
+    appendToChunk(cb, i, after.data, after.size);
+    cb->bytes -= before.size + after.size;
+    cb->lines -= cb->chunks[i+1].lines;
+    cb->symbols -= cb->chunks[i+1].symbols;
+
+    unpinChunk(cb, i);
+    dropChunk(cb, i+1);
+}
+
+/* Symbol: ChunkedBuffer_remove
+**
+**   Remove [len] bytes starting from offset [pos]. The
+**   range is extended to include any UTF-8 sequence it
+**   cuts in half. Chunks left empty are dropped and small
+**   neighbouring chunks are merged.
+**
+** Returns:
+**   [false] if a chunk couldn't be read.
+*/
+bool ChunkedBuffer_remove(ChunkedBuffer *cb, size_t pos, size_t len)
+{
+    if (pos > cb->bytes)
+        pos = cb->bytes;
+    while (pos > 0 && pos < cb->bytes && isSymbolAuxiliaryByte(getChunkedByte(cb, pos)))
+        pos--;
+    size_t end = (len > cb->bytes - pos) ? cb->bytes : pos + len;
+    while (end < cb->bytes && isSymbolAuxiliaryByte(getChunkedByte(cb, end)))
+        end++;
+    len = end - pos;
+
+    size_t start;
+    size_t i = locateChunk(cb, pos, &start);
+    size_t first = i;
+
+    while (len > 0 && i < cb->num_chunks) {
+
+        if (!faultInChunk(cb, i))
+            return false;
+
+        Chunk *chunk = &cb->chunks[i];
+        size_t off = pos - start;
+        size_t num = MIN(len, chunk->bytes - off);
+
+        moveChunkGap(chunk->buff, off);
+        String removed = getStringAfterGap(chunk->buff);
+        size_t lines = countLines(removed.data, num);
+        size_t symbols = countSymbols(removed.data, num);
+        chunk->buff->gap_length += num;
+        chunk->bytes -= num;
+        chunk->lines -= lines;
+        chunk->symbols -= symbols;
+        chunk->dirty = true;
+        cb->bytes -= num;
+        cb->lines -= lines;
+        cb->symbols -= symbols;
+        len -= num;
+
+        if (chunk->bytes == 0 && cb->num_chunks > 1)
+            dropChunk(cb, i);
+        else {
+            start += chunk->bytes;
+            i++;
+        }
+    }
+
+    // The lookup hint may refer to a dropped chunk
+    if (first > 0)
+        first--;
+    cb->hint_chunk = 0;
+    cb->hint_offset = 0;
+    mergeChunks(cb, first);
+    if (first+1 < cb->num_chunks)
+        mergeChunks(cb, first+1);
+    return true;
+}
+
+/* Symbol: getChunkSegment
+**   Returns the text before ([segment] is 0) or after the
+**   gap of the [i]-th chunk, which must be resident.
+*/
+PRIVATE String getChunkSegment(ChunkedBuffer *cb, size_t i, int segment)
+{
+    GapBuffer *buff = cb->chunks[i].buff;
+    return segment ? getStringAfterGap(buff) : getStringBeforeGap(buff);
+}
+
+/* Symbol: matchChunked
+**   Returns true if [needle] occurs at offset [off] of
+**   the given segment, continuing in the following ones
+**   if necessary.
+*/
+PRIVATE bool matchChunked(ChunkedBuffer *cb, size_t i, int segment, size_t off, const char *needle, size_t len)
+{
+    size_t k = 0;
+    while (k < len && i < cb->num_chunks) {
+        if (!pinChunk(cb, i))
+            return false;
+        String s = getChunkSegment(cb, i, segment);
+        size_t n = MIN(len - k, s.size - off);
+        bool equal = !memcmp(s.data + off, needle + k, n);
+        unpinChunk(cb, i);
+        if (!equal)
+            return false;
+        k += n;
+        off = 0;
+        if (++segment == 2) {
+            segment = 0;
+            i++;
+        }
+    }
+    return k == len;
+}
+
+/* Symbol: ChunkedBuffer_find
+**
+**   Find the first occurrence of [needle] starting from
+**   byte offset [from]. Occurrences spanning chunks are
+**   found too.
+**
+** Returns:
+**   The byte offset of the occurrence or SIZE_MAX if
+**   there isn't one (or a chunk couldn't be read).
+*/
+size_t ChunkedBuffer_find(ChunkedBuffer *cb, size_t from, const char *needle, size_t len)
+{
+    if (len == 0)
+        return from <= cb->bytes ? from : SIZE_MAX;
+    if (from >= cb->bytes)
+        return SIZE_MAX;
+
+    size_t base;
+    size_t i = locateChunk(cb, from, &base);
+
+    for (; i < cb->num_chunks; i++) {
+
+        if (!pinChunk(cb, i))
+            return SIZE_MAX;
+
+        for (int segment = 0; segment < 2; segment++) {
+
+            String s = getChunkSegment(cb, i, segment);
+            size_t j = (from > base) ? MIN(from - base, s.size) : 0;
+
+            while (j < s.size) {
+                const char *p = memchr(s.data + j, needle[0], s.size - j);
+                if (p == NULL)
+                    break;
+                j = p - s.data;
+
+                size_t pos = base + j;
+                if (len > cb->bytes - pos) {
+                    unpinChunk(cb, i);
+                    return SIZE_MAX;
+                }
+                if (matchChunked(cb, i, segment, j, needle, len)) {
+                    unpinChunk(cb, i);
+                    return pos;
+                }
+                j++;
+            }
+            base += s.size;
+        }
+        unpinChunk(cb, i);
+    }
+    return SIZE_MAX;
+}
+
+void ChunkedBufferIter_init(ChunkedBufferIter *iter, ChunkedBuffer *cb)
+{
+    iter->buff = cb;
+    iter->chunk = 0;
+    iter->segment = 0;
+    iter->cur = 0;
+    iter->pinned = false;
+}
+
+void ChunkedBufferIter_free(ChunkedBufferIter *iter)
+{
+    if (iter->pinned)
+        unpinChunk(iter->buff, iter->chunk);
+    iter->pinned = false;
+}
+
+/* Symbol: ChunkedBufferIter_next
+**
+**   Get the next line of the text, reading chunks back in
+**   memory as needed. The returned line is valid until the
+**   next call since the chunk it's in is pinned. Lines
+**   spanning chunks are copied in the iterator's scratch
+**   memory, and if they don't fit they're truncated.
+**
+** Returns:
+**   [false] if there are no more lines or a chunk couldn't
+**   be read.
+*/
+bool ChunkedBufferIter_next(ChunkedBufferIter *iter, GapBufferLine *line)
+{
+    ChunkedBuffer *cb = iter->buff;
+
+    size_t copied = 0;
+    size_t length = 0;
+    bool   spans_segments = false;
+    const char *str = NULL;
+
+    while (iter->chunk < cb->num_chunks) {
+
+        if (!iter->pinned) {
+            if (!pinChunk(cb, iter->chunk))
+                return false;
+            iter->pinned = true;
+        }
+
+        String segment = getChunkSegment(cb, iter->chunk, iter->segment);
+        const char *start = segment.data + iter->cur;
+        size_t left = segment.size - iter->cur;
+        const char *newline = memchr(start, '\n', left);
+        size_t num = newline ? (size_t) (newline - start) : left;
+
+        if (spans_segments) {
+            size_t n = MIN(num, sizeof(iter->maybe) - copied);
+            memcpy(iter->maybe + copied, start, n);
+            copied += n;
+        } else if (length == 0)
+            str = start;
+        length += num;
+
+        if (newline) {
+            iter->cur += num + 1;
+            break;
+        }
+
+        // The line continues in the next segment, which may
+        // be in another chunk. Copy it before the chunk is
+        // unpinned.
+        if (!spans_segments && length > 0) {
+            spans_segments = true;
+            copied = MIN(length, sizeof(iter->maybe));
+            memcpy(iter->maybe, str, copied);
+        }
+
+        iter->cur = 0;
+        if (++iter->segment == 2) {
+            iter->segment = 0;
+            unpinChunk(cb, iter->chunk);
+            iter->pinned = false;
+            iter->chunk++;
+        }
+
+        if (iter->chunk == cb->num_chunks && length == 0)
+            return false;
+    }
+
+    if (str == NULL && !spans_segments)
+        return false;
+
+    if (spans_segments) {
+        line->str = iter->maybe;
+        line->len = copied;
+    } else {
+        line->str = str;
+        line->len = length;
+    }
+    return true;
+}
+
+/* Symbol: ChunkedBufferRange
+**
+**   A range of the text of a chunked buffer locked by one
+**   writer, so that many threads can edit the text at the
+**   same time. ChunkedBuffer_lockRange locks the chunks
+**   holding the range, which can then be edited through
+**   it while other writers edit other chunks. A writer
+**   asking for a chunk that's part of another range waits
+**   until that range is unlocked.
+**
+**   Locked chunks must stay where they are, so the chunk
+**   table only changes while no range is locked: instead
+**   of being split, a chunk that's too small for an
+**   insertion grows beyond GAPBUFFER_CHUNK_SIZE, and
+**   chunks left empty aren't dropped. They're fixed when
+**   the last range is unlocked.
+**
+**   The byte, line and symbol counts of the buffer aren't
+**   touched while editing. Each range counts the changes
+**   to its own chunks, and they're added to the totals
+**   when it's unlocked. In the meantime, the offsets of
+**   the chunks (the ones ChunkedBuffer_lockRange looks
+**   for) don't account for the edits of locked ranges.
+*/
+
+/* Symbol: ChunkedBuffer_lockRange
+**
+**   Lock the [len] bytes of the text starting from offset
+**   [pos], waiting for the ranges that share chunks with
+**   it to be unlocked. The range is extended to include
+**   any UTF-8 sequence it cuts in half and its chunks are
+**   read in memory, where they stay until it's unlocked.
+**   Offsets passed to the functions of the range are
+**   relative to its start.
+**
+** Returns:
+**   [false] if a chunk couldn't be read.
+*/
+bool ChunkedBuffer_lockRange(ChunkedBuffer *cb, size_t pos, size_t len, ChunkedBufferRange *range)
+{
+    pthread_mutex_lock(&cb->lock);
+
+    size_t first, last;
+    size_t first_start, last_start;
+    for (;;) {
+        if (pos > cb->bytes)
+            pos = cb->bytes;
+        if (len > cb->bytes - pos)
+            len = cb->bytes - pos;
+
+        first = locateChunk(cb, pos, &first_start);
+        last = first;
+        last_start = first_start;
+        if (len > 0)
+            last = locateChunk(cb, pos + len - 1, &last_start);
+
+        bool busy = false;
+        for (size_t i = first; i <= last; i++)
+            if (cb->chunks[i].locked)
+                busy = true;
+        if (!busy)
+            break;
+        pthread_cond_wait(&cb->unlocked, &cb->lock);
+    }
+
+    for (size_t i = first; i <= last; i++)
+        if (!pinChunk(cb, i)) {
+            while (i-- > first)
+                unpinChunk(cb, i);
+            pthread_mutex_unlock(&cb->lock);
+            return false;
+        }
+    for (size_t i = first; i <= last; i++)
+        cb->chunks[i].locked = true;
+    cb->ranges++;
+    pthread_mutex_unlock(&cb->lock);
+
+    // Chunks start at the start of a UTF-8 sequence, so
+    // the range can be aligned without leaving its chunks.
+    GapBuffer *head = cb->chunks[first].buff;
+    size_t start = pos - first_start;
+    while (start > 0 && start < cb->chunks[first].bytes && isSymbolAuxiliaryByte(getChunkByte(head, start)))
+        start--;
+
+    GapBuffer *tail = cb->chunks[last].buff;
+    size_t end = (len > 0) ? pos + len - last_start : start;
+    while (end < cb->chunks[last].bytes && isSymbolAuxiliaryByte(getChunkByte(tail, end)))
+        end++;
+
+    *range = (ChunkedBufferRange) {
+        .buff  = cb,
+        .first = first,
+        .last  = last,
+        .head  = start,
+        .len   = (last_start + end) - (first_start + start),
+    };
+    return true;
+}
+
+/* Symbol: splitChunk
+**
+**   Move the text of the [i]-th chunk, which grew beyond
+**   GAPBUFFER_CHUNK_SIZE in a locked range, to chunks of
+**   the usual size filled up to CHUNK_FILL bytes.
+**
+** Returns:
+**   The number of chunks holding the text, or 0 if they
+**   couldn't be created (the chunk is left as it was).
+*/
+PRIVATE size_t splitChunk(ChunkedBuffer *cb, size_t i)
+{
+    GapBuffer *big = cb->chunks[i].buff;
+    moveChunkGap(big, cb->chunks[i].bytes);
+    String text = getStringBeforeGap(big);
+
+    GapBuffer *buff = GapBuffer_create(GAPBUFFER_CHUNK_SIZE);
+    if (buff == NULL)
+        return 0;
+
+    // The big chunk holds the text until the new chunks
+    // following it are filled.
+    size_t head = cutAtSymbol(text.data, text.size, CHUNK_FILL);
+    size_t j = i+1;
+    cb->chunks[i].pins++;
+    for (size_t k = head; k < text.size; j++) {
+        if (!createChunk(cb, j)) {
+            while (--j > i) {
+                cb->bytes   -= cb->chunks[j].bytes;
+                cb->lines   -= cb->chunks[j].lines;
+                cb->symbols -= cb->chunks[j].symbols;
+                dropChunk(cb, j);
+            }
+            cb->chunks[i].pins--;
+            GapBuffer_destroy(buff);
+            return 0;
+        }
+        size_t n = cutAtSymbol(text.data + k, text.size - k, CHUNK_FILL);
+        appendToChunk(cb, j, text.data + k, n);
+        k += n;
+    }
+
+    // The text moved to the new chunks was counted twice
+    Chunk *chunk = &cb->chunks[i];
+    size_t lines = countLines(text.data, head);
+    size_t symbols = countSymbols(text.data, head);
+    cb->bytes   -= chunk->bytes - head;
+    cb->lines   -= chunk->lines - lines;
+    cb->symbols -= chunk->symbols - symbols;
+
+    memcpy(buff->data, text.data, head);
+    buff->gap_offset = head;
+    buff->gap_length -= head;
+    GapBuffer_destroy(big);
+
+    chunk->buff = buff;
+    chunk->bytes = head;
+    chunk->lines = lines;
+    chunk->symbols = symbols;
+    chunk->dirty = true;
+    chunk->pins--;
+    updateChunkMemory(cb, chunk);
+    return j - i;
+}
+
+/* Symbol: rebalanceChunks
+**   Split the chunks that grew beyond GAPBUFFER_CHUNK_SIZE
+**   while they were locked and drop the ones left empty.
+**   Called with the lock held when no range is locked.
+*/
+PRIVATE void rebalanceChunks(ChunkedBuffer *cb)
+{
+    cb->unbalanced = false;
+    for (size_t i = 0; i < cb->num_chunks;) {
+        Chunk *chunk = &cb->chunks[i];
+        if (chunk->bytes == 0 && cb->num_chunks > 1)
+            dropChunk(cb, i);
+        else if (chunk->bytes > GAPBUFFER_CHUNK_SIZE) {
+            size_t num = splitChunk(cb, i);
+            if (num == 0) {
+                cb->unbalanced = true; // Try again next time
+                num = 1;
+            }
+            i += num;
+        } else
+            i++;
+    }
+    cb->hint_chunk = 0;
+    cb->hint_offset = 0;
+}
+
+/* Symbol: ChunkedBuffer_unlockRange
+**   Add the changes done through the range to the counts
+**   of the buffer and let other writers lock its chunks.
+*/
+void ChunkedBuffer_unlockRange(ChunkedBufferRange *range)
+{
+    ChunkedBuffer *cb = range->buff;
+    pthread_mutex_lock(&cb->lock);
+
+    for (size_t i = range->first; i <= range->last; i++) {
+        Chunk *chunk = &cb->chunks[i];
+        size_t bytes = getByteCount(chunk->buff);
+        if (i < cb->hint_chunk)
+            cb->hint_offset += bytes - chunk->bytes;
+        cb->bytes += bytes - chunk->bytes;
+        chunk->bytes = bytes;
+        chunk->locked = false;
+        updateChunkMemory(cb, chunk); // It may have grown
+        unpinChunk(cb, i);
+    }
+    cb->lines   += range->lines;
+    cb->symbols += range->symbols;
+    cb->unbalanced |= range->unbalanced;
+
+    cb->ranges--;
+    if (cb->ranges == 0 && cb->unbalanced)
+        rebalanceChunks(cb);
+
+    pthread_cond_broadcast(&cb->unlocked);
+    pthread_mutex_unlock(&cb->lock);
+}
+
+/* Symbol: locateInRange
+**   Find the chunk holding the byte at offset [off] of the
+**   range and the offset [rel] of that byte in the chunk.
+**   An offset at the end of a chunk refers to that chunk,
+**   not to the start of the next one.
+*/
+PRIVATE size_t locateInRange(ChunkedBufferRange *range, size_t off, size_t *rel)
+{
+    Chunk *chunks = range->buff->chunks;
+    size_t i = range->first;
+    off += range->head;
+    for (;;) {
+        size_t bytes = getByteCount(chunks[i].buff);
+        if (off <= bytes || i == range->last)
+            break;
+        off -= bytes;
+        i++;
+    }
+    *rel = off;
+    return i;
+}
+
+/* Symbol: ChunkedBufferRange_insertString
+**
+**   Insert a UTF8-encoded string at offset [off] of the
+**   range, moved back to the start of the UTF-8 sequence
+**   it falls in. If the chunk at that offset doesn't have
+**   enough space, it's moved to a bigger memory region,
+**   up to GAPBUFFER_CHUNK_MAX bytes. Bigger chunks are
+**   only split after all ranges are unlocked.
+**
+** Returns:
+**   [false] if the string isn't valid UTF-8, the chunk
+**   would grow beyond GAPBUFFER_CHUNK_MAX bytes or memory
+**   couldn't be allocated.
+*/
+bool ChunkedBufferRange_insertString(ChunkedBufferRange *range, size_t off, const char *str, size_t len)
+{
+    if (!isValidUTF8(str, len)) {
+        PROBE2(invalid_utf8, range->buff, len);
+        return false;
+    }
+
+    size_t rel;
+    size_t i = locateInRange(range, MIN(off, range->len), &rel);
+    Chunk *chunk = &range->buff->chunks[i];
+    while (rel > 0 && rel < getByteCount(chunk->buff) && isSymbolAuxiliaryByte(getChunkByte(chunk->buff, rel)))
+        rel--;
+
+    if (len > GAPBUFFER_CHUNK_MAX - getByteCount(chunk->buff))
+        return false;
+
+    moveChunkGap(chunk->buff, rel);
+    if (len <= chunk->buff->gap_length)
+        insertBytesBeforeCursor(chunk->buff, (String) { .data=str, .size=len });
+    else {
+        if (!GapBuffer_insertStringMaybeRelocate(&chunk->buff, str, len))
+            return false;
+        range->unbalanced = true;
+    }
+
+    size_t lines = countLines(str, len);
+    size_t symbols = countSymbols(str, len);
+    chunk->lines += lines;
+    chunk->symbols += symbols;
+    chunk->dirty = true;
+    range->len += len;
+    range->lines += lines;
+    range->symbols += symbols;
+    return true;
+}
+
+/* Symbol: ChunkedBufferRange_remove
+**   Remove [len] bytes starting from offset [off] of the
+**   range. The removal is extended to include any UTF-8
+**   sequence it cuts in half.
+*/
+void ChunkedBufferRange_remove(ChunkedBufferRange *range, size_t off, size_t len)
+{
+    off = MIN(off, range->len);
+    len = MIN(len, range->len - off);
+
+    size_t rel;
+    size_t i = locateInRange(range, off, &rel);
+    GapBuffer *buff = range->buff->chunks[i].buff;
+    while (rel > 0 && rel < getByteCount(buff) && isSymbolAuxiliaryByte(getChunkByte(buff, rel))) {
+        rel--;
+        len++;
+    }
+
+    // Chunks end at the end of a UTF-8 sequence, so the
+    // removal can be extended one chunk at a time.
+    while (len > 0 && i <= range->last) {
+        Chunk *chunk = &range->buff->chunks[i];
+        size_t bytes = getByteCount(chunk->buff);
+        size_t num = MIN(len, bytes - rel);
+        while (rel + num < bytes && isSymbolAuxiliaryByte(getChunkByte(chunk->buff, rel + num)))
+            num++;
+
+        moveChunkGap(chunk->buff, rel);
+        String removed = getStringAfterGap(chunk->buff);
+        size_t lines = countLines(removed.data, num);
+        size_t symbols = countSymbols(removed.data, num);
+        chunk->buff->gap_length += num;
+        chunk->lines -= lines;
+        chunk->symbols -= symbols;
+        chunk->dirty = true;
+        range->len -= num;
+        range->lines -= lines;
+        range->symbols -= symbols;
+        if (num == bytes)
+            range->unbalanced = true; // The chunk is empty
+
+        len -= MIN(len, num);
+        rel = 0;
+        i++;
+    }
+}
+
+/* Symbol: ChunkedBufferRange_copy
+**   Copy at most [len] bytes of the range starting from
+**   offset [off] to [dst].
+**
+** Returns:
+**   The number of bytes copied.
+*/
+size_t ChunkedBufferRange_copy(ChunkedBufferRange *range, size_t off, char *dst, size_t len)
+{
+    off = MIN(off, range->len);
+    len = MIN(len, range->len - off);
+
+    size_t rel;
+    size_t i = locateInRange(range, off, &rel);
+    size_t copied = 0;
+    while (copied < len) {
+        for (int segment = 0; segment < 2 && copied < len; segment++) {
+            String s = getChunkSegment(range->buff, i, segment);
+            if (rel >= s.size) {
+                rel -= s.size;
+                continue;
+            }
+            size_t n = MIN(s.size - rel, len - copied);
+            memcpy(dst + copied, s.data + rel, n);
+            copied += n;
+            rel = 0;
+        }
+        i++;
+    }
+    return copied;
+}
+#endif
+
+#if !defined(GAPBUFFER_NOMALLOC) && !defined(GAPBUFFER_NOPOSIX)
+#include <time.h>
+#include <pthread.h>
+
+/* Symbol: GapBufferRegistry
+**
+**   A set of gap buffers sharing a memory budget. When the
+**   registered buffers use more memory than the budget, the
+**   registry reclaims it from idle buffers: first by moving
+**   buffers with oversized gaps to smaller memory regions,
+**   then by compacting the least recently used ones with
+**   GapBuffer_compact and finally by writing them to a
+**   temporary file and freeing them.
+**
+**   Since reclaiming memory moves buffers, they're referred
+**   to by an handle and must be acquired before being used
+**   and released afterwards. Reclamation can be performed
+**   explicitly, one buffer at a time, with
+**   GapBufferRegistry_reclaim or on a background thread
+**   started by GapBufferRegistry_startReclaimer.
+*/
+
+// Gap left to buffers when shrinking them
+#ifndef GAPBUFFER_REGISTRY_MIN_GAP
+#define GAPBUFFER_REGISTRY_MIN_GAP 4096
+#endif
+
+// Level passed to GapBuffer_compact for idle buffers
+#ifndef GAPBUFFER_REGISTRY_COMPACT_LEVEL
+#define GAPBUFFER_REGISTRY_COMPACT_LEVEL 1
+#endif
+
+typedef struct {
+    GapBuffer *buff;      // NULL when spilled
+    bool       used;      // The slot holds a buffer
+    bool       busy;      // The reclaimer is working on it
+    int        users;     // Number of acquisitions not released
+    uint64_t   last_use;  // Tick of the last release
+    size_t     memory;    // Cached from the buffer at release
+    size_t     gap_length;
+    off_t      spill_offset;
+    size_t     spill_before;
+    size_t     spill_after;
+
+    // Edit stream and committed version of the buffer while
+    // it's spilled, given back when it's read back.
+    GapBufferStream  *stream;
+    GapBufferVersion *committed;
+    size_t            unchanged_head;
+    size_t            unchanged_tail;
+} RegistryEntry;
+
+struct GapBufferRegistry {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+
+    RegistryEntry  *entries;
+    size_t          num_entries;
+    size_t          max_entries;
+    size_t         *free_ids;
+    size_t          num_free_ids;
+
+    size_t   budget;
+    size_t   resident;   // Bytes used by resident buffers
+    size_t   gap_bytes;  // Bytes of gaps of resident buffers
+    size_t   spilled;    // Bytes of text in the spill file
+    uint64_t tick;
+
+    int      spill_fd;
+    off_t    spill_end;
+
+    pthread_t thread;
+    bool      thread_running;
+    bool      thread_stop;
+    int       interval; // Milliseconds
+};
+
+// Memory used by a buffer, excluding the pages given
+// back by GapBuffer_compact.
+PRIVATE size_t getBufferMemory(const GapBuffer *buff)
+{
+    size_t memory = sizeof(GapBuffer) + buff->total;
+    if (buff->compressed)
+        memory += buff->compressed_size - getDroppableBytes(buff);
+    return memory;
+}
+
+// Replace the buffer of [entry], keeping the totals up
+// to date. Called with the lock held.
+PRIVATE void setEntryBuffer(GapBufferRegistry *reg, RegistryEntry *entry, GapBuffer *buff)
+{
+    reg->resident  -= entry->memory;
+    reg->gap_bytes -= entry->gap_length;
+    entry->buff = buff;
+    entry->memory = buff ? getBufferMemory(buff) : 0;
+    entry->gap_length = (buff && !buff->compressed) ? buff->gap_length : 0;
+    reg->resident  += entry->memory;
+    reg->gap_bytes += entry->gap_length;
+}
+
+GapBufferRegistry *GapBufferRegistry_create(size_t budget)
+{
+    GapBufferRegistry *reg = malloc(sizeof(GapBufferRegistry));
+    if (reg == NULL)
+        return NULL;
+
+    *reg = (GapBufferRegistry) {
+        .budget = budget,
+        .spill_fd = -1,
+    };
+    pthread_mutex_init(&reg->lock, NULL);
+    pthread_cond_init(&reg->changed, NULL);
+    return reg;
+}
+
+/* Symbol: GapBufferRegistry_destroy
+**   Stop the reclaimer and destroy the registry with all
+**   the buffers still registered.
+*/
+void GapBufferRegistry_destroy(GapBufferRegistry *reg)
+{
+    GapBufferRegistry_stopReclaimer(reg);
+
+    for (size_t i = 0; i < reg->num_entries; i++) {
+        RegistryEntry *entry = &reg->entries[i];
+        if (entry->buff)
+            GapBuffer_destroy(entry->buff);
+        else if (entry->committed)
+            GapBufferVersion_release(entry->committed);
+    }
+    if (reg->spill_fd >= 0)
+        close(reg->spill_fd);
+
+    pthread_cond_destroy(&reg->changed);
+    pthread_mutex_destroy(&reg->lock);
+    free(reg->free_ids);
+    free(reg->entries);
+    free(reg);
+}
+
+/* Symbol: GapBufferRegistry_add
+**
+**   Register a buffer created with GapBuffer_create. The
+**   registry takes ownership of it, so it must be accessed
+**   using GapBufferRegistry_acquire from now on.
+**
+** Returns:
+**   The handle of the buffer or SIZE_MAX if memory for
+**   it couldn't be allocated or it was created by
+**   GapBuffer_createShared, since the registry moves the
+**   buffers it manages.
+*/
+size_t GapBufferRegistry_add(GapBufferRegistry *reg, GapBuffer *buff)
+{
+    if (buff->shared)
+        return SIZE_MAX;
+
+    pthread_mutex_lock(&reg->lock);
+
+    size_t id;
+    if (reg->num_free_ids > 0)
+        id = reg->free_ids[--reg->num_free_ids];
+    else {
+        if (reg->num_entries == reg->max_entries) {
+            size_t max_entries = MAX(2 * reg->max_entries, 64);
+            RegistryEntry *entries = realloc(reg->entries, max_entries * sizeof(RegistryEntry));
+            size_t *free_ids = realloc(reg->free_ids, max_entries * sizeof(size_t));
+            if (entries)
+                reg->entries = entries;
+            if (free_ids)
+                reg->free_ids = free_ids;
+            if (entries == NULL || free_ids == NULL) {
+                pthread_mutex_unlock(&reg->lock);
+                return SIZE_MAX;
+            }
+            reg->max_entries = max_entries;
+        }
+        id = reg->num_entries++;
+    }
+
+    RegistryEntry *entry = &reg->entries[id];
+    *entry = (RegistryEntry) {
+        .used = true,
+        .last_use = reg->tick++,
+    };
+    setEntryBuffer(reg, entry, buff);
+
+    pthread_cond_broadcast(&reg->changed);
+    pthread_mutex_unlock(&reg->lock);
+    return id;
+}
+
+/* Symbol: keepEdits
+**   Move the edit stream and the committed version of a
+**   buffer that was spilled to its entry, like handOverEdits
+**   does between buffers. The stream isn't attached to any
+**   buffer meanwhile, so requested snapshots wait for the
+**   buffer to be read back.
+*/
+PRIVATE void keepEdits(RegistryEntry *entry, GapBuffer *buff)
+{
+    entry->stream = buff->stream;
+    entry->committed = buff->committed;
+    entry->unchanged_head = buff->unchanged_head;
+    entry->unchanged_tail = buff->unchanged_tail;
+    if (entry->stream)
+        entry->stream->buff = NULL;
+    buff->stream = NULL;
+    buff->committed = NULL;
+}
+
+PRIVATE void restoreEdits(RegistryEntry *entry, GapBuffer *buff)
+{
+    buff->stream = entry->stream;
+    buff->committed = entry->committed;
+    buff->unchanged_head = entry->unchanged_head;
+    buff->unchanged_tail = entry->unchanged_tail;
+    if (buff->stream)
+        buff->stream->buff = buff;
+    entry->stream = NULL;
+    entry->committed = NULL;
+}
+
+/* Symbol: spillBuffer
+**   Write the text of a buffer to the spill file at [offset].
+**   Called without the lock held on a busy entry.
+*/
+PRIVATE bool spillBuffer(GapBufferRegistry *reg, GapBuffer *buff, off_t offset)
+{
+    rehydrate(buff);
+    unrotate(buff);
+    migrateBytes(buff, SIZE_MAX, SIZE_MAX);
+
+    String before = getStringBeforeGap(buff);
+    String after  = getStringAfterGap(buff);
+    struct iovec iov[2] = {
+        { .iov_base = (void*) before.data, .iov_len = before.size },
+        { .iov_base = (void*) after.data,  .iov_len = after.size  },
+    };
+    return pwritev(reg->spill_fd, iov, 2, offset) == (ssize_t) (before.size + after.size);
+}
+
+/* Symbol: unspillBuffer
+**   Read back a spilled buffer, leaving the minimum gap
+**   to it. Called without the lock held on a busy entry.
+*/
+PRIVATE GapBuffer *unspillBuffer(GapBufferRegistry *reg, RegistryEntry *entry)
+{
+    size_t size = entry->spill_before + entry->spill_after;
+    GapBuffer *buff = GapBuffer_create(size + GAPBUFFER_REGISTRY_MIN_GAP);
+    if (buff == NULL)
+        return NULL;
+
+    // Read the text after the gap at the end of the buffer
+    // directly, so that the cursor is preserved.
+    char  *after = buff->data + buff->total - entry->spill_after;
+    struct iovec iov[2] = {
+        { .iov_base = buff->data, .iov_len = entry->spill_before },
+        { .iov_base = after,      .iov_len = entry->spill_after  },
+    };
+    size_t copied = 0;
+    while (copied < size) {
+        // Skip the vectors already read
+        struct iovec rest[2];
+        int count = 0;
+        size_t skip = copied;
+        for (int i = 0; i < 2; i++) {
+            if (skip >= iov[i].iov_len) {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            rest[count].iov_base = (char*) iov[i].iov_base + skip;
+            rest[count].iov_len = iov[i].iov_len - skip;
+            skip = 0;
+            count++;
+        }
+        ssize_t n = preadv(reg->spill_fd, rest, count, entry->spill_offset + copied);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            GapBuffer_destroy(buff);
+            return NULL;
+        }
+        copied += n;
+    }
+    buff->gap_offset = entry->spill_before;
+    buff->gap_length -= size;
+
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    // Give the space back to the file system
+    if (size > 0)
+        fallocate(reg->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, entry->spill_offset, size);
+#endif
+    return buff;
+}
+
+PRIVATE bool openSpillFile(GapBufferRegistry *reg)
+{
+    if (reg->spill_fd >= 0)
+        return true;
+
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL)
+        dir = "/tmp";
+#ifdef O_TMPFILE
+    reg->spill_fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (reg->spill_fd < 0) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/gap_buffer_XXXXXX", dir);
+        reg->spill_fd = mkstemp(path);
+        if (reg->spill_fd < 0)
+            return false;
+        unlink(path);
+    }
+    return true;
+}
+
+/* Symbol: GapBufferRegistry_acquire
+**
+**   Get exclusive access to a registered buffer, reading it
+**   back in memory if it was spilled. The buffer must be
+**   released with GapBufferRegistry_release.
+**
+** Returns:
+**   NULL if the handle is invalid or the buffer couldn't
+**   be read back.
+*/
+GapBuffer *GapBufferRegistry_acquire(GapBufferRegistry *reg, size_t id)
+{
+    pthread_mutex_lock(&reg->lock);
+
+    if (id >= reg->num_entries || !reg->entries[id].used) {
+        pthread_mutex_unlock(&reg->lock);
+        return NULL;
+    }
+
+    while (reg->entries[id].busy || reg->entries[id].users > 0)
+        pthread_cond_wait(&reg->changed, &reg->lock);
+
+    RegistryEntry *entry = &reg->entries[id];
+    if (entry->buff == NULL) {
+
+        // The entries may be moved by an addition while the
+        // lock isn't held, so a copy is used.
+        entry->busy = true;
+        RegistryEntry spilled = *entry;
+        pthread_mutex_unlock(&reg->lock);
+        GapBuffer *buff = unspillBuffer(reg, &spilled);
+        pthread_mutex_lock(&reg->lock);
+
+        entry = &reg->entries[id];
+        entry->busy = false;
+        pthread_cond_broadcast(&reg->changed);
+
+        if (buff == NULL) {
+            pthread_mutex_unlock(&reg->lock);
+            return NULL;
+        }
+        reg->spilled -= entry->spill_before + entry->spill_after;
+        restoreEdits(entry, buff);
+        setEntryBuffer(reg, entry, buff);
+    }
+
+    entry->users++;
+    GapBuffer *buff = entry->buff;
+    pthread_mutex_unlock(&reg->lock);
+    return buff;
+}
+
+/* Symbol: GapBufferRegistry_release
+**
+**   Give back a buffer obtained with GapBufferRegistry_acquire.
+**   Since the buffer may have been relocated while it was
+**   acquired, its current address is passed as [buff].
+*/
+void GapBufferRegistry_release(GapBufferRegistry *reg, size_t id, GapBuffer *buff)
+{
+    pthread_mutex_lock(&reg->lock);
+
+    RegistryEntry *entry = &reg->entries[id];
+    assert(entry->used && entry->users > 0);
+
+    setEntryBuffer(reg, entry, buff);
+    entry->users--;
+    entry->last_use = reg->tick++;
+
+    pthread_cond_broadcast(&reg->changed);
+    pthread_mutex_unlock(&reg->lock);
+}
+
+/* Symbol: GapBufferRegistry_remove
+**
+**   Unregister a buffer, giving its ownership back to the
+**   caller. The buffer must not be acquired.
+**
+** Returns:
+**   The buffer, or NULL if it couldn't be read back.
+*/
+GapBuffer *GapBufferRegistry_remove(GapBufferRegistry *reg, size_t id)
+{
+    GapBuffer *buff = GapBufferRegistry_acquire(reg, id);
+    if (buff == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&reg->lock);
+    RegistryEntry *entry = &reg->entries[id];
+    setEntryBuffer(reg, entry, NULL);
+    entry->used = false;
+    entry->users = 0;
+    reg->free_ids[reg->num_free_ids++] = id;
+    pthread_cond_broadcast(&reg->changed);
+    pthread_mutex_unlock(&reg->lock);
+    return buff;
+}
+
+// Returns true if a buffer can be touched by the reclaimer
+PRIVATE bool isReclaimable(const RegistryEntry *entry)
+{
+    return entry->used && entry->buff && !entry->busy
+        && entry->users == 0 && entry->buff->pending == 0;
+}
+
+/* Symbol: GapBufferRegistry_reclaim
+**
+**   If the registered buffers exceed the budget, reclaim
+**   memory from one idle buffer. In order of preference:
+**
+**     - The buffer with the largest gap, if it's bigger than
+**       2 * GAPBUFFER_REGISTRY_MIN_GAP, is moved to a region
+**       with a gap of GAPBUFFER_REGISTRY_MIN_GAP bytes.
+**
+**     - The least recently used buffer that wasn't compacted
+**       yet (and is big enough to give pages back) is
+**       compacted.
+**
+**     - The least recently used buffer is spilled.
+**
+** Returns:
+**   [true] if some memory was reclaimed, [false] if the
+**   budget isn't exceeded or nothing could be done.
+*/
+bool GapBufferRegistry_reclaim(GapBufferRegistry *reg)
+{
+    pthread_mutex_lock(&reg->lock);
+
+    if (reg->resident <= reg->budget) {
+        pthread_mutex_unlock(&reg->lock);
+        return false;
+    }
+
+    size_t largest_gap = SIZE_MAX;
+    size_t least_recent = SIZE_MAX;
+    size_t least_recent_expanded = SIZE_MAX;
+    for (size_t i = 0; i < reg->num_entries; i++) {
+        RegistryEntry *entry = &reg->entries[i];
+        if (!isReclaimable(entry))
+            continue;
+        if (entry->gap_length > 2 * GAPBUFFER_REGISTRY_MIN_GAP
+            && (largest_gap == SIZE_MAX || entry->gap_length > reg->entries[largest_gap].gap_length))
+            largest_gap = i;
+        if (least_recent == SIZE_MAX || entry->last_use < reg->entries[least_recent].last_use)
+            least_recent = i;
+        if (!entry->buff->compressed && getDroppableBytes(entry->buff) > 0
+            && (least_recent_expanded == SIZE_MAX || entry->last_use < reg->entries[least_recent_expanded].last_use))
+            least_recent_expanded = i;
+    }
+
+    enum { SHRINK, COMPACT, SPILL } action;
+    size_t id;
+    if (largest_gap != SIZE_MAX) {
+        action = SHRINK;
+        id = largest_gap;
+    } else if (least_recent_expanded != SIZE_MAX) {
+        action = COMPACT;
+        id = least_recent_expanded;
+    } else {
+        action = SPILL;
+        id = least_recent;
+    }
+
+    if (id == SIZE_MAX || (action == SPILL && !openSpillFile(reg))) {
+        pthread_mutex_unlock(&reg->lock);
+        return false;
+    }
+
+    RegistryEntry *entry = &reg->entries[id];
+    GapBuffer *buff = entry->buff;
+    entry->busy = true;
+
+    // The spill file is only appended to, so the range can
+    // be reserved before the lock is released.
+    off_t offset = reg->spill_end;
+    if (action == SPILL)
+        reg->spill_end += getByteCount(buff);
+
+    pthread_mutex_unlock(&reg->lock);
+
+    bool done = false;
+    GapBuffer *result = NULL;
+    switch (action) {
+
+        case SHRINK:
+        {
+            size_t len = sizeof(GapBuffer) + getByteCount(buff) + GAPBUFFER_REGISTRY_MIN_GAP;
+            result = GapBuffer_cloneUsingMemory(malloc(len), len, free, buff);
+            done = (result != NULL);
+            break;
+        }
+
+        case COMPACT:
+        result = buff;
+        done = GapBuffer_compact(buff, GAPBUFFER_REGISTRY_COMPACT_LEVEL);
+        break;
+
+        case SPILL:
+        done = spillBuffer(reg, buff, offset);
+        break;
+    }
+
+    pthread_mutex_lock(&reg->lock);
+    entry = &reg->entries[id];
+    if (done) {
+        // The stream and the committed version follow the
+        // text, or the stream would stop and the next commit
+        // would copy all of the text.
+        if (action == SHRINK)
+            handOverEdits(buff, result);
+        if (action == SPILL)
+            keepEdits(entry, buff);
+        setEntryBuffer(reg, entry, result);
+        if (action == SPILL) {
+            entry->spill_offset = offset;
+            entry->spill_before = getStringBeforeGap(buff).size;
+            entry->spill_after = getStringAfterGap(buff).size;
+            reg->spilled += getByteCount(buff);
+        }
+    }
+    entry->busy = false;
+    pthread_cond_broadcast(&reg->changed);
+    pthread_mutex_unlock(&reg->lock);
+
+    if (done && action != COMPACT)
+        GapBuffer_destroy(buff);
+    return done;
+}
+
+PRIVATE void *runReclaimer(void *arg)
+{
+    GapBufferRegistry *reg = arg;
+
+    pthread_mutex_lock(&reg->lock);
+    while (!reg->thread_stop) {
+
+        if (reg->resident > reg->budget) {
+            // Do one step at a time, so that buffers can be
+            // acquired in between.
+            pthread_mutex_unlock(&reg->lock);
+            bool progress = GapBufferRegistry_reclaim(reg);
+            pthread_mutex_lock(&reg->lock);
+            if (progress)
+                continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += reg->interval / 1000;
+        deadline.tv_nsec += (long) (reg->interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&reg->changed, &reg->lock, &deadline);
+    }
+    pthread_mutex_unlock(&reg->lock);
+    return NULL;
+}
+
+/* Symbol: GapBufferRegistry_startReclaimer
+**
+**   Start a thread that reclaims memory whenever the budget
+**   is exceeded. It wakes up when a buffer is released and
+**   every [interval] milliseconds.
+*/
+bool GapBufferRegistry_startReclaimer(GapBufferRegistry *reg, int interval)
+{
+    if (reg->thread_running)
+        return true;
+
+    reg->interval = interval;
+    reg->thread_stop = false;
+    if (pthread_create(&reg->thread, NULL, runReclaimer, reg))
+        return false;
+    reg->thread_running = true;
+    return true;
+}
+
+void GapBufferRegistry_stopReclaimer(GapBufferRegistry *reg)
+{
+    if (!reg->thread_running)
+        return;
+
+    pthread_mutex_lock(&reg->lock);
+    reg->thread_stop = true;
+    pthread_cond_broadcast(&reg->changed);
+    pthread_mutex_unlock(&reg->lock);
+
+    pthread_join(reg->thread, NULL);
+    reg->thread_running = false;
+}
+
+void GapBufferRegistry_getStats(GapBufferRegistry *reg, GapBufferRegistryStats *stats)
+{
+    pthread_mutex_lock(&reg->lock);
+    stats->buffers = reg->num_entries - reg->num_free_ids;
+    stats->resident_bytes = reg->resident;
+    stats->gap_bytes = reg->gap_bytes;
+    stats->spilled_bytes = reg->spilled;
+    pthread_mutex_unlock(&reg->lock);
+}
+
+/* Symbol: GapBufferRegistry_getBufferStats
+**   Get the accounting of a single buffer, as of its
+**   last release.
+*/
+bool GapBufferRegistry_getBufferStats(GapBufferRegistry *reg, size_t id, GapBufferRegistryStats *stats)
+{
+    pthread_mutex_lock(&reg->lock);
+    if (id >= reg->num_entries || !reg->entries[id].used) {
+        pthread_mutex_unlock(&reg->lock);
+        return false;
+    }
+    RegistryEntry *entry = &reg->entries[id];
+    stats->buffers = 1;
+    stats->resident_bytes = entry->memory;
+    stats->gap_bytes = entry->buff ? entry->gap_length : 0;
+    stats->spilled_bytes = entry->buff ? 0 : entry->spill_before + entry->spill_after;
+    pthread_mutex_unlock(&reg->lock);
+    return true;
+}
+#endif
+
+#ifndef GAPBUFFER_NOMALLOC
+
+/* Symbol: GapBufferStore
+**
+**   A content-addressed store of text chunks, used to keep
+**   many similar documents in memory storing their common
+**   parts once.
+**
+**   Texts saved in the store are split in chunks at
+**   positions chosen by their content (content-defined
+**   chunking): a rolling hash of the last bytes is computed
+**   and a chunk ends where it has some bits set to 0. Since
+**   the cut points only depend on the bytes around them, an
+**   edit only changes the chunks around it and the rest of
+**   the text splits into the same chunks as before. Chunks
+**   are looked up by their hash and reference counted, so
+**   equal chunks are only stored once.
+**
+**   A saved text is a GapBufferDocument, which is immutable
+**   and can be cloned by reference. To edit it, it's loaded
+**   into a new gap buffer, which can be saved back as a new
+**   document.
+**
+** Notes:
+**   - The store isn't thread-safe.
+*/
+
+// Chunk sizes. The average is the minimum plus 2 to the
+// number of bits of the hash checked to find cut points.
+#ifndef GAPBUFFER_STORE_MIN_CHUNK
+#define GAPBUFFER_STORE_MIN_CHUNK 64
+#endif
+#ifndef GAPBUFFER_STORE_CUT_BITS
+#define GAPBUFFER_STORE_CUT_BITS 7
+#endif
+#ifndef GAPBUFFER_STORE_MAX_CHUNK
+#define GAPBUFFER_STORE_MAX_CHUNK 4096
+#endif
+
+typedef struct StoredChunk StoredChunk;
+struct StoredChunk {
+    uint64_t hash;
+    size_t   refs;
+    size_t   size;
+    char     data[];
+};
+
+struct GapBufferStore {
+    StoredChunk **table; // Open addressing with linear probing
+    size_t        capacity;
+    size_t        count;
+    size_t        bytes; // Bytes of the stored chunks
+    size_t        documents;
+    uint64_t      gear[256];
+};
+
+struct GapBufferDocument {
+    GapBufferStore *store;
+    size_t          refs;
+    size_t          bytes;
+    size_t          num_chunks;
+    StoredChunk    *chunks[];
+};
+
+// Used to generate the table of the rolling hash
+PRIVATE uint64_t splitMix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+PRIVATE uint64_t hashChunk(const char *data, size_t len)
+{
+    // Mixes 8 bytes at a time, with the steps of splitMix64
+    uint64_t hash = len * 0x9e3779b97f4a7c15;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9;
+        hash ^= hash >> 31;
+    }
+    uint64_t word = 0;
+    memcpy(&word, data + i, len - i);
+    hash = (hash ^ word) * 0x94d049bb133111eb;
+    return hash ^ (hash >> 29);
+}
+
+GapBufferStore *GapBufferStore_create(void)
+{
+    GapBufferStore *store = malloc(sizeof(GapBufferStore));
+    if (store == NULL)
+        return NULL;
+
+    store->capacity = 1024;
+    store->table = calloc(store->capacity, sizeof(StoredChunk*));
+    if (store->table == NULL) {
+        free(store);
+        return NULL;
+    }
+    store->count = 0;
+    store->bytes = 0;
+    store->documents = 0;
+
+    uint64_t state = 0;
+    for (int i = 0; i < 256; i++)
+        store->gear[i] = splitMix64(&state);
+    return store;
+}
+
+/* Symbol: GapBufferStore_destroy
+**   Free the store. All of its documents must have been
+**   released before.
+*/
+void GapBufferStore_destroy(GapBufferStore *store)
+{
+    assert(store->documents == 0);
+    free(store->table);
+    free(store);
+}
+
+PRIVATE bool growStoreTable(GapBufferStore *store)
+{
+    size_t capacity = 2 * store->capacity;
+    StoredChunk **table = calloc(capacity, sizeof(StoredChunk*));
+    if (table == NULL)
+        return false;
+
+    for (size_t i = 0; i < store->capacity; i++) {
+        StoredChunk *chunk = store->table[i];
+        if (chunk == NULL)
+            continue;
+        size_t j = chunk->hash & (capacity - 1);
+        while (table[j])
+            j = (j + 1) & (capacity - 1);
+        table[j] = chunk;
+    }
+    free(store->table);
+    store->table = table;
+    store->capacity = capacity;
+    return true;
+}
+
+/* Symbol: internChunk
+**   Returns the stored chunk equal to [data], adding it to
+**   the store if there isn't one, with a new reference.
+*/
+PRIVATE StoredChunk *internChunk(GapBufferStore *store, const char *data, size_t len)
+{
+    uint64_t hash = hashChunk(data, len);
+    size_t mask = store->capacity - 1;
+    size_t i = hash & mask;
+    while (store->table[i]) {
+        StoredChunk *chunk = store->table[i];
+        if (chunk->hash == hash && chunk->size == len && !memcmp(chunk->data, data, len)) {
+            chunk->refs++;
+            return chunk;
+        }
+        i = (i + 1) & mask;
+    }
+
+    // Keep the load factor under 1/2
+    if (2 * (store->count + 1) > store->capacity) {
+        if (!growStoreTable(store))
+            return NULL;
+        mask = store->capacity - 1;
+        i = hash & mask;
+        while (store->table[i])
+            i = (i + 1) & mask;
+    }
+
+    StoredChunk *chunk = malloc(sizeof(StoredChunk) + len);
+    if (chunk == NULL)
+        return NULL;
+    chunk->hash = hash;
+    chunk->refs = 1;
+    chunk->size = len;
+    memcpy(chunk->data, data, len);
+
+    store->table[i] = chunk;
+    store->count++;
+    store->bytes += len;
+    return chunk;
+}
+
+/* Symbol: releaseChunk
+**   Drop a reference to a chunk, removing it from the
+**   store when it was the last one. Removal shifts back
+**   the following entries of the probe sequence, so the
+**   table never holds tombstones.
+*/
+PRIVATE void releaseChunk(GapBufferStore *store, StoredChunk *chunk)
+{
+    if (--chunk->refs > 0)
+        return;
+
+    size_t mask = store->capacity - 1;
+    size_t i = chunk->hash & mask;
+    while (store->table[i] != chunk)
+        i = (i + 1) & mask;
+
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        StoredChunk *next = store->table[j];
+        if (next == NULL)
+            break;
+        // Move [next] into the hole if its home slot isn't
+        // between the hole and its current position.
+        size_t home = next->hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            store->table[i] = next;
+            i = j;
+        }
+    }
+    store->table[i] = NULL;
+
+    store->count--;
+    store->bytes -= chunk->size;
+    free(chunk);
+}
+
+typedef struct {
+    GapBufferStore    *store;
+    GapBufferDocument *doc;
+    size_t             max_chunks;
+    char               pending[GAPBUFFER_STORE_MAX_CHUNK];
+    size_t             num_pending;
+    uint64_t           hash;
+} DocumentWriter;
+
+PRIVATE bool flushChunk(DocumentWriter *w)
+{
+    if (w->num_pending == 0)
+        return true;
+
+    if (w->doc->num_chunks == w->max_chunks) {
+        size_t max_chunks = 2 * w->max_chunks;
+        GapBufferDocument *doc = realloc(w->doc, sizeof(GapBufferDocument) + max_chunks * sizeof(StoredChunk*));
+        if (doc == NULL)
+            return false;
+        w->doc = doc;
+        w->max_chunks = max_chunks;
+    }
+
+    StoredChunk *chunk = internChunk(w->store, w->pending, w->num_pending);
+    if (chunk == NULL)
+        return false;
+    w->doc->chunks[w->doc->num_chunks++] = chunk;
+    w->doc->bytes += w->num_pending;
+    w->num_pending = 0;
+    w->hash = 0;
+    return true;
+}
+
+/* Symbol: writeDocument
+**   Split [str] in chunks, continuing the one that's
+**   being built.
+*/
+PRIVATE bool writeDocument(DocumentWriter *w, String str)
+{
+    const uint64_t cut_mask = ((uint64_t) 1 << GAPBUFFER_STORE_CUT_BITS) - 1;
+
+    for (size_t i = 0; i < str.size; i++) {
+
+        uint8_t byte = str.data[i];
+        w->pending[w->num_pending++] = byte;
+
+        // Gear hash: each byte is shifted out after 64 more,
+        // so the hash only depends on the last 64 bytes. The
+        // cut is decided by its high bits, which depend on
+        // more bytes than the low ones.
+        w->hash = (w->hash << 1) + w->store->gear[byte];
+
+        bool cut = w->num_pending >= GAPBUFFER_STORE_MIN_CHUNK
+                && ((w->hash >> (64 - GAPBUFFER_STORE_CUT_BITS)) & cut_mask) == 0;
+        if ((cut || w->num_pending == GAPBUFFER_STORE_MAX_CHUNK) && !flushChunk(w))
+            return false;
+    }
+    return true;
+}
+
+/* Symbol: GapBufferStore_save
+**
+**   Store the text of a buffer, sharing the chunks it has
+**   in common with the texts already in the store.
+**
+** Returns:
+**   A new document with a single reference, or NULL if
+**   memory couldn't be allocated.
+*/
+GapBufferDocument *GapBufferStore_save(GapBufferStore *store, GapBuffer *buff)
+{
+    rehydrate(buff);
+
+    DocumentWriter *w = malloc(sizeof(DocumentWriter));
+    if (w == NULL)
+        return NULL;
+    w->store = store;
+    w->max_chunks = 8;
+    w->num_pending = 0;
+    w->hash = 0;
+    w->doc = malloc(sizeof(GapBufferDocument) + w->max_chunks * sizeof(StoredChunk*));
+    if (w->doc == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->doc->store = store;
+    w->doc->refs = 1;
+    w->doc->bytes = 0;
+    w->doc->num_chunks = 0;
+
+    // The text of a relocation in progress is read where
+    // it is, a slice at the time.
+    bool written = true;
+    size_t count = getByteCount(buff);
+    for (size_t off = 0; written && off < count;) {
+        String slice = getOrderedSlice(buff, off);
+        written = writeDocument(w, slice);
+        off += slice.size;
+    }
+    if (!written || !flushChunk(w)) {
+        for (size_t i = 0; i < w->doc->num_chunks; i++)
+            releaseChunk(store, w->doc->chunks[i]);
+        free(w->doc);
+        free(w);
+        return NULL;
+    }
+
+    GapBufferDocument *doc = w->doc;
+    free(w);
+
+    // Give back the unused part of the chunk list
+    GapBufferDocument *shrunk = realloc(doc, sizeof(GapBufferDocument) + doc->num_chunks * sizeof(StoredChunk*));
+    if (shrunk)
+        doc = shrunk;
+
+    store->documents++;
+    return doc;
+}
+
+/* Symbol: GapBufferDocument_clone
+**
+**   Returns a new reference to an immutable document.
+**   Documents are reference counted, so cloning only
+**   costs a counter increment and returns [doc] itself.
+**
+** Notes:
+**   - Each reference, the one returned by
+**     GapBufferStore_save and each clone, must be released
+**     with GapBufferDocument_release. The document is
+**     freed when the last one is.
+*/
+GapBufferDocument *GapBufferDocument_clone(GapBufferDocument *doc)
+{
+    doc->refs++;
+    doc->store->documents++;
+    return doc;
+}
+
+void GapBufferDocument_release(GapBufferDocument *doc)
+{
+    GapBufferStore *store = doc->store;
+    store->documents--;
+    if (--doc->refs > 0)
+        return;
+
+    for (size_t i = 0; i < doc->num_chunks; i++)
+        releaseChunk(store, doc->chunks[i]);
+    free(doc);
+}
+
+size_t GapBufferDocument_getByteCount(const GapBufferDocument *doc)
+{
+    return doc->bytes;
+}
+
+/* Symbol: GapBufferDocument_load
+**
+**   Create a gap buffer holding the text of a document
+**   and a gap of [extra] bytes, with the cursor at the
+**   end of the text.
+*/
+GapBuffer *GapBufferDocument_load(const GapBufferDocument *doc, size_t extra)
+{
+    GapBuffer *buff = GapBuffer_create(doc->bytes + extra);
+    if (buff == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < doc->num_chunks; i++) {
+        StoredChunk *chunk = doc->chunks[i];
+        insertBytesBeforeCursor(buff, (String) { .data=chunk->data, .size=chunk->size });
+    }
+    return buff;
+}
+
+/* Symbol: GapBufferStore_getStats
+**   Compare the memory used by the store with the text
+**   its documents hold.
+*/
+void GapBufferStore_getStats(const GapBufferStore *store, GapBufferStoreStats *stats)
+{
+    stats->chunks = store->count;
+    stats->chunk_bytes = store->bytes;
+    stats->memory = sizeof(GapBufferStore)
+                  + store->capacity * sizeof(StoredChunk*)
+                  + store->count * sizeof(StoredChunk)
+                  + store->bytes;
+}
+
+/* Symbol: GapBufferDocument_getMemory
+**   Returns the memory used by the metadata of a document,
+**   which is all a clone costs.
+*/
+size_t GapBufferDocument_getMemory(const GapBufferDocument *doc)
+{
+    return sizeof(GapBufferDocument) + doc->num_chunks * sizeof(StoredChunk*);
+}
+#endif
+
+#ifndef GAPBUFFER_NOMALLOC
+
+/* Symbol: GapBufferVersion
+**
+**   An immutable copy of the text of a gap buffer, made by
+**   GapBuffer_commitVersion, which stays readable while the
+**   buffer is edited further. The text is held by a B-tree
+**   whose leaves store up to GAPBUFFER_VERSION_LEAF bytes
+**   and whose other nodes up to GAPBUFFER_VERSION_FANOUT
+**   children, along with the bytes below them.
+**
+**   Nodes never change once created, so versions share
+**   them. A commit only creates the leaves holding the
+**   bytes that changed since the previous one and copies
+**   the nodes on their paths to the root, pointing to the
+**   nodes of the previous version for everything else.
+**   Nodes are reference counted and freed when no version
+**   uses them anymore.
+**
+**   The buffer only tracks the bytes left untouched at the
+**   start and at the end of the text since the last commit,
+**   so distant edits between two commits copy all of the
+**   text in between.
+**
+** Notes:
+**   - Versions aren't thread-safe.
+*/
+
+#ifndef GAPBUFFER_VERSION_LEAF
+#define GAPBUFFER_VERSION_LEAF 512
+#endif
+#ifndef GAPBUFFER_VERSION_FANOUT
+#define GAPBUFFER_VERSION_FANOUT 16
+#endif
+
+// Nodes are followed by the pointers to their children,
+// or by their text if they're leaves.
+typedef struct VersionNode VersionNode;
+struct VersionNode {
+    size_t refs;
+    size_t bytes; // Of text below the node
+    size_t count; // Children, which leaves have none of
+};
+
+#define NODE_CHILDREN(NODE) ((VersionNode**) ((NODE) + 1))
+#define NODE_TEXT(NODE) ((const char*) ((NODE) + 1))
+
+struct GapBufferVersion {
+    size_t       refs;
+    VersionNode *root;   // NULL if the text is empty
+    int          height; // Of the root, leaves being at 0
+    size_t       memory; // Allocated by the commit that made it
+};
+
+// List of nodes, each holding a reference
+typedef struct {
+    VersionNode **items;
+    size_t        count;
+    size_t        capacity;
+} NodeList;
+
+/* Symbol: trackEdit
+**   Shrink the bytes left untouched since the last commit
+**   at the start and at the end of the text to exclude
+**   the ones changed by an edit stream record.
+*/
+PRIVATE void trackEdit(GapBuffer *buff, int type, size_t num)
+{
+    size_t count = getByteCount(buff);
+    size_t cursor = getCursorOffset(buff);
+
+    size_t pos;
+    size_t inserted = 0;
+    size_t removed = 0;
+    switch (type) {
+        case STREAM_INSERT:           pos = cursor - num; inserted = num; break;
+        case STREAM_REMOVE_FORWARDS:  pos = cursor; removed = num; break;
+        case STREAM_REMOVE_BACKWARDS: pos = cursor; removed = num; break;
+        case STREAM_CONSUME:          pos = 0; removed = num; break;
+        default: return;
+    }
+
+    size_t before = count - inserted + removed;
+    buff->unchanged_head = MIN(buff->unchanged_head, pos);
+    buff->unchanged_tail = MIN(buff->unchanged_tail, before - pos - removed);
+}
+
+PRIVATE void releaseNode(VersionNode *node)
+{
+    if (--node->refs > 0)
+        return;
+    for (size_t i = 0; i < node->count; i++)
+        releaseNode(NODE_CHILDREN(node)[i]);
+    free(node);
+}
+
+// Appends a node to the list, or drops its reference if
+// memory couldn't be allocated.
+PRIVATE bool pushNode(NodeList *list, VersionNode *node)
+{
+    if (list->count == list->capacity) {
+        size_t capacity = MAX(2 * list->capacity, 2 * GAPBUFFER_VERSION_FANOUT);
+        VersionNode **items = realloc(list->items, capacity * sizeof(VersionNode*));
+        if (items == NULL) {
+            releaseNode(node);
+            return false;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = node;
+    return true;
+}
+
+PRIVATE void clearNodes(NodeList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+        releaseNode(list->items[i]);
+    free(list->items);
+    *list = (NodeList) {0};
+}
+
+PRIVATE VersionNode *createLeaf(const GapBuffer *buff, size_t off, size_t len, size_t *memory)
+{
+    size_t size = sizeof(VersionNode) + len;
+    VersionNode *leaf = malloc(size);
+    if (leaf == NULL)
+        return NULL;
+    *leaf = (VersionNode) { .refs=1, .bytes=len, .count=0 };
+
+    char *text = (char*) (leaf + 1);
+    for (size_t copied = 0; copied < len; ) {
+        String slice = getOrderedSlice(buff, off + copied);
+        size_t num = MIN(slice.size, len - copied);
+        memcpy(text + copied, slice.data, num);
+        copied += num;
+    }
+    COST(copied, len);
+
+    *memory += size;
+    return leaf;
+}
+
+// Takes the references to the children
+PRIVATE VersionNode *createBranch(VersionNode **children, size_t count, size_t *memory)
+{
+    size_t size = sizeof(VersionNode) + count * sizeof(VersionNode*);
+    VersionNode *node = malloc(size);
+    if (node == NULL)
+        return NULL;
+    *node = (VersionNode) { .refs=1, .bytes=0, .count=count };
+    for (size_t i = 0; i < count; i++) {
+        NODE_CHILDREN(node)[i] = children[i];
+        node->bytes += children[i]->bytes;
+    }
+    *memory += size;
+    return node;
+}
+
+/* Symbol: packNodes
+**   Group the nodes of [in] in order under as few new
+**   parents as possible, with the same number of children
+**   give or take one, and append the parents to [out].
+**   The references held by [in] pass to the parents and
+**   [in] is left empty, even on failure.
+*/
+PRIVATE bool packNodes(NodeList *in, NodeList *out, size_t *memory)
+{
+    size_t groups = (in->count + GAPBUFFER_VERSION_FANOUT - 1) / GAPBUFFER_VERSION_FANOUT;
+    size_t done = 0;
+    for (size_t i = 0; i < groups; i++) {
+        size_t num = (in->count - done) / (groups - i);
+        VersionNode *node = createBranch(in->items + done, num, memory);
+        if (node == NULL)
+            break;
+        done += num;
+        if (!pushNode(out, node))
+            break;
+    }
+
+    bool ok = (done == in->count);
+    for (size_t i = done; i < in->count; i++)
+        releaseNode(in->items[i]);
+    free(in->items);
+    *in = (NodeList) {0};
+    return ok;
+}
+
+/* Symbol: mergeSparseNodes
+**   Regroup the children of the nodes of [list] that have
+**   less than a quarter of the maximum with the ones of a
+**   neighbour, so that the depth of the tree stays
+**   logarithmic in the length of the text.
+*/
+PRIVATE bool mergeSparseNodes(NodeList *list, size_t *memory)
 {
-    if (!GapBuffer_insertString(*buff, str, len)) {
-        // Need to relocate
-        GapBuffer *buff2 = GapBuffer_create(getByteCount(*buff) + len);
-        if (buff2 == NULL)
-            return false; // Failed to create new location
+    size_t i = 0;
+    while (i < list->count && list->count > 1) {
 
-        if (!GapBuffer_insertString(buff2, str, len)) {
-            // Insertion failed unexpectedly. The gap was created
-            // with enough free memory to hold the new text..
-            GapBuffer_destroy(buff2);
+        if (list->items[i]->count >= GAPBUFFER_VERSION_FANOUT / 4) {
+            i++;
+            continue;
+        }
+
+        size_t first = (i + 1 < list->count) ? i : i - 1;
+        VersionNode *a = list->items[first];
+        VersionNode *b = list->items[first + 1];
+
+        NodeList children = {0};
+        for (size_t j = 0; j < a->count + b->count; j++) {
+            VersionNode *child = (j < a->count) ? NODE_CHILDREN(a)[j] : NODE_CHILDREN(b)[j - a->count];
+            child->refs++;
+            if (!pushNode(&children, child)) {
+                clearNodes(&children);
+                return false;
+            }
+        }
+
+        NodeList merged = {0};
+        if (!packNodes(&children, &merged, memory)) {
+            clearNodes(&merged);
             return false;
         }
+        releaseNode(a);
+        releaseNode(b);
 
-        // Swap the parent buffer with the new one
-        GapBuffer_destroy(*buff);
-        *buff = buff2;
+        list->items[first] = merged.items[0];
+        if (merged.count == 2)
+            list->items[first + 1] = merged.items[1];
+        else {
+            memmove(list->items + first + 1, list->items + first + 2, (list->count - first - 2) * sizeof(VersionNode*));
+            list->count--;
+        }
+        free(merged.items);
+
+        // The merged node may still be sparse
+        i = first;
+        if (merged.count == 2)
+            i += 2;
+    }
+    return true;
+}
+
+/* Symbol: rebuildNode
+**
+**   Append to [out] the nodes that replace [node], of the
+**   given [height] and holding the bytes of the previous
+**   version starting at [start]. Subtrees with no bytes in
+**   the range [a, b) are kept, the leaves in it replaced by
+**   the ones in [leaves] and the nodes in between copied.
+*/
+PRIVATE bool rebuildNode(VersionNode *node, int height, size_t start, size_t a, size_t b,
+                         NodeList *leaves, NodeList *out, size_t *memory)
+{
+    if (start + node->bytes <= a || start >= b) {
+        node->refs++;
+        return pushNode(out, node);
+    }
+
+    if (height == 0) {
+        // The first leaf of the range is replaced by the new
+        // ones and the others are dropped.
+        if (start == a) {
+            for (size_t i = 0; i < leaves->count; i++) {
+                if (!pushNode(out, leaves->items[i])) {
+                    for (size_t j = i + 1; j < leaves->count; j++)
+                        releaseNode(leaves->items[j]);
+                    leaves->count = 0;
+                    return false;
+                }
+            }
+            leaves->count = 0;
+        }
+        return true;
+    }
+
+    NodeList children = {0};
+    for (size_t i = 0; i < node->count; i++) {
+        VersionNode *child = NODE_CHILDREN(node)[i];
+        if (!rebuildNode(child, height - 1, start, a, b, leaves, &children, memory)) {
+            clearNodes(&children);
+            return false;
+        }
+        start += child->bytes;
+    }
+
+    if (height > 1 && !mergeSparseNodes(&children, memory)) {
+        clearNodes(&children);
+        return false;
+    }
+    return packNodes(&children, out, memory);
+}
+
+// Returns the leaf holding the byte at [pos], or the last
+// one if [pos] is the end of the text, and stores the
+// offset of its first byte in [start].
+PRIVATE const VersionNode *findLeaf(const GapBufferVersion *version, size_t pos, size_t *start)
+{
+    const VersionNode *node = version->root;
+    *start = 0;
+    while (node->count > 0) {
+        size_t i = 0;
+        while (i + 1 < node->count && pos >= *start + NODE_CHILDREN(node)[i]->bytes) {
+            *start += NODE_CHILDREN(node)[i]->bytes;
+            i++;
+        }
+        node = NODE_CHILDREN(node)[i];
+    }
+    return node;
+}
+
+/* Symbol: GapBuffer_commitVersion
+**
+**   Make a version holding the current text of the buffer.
+**   The first commit copies all of the text, the following
+**   ones only the leaves holding the bytes that changed
+**   since the previous commit (see GapBufferVersion). The
+**   buffer holds a reference to its last version until
+**   it's destroyed.
+**
+** Returns:
+**   A new reference to the version, to be released with
+**   GapBufferVersion_release, or NULL if memory couldn't
+**   be allocated.
+*/
+GapBufferVersion *GapBuffer_commitVersion(GapBuffer *buff)
+{
+    TRACE(buff, NULL, 0, NULL, 0);
+    rehydrate(buff);
+
+    GapBufferVersion *prev = buff->committed;
+    size_t count = getByteCount(buff);
+    size_t prev_bytes = GapBufferVersion_getByteCount(prev);
+
+    // Bytes [head, prev_bytes - tail) of the previous version
+    // became bytes [head, count - tail) of the text.
+    size_t head = 0;
+    size_t tail = 0;
+    if (prev) {
+        head = MIN(buff->unchanged_head, MIN(prev_bytes, count));
+        tail = MIN(buff->unchanged_tail, MIN(prev_bytes, count) - head);
+        if (count == prev_bytes && head + tail == count)
+            return GapBufferVersion_clone(prev);
+    }
+
+    // Widen the changed bytes to whole leaves
+    size_t a = 0;
+    size_t b = 0;
+    if (prev_bytes > 0) {
+        size_t start;
+        const VersionNode *leaf = findLeaf(prev, head, &start);
+        a = start;
+        b = start + leaf->bytes;
+        if (prev_bytes - tail > b) {
+            leaf = findLeaf(prev, prev_bytes - tail - 1, &start);
+            b = start + leaf->bytes;
+        }
+
+        // Don't leave a small leaf behind when there's a
+        // neighbour to merge it with
+        if ((b + count) - (prev_bytes + a) < GAPBUFFER_VERSION_LEAF / 2) {
+            if (b < prev_bytes) {
+                leaf = findLeaf(prev, b, &start);
+                b = start + leaf->bytes;
+            } else if (a > 0) {
+                findLeaf(prev, a - 1, &start);
+                a = start;
+            }
+        }
+    }
+    size_t len = (b + count) - (prev_bytes + a);
+
+    size_t memory = sizeof(GapBufferVersion);
+    NodeList leaves = {0};
+    size_t num_leaves = (len + GAPBUFFER_VERSION_LEAF - 1) / GAPBUFFER_VERSION_LEAF;
+    for (size_t i = 0, done = 0; i < num_leaves; i++) {
+        size_t num = (len - done) / (num_leaves - i);
+        VersionNode *leaf = createLeaf(buff, a + done, num, &memory);
+        if (leaf == NULL || !pushNode(&leaves, leaf)) {
+            clearNodes(&leaves);
+            return NULL;
+        }
+        done += num;
+    }
+
+    NodeList nodes = {0};
+    int height = 0;
+    if (prev_bytes == 0) {
+        nodes = leaves;
+        leaves = (NodeList) {0};
+    } else {
+        height = prev->height;
+        bool ok = rebuildNode(prev->root, height, 0, a, b, &leaves, &nodes, &memory);
+        clearNodes(&leaves);
+        if (!ok) {
+            clearNodes(&nodes);
+            return NULL;
+        }
+    }
+
+    while (nodes.count > 1) {
+        NodeList parents = {0};
+        if (height > 0 && !mergeSparseNodes(&nodes, &memory)) {
+            clearNodes(&nodes);
+            return NULL;
+        }
+        if (!packNodes(&nodes, &parents, &memory)) {
+            clearNodes(&parents);
+            return NULL;
+        }
+        nodes = parents;
+        height++;
+    }
+    VersionNode *root = nodes.count ? nodes.items[0] : NULL;
+    free(nodes.items);
+
+    // Roots with a single child are replaced by it
+    while (root && root->count == 1) {
+        VersionNode *child = NODE_CHILDREN(root)[0];
+        child->refs++;
+        if (root->refs == 1)
+            memory -= sizeof(VersionNode) + sizeof(VersionNode*);
+        releaseNode(root);
+        root = child;
+        height--;
+    }
+
+    GapBufferVersion *version = NULL;
+    if (height < GAPBUFFER_VERSION_DEPTH)
+        version = malloc(sizeof(GapBufferVersion));
+    if (version == NULL) {
+        if (root)
+            releaseNode(root);
+        return NULL;
+    }
+    version->refs = 2; // The buffer's and the caller's
+    version->root = root;
+    version->height = height;
+    version->memory = memory;
+
+    if (prev)
+        GapBufferVersion_release(prev);
+    buff->committed = version;
+    buff->unchanged_head = count;
+    buff->unchanged_tail = count;
+    return version;
+}
+
+/* Symbol: GapBufferVersion_clone
+**   Returns a new reference to an immutable version.
+**   Cloning only costs a counter increment.
+*/
+GapBufferVersion *GapBufferVersion_clone(GapBufferVersion *version)
+{
+    version->refs++;
+    return version;
+}
+
+void GapBufferVersion_release(GapBufferVersion *version)
+{
+    if (version == NULL || --version->refs > 0)
+        return;
+    if (version->root)
+        releaseNode(version->root);
+    free(version);
+}
+
+size_t GapBufferVersion_getByteCount(const GapBufferVersion *version)
+{
+    if (version == NULL || version->root == NULL)
+        return 0;
+    return version->root->bytes;
+}
+
+/* Symbol: GapBufferVersion_getMemory
+**   Returns the memory allocated by the commit that made
+**   the version, which doesn't count the nodes it shares
+**   with the previous one.
+*/
+size_t GapBufferVersion_getMemory(const GapBufferVersion *version)
+{
+    return version->memory;
+}
+
+PRIVATE void copyNode(const VersionNode *node, size_t off, char *dst, size_t len)
+{
+    if (node->count == 0) {
+        memcpy(dst, NODE_TEXT(node) + off, len);
+        return;
+    }
+    for (size_t i = 0; i < node->count && len > 0; i++) {
+        const VersionNode *child = NODE_CHILDREN(node)[i];
+        if (off >= child->bytes) {
+            off -= child->bytes;
+            continue;
+        }
+        size_t num = MIN(len, child->bytes - off);
+        copyNode(child, off, dst, num);
+        dst += num;
+        len -= num;
+        off = 0;
+    }
+}
+
+/* Symbol: GapBufferVersion_copy
+**   Copy up to [len] bytes of the text of a version that
+**   start [off] bytes from its start into [dst]. Only the
+**   nodes holding them are visited.
+**
+** Returns:
+**   The number of bytes copied.
+*/
+size_t GapBufferVersion_copy(const GapBufferVersion *version, size_t off, char *dst, size_t len)
+{
+    size_t bytes = GapBufferVersion_getByteCount(version);
+    if (off >= bytes)
+        return 0;
+    len = MIN(len, bytes - off);
+    copyNode(version->root, off, dst, len);
+    return len;
+}
+
+PRIVATE void loadNode(GapBuffer *buff, const VersionNode *node)
+{
+    if (node->count == 0) {
+        insertBytesBeforeCursor(buff, (String) { .data=NODE_TEXT(node), .size=node->bytes });
+        return;
+    }
+    for (size_t i = 0; i < node->count; i++)
+        loadNode(buff, NODE_CHILDREN(node)[i]);
+}
+
+/* Symbol: GapBufferVersion_load
+**
+**   Create a gap buffer holding the text of a version
+**   and a gap of [extra] bytes, with the cursor at the
+**   end of the text.
+*/
+GapBuffer *GapBufferVersion_load(const GapBufferVersion *version, size_t extra)
+{
+    GapBuffer *buff = GapBuffer_create(GapBufferVersion_getByteCount(version) + extra);
+    if (buff == NULL)
+        return NULL;
+    if (version->root)
+        loadNode(buff, version->root);
+    return buff;
+}
+
+// Goes down to the first leaf below the node at [depth]
+PRIVATE void descendToLeaf(GapBufferVersionIter *iter, int depth)
+{
+    const VersionNode *node = iter->path[depth];
+    while (node->count > 0) {
+        iter->index[depth] = 0;
+        node = NODE_CHILDREN(node)[0];
+        iter->path[++depth] = node;
+    }
+}
+
+// Moves to the leaf after the current one
+PRIVATE void moveToNextLeaf(GapBufferVersionIter *iter)
+{
+    int depth = iter->version->height - 1;
+    while (depth >= 0) {
+        const VersionNode *node = iter->path[depth];
+        if ((size_t) iter->index[depth] + 1 < node->count) {
+            iter->index[depth]++;
+            iter->path[depth + 1] = NODE_CHILDREN(node)[iter->index[depth]];
+            descendToLeaf(iter, depth + 1);
+            return;
+        }
+        depth--;
+    }
+    iter->done = true;
+}
+
+/* Symbol: GapBufferVersionIter_init
+**   Start iterating over the lines of a version, which
+**   must outlive the iterator.
+*/
+void GapBufferVersionIter_init(GapBufferVersionIter *iter, const GapBufferVersion *version)
+{
+    iter->version = version;
+    iter->cur = 0;
+    iter->offset = 0;
+    iter->line_offset = 0;
+    iter->line_length = 0;
+    iter->done = (version->root == NULL);
+    if (!iter->done) {
+        iter->path[0] = version->root;
+        descendToLeaf(iter, 0);
+    }
+}
+
+/* Symbol: GapBufferVersionIter_next
+**
+**   Get the next line of the text of a version. Lines
+**   spanning leaves are copied in the iterator's scratch
+**   memory, and if they don't fit they're truncated. The
+**   returned line is valid until the next call.
+**
+**   The offset and the length of the whole line are stored
+**   in [line_offset] and [line_length], so a truncated line
+**   (one whose length is less than [line_length]) can be
+**   read with GapBufferVersion_copy.
+**
+** Returns:
+**   [false] if there are no more lines.
+*/
+bool GapBufferVersionIter_next(GapBufferVersionIter *iter, GapBufferLine *line)
+{
+    size_t copied = 0;
+    size_t length = 0;
+    size_t offset = iter->offset;
+    bool   spans_leaves = false;
+    const char *str = NULL;
+
+    while (!iter->done) {
+
+        const VersionNode *leaf = iter->path[iter->version->height];
+        const char *start = NODE_TEXT(leaf) + iter->cur;
+        size_t left = leaf->bytes - iter->cur;
+        const char *newline = memchr(start, '\n', left);
+        size_t num = newline ? (size_t) (newline - start) : left;
+
+        if (spans_leaves) {
+            size_t n = MIN(num, sizeof(iter->maybe) - copied);
+            memcpy(iter->maybe + copied, start, n);
+            copied += n;
+        } else if (length == 0)
+            str = start;
+        length += num;
+        iter->offset += num;
+
+        if (newline) {
+            iter->cur += num + 1;
+            iter->offset++;
+            break;
+        }
+
+        // The line continues in the next leaf
+        if (!spans_leaves && length > 0) {
+            spans_leaves = true;
+            copied = MIN(length, sizeof(iter->maybe));
+            memcpy(iter->maybe, str, copied);
+        }
+
+        iter->cur = 0;
+        moveToNextLeaf(iter);
+
+        if (iter->done && length == 0)
+            return false;
     }
 
+    if (str == NULL && !spans_leaves)
+        return false;
+
+    if (spans_leaves) {
+        line->str = iter->maybe;
+        line->len = copied;
+    } else {
+        line->str = str;
+        line->len = length;
+    }
+    iter->line_offset = offset;
+    iter->line_length = length;
+    return true;
+}
+#endif
+
+#ifdef GAPBUFFER_TRACE
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+/* Symbol: TraceRing
+**
+**   The events recorded by a thread. Only the thread that
+**   owns the ring writes to it, so recording takes no locks.
+**   When the ring is full, the oldest events are overwritten.
+**
+**   [written] counts all events ever written. A reader
+**   loads it before and after copying the events, and
+**   drops the ones that may have been overwritten in the
+**   meantime.
+**
+**   Rings are pushed to a global list the first time their
+**   thread records an event, and stay there until
+**   GapBufferTrace_clear.
+*/
+typedef struct {
+    const TraceSite *site;
+    const void      *buff;
+    int64_t          args[2];
+    uint64_t         start;    // Nanoseconds
+    uint64_t         duration; // Nanoseconds
+    GapBufferCost    cost;
+} TraceEvent;
+
+typedef struct TraceRing TraceRing;
+struct TraceRing {
+    TraceRing     *next;
+    unsigned int   tid;
+    unsigned int   calls;      // Used for sampling
+    uint64_t       generation; // The one of the recording it belongs to
+    size_t         capacity;
+    _Atomic size_t written;
+    TraceEvent     events[];
+};
+
+static _Atomic bool       trace_enabled;
+static _Atomic uint64_t   trace_generation;
+static _Atomic(TraceRing*) trace_rings;
+static _Atomic unsigned int trace_threads;
+static size_t             trace_capacity;
+static unsigned int       trace_sampling;
+static uint64_t           trace_origin;
+
+// The ring of the calling thread and the recording it was
+// created for. The generation is kept apart since the ring
+// may have been freed by GapBufferTrace_clear.
+static _Thread_local TraceRing *trace_ring;
+static _Thread_local uint64_t   trace_ring_generation;
+
+PRIVATE uint64_t getTraceTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Symbol: getTraceRing
+**
+**   Returns the ring of the calling thread for the current
+**   recording, creating it if needed, or NULL if it can't
+**   be allocated.
+*/
+PRIVATE TraceRing *getTraceRing(void)
+{
+    uint64_t generation = atomic_load_explicit(&trace_generation, memory_order_acquire);
+    if (trace_ring && trace_ring_generation == generation)
+        return trace_ring;
+
+    TraceRing *ring = malloc(sizeof(TraceRing) + trace_capacity * sizeof(TraceEvent));
+    if (ring == NULL)
+        return NULL;
+    ring->tid = atomic_fetch_add(&trace_threads, 1) + 1;
+    ring->calls = 0;
+    ring->generation = generation;
+    ring->capacity = trace_capacity;
+    atomic_init(&ring->written, 0);
+
+    ring->next = atomic_load(&trace_rings);
+    while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring));
+
+    trace_ring = ring;
+    trace_ring_generation = generation;
+    return ring;
+}
+
+PRIVATE TraceSpan beginTraceSpan(const TraceSite *site, const void *buff, int64_t arg0, int64_t arg1)
+{
+    TraceSpan span = { .site = site, .sampled = false };
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+        return span;
+
+    TraceRing *ring = getTraceRing();
+    if (ring == NULL || ring->calls++ % trace_sampling != 0)
+        return span;
+
+    span.buff = buff;
+    span.args[0] = arg0;
+    span.args[1] = arg1;
+    span.cost = trace_cost;
+    span.sampled = true;
+    span.start = getTraceTime();
+    return span;
+}
+
+PRIVATE void endTraceSpan(TraceSpan *span)
+{
+    if (!span->sampled)
+        return;
+
+    uint64_t end = getTraceTime();
+
+    // The recording may have been cleared during the call
+    TraceRing *ring = trace_ring;
+    if (ring == NULL || trace_ring_generation != atomic_load_explicit(&trace_generation, memory_order_acquire))
+        return;
+
+    size_t written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    TraceEvent *event = &ring->events[written % ring->capacity];
+    event->site = span->site;
+    event->buff = span->buff;
+    event->args[0] = span->args[0];
+    event->args[1] = span->args[1];
+    event->start = span->start;
+    event->duration = end - span->start;
+    event->cost.copied      = trace_cost.copied      - span->cost.copied;
+    event->cost.scanned     = trace_cost.scanned     - span->cost.scanned;
+    event->cost.allocations = trace_cost.allocations - span->cost.allocations;
+    event->cost.allocated   = trace_cost.allocated   - span->cost.allocated;
+    atomic_store_explicit(&ring->written, written + 1, memory_order_release);
+}
+
+/* Symbol: GapBufferTrace_start
+**
+**   Start recording the calls to the GapBuffer_* functions
+**   made by all threads. Each thread keeps its last
+**   [capacity] events. If [sampling] is greater than 1,
+**   only one call every [sampling] is recorded by each
+**   thread.
+**
+**   Events of earlier recordings aren't part of the new
+**   one, even if GapBufferTrace_clear wasn't called. They
+**   are freed by GapBufferTrace_clear.
+**
+** Returns:
+**   [false] if a recording is already in progress or the
+**   arguments are invalid.
+*/
+bool GapBufferTrace_start(size_t capacity, unsigned int sampling)
+{
+    if (capacity == 0 || atomic_load(&trace_enabled))
+        return false;
+
+    trace_capacity = capacity;
+    trace_sampling = MAX(sampling, 1);
+    if (trace_origin == 0)
+        trace_origin = getTraceTime();
+
+    atomic_fetch_add_explicit(&trace_generation, 1, memory_order_release);
+    atomic_store(&trace_enabled, true);
     return true;
 }
-#endif
\ No newline at end of file
+
+/* Symbol: GapBufferTrace_stop
+**   Stop recording. The recorded events are kept until
+**   GapBufferTrace_clear, so they can be written.
+*/
+void GapBufferTrace_stop(void)
+{
+    atomic_store(&trace_enabled, false);
+}
+
+/* Symbol: GapBufferTrace_clear
+**
+**   Free the recorded events.
+**
+** Notes:
+**   - No thread must be calling the library when this
+**     is called, since it may be recording an event.
+*/
+void GapBufferTrace_clear(void)
+{
+    GapBufferTrace_stop();
+    atomic_fetch_add(&trace_generation, 1);
+
+    TraceRing *ring = atomic_exchange(&trace_rings, NULL);
+    while (ring) {
+        TraceRing *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    trace_ring = NULL;
+}
+
+typedef struct {
+    int    fd;
+    size_t used;
+    bool   failed;
+    char   data[1 << 16];
+} TraceWriter;
+
+PRIVATE void flushTraceWriter(TraceWriter *w)
+{
+    size_t done = 0;
+    while (done < w->used && !w->failed) {
+        ssize_t n = write(w->fd, w->data + done, w->used - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            w->failed = true;
+        else
+            done += n;
+    }
+    w->used = 0;
+}
+
+__attribute__((format(printf, 2, 3)))
+PRIVATE void writeTrace(TraceWriter *w, const char *fmt, ...)
+{
+    if (sizeof(w->data) - w->used < 512)
+        flushTraceWriter(w);
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(w->data + w->used, sizeof(w->data) - w->used, fmt, args);
+    va_end(args);
+    if (n > 0)
+        w->used += MIN((size_t) n, sizeof(w->data) - w->used - 1);
+}
+
+/* Symbol: GapBufferTrace_writeJSON
+**
+**   Write the recorded events to [fd] in the Chrome trace
+**   event format, which can be opened by chrome://tracing
+**   and Perfetto. Each call is a complete event ("X") on
+**   the track of its thread, with the buffer, the arguments
+**   of the call and the bytes it copied and scanned as
+**   arguments. Calls made by other calls appear nested in
+**   them.
+**
+**   It can be called while recording. Events recorded
+**   while it runs may be left out.
+**
+** Returns:
+**   [false] if the events couldn't be written.
+*/
+bool GapBufferTrace_writeJSON(int fd)
+{
+    TraceWriter *w = malloc(sizeof(TraceWriter));
+    if (w == NULL)
+        return false;
+    w->fd = fd;
+    w->used = 0;
+    w->failed = false;
+
+    writeTrace(w, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+
+    uint64_t generation = atomic_load_explicit(&trace_generation, memory_order_acquire);
+    for (TraceRing *ring = atomic_load(&trace_rings); ring; ring = ring->next) {
+
+        // Rings of earlier recordings
+        if (ring->generation != generation)
+            continue;
+
+        size_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+        size_t start = written > ring->capacity ? written - ring->capacity : 0;
+
+        for (size_t i = start; i < written; i++) {
+
+            TraceEvent event = ring->events[i % ring->capacity];
+
+            // Skip the event if the thread overwrote it while
+            // it was being copied. The slot of the event after
+            // the last written one may be being written.
+            atomic_thread_fence(memory_order_acquire);
+            size_t now = atomic_load_explicit(&ring->written, memory_order_relaxed);
+            if (i + ring->capacity <= now + 1)
+                continue;
+
+            const TraceSite *site = event.site;
+            uint64_t ts = event.start - MIN(event.start, trace_origin);
+            writeTrace(w, "%s\n{\"name\":\"%s\",\"cat\":\"gap_buffer\",\"ph\":\"X\","
+                          "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":1,\"tid\":%u,"
+                          "\"args\":{\"buff\":\"%p\"",
+                       first ? "" : ",", site->name,
+                       (unsigned long long) ts / 1000, (unsigned long long) ts % 1000,
+                       (unsigned long long) event.duration / 1000, (unsigned long long) event.duration % 1000,
+                       ring->tid, event.buff);
+            for (int j = 0; j < 2; j++)
+                if (site->arg_names[j])
+                    writeTrace(w, ",\"%s\":%lld", site->arg_names[j], (long long) event.args[j]);
+            writeTrace(w, ",\"copied\":%zu,\"scanned\":%zu,\"allocated\":%zu}}",
+                       event.cost.copied, event.cost.scanned, event.cost.allocated);
+            first = false;
+        }
+    }
+    writeTrace(w, "\n]}\n");
+    flushTraceWriter(w);
+
+    bool ok = !w->failed;
+    free(w);
+    return ok;
+}
+#endif
@@ -1,6 +1,14 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+// GapBufferQueue needs C11 atomics, so it's left out when
+// they're not available or GAPBUFFER_NOQUEUE is defined.
+#if !defined(__STDC_VERSION__) || __STDC_VERSION__ < 201112L || defined(__STDC_NO_ATOMICS__)
+#ifndef GAPBUFFER_NOQUEUE
+#define GAPBUFFER_NOQUEUE
+#endif
+#endif
+
 typedef struct GapBuffer GapBuffer;
 
 typedef struct {
@@ -18,17 +26,322 @@ typedef struct {
 
 GapBuffer *GapBuffer_createUsingMemory(void *mem, size_t len, void (*free)(void*));
 GapBuffer *GapBuffer_cloneUsingMemory(void *mem, size_t len, void (*free)(void*), const GapBuffer *src);
+GapBuffer *GapBuffer_relocateUsingMemory(void *mem, size_t len, void (*free)(void*), GapBuffer *src);
+bool       GapBuffer_continueRelocation(GapBuffer *buff, size_t num);
 void       GapBuffer_destroy(GapBuffer *buff);
 bool       GapBuffer_insertString(GapBuffer *buff, const char *str, size_t len);
+char      *GapBuffer_reserve(GapBuffer *buff, size_t num);
+bool       GapBuffer_commit(GapBuffer *buff, size_t num);
 void       GapBuffer_moveRelative(GapBuffer *buff, int off);
 void       GapBuffer_moveAbsolute(GapBuffer *buff, size_t num);
 void       GapBuffer_removeForwards(GapBuffer *buff, size_t num);
 void       GapBuffer_removeBackwards(GapBuffer *buff, size_t num);
+void       GapBuffer_consume(GapBuffer *buff, size_t num);
+bool       GapBuffer_appendDroppingLines(GapBuffer *buff, const char *str, size_t len);
 void       GapBufferIter_init(GapBufferIter *iter, GapBuffer *buff);
 void       GapBufferIter_free(GapBufferIter *iter);
 bool       GapBufferIter_next(GapBufferIter *iter, GapBufferLine *line);
+size_t     GapBuffer_getByteCount(const GapBuffer *buff);
+const char *GapBuffer_getSlice(GapBuffer *buff, size_t off, size_t *len);
+
+typedef struct {
+    size_t copied;      // Bytes moved or copied
+    size_t scanned;     // Bytes read by validations and scans
+    size_t allocations; // Buffers allocated
+    size_t allocated;   // Bytes allocated for them
+} GapBufferCost;
+
+typedef struct {
+    size_t symbols; // Symbols still to be skipped
+    size_t offset;  // Bytes of text skipped so far
+    bool   found;   // [offset] is the destination
+} GapBufferMove;
+
+size_t     GapBuffer_estimateInsert(const GapBuffer *buff, size_t len, GapBufferCost *cost);
+size_t     GapBuffer_estimateRemoveForwards(const GapBuffer *buff, size_t num, GapBufferCost *cost);
+size_t     GapBuffer_estimateRemoveBackwards(const GapBuffer *buff, size_t num, GapBufferCost *cost);
+size_t     GapBuffer_estimateMoveRelative(const GapBuffer *buff, int off, GapBufferCost *cost);
+size_t     GapBuffer_estimateMoveAbsolute(const GapBuffer *buff, size_t num, GapBufferCost *cost);
+size_t     GapBuffer_estimateClone(const GapBuffer *buff, GapBufferCost *cost);
+bool       GapBuffer_moveAbsoluteBudgeted(GapBuffer *buff, size_t num, size_t budget, GapBufferMove *move);
+bool       GapBuffer_continueMove(GapBuffer *buff, GapBufferMove *move, size_t budget);
+
+#ifdef GAPBUFFER_COST
+extern GapBufferCost GapBuffer_cost;
+#endif
+
+typedef enum {
+    GAPBUFFER_JOB_FIND,
+    GAPBUFFER_JOB_COPY,
+    GAPBUFFER_JOB_WRITE,
+} GapBufferJobKind;
+
+typedef enum {
+    GAPBUFFER_JOB_RUNNING,
+    GAPBUFFER_JOB_DONE,
+    GAPBUFFER_JOB_CANCELLED,
+    GAPBUFFER_JOB_CONFLICT, // The text changed between two steps
+    GAPBUFFER_JOB_FAILED,
+} GapBufferJobStatus;
+
+typedef struct {
+    GapBufferJobKind   kind;
+    GapBufferJobStatus status;
+    GapBuffer **buff;    // Followed through relocations
+    size_t      version; // Of the buffer when the job was created
+    size_t      offset;  // Bytes of text processed so far
+    size_t      slice;   // Bytes of text processed by each step
+    const bool *cancel;  // If not NULL and true, the next step cancels the job
+    const char *needle;  // GAPBUFFER_JOB_FIND
+    size_t      needle_len;
+    size_t      found;
+    char       *dst;     // GAPBUFFER_JOB_COPY
+    size_t      cap;
+    int         fd;      // GAPBUFFER_JOB_WRITE
+} GapBufferJob;
+
+size_t             GapBuffer_getVersion(const GapBuffer *buff);
+void               GapBufferJob_find(GapBufferJob *job, GapBuffer **buff, size_t from, const char *needle, size_t len);
+void               GapBufferJob_copy(GapBufferJob *job, GapBuffer **buff, char *dst, size_t cap);
+GapBufferJobStatus GapBufferJob_step(GapBufferJob *job);
+
+#ifndef GAPBUFFER_NOQUEUE
+typedef struct GapBufferQueue GapBufferQueue;
+
+typedef enum {
+    GAPBUFFER_QUEUE_QUEUED,
+    GAPBUFFER_QUEUE_FULL,      // No room right now, try again later
+    GAPBUFFER_QUEUE_TOO_LARGE, // Never fits, apply it directly or use a larger queue
+    GAPBUFFER_QUEUE_INVALID,   // Not valid UTF-8
+} GapBufferQueueStatus;
+
+GapBufferQueue      *GapBufferQueue_createUsingMemory(void *mem, size_t len, void (*free)(void*));
+void                 GapBufferQueue_destroy(GapBufferQueue *queue);
+GapBufferQueueStatus GapBufferQueue_insertString(GapBufferQueue *queue, const char *str, size_t len);
+bool                 GapBufferQueue_removeForwards(GapBufferQueue *queue, size_t num);
+bool                 GapBufferQueue_removeBackwards(GapBufferQueue *queue, size_t num);
+bool                 GapBufferQueue_moveRelative(GapBufferQueue *queue, int off);
+bool                 GapBufferQueue_moveAbsolute(GapBufferQueue *queue, size_t num);
+bool                 GapBufferQueue_apply(GapBufferQueue *queue, GapBuffer *buff);
+#endif
+
+typedef struct GapBufferStream GapBufferStream;
+typedef struct GapBufferVersion GapBufferVersion;
+
+typedef enum {
+    GAPBUFFER_REPLICA_OK,
+    GAPBUFFER_REPLICA_DIVERGED, // A checksum didn't match, a snapshot is needed
+    GAPBUFFER_REPLICA_INVALID,  // The stream is malformed or memory ran out
+} GapBufferReplicaStatus;
+
+#ifndef GAPBUFFER_MAX_GAPS
+#define GAPBUFFER_MAX_GAPS 8
+#endif
+
+typedef struct MultiGapBuffer MultiGapBuffer;
+
+typedef struct {
+    MultiGapBuffer *buff;
+    int    segment;
+    size_t cur;
+    char   maybe[512];
+} MultiGapBufferIter;
+
+MultiGapBuffer *MultiGapBuffer_createUsingMemory(void *mem, size_t len, void (*free)(void*));
+void            MultiGapBuffer_destroy(MultiGapBuffer *buff);
+size_t          MultiGapBuffer_getByteCount(const MultiGapBuffer *buff);
+bool            MultiGapBuffer_insertString(MultiGapBuffer *buff, size_t pos, const char *str, size_t len);
+void            MultiGapBuffer_remove(MultiGapBuffer *buff, size_t pos, size_t len);
+size_t          MultiGapBuffer_find(const MultiGapBuffer *buff, size_t from, const char *needle, size_t len);
+void            MultiGapBufferIter_init(MultiGapBufferIter *iter, MultiGapBuffer *buff);
+void            MultiGapBufferIter_free(MultiGapBufferIter *iter);
+bool            MultiGapBufferIter_next(MultiGapBufferIter *iter, GapBufferLine *line);
 
 #ifndef GAPBUFFER_NOMALLOC
 GapBuffer *GapBuffer_create(size_t capacity);
 bool       GapBuffer_insertStringMaybeRelocate(GapBuffer **buff, const char *str, size_t len);
+bool       GapBuffer_insertStringMaybeRelocateIncrementally(GapBuffer **buff, const char *str, size_t len);
+MultiGapBuffer *MultiGapBuffer_create(size_t capacity);
+#ifndef GAPBUFFER_NOQUEUE
+GapBufferQueue *GapBufferQueue_create(size_t capacity);
+#endif
+GapBufferStream *GapBufferStream_create(size_t checksum_period);
+void             GapBufferStream_destroy(GapBufferStream *stream);
+void             GapBuffer_setStream(GapBuffer *buff, GapBufferStream *stream);
+const char      *GapBufferStream_getData(GapBufferStream *stream, size_t *len);
+void             GapBufferStream_consume(GapBufferStream *stream, size_t num);
+void             GapBufferStream_requestSnapshot(GapBufferStream *stream);
+GapBufferReplicaStatus GapBuffer_applyStream(GapBuffer **buff, const char *data, size_t len, size_t *used);
+#endif
+
+#ifndef GAPBUFFER_NOPOSIX
+#include <sys/types.h>
+
+typedef struct {
+    const char *path;
+    int   fd;
+    int   inotify;
+    int   watch;
+    off_t offset;
+    size_t appended; // Bytes of the text that came from the open file
+    bool  moved;     // The open file may have been renamed or deleted
+    dev_t dev;
+    ino_t ino;
+} GapBufferFollow;
+
+ssize_t    GapBuffer_readFrom(GapBuffer *buff, int fd, size_t max);
+void       GapBufferJob_write(GapBufferJob *job, GapBuffer **buff, int fd);
+GapBuffer *GapBuffer_mapFile(int fd, size_t extra);
+#ifndef GAPBUFFER_NOMALLOC
+bool       GapBuffer_compact(GapBuffer *buff, int level);
+size_t     GapBuffer_getCompactedSize(const GapBuffer *buff);
+#endif
+bool       GapBufferFollow_open(GapBufferFollow *follow, const char *path, off_t offset);
+void       GapBufferFollow_close(GapBufferFollow *follow);
+ssize_t    GapBufferFollow_poll(GapBufferFollow *follow, GapBuffer **buff, int timeout);
+#endif
+
+#if !defined(GAPBUFFER_NOMALLOC) && !defined(GAPBUFFER_NOPOSIX)
+typedef struct ChunkedBuffer ChunkedBuffer;
+
+typedef struct {
+    ChunkedBuffer *buff;
+    size_t chunk;
+    int    segment;
+    size_t cur;
+    bool   pinned;
+    char   maybe[512];
+} ChunkedBufferIter;
+
+ChunkedBuffer *ChunkedBuffer_create(size_t budget);
+void           ChunkedBuffer_destroy(ChunkedBuffer *cb);
+bool           ChunkedBuffer_loadFile(ChunkedBuffer *cb, int fd);
+size_t         ChunkedBuffer_getByteCount(const ChunkedBuffer *cb);
+size_t         ChunkedBuffer_getLineCount(const ChunkedBuffer *cb);
+size_t         ChunkedBuffer_getSymbolCount(const ChunkedBuffer *cb);
+size_t         ChunkedBuffer_getResidentBytes(const ChunkedBuffer *cb);
+bool           ChunkedBuffer_insertString(ChunkedBuffer *cb, size_t pos, const char *str, size_t len);
+bool           ChunkedBuffer_remove(ChunkedBuffer *cb, size_t pos, size_t len);
+size_t         ChunkedBuffer_find(ChunkedBuffer *cb, size_t from, const char *needle, size_t len);
+void           ChunkedBufferIter_init(ChunkedBufferIter *iter, ChunkedBuffer *cb);
+void           ChunkedBufferIter_free(ChunkedBufferIter *iter);
+bool           ChunkedBufferIter_next(ChunkedBufferIter *iter, GapBufferLine *line);
+
+typedef struct {
+    ChunkedBuffer *buff;
+    size_t    first;   // Locked chunks
+    size_t    last;
+    size_t    head;    // Offset of the range in the first chunk
+    size_t    len;     // Bytes in the range
+    ptrdiff_t lines;   // Changes to the counts of the buffer,
+    ptrdiff_t symbols; // applied when the range is unlocked
+    bool      unbalanced;
+} ChunkedBufferRange;
+
+bool           ChunkedBuffer_lockRange(ChunkedBuffer *cb, size_t pos, size_t len, ChunkedBufferRange *range);
+void           ChunkedBuffer_unlockRange(ChunkedBufferRange *range);
+bool           ChunkedBufferRange_insertString(ChunkedBufferRange *range, size_t off, const char *str, size_t len);
+void           ChunkedBufferRange_remove(ChunkedBufferRange *range, size_t off, size_t len);
+size_t         ChunkedBufferRange_copy(ChunkedBufferRange *range, size_t off, char *dst, size_t len);
+#endif
+
+#if !defined(GAPBUFFER_NOMALLOC) && !defined(GAPBUFFER_NOPOSIX)
+typedef struct GapBufferRegistry GapBufferRegistry;
+
+typedef struct {
+    size_t buffers;
+    size_t resident_bytes; // Memory of the buffers in memory
+    size_t gap_bytes;      // Part of it that's unused
+    size_t spilled_bytes;  // Text written to the spill file
+} GapBufferRegistryStats;
+
+GapBufferRegistry *GapBufferRegistry_create(size_t budget);
+void               GapBufferRegistry_destroy(GapBufferRegistry *reg);
+size_t             GapBufferRegistry_add(GapBufferRegistry *reg, GapBuffer *buff);
+GapBuffer         *GapBufferRegistry_remove(GapBufferRegistry *reg, size_t id);
+GapBuffer         *GapBufferRegistry_acquire(GapBufferRegistry *reg, size_t id);
+void               GapBufferRegistry_release(GapBufferRegistry *reg, size_t id, GapBuffer *buff);
+bool               GapBufferRegistry_reclaim(GapBufferRegistry *reg);
+bool               GapBufferRegistry_startReclaimer(GapBufferRegistry *reg, int interval);
+void               GapBufferRegistry_stopReclaimer(GapBufferRegistry *reg);
+void               GapBufferRegistry_getStats(GapBufferRegistry *reg, GapBufferRegistryStats *stats);
+bool               GapBufferRegistry_getBufferStats(GapBufferRegistry *reg, size_t id, GapBufferRegistryStats *stats);
+#endif
+
+#ifndef GAPBUFFER_NOMALLOC
+typedef struct GapBufferStore GapBufferStore;
+typedef struct GapBufferDocument GapBufferDocument;
+
+typedef struct {
+    size_t chunks;
+    size_t chunk_bytes; // Text stored, each chunk counted once
+    size_t memory;      // Including the metadata of the chunks
+} GapBufferStoreStats;
+
+GapBufferStore    *GapBufferStore_create(void);
+void               GapBufferStore_destroy(GapBufferStore *store);
+GapBufferDocument *GapBufferStore_save(GapBufferStore *store, GapBuffer *buff);
+void               GapBufferStore_getStats(const GapBufferStore *store, GapBufferStoreStats *stats);
+GapBufferDocument *GapBufferDocument_clone(GapBufferDocument *doc);
+void               GapBufferDocument_release(GapBufferDocument *doc);
+size_t             GapBufferDocument_getByteCount(const GapBufferDocument *doc);
+size_t             GapBufferDocument_getMemory(const GapBufferDocument *doc);
+GapBuffer         *GapBufferDocument_load(const GapBufferDocument *doc, size_t extra);
+#endif
+
+#ifndef GAPBUFFER_NOMALLOC
+#ifndef GAPBUFFER_VERSION_DEPTH
+#define GAPBUFFER_VERSION_DEPTH 16
+#endif
+
+typedef struct {
+    const GapBufferVersion *version;
+    const void *path[GAPBUFFER_VERSION_DEPTH]; // Nodes from the root to the current leaf
+    int         index[GAPBUFFER_VERSION_DEPTH];
+    size_t      cur;
+    bool        done;
+    size_t      offset;      // Of the next byte to read
+    size_t      line_offset; // Of the last line returned
+    size_t      line_length; // Of the last line, more than its len if it was truncated
+    char        maybe[512];
+} GapBufferVersionIter;
+
+GapBufferVersion *GapBuffer_commitVersion(GapBuffer *buff);
+GapBufferVersion *GapBufferVersion_clone(GapBufferVersion *version);
+void              GapBufferVersion_release(GapBufferVersion *version);
+size_t            GapBufferVersion_getByteCount(const GapBufferVersion *version);
+size_t            GapBufferVersion_getMemory(const GapBufferVersion *version);
+size_t            GapBufferVersion_copy(const GapBufferVersion *version, size_t off, char *dst, size_t len);
+GapBuffer        *GapBufferVersion_load(const GapBufferVersion *version, size_t extra);
+void              GapBufferVersionIter_init(GapBufferVersionIter *iter, const GapBufferVersion *version);
+bool              GapBufferVersionIter_next(GapBufferVersionIter *iter, GapBufferLine *line);
+#endif
+
+#ifdef GAPBUFFER_SHARED
+typedef struct GapBufferView GapBufferView;
+
+typedef struct {
+    GapBufferIter        iter;
+    const char          *first;
+    size_t               first_len;
+    const char          *second;
+    size_t               second_len;
+    const GapBufferView *view;
+    size_t               sequence;
+} GapBufferViewIter;
+
+GapBuffer     *GapBuffer_createShared(size_t capacity, int *fd);
+GapBufferView *GapBufferView_open(int fd);
+void           GapBufferView_close(GapBufferView *view);
+size_t         GapBufferView_getVersion(const GapBufferView *view);
+void           GapBufferViewIter_init(GapBufferViewIter *iter, const GapBufferView *view);
+bool           GapBufferViewIter_next(GapBufferViewIter *iter, GapBufferLine *line);
+bool           GapBufferViewIter_isValid(const GapBufferViewIter *iter);
+#endif
+
+#ifdef GAPBUFFER_TRACE
+bool GapBufferTrace_start(size_t capacity, unsigned int sampling);
+void GapBufferTrace_stop(void);
+bool GapBufferTrace_writeJSON(int fd);
+void GapBufferTrace_clear(void);
 #endif
@@ -0,0 +1,67 @@
+/* Statically defined tracepoints compatible with the ones
+** of systemtap's <sys/sdt.h>, for the systems that don't
+** have it.
+**
+** Each probe is a nop instruction plus an ELF note in the
+** .note.stapsdt section, which tells the tracers (perf,
+** bpftrace, systemtap, ...) where the nop is and where its
+** arguments are. When a tracer attaches, it replaces the
+** nop with a breakpoint. The arguments are only evaluated
+** into registers or memory operands, so when no tracer is
+** attached the cost of a probe is a nop.
+**
+** Only x86-64 and AArch64 with GCC-compatible compilers
+** are supported. Elsewhere the probes expand to nothing.
+*/
+#ifndef GAPBUFFER_SDT_H
+#define GAPBUFFER_SDT_H
+
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__GNUC__) && defined(__ELF__)
+
+// Arguments are passed as unsigned 64 bit integers ("8@").
+// The "nor" constraint lets the compiler leave them where
+// they already are, so the probe adds no instructions.
+#define GAPBUFFER_SDT_ARG(X) "nor" ((uint64_t) (X))
+
+#define GAPBUFFER_SDT_NOTE(PROVIDER, NAME, ARGS)                       \
+    "990: nop\n"                                                       \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                      \
+    ".balign 4\n"                                                      \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                 \
+    "991: .asciz \"stapsdt\"\n"                                        \
+    "992: .balign 4\n"                                                 \
+    "993: .8byte 990b\n"                                               \
+    ".8byte _.stapsdt.base\n"                                          \
+    ".8byte 0\n" /* No semaphore */                                    \
+    ".asciz \"" #PROVIDER "\"\n"                                       \
+    ".asciz \"" #NAME "\"\n"                                           \
+    ".asciz \"" ARGS "\"\n"                                            \
+    "994: .balign 4\n"                                                 \
+    ".popsection\n"                                                    \
+    ".ifndef _.stapsdt.base\n"                                         \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                           \
+    ".hidden _.stapsdt.base\n"                                         \
+    "_.stapsdt.base: .space 1\n"                                       \
+    ".size _.stapsdt.base, 1\n"                                        \
+    ".popsection\n"                                                    \
+    ".endif\n"
+
+#define GAPBUFFER_SDT_PROBE2(PROVIDER, NAME, A, B)                     \
+    __asm__ __volatile__ (GAPBUFFER_SDT_NOTE(PROVIDER, NAME, "8@%0 8@%1") \
+                          :: GAPBUFFER_SDT_ARG(A), GAPBUFFER_SDT_ARG(B))
+
+#define GAPBUFFER_SDT_PROBE3(PROVIDER, NAME, A, B, C)                  \
+    __asm__ __volatile__ (GAPBUFFER_SDT_NOTE(PROVIDER, NAME, "8@%0 8@%1 8@%2") \
+                          :: GAPBUFFER_SDT_ARG(A), GAPBUFFER_SDT_ARG(B), GAPBUFFER_SDT_ARG(C))
+
+#else
+
+#define GAPBUFFER_SDT_PROBE2(PROVIDER, NAME, A, B) ((void) 0)
+#define GAPBUFFER_SDT_PROBE3(PROVIDER, NAME, A, B, C) ((void) 0)
+
+#endif
+
+#endif
@@ -0,0 +1,1034 @@
+/* Document server hosting many gap buffers, and a load
+** generator for it.
+**
+**   ./server serve PATH
+**       Listen on the Unix domain socket PATH.
+**
+**   ./server load PATH [CONNECTIONS] [DEPTH] [SECONDS]
+**       Open CONNECTIONS connections (8 by default) to the
+**       server at PATH, each editing its own document with
+**       DEPTH requests in flight (16 by default), for
+**       SECONDS seconds (3 by default), then print the
+**       operations per second and the latency of requests.
+**
+**   ./server check PATH
+**       Send a batch of known requests to the server at PATH
+**       in small pieces and check every response, then exit
+**       with status 0 if they were all as expected.
+**
+** The protocol is binary, with little-endian integers.
+** Requests are batches of operations on one document and
+** clients can send many of them without waiting for the
+** responses, which come back in the same order:
+**
+**   request:  [u32 size][u32 id][u32 document][u16 count][operation]...
+**   response: [u32 size][u32 id][u8 status][u16 applied][result]...
+**
+** [size] counts the bytes after it. Documents are numbered
+** from 0 to MAX_DOCUMENTS-1 and are created empty the first
+** time they're used. The operations are applied in order
+** until one fails, [applied] being how many succeeded. The
+** ones that read the document have a result:
+**
+**   OP_INSERT            [u32 len][bytes]
+**   OP_REMOVE_FORWARDS   [u32 symbols]
+**   OP_REMOVE_BACKWARDS  [u32 symbols]
+**   OP_MOVE_RELATIVE     [i32 symbols]
+**   OP_MOVE_ABSOLUTE     [u32 symbols]
+**   OP_READ              [u32 offset][u32 len]  -> [u32 len][bytes]
+**   OP_STAT                                     -> [u64 bytes][u64 version]
+**
+** Offsets and lengths of reads are in bytes. The server is
+** a single thread running an epoll loop. The bytes of the
+** text in responses aren't copied: they're sent with writev
+** straight from the memory around the gap, and copied only
+** if the document must change before they're sent.
+*/
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "gap_buffer.h"
+
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
+
+#define MAX_DOCUMENTS 4096
+#define MAX_CONNECTIONS 1024
+
+// Requests bigger than this close the connection
+#define MAX_FRAME (1 << 20)
+
+// Responses are sent when this many bytes are ready,
+// even if there are more requests to process.
+#define FLUSH_THRESHOLD (256 * 1024)
+
+// A connection isn't read while this many bytes of its
+// responses are waiting for the client to receive them.
+#define MAX_PENDING_OUTPUT (1 << 20)
+
+#define REQUEST_HEADER  14 // Size, id, document and count
+#define RESPONSE_HEADER 11 // Size, id, status and applied
+
+enum {
+    OP_INSERT = 1,
+    OP_REMOVE_FORWARDS,
+    OP_REMOVE_BACKWARDS,
+    OP_MOVE_RELATIVE,
+    OP_MOVE_ABSOLUTE,
+    OP_READ,
+    OP_STAT,
+};
+
+enum {
+    STATUS_OK,
+    STATUS_BAD_REQUEST, // Malformed or unknown document
+    STATUS_FAILED,      // An insertion was invalid UTF-8 or memory ran out
+};
+
+static uint32_t getU32(const char *p)
+{
+    const uint8_t *b = (const uint8_t*) p;
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+static uint16_t getU16(const char *p)
+{
+    const uint8_t *b = (const uint8_t*) p;
+    return b[0] | b[1] << 8;
+}
+
+static uint64_t getU64(const char *p)
+{
+    return getU32(p) | (uint64_t) getU32(p + 4) << 32;
+}
+
+static void putU32(char *p, uint32_t num)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (char) (num >> (8 * i));
+}
+
+static void putU64(char *p, uint64_t num)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (char) (num >> (8 * i));
+}
+
+static double getTimeInNanoseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Symbol: grow
+**   Make sure the array [*ptr] of elements of [size] bytes
+**   has room for [need] of them, doubling its capacity.
+*/
+static bool grow(void *ptr, size_t *cap, size_t need, size_t size)
+{
+    if (need <= *cap)
+        return true;
+
+    size_t cap2 = MAX(MAX(2 * *cap, need), 64);
+    void *mem = realloc(*(void**) ptr, cap2 * size);
+    if (mem == NULL)
+        return false;
+    *(void**) ptr = mem;
+    *cap = cap2;
+    return true;
+}
+
+/* Symbol: Piece
+**
+**   Part of the responses being built by a connection.
+**   It's either in the arena of the connection (headers,
+**   numbers and copied text) or borrowed from the memory
+**   of a document.
+*/
+typedef struct {
+    const char *data; // NULL if the bytes are in the arena
+    size_t      off;  // In the arena
+    size_t      len;
+    int         doc;  // Borrowed from this document, or -1
+} Piece;
+
+typedef struct {
+    int    fd;
+    bool   writing; // Waiting to send [out]
+
+    // Received bytes that weren't processed yet
+    char  *in;
+    size_t in_len;
+    size_t in_cap;
+
+    // Bytes of responses that the socket didn't accept
+    char  *out;
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+
+    // Responses being built
+    char  *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    Piece *pieces;
+    size_t num_pieces;
+    size_t cap_pieces;
+    size_t pending; // Bytes in [pieces]
+
+    // Documents this connection borrowed from are marked
+    // with this, which changes every time it sends.
+    uint64_t epoch;
+} Connection;
+
+typedef struct {
+    int        epoll;
+    int        listener;
+    uint64_t   epochs;
+    GapBuffer *docs[MAX_DOCUMENTS];
+    uint64_t   borrowed[MAX_DOCUMENTS]; // Epoch of the connection borrowing from the document
+} Server;
+
+static char *addArenaPiece(Connection *c, size_t len)
+{
+    if (!grow(&c->arena, &c->arena_cap, c->arena_len + len, 1))
+        return NULL;
+
+    // Extend the last piece if it's the end of the arena
+    Piece *last = c->num_pieces > 0 ? &c->pieces[c->num_pieces-1] : NULL;
+    if (last && last->data == NULL && last->off + last->len == c->arena_len)
+        last->len += len;
+    else {
+        if (!grow(&c->pieces, &c->cap_pieces, c->num_pieces + 1, sizeof(Piece)))
+            return NULL;
+        c->pieces[c->num_pieces++] = (Piece) { .data=NULL, .off=c->arena_len, .len=len, .doc=-1 };
+    }
+
+    char *p = c->arena + c->arena_len;
+    c->arena_len += len;
+    c->pending += len;
+    return p;
+}
+
+static bool addBorrowedPiece(Server *s, Connection *c, int doc, const char *data, size_t len)
+{
+    if (!grow(&c->pieces, &c->cap_pieces, c->num_pieces + 1, sizeof(Piece)))
+        return false;
+    c->pieces[c->num_pieces++] = (Piece) { .data=data, .off=0, .len=len, .doc=doc };
+    c->pending += len;
+    s->borrowed[doc] = c->epoch;
+    return true;
+}
+
+/* Symbol: copyBorrowedPieces
+**   Copy in the arena the pieces borrowed from [doc], which
+**   is about to change.
+*/
+static bool copyBorrowedPieces(Server *s, Connection *c, int doc)
+{
+    if (s->borrowed[doc] != c->epoch)
+        return true;
+
+    for (size_t i = 0; i < c->num_pieces; i++) {
+        Piece *piece = &c->pieces[i];
+        if (piece->doc != doc)
+            continue;
+        if (!grow(&c->arena, &c->arena_cap, c->arena_len + piece->len, 1))
+            return false;
+        memcpy(c->arena + c->arena_len, piece->data, piece->len);
+        *piece = (Piece) { .data=NULL, .off=c->arena_len, .len=piece->len, .doc=-1 };
+        c->arena_len += piece->len;
+    }
+    s->borrowed[doc] = 0;
+    return true;
+}
+
+static bool appendOutput(Connection *c, const char *data, size_t len)
+{
+    if (c->out_off > 0 && c->out_off == c->out_len)
+        c->out_off = c->out_len = 0;
+    if (!grow(&c->out, &c->out_cap, c->out_len + len, 1))
+        return false;
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return true;
+}
+
+/* Symbol: sendResponses
+**
+**   Write the responses built so far with as few writev
+**   calls as possible. What the socket doesn't accept is
+**   copied to [out], to be sent when it's writable, since
+**   the documents may change in the meantime.
+*/
+static bool sendResponses(Server *s, Connection *c)
+{
+    size_t i = 0;
+    size_t skip = 0;
+    while (c->out_off == c->out_len && i < c->num_pieces) {
+
+        struct iovec iov[IOV_MAX];
+        int count = 0;
+        size_t total = 0;
+        for (size_t j = i; j < c->num_pieces && count < IOV_MAX; j++) {
+            Piece *piece = &c->pieces[j];
+            iov[count].iov_base = (char*) (piece->data ? piece->data : c->arena + piece->off);
+            iov[count].iov_len = piece->len;
+            total += piece->len;
+            count++;
+        }
+
+        ssize_t n = writev(c->fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            n = 0;
+        }
+
+        size_t written = n;
+        while (i < c->num_pieces && written >= c->pieces[i].len)
+            written -= c->pieces[i++].len;
+        skip = written;
+        if ((size_t) n < total)
+            break;
+    }
+
+    for (; i < c->num_pieces; i++) {
+        Piece *piece = &c->pieces[i];
+        const char *data = piece->data ? piece->data : c->arena + piece->off;
+        if (!appendOutput(c, data + skip, piece->len - skip))
+            return false;
+        skip = 0;
+    }
+
+    c->num_pieces = 0;
+    c->arena_len = 0;
+    c->pending = 0;
+    c->epoch = ++s->epochs;
+    return true;
+}
+
+/* Symbol: checkOperations
+**
+**   Make sure the [count] operations in [ops] are well formed
+**   and tell whether any of them changes the document.
+*/
+static bool checkOperations(const char *ops, size_t len, size_t count, bool *changes)
+{
+    *changes = false;
+    size_t i = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (i == len)
+            return false;
+        int op = ops[i++];
+        size_t args;
+        switch (op) {
+            case OP_INSERT:
+            if (len - i < 4 || len - i - 4 < getU32(ops + i))
+                return false;
+            args = 4 + getU32(ops + i);
+            break;
+
+            case OP_REMOVE_FORWARDS:
+            case OP_REMOVE_BACKWARDS:
+            case OP_MOVE_RELATIVE:
+            case OP_MOVE_ABSOLUTE:
+            args = 4;
+            break;
+
+            case OP_READ: args = 8; break;
+            case OP_STAT: args = 0; break;
+            default: return false;
+        }
+        if (len - i < args)
+            return false;
+        i += args;
+        if (op != OP_READ && op != OP_STAT)
+            *changes = true;
+    }
+    return i == len;
+}
+
+/* Symbol: readDocument
+**   Add to the response [len] bytes of [doc] starting at
+**   [off], as borrowed pieces.
+*/
+static bool readDocument(Server *s, Connection *c, int doc, size_t off, size_t len)
+{
+    GapBuffer *buff = s->docs[doc];
+    size_t count = GapBuffer_getByteCount(buff);
+    off = MIN(off, count);
+    len = MIN(len, count - off);
+
+    char *p = addArenaPiece(c, 4);
+    if (p == NULL)
+        return false;
+    putU32(p, len);
+
+    while (len > 0) {
+        size_t n;
+        const char *data = GapBuffer_getSlice(buff, off, &n);
+        n = MIN(n, len);
+        if (!addBorrowedPiece(s, c, doc, data, n))
+            return false;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Symbol: processRequest
+**   Apply the request [req] of [len] bytes (after the size)
+**   and add its response to the ones being built.
+*/
+static bool processRequest(Server *s, Connection *c, const char *req, size_t len)
+{
+    uint32_t id    = getU32(req);
+    uint32_t doc   = getU32(req + 4);
+    uint16_t count = getU16(req + 8);
+    const char *ops = req + 10;
+
+    bool changes;
+    int status = STATUS_OK;
+    if (doc >= MAX_DOCUMENTS || !checkOperations(ops, len - 10, count, &changes))
+        status = STATUS_BAD_REQUEST;
+    else if (s->docs[doc] == NULL && (s->docs[doc] = GapBuffer_create(4096)) == NULL)
+        status = STATUS_FAILED;
+
+    // The responses borrowing from the document must be
+    // sent before it changes.
+    if (status == STATUS_OK && changes && s->borrowed[doc] == c->epoch)
+        if (!sendResponses(s, c))
+            return false;
+
+    size_t start = c->pending;
+    size_t header = c->arena_len;
+    if (addArenaPiece(c, RESPONSE_HEADER) == NULL)
+        return false;
+
+    uint16_t applied = 0;
+    for (size_t i = 0; status == STATUS_OK && applied < count; applied++) {
+
+        int op = ops[i++];
+        if (op != OP_READ && op != OP_STAT && !copyBorrowedPieces(s, c, doc))
+            return false;
+
+        GapBuffer **buff = &s->docs[doc];
+        switch (op) {
+
+            case OP_INSERT:
+            {
+                uint32_t n = getU32(ops + i);
+                if (!GapBuffer_insertStringMaybeRelocate(buff, ops + i + 4, n))
+                    status = STATUS_FAILED;
+                i += 4 + n;
+                break;
+            }
+
+            case OP_REMOVE_FORWARDS:  GapBuffer_removeForwards(*buff, getU32(ops + i)); i += 4; break;
+            case OP_REMOVE_BACKWARDS: GapBuffer_removeBackwards(*buff, getU32(ops + i)); i += 4; break;
+            case OP_MOVE_RELATIVE:    GapBuffer_moveRelative(*buff, (int32_t) getU32(ops + i)); i += 4; break;
+            case OP_MOVE_ABSOLUTE:    GapBuffer_moveAbsolute(*buff, getU32(ops + i)); i += 4; break;
+
+            case OP_READ:
+            if (!readDocument(s, c, doc, getU32(ops + i), getU32(ops + i + 4)))
+                return false;
+            i += 8;
+            break;
+
+            case OP_STAT:
+            {
+                char *p = addArenaPiece(c, 16);
+                if (p == NULL)
+                    return false;
+                putU64(p, GapBuffer_getByteCount(*buff));
+                putU64(p + 8, GapBuffer_getVersion(*buff));
+                break;
+            }
+        }
+        if (status != STATUS_OK)
+            break;
+    }
+
+    char *p = c->arena + header;
+    putU32(p, c->pending - start - 4);
+    putU32(p + 4, id);
+    p[8] = (char) status;
+    p[9] = (char) applied;
+    p[10] = (char) (applied >> 8);
+    return true;
+}
+
+static bool watch(Server *s, Connection *c, bool writing)
+{
+    struct epoll_event event = { .events = writing ? EPOLLOUT : EPOLLIN, .data.ptr = c };
+    c->writing = writing;
+    return epoll_ctl(s->epoll, EPOLL_CTL_MOD, c->fd, &event) == 0;
+}
+
+/* Symbol: processInput
+**
+**   Process the complete requests received by [c], until
+**   too many bytes of responses are waiting to be sent,
+**   and send the responses. If the socket doesn't accept
+**   all of them, the connection stops being read until it
+**   does.
+*/
+static bool processInput(Server *s, Connection *c)
+{
+    size_t i = 0;
+    while (c->in_len - i >= 4 && c->out_len - c->out_off < MAX_PENDING_OUTPUT) {
+
+        size_t len = getU32(c->in + i);
+        if (len < REQUEST_HEADER - 4 || len > MAX_FRAME)
+            return false;
+        if (c->in_len - i - 4 < len)
+            break;
+
+        if (!processRequest(s, c, c->in + i + 4, len))
+            return false;
+        i += 4 + len;
+
+        if (c->pending >= FLUSH_THRESHOLD && !sendResponses(s, c))
+            return false;
+    }
+    memmove(c->in, c->in + i, c->in_len - i);
+    c->in_len -= i;
+
+    if (!sendResponses(s, c))
+        return false;
+
+    bool writing = c->out_len > c->out_off;
+    return writing == c->writing || watch(s, c, writing);
+}
+
+static bool handleReadable(Server *s, Connection *c)
+{
+    if (!grow(&c->in, &c->in_cap, c->in_len + 65536, 1))
+        return false;
+
+    ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n < 0)
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+    if (n == 0)
+        return false;
+    c->in_len += n;
+    return processInput(s, c);
+}
+
+static bool handleWritable(Server *s, Connection *c)
+{
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+
+    // Requests received while the socket was busy
+    return processInput(s, c);
+}
+
+static void closeConnection(Connection *c)
+{
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c->arena);
+    free(c->pieces);
+    free(c);
+}
+
+static void acceptConnections(Server *s, size_t *connections)
+{
+    for (;;) {
+        int fd = accept4(s->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        Connection *c = calloc(1, sizeof(Connection));
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = c };
+        if (*connections == MAX_CONNECTIONS || c == NULL || epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &event)) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->fd = fd;
+        c->epoch = ++s->epochs;
+        (*connections)++;
+    }
+}
+
+static int serve(const char *path)
+{
+    static Server server;
+    Server *s = &server;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    s->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    s->epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (s->listener < 0 || s->epoll < 0
+        || bind(s->listener, (struct sockaddr*) &addr, sizeof(addr))
+        || listen(s->listener, SOMAXCONN)
+        || epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->listener, &event)) {
+        perror("serve");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t connections = 0;
+    for (;;) {
+        struct epoll_event events[64];
+        int num = epoll_wait(s->epoll, events, 64, -1);
+        if (num < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (int i = 0; i < num; i++) {
+            Connection *c = events[i].data.ptr;
+            if (c == NULL) {
+                acceptConnections(s, &connections);
+                continue;
+            }
+
+            bool ok;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN))
+                ok = false;
+            else if (c->writing)
+                ok = handleWritable(s, c);
+            else
+                ok = handleReadable(s, c);
+
+            if (!ok) {
+                closeConnection(c);
+                connections--;
+            }
+        }
+    }
+}
+
+// Operations in each request sent by the load generator:
+// some typed characters and a read of the start of the
+// document, like an editor refreshing its view.
+#define LOAD_TYPED 7
+#define LOAD_READ  256
+
+typedef struct {
+    const char *path;
+    int     doc;
+    int     depth;
+    double  seconds;
+    size_t  requests;
+    bool    failed;
+    double *latencies;
+    size_t  num_latencies;
+    size_t  cap_latencies;
+} Worker;
+
+/* Symbol: writeRequest
+**   Write at [p] the request [id] of the load generator
+**   and return its length.
+*/
+static size_t writeRequest(char *p, uint32_t id, uint32_t doc)
+{
+    char *start = p;
+    p += 4;
+    putU32(p, id);
+    putU32(p + 4, doc);
+    p[8] = LOAD_TYPED + 1;
+    p[9] = 0;
+    p += 10;
+    for (int i = 0; i < LOAD_TYPED; i++) {
+        *p++ = OP_INSERT;
+        putU32(p, 1);
+        p[4] = (id + i) % 61 ? 'a' + (id + i) % 26 : '\n';
+        p += 5;
+    }
+    *p++ = OP_READ;
+    putU32(p, 0);
+    putU32(p + 4, LOAD_READ);
+    p += 8;
+    putU32(start, p - start - 4);
+    return p - start;
+}
+
+static void *runWorker(void *arg)
+{
+    Worker *w = arg;
+    w->failed = true;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, w->path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        perror("connect");
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    double *sent = malloc(w->depth * sizeof(double));
+    char   *out = malloc(w->depth * 128);
+    size_t  in_cap = 1 << 20;
+    char   *in = malloc(in_cap);
+    if (sent == NULL || out == NULL || in == NULL)
+        goto done;
+
+    double end = getTimeInNanoseconds() + w->seconds * 1e9;
+    uint32_t next = 0;
+    uint32_t received = 0;
+    size_t in_len = 0;
+    for (;;) {
+
+        // Keep [depth] requests in flight until the time is up
+        double now = getTimeInNanoseconds();
+        size_t out_len = 0;
+        while (now < end && next - received < (uint32_t) w->depth) {
+            sent[next % w->depth] = now;
+            out_len += writeRequest(out + out_len, next++, w->doc);
+        }
+        for (size_t off = 0; off < out_len;) {
+            ssize_t n = write(fd, out + off, out_len - off);
+            if (n < 0 && errno != EINTR)
+                goto done;
+            if (n > 0)
+                off += n;
+        }
+        if (received == next)
+            break;
+
+        ssize_t n = read(fd, in + in_len, in_cap - in_len);
+        if (n <= 0)
+            goto done;
+        in_len += n;
+        now = getTimeInNanoseconds();
+
+        size_t i = 0;
+        while (in_len - i >= 4 && in_len - i - 4 >= getU32(in + i)) {
+            uint32_t id = getU32(in + i + 4);
+            if (id != received || in[i + 8] != STATUS_OK)
+                goto done;
+            if (!grow(&w->latencies, &w->cap_latencies, w->num_latencies + 1, sizeof(double)))
+                goto done;
+            w->latencies[w->num_latencies++] = now - sent[id % w->depth];
+            received++;
+            i += 4 + getU32(in + i);
+        }
+        memmove(in, in + i, in_len - i);
+        in_len -= i;
+    }
+    w->requests = received;
+    w->failed = false;
+
+done:
+    close(fd);
+    free(sent);
+    free(out);
+    free(in);
+    return NULL;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static int load(const char *path, int connections, int depth, double seconds)
+{
+    Worker   *workers = calloc(connections, sizeof(Worker));
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    if (workers == NULL || threads == NULL)
+        return 1;
+
+    double start = getTimeInNanoseconds();
+    for (int i = 0; i < connections; i++) {
+        workers[i] = (Worker) { .path=path, .doc=i % MAX_DOCUMENTS, .depth=depth, .seconds=seconds };
+        if (pthread_create(&threads[i], NULL, runWorker, &workers[i])) {
+            connections = i;
+            break;
+        }
+    }
+
+    size_t requests = 0;
+    size_t count = 0;
+    bool failed = false;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+        requests += workers[i].requests;
+        count += workers[i].num_latencies;
+        failed |= workers[i].failed;
+    }
+    double elapsed = getTimeInNanoseconds() - start;
+
+    double *latencies = malloc(MAX(count, 1) * sizeof(double));
+    if (latencies == NULL)
+        return 1;
+    size_t k = 0;
+    for (int i = 0; i < connections; i++) {
+        memcpy(latencies + k, workers[i].latencies, workers[i].num_latencies * sizeof(double));
+        k += workers[i].num_latencies;
+        free(workers[i].latencies);
+    }
+    qsort(latencies, count, sizeof(double), compareDoubles);
+
+    if (count > 0)
+        printf("connections=%d depth=%d requests=%zu ops/s=%.0f requests/s=%.0f p50=%.0fus p99=%.0fus p99.9=%.0fus\n",
+               connections, depth, requests,
+               requests * (LOAD_TYPED + 1) / elapsed * 1e9,
+               requests / elapsed * 1e9,
+               latencies[count * 500 / 1000] / 1e3,
+               latencies[count * 990 / 1000] / 1e3,
+               latencies[count * 999 / 1000] / 1e3);
+    if (failed)
+        fprintf(stderr, "Some connections failed\n");
+
+    free(latencies);
+    free(workers);
+    free(threads);
+    return failed || count == 0;
+}
+
+// Requests built by the round-trip check
+typedef struct {
+    char   data[1024];
+    size_t len;
+    size_t start;
+} Batch;
+
+static void beginRequest(Batch *b, uint32_t id, uint32_t doc, uint16_t count)
+{
+    b->start = b->len;
+    putU32(b->data + b->len + 4, id);
+    putU32(b->data + b->len + 8, doc);
+    b->data[b->len + 12] = (char) count;
+    b->data[b->len + 13] = (char) (count >> 8);
+    b->len += REQUEST_HEADER;
+}
+
+static void addOperation(Batch *b, int op)
+{
+    b->data[b->len++] = (char) op;
+}
+
+static void addU32(Batch *b, uint32_t num)
+{
+    putU32(b->data + b->len, num);
+    b->len += 4;
+}
+
+static void addString(Batch *b, const char *str)
+{
+    size_t len = strlen(str);
+    addU32(b, len);
+    memcpy(b->data + b->len, str, len);
+    b->len += len;
+}
+
+static void endRequest(Batch *b)
+{
+    putU32(b->data + b->start, b->len - b->start - 4);
+}
+
+/* Symbol: expectResponse
+**
+**   Check that the response at [*p] is the one of request
+**   [id] with the given [status] and number of [applied]
+**   operations, and move [*p] to its results.
+*/
+static bool expectResponse(const char **p, const char *end, uint32_t id, int status, uint16_t applied)
+{
+    if (end - *p < RESPONSE_HEADER || (size_t) (end - *p - 4) < getU32(*p)
+        || getU32(*p + 4) != id || (*p)[8] != status || getU16(*p + 9) != applied) {
+        fprintf(stderr, "Unexpected response to request %u\n", id);
+        return false;
+    }
+    *p += RESPONSE_HEADER;
+    return true;
+}
+
+static bool expectRead(const char **p, const char *str)
+{
+    size_t len = strlen(str);
+    if (getU32(*p) != len || memcmp(*p + 4, str, len)) {
+        fprintf(stderr, "Unexpected read of \"%s\"\n", str);
+        return false;
+    }
+    *p += 4 + len;
+    return true;
+}
+
+/* Symbol: check
+**
+**   Round-trip a batch of requests through the server at
+**   [path]. The batch is sent a few bytes at a time so the
+**   server sees frames split across reads, and frames that
+**   share a read with the next ones.
+*/
+static int check(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        perror("connect");
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    // Each check runs on a document of its own
+    uint32_t doc = getpid() % (MAX_DOCUMENTS - 1);
+
+    Batch b = { .len = 0 };
+    beginRequest(&b, 0, doc, 4);
+    addOperation(&b, OP_INSERT); addString(&b, "hello\n");
+    addOperation(&b, OP_INSERT); addString(&b, "world");
+    addOperation(&b, OP_STAT);
+    addOperation(&b, OP_READ); addU32(&b, 0); addU32(&b, 100);
+    endRequest(&b);
+
+    beginRequest(&b, 1, doc, 4);
+    addOperation(&b, OP_MOVE_ABSOLUTE); addU32(&b, 5);
+    addOperation(&b, OP_REMOVE_BACKWARDS); addU32(&b, 5);
+    addOperation(&b, OP_INSERT); addString(&b, "HELLO");
+    addOperation(&b, OP_READ); addU32(&b, 0); addU32(&b, 100);
+    endRequest(&b);
+
+    // Unknown document
+    beginRequest(&b, 2, MAX_DOCUMENTS, 1);
+    addOperation(&b, OP_STAT);
+    endRequest(&b);
+
+    // Fewer operations than the count
+    beginRequest(&b, 3, doc, 2);
+    addOperation(&b, OP_STAT);
+    endRequest(&b);
+
+    // Invalid UTF-8 stops the batch after the first operation
+    beginRequest(&b, 4, doc, 3);
+    addOperation(&b, OP_MOVE_ABSOLUTE); addU32(&b, 0);
+    addOperation(&b, OP_INSERT); addString(&b, "\xff");
+    addOperation(&b, OP_STAT);
+    endRequest(&b);
+
+    beginRequest(&b, 5, doc, 3);
+    addOperation(&b, OP_READ); addU32(&b, 6); addU32(&b, 3);
+    addOperation(&b, OP_READ); addU32(&b, 100); addU32(&b, 5);
+    addOperation(&b, OP_STAT);
+    endRequest(&b);
+
+    for (size_t off = 0; off < b.len;) {
+        ssize_t n = write(fd, b.data + off, MIN(b.len - off, 7));
+        if (n < 0 && errno != EINTR)
+            break;
+        if (n > 0)
+            off += n;
+    }
+
+    // Read until the last response is complete
+    char in[4096];
+    size_t in_len = 0;
+    size_t responses = 0;
+    size_t i = 0;
+    while (responses < 6) {
+        while (in_len - i >= 4 && in_len - i - 4 >= getU32(in + i)) {
+            i += 4 + getU32(in + i);
+            responses++;
+        }
+        if (responses == 6)
+            break;
+        ssize_t n = read(fd, in + in_len, sizeof(in) - in_len);
+        if (n <= 0 && !(n < 0 && errno == EINTR)) {
+            fprintf(stderr, "Connection closed after %zu responses\n", responses);
+            close(fd);
+            return 1;
+        }
+        if (n > 0)
+            in_len += n;
+    }
+    close(fd);
+
+    const char *p = in;
+    const char *end = in + in_len;
+    if (!expectResponse(&p, end, 0, STATUS_OK, 4))
+        return 1;
+    uint64_t bytes = getU64(p);
+    uint64_t version = getU64(p + 8);
+    p += 16;
+    if (bytes != 11 || !expectRead(&p, "hello\nworld"))
+        return 1;
+
+    if (!expectResponse(&p, end, 1, STATUS_OK, 4) || !expectRead(&p, "HELLO\nworld"))
+        return 1;
+    if (!expectResponse(&p, end, 2, STATUS_BAD_REQUEST, 0))
+        return 1;
+    if (!expectResponse(&p, end, 3, STATUS_BAD_REQUEST, 0))
+        return 1;
+    if (!expectResponse(&p, end, 4, STATUS_FAILED, 1))
+        return 1;
+
+    if (!expectResponse(&p, end, 5, STATUS_OK, 3) || !expectRead(&p, "wor") || !expectRead(&p, ""))
+        return 1;
+    bytes = getU64(p);
+    uint64_t version2 = getU64(p + 8);
+    p += 16;
+    if (bytes != 11 || version2 <= version || p != end) {
+        fprintf(stderr, "Unexpected state after the batch\n");
+        return 1;
+    }
+    printf("All %zu responses as expected\n", responses);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2 && !strcmp(argv[1], "serve"))
+        return serve(argv[2]);
+
+    if (argc > 2 && !strcmp(argv[1], "check"))
+        return check(argv[2]);
+
+    if (argc > 2 && !strcmp(argv[1], "load")) {
+        int connections = argc > 3 ? atoi(argv[3]) : 8;
+        int depth       = argc > 4 ? atoi(argv[4]) : 16;
+        double seconds  = argc > 5 ? strtod(argv[5], NULL) : 3;
+        return load(argv[2], MAX(connections, 1), MAX(depth, 1), seconds);
+    }
+
+    fprintf(stderr, "Usage: %s serve PATH\n"
+                    "       %s load PATH [CONNECTIONS] [DEPTH] [SECONDS]\n"
+                    "       %s check PATH\n", argv[0], argv[0], argv[0]);
+    return 1;
+}
@@ -1,13 +1,21 @@
 #include <time.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
 #include "gap_buffer.h"
 
 size_t getByteCount(GapBuffer *buff);
 int getSymbolRune(const char *sym, size_t symlen, uint32_t *rune);
+size_t getIncompleteSymbolLength(const char *str, size_t len);
 
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 
@@ -87,14 +95,386 @@ static void printStringAsHex(char *str, size_t len, FILE *stream)
 }
 */
 
+typedef struct {
+    int    kind;
+    int    num;
+    size_t len;
+    char   str[32];
+} ScriptedEdit;
+
+typedef struct {
+    GapBufferQueue *queue;
+    ScriptedEdit   *edits;
+    size_t          count;
+    _Atomic bool    done;
+} Producer;
+
+static GapBufferQueueStatus queueEdit(GapBufferQueue *queue, const ScriptedEdit *edit)
+{
+    bool queued;
+    switch (edit->kind) {
+        case 0: return GapBufferQueue_insertString(queue, edit->str, edit->len);
+        case 1: queued = GapBufferQueue_removeForwards(queue, edit->num); break;
+        case 2: queued = GapBufferQueue_removeBackwards(queue, edit->num); break;
+        case 3: queued = GapBufferQueue_moveRelative(queue, edit->num); break;
+        default: queued = GapBufferQueue_moveAbsolute(queue, edit->num); break;
+    }
+    return queued ? GAPBUFFER_QUEUE_QUEUED : GAPBUFFER_QUEUE_FULL;
+}
+
+static void applyEdit(GapBuffer *buff, const ScriptedEdit *edit)
+{
+    switch (edit->kind) {
+        case 0: assert(GapBuffer_insertString(buff, edit->str, edit->len)); break;
+        case 1: GapBuffer_removeForwards(buff, edit->num); break;
+        case 2: GapBuffer_removeBackwards(buff, edit->num); break;
+        case 3: GapBuffer_moveRelative(buff, edit->num); break;
+        default: GapBuffer_moveAbsolute(buff, edit->num); break;
+    }
+}
+
+static void *runProducer(void *arg)
+{
+    Producer *producer = arg;
+    for (size_t i = 0; i < producer->count; i++) {
+        GapBufferQueueStatus status;
+        while ((status = queueEdit(producer->queue, &producer->edits[i])) == GAPBUFFER_QUEUE_FULL)
+            sched_yield();
+        // Only a full queue is worth retrying
+        assert(status == GAPBUFFER_QUEUE_QUEUED);
+    }
+    producer->done = true;
+    return NULL;
+}
+
+// Line inserted and removed by the writer of the shared
+// buffer test, which the readers check.
+static const char shared_line[] = "All work and no play makes Jack a dull boy\n";
+#define SHARED_LINE_LEN (sizeof(shared_line) - 1)
+
+typedef struct {
+    GapBufferView *view;
+    _Atomic bool   stop;
+    size_t         snapshots; // Consistent ones
+} SharedReader;
+
+static void *runSharedReader(void *arg)
+{
+    SharedReader *reader = arg;
+    while (!reader->stop) {
+        GapBufferViewIter iter;
+        GapBufferLine line;
+        bool torn = false;
+        GapBufferViewIter_init(&iter, reader->view);
+        while (GapBufferViewIter_next(&iter, &line))
+            if (line.len != SHARED_LINE_LEN - 1 || memcmp(line.str, shared_line, line.len))
+                torn = true;
+        if (GapBufferViewIter_isValid(&iter)) {
+            assert(!torn);
+            reader->snapshots++;
+        }
+    }
+    return NULL;
+}
+
+/* Symbol: runSharedReaderProcess
+**
+**   Body of a process reading the shared buffer [fd] until
+**   its parent writes the number of lines the text ends
+**   with on [pipe_fd]. Returns the exit status: 0 if every
+**   consistent snapshot was made of copies of the line and
+**   the last one has that many lines.
+*/
+static int runSharedReaderProcess(int fd, int pipe_fd)
+{
+    GapBufferView *view = GapBufferView_open(fd);
+    if (view == NULL)
+        return 1;
+
+    size_t expected = SIZE_MAX;
+    for (;;) {
+        if (expected == SIZE_MAX) {
+            struct pollfd pfd = { .fd=pipe_fd, .events=POLLIN };
+            if (poll(&pfd, 1, 0) > 0 && read(pipe_fd, &expected, sizeof(expected)) != sizeof(expected))
+                return 1;
+        }
+
+        GapBufferViewIter iter;
+        GapBufferLine line;
+        size_t seen = 0;
+        bool torn = false;
+        GapBufferViewIter_init(&iter, view);
+        while (GapBufferViewIter_next(&iter, &line)) {
+            if (line.len != SHARED_LINE_LEN - 1 || memcmp(line.str, shared_line, line.len))
+                torn = true;
+            seen++;
+        }
+        if (!GapBufferViewIter_isValid(&iter))
+            continue;
+        if (torn)
+            return 1;
+        if (expected != SIZE_MAX)
+            return seen == expected ? 0 : 1;
+    }
+}
+
+// Big insertions make chunks grow beyond their capacity
+#define BIG_INSERTION 100000
+
+static bool isAuxiliaryByte(char c)
+{
+    return (c & 0xc0) == 0x80;
+}
+
+/* Symbol: runRangeWriter
+**
+**   Lock a random range of the chunked buffer and edit it
+**   along with a copy of its text, checking that they're
+**   still the same at the end. Offsets are aligned to the
+**   UTF-8 sequences of the copy like the range does.
+*/
+static void *runRangeWriter(void *arg)
+{
+    ChunkedBuffer *cb = arg;
+    size_t bytes = ChunkedBuffer_getByteCount(cb);
+    size_t pos = generateUnsignedIntegerBetween(0, bytes);
+    size_t len = generateUnsignedIntegerBetween(0, bytes - pos);
+    ChunkedBufferRange range;
+    assert(ChunkedBuffer_lockRange(cb, pos, len, &range));
+
+    size_t count = generateUnsignedIntegerBetween(0, 34);
+    size_t copy_len = range.len;
+    char  *copy = malloc(copy_len + count * BIG_INSERTION + 1);
+    assert(copy != NULL);
+    assert(ChunkedBufferRange_copy(&range, 0, copy, copy_len) == copy_len);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t off = generateUnsignedIntegerBetween(0, copy_len);
+        while (off > 0 && off < copy_len && isAuxiliaryByte(copy[off]))
+            off--;
+
+        if (generateUnsignedIntegerBetween(0, 1)) {
+            char str[32];
+            size_t num = generateUTF8String(str, sizeof(str));
+            const char *text = str;
+            char *big = NULL;
+            if (generateUnsignedIntegerBetween(0, 15) == 0) {
+                big = malloc(BIG_INSERTION);
+                assert(big != NULL);
+                for (size_t k = 0; k < BIG_INSERTION; k++)
+                    big[k] = (k % 61 == 60) ? '\n' : 'a' + k % 26;
+                text = big;
+                num = BIG_INSERTION;
+            }
+            // Big insertions fail if the chunk would grow
+            // beyond GAPBUFFER_CHUNK_MAX.
+            bool inserted = ChunkedBufferRange_insertString(&range, off, text, num);
+            assert(inserted || big != NULL);
+            if (inserted) {
+                memmove(copy + off + num, copy + off, copy_len - off);
+                memcpy(copy + off, text, num);
+                copy_len += num;
+            }
+            free(big);
+        } else {
+            // Big removals keep the size of the text stable
+            size_t num = (copy_len > 2 * BIG_INSERTION) ? copy_len - off : generateUnsignedIntegerBetween(0, 64);
+            ChunkedBufferRange_remove(&range, off, num);
+            size_t end = off + MIN(num, copy_len - off);
+            while (end < copy_len && isAuxiliaryByte(copy[end]))
+                end++;
+            memmove(copy + off, copy + end, copy_len - end);
+            copy_len -= end - off;
+        }
+        assert(range.len == copy_len);
+    }
+
+    char *text = malloc(copy_len + 1);
+    assert(text != NULL);
+    assert(ChunkedBufferRange_copy(&range, 0, text, copy_len) == copy_len);
+    assert(!memcmp(text, copy, copy_len));
+    ChunkedBuffer_unlockRange(&range);
+    free(text);
+    free(copy);
+    return NULL;
+}
+
+/* Symbol: replicate
+**
+**   Pass the records of [stream] to the follower a piece
+**   of random size at the time, like they would arrive
+**   from a socket.
+*/
+static GapBufferReplicaStatus replicate(GapBufferStream *stream, GapBuffer **follower)
+{
+    size_t len;
+    const char *data = GapBufferStream_getData(stream, &len);
+    GapBufferReplicaStatus status = GAPBUFFER_REPLICA_OK;
+    size_t applied = 0;
+    size_t received = 0;
+    while (applied < len) {
+        received += generateUnsignedIntegerBetween(1, len - received);
+        size_t used;
+        status = GapBuffer_applyStream(follower, data + applied, received - applied, &used);
+        if (status == GAPBUFFER_REPLICA_INVALID)
+            break;
+        applied += used;
+        assert(received < len || applied == len);
+    }
+    GapBufferStream_consume(stream, len);
+    return status;
+}
+
+static char *copyText(GapBuffer *buff, size_t *len)
+{
+    *len = getByteCount(buff);
+    char *text = malloc(*len + 1);
+    assert(text != NULL);
+    GapBufferJob job;
+    GapBufferJob_copy(&job, &buff, text, *len);
+    while (GapBufferJob_step(&job) == GAPBUFFER_JOB_RUNNING);
+    assert(job.status == GAPBUFFER_JOB_DONE);
+    return text;
+}
+
+static bool haveSameText(GapBuffer *a, GapBuffer *b)
+{
+    size_t len_a, len_b;
+    char *text_a = copyText(a, &len_a);
+    char *text_b = copyText(b, &len_b);
+    bool same = len_a == len_b && !memcmp(text_a, text_b, len_a);
+    free(text_a);
+    free(text_b);
+    return same;
+}
+
+// A version of the main buffer and the text it had when
+// it was committed
+typedef struct {
+    GapBufferVersion *version;
+    char             *text;
+    size_t            len;
+} KeptVersion;
+
+#define KEPT_VERSIONS 8
+
+static void checkVersion(const KeptVersion *kept)
+{
+    assert(GapBufferVersion_getByteCount(kept->version) == kept->len);
+    char *copy = malloc(kept->len + 1);
+    assert(copy != NULL);
+    assert(GapBufferVersion_copy(kept->version, 0, copy, kept->len) == kept->len);
+    assert(!memcmp(copy, kept->text, kept->len));
+    size_t off = generateUnsignedIntegerBetween(0, kept->len);
+    size_t num = GapBufferVersion_copy(kept->version, off, copy, kept->len);
+    assert(num == kept->len - off);
+    assert(!memcmp(copy, kept->text + off, num));
+    free(copy);
+
+    // Lines spanning leaves may have been truncated, but the
+    // iterator tells where they are and how long they are.
+    GapBufferVersionIter iter;
+    GapBufferLine line;
+    GapBufferVersionIter_init(&iter, kept->version);
+    size_t cur = 0;
+    while (GapBufferVersionIter_next(&iter, &line)) {
+        assert(cur < kept->len);
+        const char *newline = memchr(kept->text + cur, '\n', kept->len - cur);
+        size_t end = newline ? (size_t) (newline - kept->text) : kept->len;
+        assert(iter.line_offset == cur && iter.line_length == end - cur);
+        assert(line.len == end - cur || (line.len == sizeof(iter.maybe) && line.len < iter.line_length));
+        assert(!memcmp(line.str, kept->text + cur, line.len));
+        cur = end + 1;
+    }
+    assert(cur >= kept->len);
+}
+
+// Stores in [dst] the text GapBufferFollow_poll takes from
+// a file holding [src]: invalid bytes are skipped and an
+// incomplete sequence at the end is held back.
+static size_t decodeFollowed(const char *src, size_t len, char *dst)
+{
+    size_t i = 0;
+    size_t num = 0;
+    while (i < len) {
+        uint32_t rune;
+        int n = getSymbolRune(src + i, len - i, &rune);
+        if (n < 0) {
+            if (getIncompleteSymbolLength(src + i, len - i) == len - i)
+                break;
+            i++;
+            continue;
+        }
+        memcpy(dst + num, src + i, n);
+        num += n;
+        i += n;
+    }
+    return num;
+}
+
+typedef struct {
+    const char *path;
+    const char *text;
+    size_t      len;
+} LateFile;
+
+// Creates the file after the main thread started waiting
+// for it
+static void *createLateFile(void *arg)
+{
+    LateFile *late = arg;
+    usleep(10000);
+    int fd = open(late->path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    assert(fd >= 0);
+    assert(write(fd, late->text, late->len) == (ssize_t) late->len);
+    close(fd);
+    return NULL;
+}
+
+#ifdef GAPBUFFER_TRACE
+// Returns the recorded trace as a string
+static char *writeTrace(void)
+{
+    FILE *file = tmpfile();
+    assert(file != NULL);
+    assert(GapBufferTrace_writeJSON(fileno(file)));
+    long size = lseek(fileno(file), 0, SEEK_END);
+    assert(size > 0);
+    char *json = malloc(size + 1);
+    assert(json != NULL);
+    assert(pread(fileno(file), json, size, 0) == size);
+    json[size] = '\0';
+    fclose(file);
+    return json;
+}
+#endif
+
 int main(void)
 {
     srand(time(NULL));
     char buffer[32/*65536*/];
     GapBuffer *gap_buffer = GapBuffer_create(0);
     assert(gap_buffer != NULL);
+    MultiGapBuffer *multi_gap_buffer = MultiGapBuffer_create(1 << 16);
+    assert(multi_gap_buffer != NULL);
+    ChunkedBuffer *chunked_buffer = ChunkedBuffer_create(1 << 20);
+    assert(chunked_buffer != NULL);
+    GapBufferRegistry *registry = GapBufferRegistry_create(1 << 12);
+    assert(registry != NULL);
+    size_t registered = GapBufferRegistry_add(registry, GapBuffer_create(1 << 16));
+    assert(registered != SIZE_MAX);
+    GapBufferStore *store = GapBufferStore_create();
+    assert(store != NULL);
+    GapBufferStream *stream = GapBufferStream_create(16);
+    assert(stream != NULL);
+    GapBuffer_setStream(gap_buffer, stream);
+    GapBuffer *follower = GapBuffer_create(0);
+    assert(follower != NULL);
+    bool follower_corrupted = false;
+    KeptVersion versions[KEPT_VERSIONS] = {0};
+    size_t num_versions = 0;
     while (1) {
-        switch (generateUnsignedIntegerBetween(0, 6)) {
+        switch (generateUnsignedIntegerBetween(0, 36)) {
             
             case 0:
             {
@@ -164,8 +544,1122 @@ int main(void)
                 break;
             }
 
+            case 7:
+            {
+                size_t len = generateUTF8String(buffer, sizeof(buffer));
+                bool done = GapBuffer_insertStringMaybeRelocateIncrementally(&gap_buffer, buffer, len);
+                fprintf(stderr, "INSERT_INCREMENTALLY %ld \"%.*s\" .. %s\n", len, (int) len, buffer, done ? "DONE" : "NOT DONE");
+                break;
+            }
+
+            case 8:
+            {
+                size_t num = generateUnsignedIntegerBetween(0, sizeof(buffer));
+                bool more = GapBuffer_continueRelocation(gap_buffer, num);
+                fprintf(stderr, "CONTINUE_RELOCATION %ld .. %s\n", num, more ? "MORE" : "DONE");
+                break;
+            }
+
+            case 9:
+            {
+                size_t limit = 1.5 * MultiGapBuffer_getByteCount(multi_gap_buffer);
+                size_t pos = generateUnsignedIntegerBetween(0, limit);
+                size_t len = generateUTF8String(buffer, sizeof(buffer));
+                bool done = MultiGapBuffer_insertString(multi_gap_buffer, pos, buffer, len);
+                fprintf(stderr, "MULTI_INSERT %ld %ld \"%.*s\" .. %s\n", pos, len, (int) len, buffer, done ? "DONE" : "NOT DONE");
+                break;
+            }
+
+            case 10:
+            {
+                size_t limit = 1.5 * MultiGapBuffer_getByteCount(multi_gap_buffer);
+                size_t pos = generateUnsignedIntegerBetween(0, limit);
+                size_t len = generateUnsignedIntegerBetween(0, sizeof(buffer));
+                fprintf(stderr, "MULTI_REMOVE %ld %ld\n", pos, len);
+                MultiGapBuffer_remove(multi_gap_buffer, pos, len);
+                break;
+            }
+
+            case 11:
+            {
+                fprintf(stderr, "MULTI_PRINT\n");
+                MultiGapBufferIter iter;
+                GapBufferLine line;
+                MultiGapBufferIter_init(&iter, multi_gap_buffer);
+                while (MultiGapBufferIter_next(&iter, &line));
+                MultiGapBufferIter_free(&iter);
+                MultiGapBuffer_find(multi_gap_buffer, 0, "\n\n", 2);
+                break;
+            }
+
+            case 12:
+            {
+                size_t len = generateUnsignedIntegerBetween(0, sizeof(buffer));
+                char *dst = GapBuffer_reserve(gap_buffer, len);
+                if (dst == NULL) {
+                    fprintf(stderr, "RESERVE %ld .. NOT DONE\n", len);
+                    break;
+                }
+                len = generateUTF8String(dst, len);
+                // Cut the string at a random point, possibly in the middle of a symbol
+                len = generateUnsignedIntegerBetween(0, len);
+                bool done = GapBuffer_commit(gap_buffer, len);
+                fprintf(stderr, "COMMIT %ld \"%.*s\" .. %s\n", len, (int) len, dst, done ? "DONE" : "NOT DONE");
+                break;
+            }
+
+            case 13:
+            {
+                size_t limit = 1.5 * getByteCount(gap_buffer);
+                size_t length = generateUnsignedIntegerBetween(0, limit);
+                fprintf(stderr, "CONSUME %ld\n", length);
+                GapBuffer_consume(gap_buffer, length);
+                break;
+            }
+
+            case 14:
+            {
+                size_t len = generateUTF8String(buffer, sizeof(buffer));
+                bool done = GapBuffer_appendDroppingLines(gap_buffer, buffer, len);
+                fprintf(stderr, "APPEND_DROPPING_LINES %ld \"%.*s\" .. %s\n", len, (int) len, buffer, done ? "DONE" : "NOT DONE");
+                break;
+            }
+
+            case 15:
+            {
+                size_t limit = 1.5 * ChunkedBuffer_getByteCount(chunked_buffer);
+                size_t pos = generateUnsignedIntegerBetween(0, limit);
+                size_t len = generateUTF8String(buffer, sizeof(buffer));
+                bool done = ChunkedBuffer_insertString(chunked_buffer, pos, buffer, len);
+                fprintf(stderr, "CHUNKED_INSERT %ld %ld \"%.*s\" .. %s\n", pos, len, (int) len, buffer, done ? "DONE" : "NOT DONE");
+                break;
+            }
+
+            case 16:
+            {
+                size_t limit = 1.5 * ChunkedBuffer_getByteCount(chunked_buffer);
+                size_t pos = generateUnsignedIntegerBetween(0, limit);
+                size_t len = generateUnsignedIntegerBetween(0, sizeof(buffer));
+                fprintf(stderr, "CHUNKED_REMOVE %ld %ld\n", pos, len);
+                ChunkedBuffer_remove(chunked_buffer, pos, len);
+
+                ChunkedBufferIter iter;
+                GapBufferLine line;
+                ChunkedBufferIter_init(&iter, chunked_buffer);
+                while (ChunkedBufferIter_next(&iter, &line));
+                ChunkedBufferIter_free(&iter);
+                break;
+            }
+
+            case 17:
+            {
+                size_t len = generateUTF8String(buffer, sizeof(buffer));
+                GapBuffer *buff = GapBufferRegistry_acquire(registry, registered);
+                assert(buff != NULL);
+                bool done = GapBuffer_insertStringMaybeRelocate(&buff, buffer, len);
+                GapBufferRegistry_release(registry, registered, buff);
+                bool reclaimed = GapBufferRegistry_reclaim(registry);
+                fprintf(stderr, "REGISTRY_INSERT %ld \"%.*s\" .. %s %s\n", len, (int) len, buffer, done ? "DONE" : "NOT DONE", reclaimed ? "RECLAIMED" : "");
+                break;
+            }
+
+            case 18:
+            {
+                int level = generateUnsignedIntegerBetween(0, 9);
+                bool done = GapBuffer_compact(gap_buffer, level);
+                fprintf(stderr, "COMPACT %d .. %s\n", level, done ? "DONE" : "NOT DONE");
+                break;
+            }
+
+            case 19:
+            {
+                fprintf(stderr, "STORE_SAVE\n");
+                GapBufferDocument *doc = GapBufferStore_save(store, gap_buffer);
+                assert(doc != NULL);
+
+                // The clone keeps the chunks alive after the first
+                // reference is released, and they're freed with
+                // the last one.
+                GapBufferDocument *clone = GapBufferDocument_clone(doc);
+                GapBufferDocument_release(doc);
+                GapBuffer *copy = GapBufferDocument_load(clone, 0);
+                assert(copy != NULL);
+                GapBufferStoreStats stats;
+                GapBufferStore_getStats(store, &stats);
+                assert(stats.chunks > 0 || getByteCount(gap_buffer) == 0);
+                GapBufferDocument_release(clone);
+                GapBufferStore_getStats(store, &stats);
+                assert(stats.chunks == 0);
+
+                GapBufferIter iter, copy_iter;
+                GapBufferLine line, copy_line;
+                GapBufferIter_init(&iter, gap_buffer);
+                GapBufferIter_init(&copy_iter, copy);
+                while (GapBufferIter_next(&iter, &line)) {
+                    assert(GapBufferIter_next(&copy_iter, &copy_line));
+                    assert(line.len == copy_line.len && !memcmp(line.str, copy_line.str, line.len));
+                }
+                assert(!GapBufferIter_next(&copy_iter, &copy_line));
+                GapBufferIter_free(&iter);
+                GapBufferIter_free(&copy_iter);
+                GapBuffer_destroy(copy);
+                break;
+            }
+
+            case 20:
+            {
+                // Write the same text to a file and to a chunked
+                // buffer, then check that loading the file gives
+                // the same counts.
+                size_t num = generateUnsignedIntegerBetween(0, 1 << 12);
+                fprintf(stderr, "CHUNKED_LOAD %ld\n", num);
+                FILE *file = tmpfile();
+                assert(file != NULL);
+                ChunkedBuffer *written = ChunkedBuffer_create(0);
+                assert(written != NULL);
+                for (size_t i = 0; i < num; i++) {
+                    size_t len = generateUTF8String(buffer, sizeof(buffer));
+                    fwrite(buffer, 1, len, file);
+                    assert(ChunkedBuffer_insertString(written, ChunkedBuffer_getByteCount(written), buffer, len));
+                }
+                fflush(file);
+
+                ChunkedBuffer *loaded = ChunkedBuffer_create(1 << 20);
+                assert(loaded != NULL);
+                assert(ChunkedBuffer_loadFile(loaded, fileno(file)));
+                assert(ChunkedBuffer_getByteCount(loaded) == ChunkedBuffer_getByteCount(written));
+                assert(ChunkedBuffer_getLineCount(loaded) == ChunkedBuffer_getLineCount(written));
+                assert(ChunkedBuffer_getSymbolCount(loaded) == ChunkedBuffer_getSymbolCount(written));
+                ChunkedBuffer_destroy(loaded);
+                ChunkedBuffer_destroy(written);
+                fclose(file);
+                break;
+            }
+
+            case 21:
+            {
+                // Move with a small budget per call and check the
+                // cursor ends where GapBuffer_moveAbsolute puts it
+                // on a copy, by inserting a marker in both.
+                size_t limit = 1.5 * getByteCount(gap_buffer);
+                size_t index = generateUnsignedIntegerBetween(0, limit);
+                size_t budget = generateUnsignedIntegerBetween(0, 64);
+                fprintf(stderr, "MOVE_BUDGETED %ld %ld\n", index, budget);
+
+                GapBufferDocument *doc = GapBufferStore_save(store, gap_buffer);
+                assert(doc != NULL);
+                GapBuffer *copy = GapBufferDocument_load(doc, 1);
+                assert(copy != NULL);
+                GapBufferDocument_release(doc);
+                GapBuffer_moveAbsolute(copy, index);
+                assert(GapBuffer_insertString(copy, "\x01", 1));
+
+                size_t estimate = GapBuffer_estimateMoveAbsolute(gap_buffer, index, NULL);
+                size_t calls = 1;
+                GapBufferMove move;
+                bool pending = GapBuffer_moveAbsoluteBudgeted(gap_buffer, index, budget, &move);
+                while (pending) {
+                    pending = GapBuffer_continueMove(gap_buffer, &move, budget);
+                    calls++;
+                }
+                assert(budget == 0 || calls <= estimate / budget + 4);
+                assert(GapBuffer_insertStringMaybeRelocate(&gap_buffer, "\x01", 1));
+
+                GapBufferIter iter, copy_iter;
+                GapBufferLine line, copy_line;
+                GapBufferIter_init(&iter, gap_buffer);
+                GapBufferIter_init(&copy_iter, copy);
+                while (GapBufferIter_next(&iter, &line)) {
+                    assert(GapBufferIter_next(&copy_iter, &copy_line));
+                    assert(line.len == copy_line.len && !memcmp(line.str, copy_line.str, line.len));
+                }
+                assert(!GapBufferIter_next(&copy_iter, &copy_line));
+                GapBufferIter_free(&iter);
+                GapBufferIter_free(&copy_iter);
+                GapBuffer_destroy(copy);
+                GapBuffer_removeBackwards(gap_buffer, 1);
+                break;
+            }
+
+            case 22:
+            {
+                size_t count = getByteCount(gap_buffer);
+                size_t slice = generateUnsignedIntegerBetween(1, 64);
+                fprintf(stderr, "JOBS %ld\n", slice);
+
+                GapBufferJob job;
+                char *text = malloc(count + 1);
+                assert(text != NULL);
+                GapBufferJob_copy(&job, &gap_buffer, text, count);
+                job.slice = slice;
+                while (GapBufferJob_step(&job) == GAPBUFFER_JOB_RUNNING);
+                assert(job.status == GAPBUFFER_JOB_DONE);
+
+                FILE *file = tmpfile();
+                assert(file != NULL);
+                GapBufferJob_write(&job, &gap_buffer, fileno(file));
+                job.slice = slice;
+                while (GapBufferJob_step(&job) == GAPBUFFER_JOB_RUNNING);
+                assert(job.status == GAPBUFFER_JOB_DONE);
+                char *written = malloc(count + 1);
+                assert(written != NULL);
+                rewind(file);
+                assert(fread(written, 1, count + 1, file) == count);
+                assert(!memcmp(written, text, count));
+                free(written);
+                fclose(file);
+
+                // Look for a piece of the text or for a random string
+                size_t from = generateUnsignedIntegerBetween(0, count);
+                size_t len = generateUnsignedIntegerBetween(0, 4);
+                char needle[5];
+                size_t pos = generateUnsignedIntegerBetween(0, count);
+                if (pos + len <= count && generateUnsignedIntegerBetween(0, 1))
+                    memcpy(needle, text + pos, len);
+                else
+                    len = generateString(needle, len + 1);
+                size_t expected = SIZE_MAX;
+                for (size_t i = from; i + len <= count; i++)
+                    if (!memcmp(text + i, needle, len)) {
+                        expected = i;
+                        break;
+                    }
+                GapBufferJob_find(&job, &gap_buffer, from, needle, len);
+                job.slice = slice;
+                while (GapBufferJob_step(&job) == GAPBUFFER_JOB_RUNNING);
+                assert(job.status == GAPBUFFER_JOB_DONE);
+                assert(job.found == expected);
+                free(text);
+
+                // A job is stopped by a cancellation or an edit,
+                // but not by an edit that leaves the text as it
+                // was.
+                bool cancel = false;
+                GapBufferJob_find(&job, &gap_buffer, 0, "\x01", 1);
+                job.slice = 1;
+                job.cancel = &cancel;
+                if (GapBufferJob_step(&job) == GAPBUFFER_JOB_RUNNING) {
+                    switch (generateUnsignedIntegerBetween(0, 2)) {
+                        case 0:
+                        cancel = true;
+                        assert(GapBufferJob_step(&job) == GAPBUFFER_JOB_CANCELLED);
+                        break;
+
+                        case 1:
+                        assert(GapBuffer_insertStringMaybeRelocate(&gap_buffer, "\x02", 1));
+                        GapBuffer_removeBackwards(gap_buffer, 1);
+                        assert(GapBufferJob_step(&job) == GAPBUFFER_JOB_CONFLICT);
+                        break;
+
+                        case 2:
+                        GapBuffer_removeForwards(gap_buffer, 0);
+                        GapBuffer_removeBackwards(gap_buffer, 0);
+                        assert(GapBuffer_insertString(gap_buffer, "", 0));
+                        assert(GapBufferJob_step(&job) != GAPBUFFER_JOB_CONFLICT);
+                        break;
+                    }
+                }
+
+                // Insertions that relocate the buffer stop the job,
+                // while relocations that keep the text don't.
+                GapBuffer *small = GapBuffer_create(16);
+                assert(small != NULL && GapBuffer_insertString(small, "abc", 3));
+                GapBufferJob_find(&job, &small, 0, "c", 1);
+                job.slice = 1;
+                assert(GapBufferJob_step(&job) == GAPBUFFER_JOB_RUNNING);
+                for (GapBuffer *before = small; small == before;)
+                    assert(GapBuffer_insertStringMaybeRelocate(&small, "x", 1));
+                assert(GapBufferJob_step(&job) == GAPBUFFER_JOB_CONFLICT);
+
+                GapBufferJob_find(&job, &small, 0, "c", 1);
+                job.slice = 1;
+                assert(GapBufferJob_step(&job) == GAPBUFFER_JOB_RUNNING);
+                size_t cap = 1024 + getByteCount(small);
+                small = GapBuffer_relocateUsingMemory(malloc(cap), cap, free, small);
+                assert(small != NULL);
+                while (GapBufferJob_step(&job) == GAPBUFFER_JOB_RUNNING);
+                assert(job.status == GAPBUFFER_JOB_DONE && job.found == 2);
+                GapBuffer_destroy(small);
+                break;
+            }
+
+            case 23:
+            {
+                // Apply the same edits to a copy of the buffer
+                // directly and to another through a queue filled
+                // by a second thread.
+                size_t count = generateUnsignedIntegerBetween(0, 64);
+                size_t capacity = generateUnsignedIntegerBetween(2, 64);
+                fprintf(stderr, "QUEUE %ld %ld\n", count, capacity);
+
+                GapBufferDocument *doc = GapBufferStore_save(store, gap_buffer);
+                assert(doc != NULL);
+                GapBuffer *direct = GapBufferDocument_load(doc, 4096);
+                GapBuffer *queued = GapBufferDocument_load(doc, 4096);
+                assert(direct != NULL && queued != NULL);
+                GapBufferDocument_release(doc);
+
+                ScriptedEdit edits[64];
+                for (size_t i = 0; i < count; i++) {
+                    edits[i].kind = generateUnsignedIntegerBetween(0, 4);
+                    edits[i].num = generateUnsignedIntegerBetween(0, 16);
+                    if (edits[i].kind == 3)
+                        edits[i].num -= 8;
+                    if (edits[i].kind == 0)
+                        edits[i].len = generateUTF8String(edits[i].str, sizeof(edits[i].str));
+                    applyEdit(direct, &edits[i]);
+                }
+
+                Producer producer = { .edits=edits, .count=count, .done=false };
+                producer.queue = GapBufferQueue_create(capacity);
+                assert(producer.queue != NULL);
+                pthread_t thread;
+                assert(!pthread_create(&thread, NULL, runProducer, &producer));
+                while (!producer.done)
+                    assert(GapBufferQueue_apply(producer.queue, queued));
+                assert(GapBufferQueue_apply(producer.queue, queued));
+                pthread_join(thread, NULL);
+                GapBufferQueue_destroy(producer.queue);
+
+                assert(GapBuffer_insertString(direct, "\x01", 1));
+                assert(GapBuffer_insertString(queued, "\x01", 1));
+                GapBufferIter iter, queued_iter;
+                GapBufferLine line, queued_line;
+                GapBufferIter_init(&iter, direct);
+                GapBufferIter_init(&queued_iter, queued);
+                while (GapBufferIter_next(&iter, &line)) {
+                    assert(GapBufferIter_next(&queued_iter, &queued_line));
+                    assert(line.len == queued_line.len && !memcmp(line.str, queued_line.str, line.len));
+                }
+                assert(!GapBufferIter_next(&queued_iter, &queued_line));
+                GapBufferIter_free(&iter);
+                GapBufferIter_free(&queued_iter);
+                GapBuffer_destroy(direct);
+                GapBuffer_destroy(queued);
+
+                // A string that needs more records than the queue
+                // has is rejected as too large, not as full.
+                GapBufferQueue *small = GapBufferQueue_create(2);
+                assert(small != NULL);
+                char text[45];
+                memset(text, 'a', sizeof(text));
+                assert(GapBufferQueue_insertString(small, text, 45) == GAPBUFFER_QUEUE_TOO_LARGE);
+                assert(GapBufferQueue_insertString(small, "\xff", 1) == GAPBUFFER_QUEUE_INVALID);
+                assert(GapBufferQueue_insertString(small, text, 44) == GAPBUFFER_QUEUE_QUEUED);
+                assert(GapBufferQueue_insertString(small, text, 1) == GAPBUFFER_QUEUE_FULL);
+                GapBuffer *target = GapBuffer_create(128);
+                assert(target != NULL);
+                assert(GapBufferQueue_apply(small, target));
+                assert(GapBuffer_getByteCount(target) == 44);
+                assert(GapBufferQueue_insertString(small, text, 1) == GAPBUFFER_QUEUE_QUEUED);
+                GapBufferQueue_destroy(small);
+                GapBuffer_destroy(target);
+                break;
+            }
+
+            case 24:
+            {
+                // Edit a shared buffer while another thread reads
+                // it through its own mapping. The text is always
+                // made of copies of the same line, so a reader
+                // seeing anything else read it while it changed.
+                size_t count = generateUnsignedIntegerBetween(0, 256);
+                fprintf(stderr, "SHARED %ld\n", count);
+                int fd;
+                GapBuffer *shared = GapBuffer_createShared(1 << 16, &fd);
+                assert(shared != NULL);
+                SharedReader reader = { .view=GapBufferView_open(fd), .stop=false, .snapshots=0 };
+                assert(reader.view != NULL);
+                close(fd);
+
+                pthread_t thread;
+                assert(!pthread_create(&thread, NULL, runSharedReader, &reader));
+                size_t lines = 0;
+                for (size_t i = 0; i < count; i++) {
+                    if (lines == 0 || generateUnsignedIntegerBetween(0, 2)) {
+                        GapBuffer_moveAbsolute(shared, generateUnsignedIntegerBetween(0, lines) * SHARED_LINE_LEN);
+                        assert(GapBuffer_insertString(shared, shared_line, SHARED_LINE_LEN));
+                        lines++;
+                    } else {
+                        GapBuffer_moveAbsolute(shared, generateUnsignedIntegerBetween(1, lines) * SHARED_LINE_LEN);
+                        GapBuffer_removeBackwards(shared, SHARED_LINE_LEN);
+                        lines--;
+                    }
+                }
+                reader.stop = true;
+                pthread_join(thread, NULL);
+
+                // Once the writer is done, the reader sees all of it
+                GapBufferViewIter iter;
+                GapBufferLine line;
+                size_t seen = 0;
+                GapBufferViewIter_init(&iter, reader.view);
+                while (GapBufferViewIter_next(&iter, &line))
+                    seen++;
+                assert(GapBufferViewIter_isValid(&iter));
+                assert(GapBufferView_getVersion(reader.view) == GapBuffer_getVersion(shared));
+                assert(seen == lines);
+                GapBufferView_close(reader.view);
+                GapBuffer_destroy(shared);
+                break;
+            }
+
+            case 25:
+            {
+                // Replay the edits done to the main buffer since
+                // the last time on the follower. Now and then
+                // the follower is changed behind the back of the
+                // leader, which must be detected sooner or later.
+                bool corrupt = generateUnsignedIntegerBetween(0, 15) == 0;
+                fprintf(stderr, "REPLICATE%s\n", corrupt ? " CORRUPT" : "");
+                if (corrupt) {
+                    assert(GapBuffer_insertStringMaybeRelocate(&follower, "?", 1));
+                    follower_corrupted = true;
+                }
+
+                GapBufferReplicaStatus status = replicate(stream, &follower);
+                assert(status != GAPBUFFER_REPLICA_INVALID);
+                if (status == GAPBUFFER_REPLICA_DIVERGED) {
+                    assert(follower_corrupted);
+                    GapBufferStream_requestSnapshot(stream);
+                    assert(replicate(stream, &follower) == GAPBUFFER_REPLICA_OK);
+                    follower_corrupted = false;
+                }
+                if (follower_corrupted)
+                    break;
+                assert(haveSameText(gap_buffer, follower));
+
+                // The cursors match if a marker inserted at the
+                // cursor of the leader ends up in the same place.
+                if (!GapBuffer_insertStringMaybeRelocate(&gap_buffer, "\x01", 1))
+                    break;
+                assert(replicate(stream, &follower) == GAPBUFFER_REPLICA_OK);
+                assert(haveSameText(gap_buffer, follower));
+                GapBuffer_removeBackwards(gap_buffer, 1);
+                break;
+            }
+
+            case 26:
+            {
+                // Edit random ranges of the chunked buffer from
+                // many threads. Overlapping ones wait for each
+                // other. Then check that the counts match the
+                // text.
+                size_t count = generateUnsignedIntegerBetween(1, 4);
+                fprintf(stderr, "RANGES %ld\n", count);
+                pthread_t threads[4];
+                for (size_t i = 0; i < count; i++)
+                    assert(!pthread_create(&threads[i], NULL, runRangeWriter, chunked_buffer));
+                for (size_t i = 0; i < count; i++)
+                    pthread_join(threads[i], NULL);
+
+                ChunkedBufferRange range;
+                assert(ChunkedBuffer_lockRange(chunked_buffer, 0, SIZE_MAX, &range));
+                assert(range.len == ChunkedBuffer_getByteCount(chunked_buffer));
+                char *text = malloc(range.len + 1);
+                assert(text != NULL);
+                assert(ChunkedBufferRange_copy(&range, 0, text, range.len) == range.len);
+                size_t lines = 1;
+                size_t symbols = 0;
+                for (size_t i = 0; i < range.len; i++) {
+                    lines += text[i] == '\n';
+                    symbols += !isAuxiliaryByte(text[i]);
+                }
+                assert(lines == ChunkedBuffer_getLineCount(chunked_buffer));
+                assert(symbols == ChunkedBuffer_getSymbolCount(chunked_buffer));
+                ChunkedBuffer_unlockRange(&range);
+                free(text);
+                break;
+            }
+
+            case 27:
+            {
+                // Commit the text of the main buffer and check
+                // that the last few versions still hold the
+                // text they had when they were committed.
+                fprintf(stderr, "VERSION %ld\n", num_versions);
+                GapBufferVersion *version = GapBuffer_commitVersion(gap_buffer);
+                if (version == NULL)
+                    break;
+                KeptVersion *kept = &versions[num_versions++ % KEPT_VERSIONS];
+                if (kept->version) {
+                    GapBufferVersion_release(kept->version);
+                    free(kept->text);
+                }
+                kept->version = version;
+                kept->text = copyText(gap_buffer, &kept->len);
+                for (size_t i = 0; i < MIN(num_versions, KEPT_VERSIONS); i++)
+                    checkVersion(&versions[i]);
+                break;
+            }
+
+            case 28:
+            {
+                // Feed UTF-8 text to a buffer through a pipe in
+                // pieces cut at random points, so that symbols
+                // are split between reads, relocating the buffer
+                // in between now and then. Sometimes a byte is
+                // made invalid and only the text before it must
+                // be inserted.
+                char text[256];
+                size_t len = generateUTF8String(text, sizeof(text));
+                bool corrupt = len > 0 && generateUnsignedIntegerBetween(0, 3) == 0;
+                if (corrupt)
+                    text[generateUnsignedIntegerBetween(0, len-1)] = (char) 0xFF;
+                fprintf(stderr, "READ %ld%s\n", len, corrupt ? " CORRUPT" : "");
+
+                size_t valid = 0;
+                while (valid < len) {
+                    uint32_t rune;
+                    int n = getSymbolRune(text + valid, len - valid, &rune);
+                    if (n < 0)
+                        break;
+                    valid += n;
+                }
+
+                int fds[2];
+                assert(!pipe(fds));
+                GapBuffer *reader = GapBuffer_create(sizeof(text));
+                assert(reader != NULL);
+                size_t written = 0;
+                bool failed = false;
+                while (written < len && !failed) {
+                    size_t piece = generateUnsignedIntegerBetween(1, len - written);
+                    assert(write(fds[1], text + written, piece) == (ssize_t) piece);
+                    written += piece;
+                    ssize_t n = GapBuffer_readFrom(reader, fds[0], piece);
+                    if (n < 0) {
+                        assert(errno == EILSEQ);
+                        failed = true;
+                    } else
+                        assert((size_t) n == piece);
+
+                    if (generateUnsignedIntegerBetween(0, 3) == 0) {
+                        size_t cap = 1024 + generateUnsignedIntegerBetween(0, 16);
+                        GapBuffer *moved = GapBuffer_relocateUsingMemory(malloc(cap), cap, free, reader);
+                        assert(moved != NULL);
+                        reader = moved;
+                    }
+                }
+                assert(failed == (valid < len));
+
+                size_t got;
+                char *copy = copyText(reader, &got);
+                assert(got == valid);
+                assert(!memcmp(copy, text, got));
+                free(copy);
+                GapBuffer_destroy(reader);
+                close(fds[0]);
+                close(fds[1]);
+                break;
+            }
+
+            case 29:
+            {
+                // Follow a file while it's appended to (with
+                // symbols split between appends and invalid
+                // bytes), truncated in place and rotated, and
+                // check that the buffer holds the text of the
+                // rotated files followed by the text of the
+                // current one.
+                size_t actions = generateUnsignedIntegerBetween(1, 20);
+                fprintf(stderr, "FOLLOW %ld\n", actions);
+                char path[] = "/tmp/gap_buffer_follow_XXXXXX";
+                int fd = mkstemp(path);
+                assert(fd >= 0);
+                char rotated[sizeof(path) + 2];
+                snprintf(rotated, sizeof(rotated), "%s.1", path);
+
+                GapBufferFollow follow;
+                assert(GapBufferFollow_open(&follow, path, 0));
+                GapBuffer *followed = GapBuffer_create(0);
+                assert(followed != NULL);
+
+                static char file[4096];
+                static char expected[16384];
+                size_t file_len = 0;
+                size_t done_len = 0; // Text of the rotated files
+                for (size_t i = 0; i < actions; i++) {
+                    size_t action = generateUnsignedIntegerBetween(0, 7);
+                    if (action == 6 && file_len > 0 && fd >= 0) {
+                        file_len = generateUnsignedIntegerBetween(0, file_len-1);
+                        assert(!ftruncate(fd, file_len));
+                    } else if (action == 7 && fd >= 0) {
+                        assert(!rename(path, rotated));
+                        close(fd);
+                        fd = -1;
+                        done_len += decodeFollowed(file, file_len, expected + done_len);
+                        file_len = 0;
+                        if (generateUnsignedIntegerBetween(0, 1))
+                            fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+                        else if (generateUnsignedIntegerBetween(0, 9) == 0) {
+                            // The file shows up while waiting for it
+                            LateFile late = { .path=path, .text="late\n", .len=5 };
+                            pthread_t thread;
+                            assert(!pthread_create(&thread, NULL, createLateFile, &late));
+                            assert(GapBufferFollow_poll(&follow, &followed, -1) >= 0);
+                            pthread_join(thread, NULL);
+                            fd = open(path, O_WRONLY);
+                            memcpy(file, late.text, late.len);
+                            file_len = late.len;
+                        }
+                    } else if (action < 6) {
+                        if (fd < 0)
+                            fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+                        char piece[64];
+                        size_t len = generateUTF8String(piece, sizeof(piece));
+                        len = generateUnsignedIntegerBetween(0, len);
+                        if (len > 0 && generateUnsignedIntegerBetween(0, 7) == 0)
+                            piece[generateUnsignedIntegerBetween(0, len-1)] = (char) 0xFF;
+                        assert(pwrite(fd, piece, len, file_len) == (ssize_t) len);
+                        memcpy(file + file_len, piece, len);
+                        file_len += len;
+                    }
+                    assert(fd >= 0 || file_len == 0);
+
+                    ssize_t n = GapBufferFollow_poll(&follow, &followed, 0);
+                    assert(n >= 0 || errno == EILSEQ);
+
+                    size_t len = done_len + decodeFollowed(file, file_len, expected + done_len);
+                    size_t got;
+                    char *text = copyText(followed, &got);
+                    assert(got == len);
+                    assert(!memcmp(text, expected, len));
+                    free(text);
+                }
+                GapBufferFollow_close(&follow);
+                GapBuffer_destroy(followed);
+                if (fd >= 0)
+                    close(fd);
+                unlink(path);
+                unlink(rotated);
+
+                // Readers of a shared buffer see what's appended
+                // and what's dropped when the file is truncated.
+                fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+                assert(fd >= 0);
+                assert(GapBufferFollow_open(&follow, path, 0));
+                int shared_fd;
+                GapBuffer *shared = GapBuffer_createShared(4096, &shared_fd);
+                assert(shared != NULL);
+                GapBufferView *view = GapBufferView_open(shared_fd);
+                assert(view != NULL);
+                // Each text is shorter than the previous one, so
+                // that the file reads as truncated.
+                const char *texts[] = { "first line\n", "next\n", "" };
+                for (size_t i = 0; i < 3; i++) {
+                    size_t version = GapBufferView_getVersion(view);
+                    assert(!ftruncate(fd, 0));
+                    assert(pwrite(fd, texts[i], strlen(texts[i]), 0) == (ssize_t) strlen(texts[i]));
+                    assert(GapBufferFollow_poll(&follow, &shared, 0) == (ssize_t) strlen(texts[i]));
+                    assert(GapBufferView_getVersion(view) != version);
+                    GapBufferViewIter view_iter;
+                    GapBufferLine line;
+                    GapBufferViewIter_init(&view_iter, view);
+                    if (texts[i][0] != '\0') {
+                        assert(GapBufferViewIter_next(&view_iter, &line));
+                        assert(line.len == strlen(texts[i]) - 1 && !memcmp(line.str, texts[i], line.len));
+                    }
+                    assert(!GapBufferViewIter_next(&view_iter, &line) || line.len == 0);
+                    assert(GapBufferViewIter_isValid(&view_iter));
+                }
+                GapBufferView_close(view);
+                GapBufferFollow_close(&follow);
+                GapBuffer_destroy(shared);
+                close(shared_fd);
+                close(fd);
+                unlink(path);
+                break;
+            }
+
+            case 30:
+            {
+                // Edit a chunked buffer whose budget only fits a
+                // couple of chunks, so that edited chunks are
+                // spilled and read back, and check its text
+                // against a copy edited the same way.
+                size_t edits = generateUnsignedIntegerBetween(1, 40);
+                fprintf(stderr, "CHUNKED_SPILL %ld\n", edits);
+                ChunkedBuffer *small = ChunkedBuffer_create(3 << 16);
+                assert(small != NULL);
+
+                static char expected[1 << 21];
+                static char str[1 << 18];
+                size_t expected_len = 0;
+                for (size_t i = 0; i < edits; i++) {
+                    size_t pos = generateUnsignedIntegerBetween(0, expected_len);
+                    while (pos > 0 && pos < expected_len && isAuxiliaryByte(expected[pos]))
+                        pos--;
+                    if (generateUnsignedIntegerBetween(0, 3) > 0) {
+                        size_t max = generateUnsignedIntegerBetween(0, 5) ? (1 << 15) : sizeof(str);
+                        size_t len = generateUTF8String(str, MIN(max, sizeof(expected) - expected_len));
+                        assert(ChunkedBuffer_insertString(small, pos, str, len));
+                        memmove(expected + pos + len, expected + pos, expected_len - pos);
+                        memcpy(expected + pos, str, len);
+                        expected_len += len;
+                    } else {
+                        size_t len = generateUnsignedIntegerBetween(0, 1 << 16);
+                        assert(ChunkedBuffer_remove(small, pos, len));
+                        size_t end = MIN(pos + len, expected_len);
+                        while (end < expected_len && isAuxiliaryByte(expected[end]))
+                            end++;
+                        memmove(expected + pos, expected + end, expected_len - end);
+                        expected_len -= end - pos;
+                    }
+                    assert(ChunkedBuffer_getByteCount(small) == expected_len);
+                }
+
+                // With more than a few chunks of text, some of
+                // them must have been evicted.
+                if (expected_len > (8 << 16))
+                    assert(ChunkedBuffer_getResidentBytes(small) < expected_len);
+
+                ChunkedBufferRange range;
+                assert(ChunkedBuffer_lockRange(small, 0, SIZE_MAX, &range));
+                char *text = malloc(range.len + 1);
+                assert(text != NULL);
+                assert(ChunkedBufferRange_copy(&range, 0, text, range.len) == expected_len);
+                assert(!memcmp(text, expected, expected_len));
+                ChunkedBuffer_unlockRange(&range);
+                free(text);
+                ChunkedBuffer_destroy(small);
+                break;
+            }
+
+            case 31:
+            {
+                // Map a file of random text, check that the buffer
+                // holds it and that it can be edited but not
+                // compacted. Files with invalid UTF-8 can't be
+                // mapped.
+                static char text[1 << 16];
+                size_t len = generateUnsignedIntegerBetween(0, sizeof(text) - 32);
+                size_t extra = generateUnsignedIntegerBetween(0, 64);
+                size_t done = 0;
+                while (done < len)
+                    done += generateUTF8String(text + done, MIN(len - done, 32));
+                bool corrupt = len > 0 && generateUnsignedIntegerBetween(0, 7) == 0;
+                if (corrupt)
+                    text[generateUnsignedIntegerBetween(0, len-1)] = (char) 0xFF;
+                fprintf(stderr, "MAP_FILE %ld %ld %s\n", len, extra, corrupt ? "CORRUPT" : "");
+
+                FILE *file = tmpfile();
+                assert(file != NULL);
+                assert(fwrite(text, 1, len, file) == len);
+                fflush(file);
+
+                GapBuffer *mapped = GapBuffer_mapFile(fileno(file), extra);
+                fclose(file);
+                if (corrupt) {
+                    assert(mapped == NULL);
+                    break;
+                }
+                assert(mapped != NULL);
+                assert(!GapBuffer_compact(mapped, 0));
+
+                size_t got;
+                char *copy = copyText(mapped, &got);
+                assert(got == len && !memcmp(copy, text, len));
+                free(copy);
+
+                size_t num = generateUTF8String(text + len, MIN(extra, 32));
+                assert(GapBuffer_insertString(mapped, text + len, num));
+                GapBuffer_moveAbsolute(mapped, 0);
+                copy = copyText(mapped, &got);
+                assert(got == len + num && !memcmp(copy, text, len + num));
+                free(copy);
+                GapBuffer_destroy(mapped);
+                break;
+            }
+
+            case 32:
+            {
+#ifdef GAPBUFFER_TRACE
+                // Record the calls on a buffer, then record a
+                // second session without clearing the first
+                // one, and check that each trace only has the
+                // calls of its session.
+                fprintf(stderr, "TRACE\n");
+                GapBuffer *traced = GapBuffer_create(64);
+                assert(traced != NULL);
+
+                assert(GapBufferTrace_start(64, 1));
+                assert(!GapBufferTrace_start(64, 1));
+                size_t len = generateUTF8String(buffer, sizeof(buffer));
+                GapBufferCost cost;
+                GapBuffer_estimateInsert(traced, len, &cost);
+                assert(GapBuffer_insertString(traced, buffer, len));
+                GapBuffer_getSlice(traced, 0, &len);
+                GapBufferVersion_release(GapBuffer_commitVersion(traced));
+                GapBufferTrace_stop();
+
+                char *json = writeTrace();
+                assert(strstr(json, "\"GapBuffer_estimateInsert\""));
+                assert(strstr(json, "\"GapBuffer_insertString\""));
+                assert(strstr(json, "\"GapBuffer_getSlice\""));
+                assert(strstr(json, "\"GapBuffer_commitVersion\""));
+                free(json);
+
+                assert(GapBufferTrace_start(64, 1));
+                GapBuffer_destroy(traced);
+                GapBufferTrace_stop();
+                json = writeTrace();
+                assert(strstr(json, "\"GapBuffer_destroy\""));
+                assert(!strstr(json, "\"GapBuffer_insertString\""));
+                free(json);
+                GapBufferTrace_clear();
+#endif
+                break;
+            }
+
+            case 33:
+            {
+                // Fill a shared buffer while another process reads
+                // it, then check that the functions that would move
+                // it elsewhere fail instead, so that the reader
+                // keeps seeing the text.
+                size_t capacity = generateUnsignedIntegerBetween(1, 16) * SHARED_LINE_LEN;
+                fprintf(stderr, "SHARED_FULL %ld\n", capacity);
+                int fd;
+                GapBuffer *shared = GapBuffer_createShared(capacity, &fd);
+                assert(shared != NULL);
+                int fds[2];
+                assert(!pipe(fds));
+                fflush(stderr);
+                pid_t pid = fork();
+                assert(pid >= 0);
+                if (pid == 0) {
+                    close(fds[1]);
+                    _exit(runSharedReaderProcess(fd, fds[0]));
+                }
+                close(fds[0]);
+                close(fd);
+
+                size_t lines = 0;
+                while (GapBuffer_insertString(shared, shared_line, SHARED_LINE_LEN))
+                    lines++;
+                assert(lines * SHARED_LINE_LEN >= capacity);
+
+                GapBuffer *full = shared;
+                assert(!GapBuffer_insertStringMaybeRelocate(&shared, shared_line, SHARED_LINE_LEN));
+                assert(!GapBuffer_insertStringMaybeRelocateIncrementally(&shared, shared_line, SHARED_LINE_LEN));
+                size_t len = 2 * getByteCount(shared) + 1024;
+                assert(GapBuffer_relocateUsingMemory(malloc(len), len, free, shared) == NULL);
+                assert(GapBufferRegistry_add(registry, shared) == SIZE_MAX);
+
+                // Replicating a longer text needs more space
+                GapBuffer *leader = GapBuffer_create(0);
+                GapBufferStream *leader_stream = GapBufferStream_create(16);
+                assert(leader != NULL && leader_stream != NULL);
+                GapBuffer_setStream(leader, leader_stream);
+                for (size_t i = 0; i <= lines; i++)
+                    assert(GapBuffer_insertStringMaybeRelocate(&leader, shared_line, SHARED_LINE_LEN));
+                size_t data_len, used;
+                const char *data = GapBufferStream_getData(leader_stream, &data_len);
+                assert(GapBuffer_applyStream(&shared, data, data_len, &used) == GAPBUFFER_REPLICA_INVALID);
+                GapBuffer_destroy(leader);
+                GapBufferStream_destroy(leader_stream);
+                assert(shared == full);
+
+                // The text may have grown by a few of the lines of the
+                // stream, so remove one and tell the reader how many
+                // are left.
+                GapBuffer_removeBackwards(shared, SHARED_LINE_LEN);
+                lines = getByteCount(shared) / SHARED_LINE_LEN;
+                assert(write(fds[1], &lines, sizeof(lines)) == sizeof(lines));
+                close(fds[1]);
+                int status;
+                assert(waitpid(pid, &status, 0) == pid);
+                assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+                GapBuffer_destroy(shared);
+                break;
+            }
+
+            case 34:
+            {
+                // Edit a buffer managed by a registry with no
+                // budget, which shrinks, compacts and spills it
+                // between the edits, and check that its stream and
+                // its committed version follow it.
+                size_t edits = generateUnsignedIntegerBetween(1, 16);
+                fprintf(stderr, "REGISTRY_STREAM %ld\n", edits);
+                GapBufferRegistry *managing = GapBufferRegistry_create(0);
+                GapBuffer *managed = GapBuffer_create(1 << 16);
+                GapBufferStream *managed_stream = GapBufferStream_create(16);
+                GapBuffer *replica = GapBuffer_create(0);
+                assert(managing != NULL && managed != NULL && managed_stream != NULL && replica != NULL);
+                GapBuffer_setStream(managed, managed_stream);
+                size_t id = GapBufferRegistry_add(managing, managed);
+                assert(id != SIZE_MAX);
+
+                bool spilled = false;
+                for (size_t i = 0; i < edits; i++) {
+                    GapBuffer *buff = GapBufferRegistry_acquire(managing, id);
+                    assert(buff != NULL);
+                    size_t len = generateUTF8String(buffer, sizeof(buffer));
+                    assert(GapBuffer_insertStringMaybeRelocate(&buff, buffer, len));
+                    GapBufferVersion *version = GapBuffer_commitVersion(buff);
+                    assert(version != NULL);
+                    GapBufferRegistry_release(managing, id, buff);
+
+                    size_t steps = generateUnsignedIntegerBetween(0, 3);
+                    for (size_t j = 0; j < steps; j++)
+                        GapBufferRegistry_reclaim(managing);
+                    GapBufferRegistryStats stats;
+                    GapBufferRegistry_getStats(managing, &stats);
+                    spilled |= stats.spilled_bytes > 0;
+
+                    // Nothing changed since the last commit, so the
+                    // buffer gives the same version back.
+                    buff = GapBufferRegistry_acquire(managing, id);
+                    assert(buff != NULL);
+                    GapBufferVersion *same = GapBuffer_commitVersion(buff);
+                    assert(same == version);
+                    GapBufferVersion_release(same);
+                    GapBufferVersion_release(version);
+                    assert(replicate(managed_stream, &replica) == GAPBUFFER_REPLICA_OK);
+                    assert(haveSameText(buff, replica));
+                    GapBufferRegistry_release(managing, id, buff);
+                }
+                fprintf(stderr, "REGISTRY_STREAM .. %s\n", spilled ? "SPILLED" : "NOT SPILLED");
+                GapBufferRegistry_destroy(managing);
+                GapBufferStream_destroy(managed_stream);
+                GapBuffer_destroy(replica);
+                break;
+            }
+
+            case 35:
+            {
+                // Grow a chunk of a locked range until insertions
+                // into it fail, then check that it's split when
+                // the range is unlocked and can grow again.
+                size_t num = generateUnsignedIntegerBetween(1, BIG_INSERTION);
+                fprintf(stderr, "CHUNK_GROWTH %ld\n", num);
+                char *big = malloc(num);
+                ChunkedBuffer *growing = ChunkedBuffer_create(0);
+                assert(big != NULL && growing != NULL);
+                for (size_t k = 0; k < num; k++)
+                    big[k] = (k % 61 == 60) ? '\n' : 'a' + k % 26;
+
+                ChunkedBufferRange range;
+                assert(ChunkedBuffer_lockRange(growing, 0, 0, &range));
+                size_t inserted = 0;
+                while (inserted < (64 << 20) && ChunkedBufferRange_insertString(&range, 0, big, num))
+                    inserted += num;
+                assert(inserted < (64 << 20) && range.len == inserted);
+                ChunkedBuffer_unlockRange(&range);
+                assert(ChunkedBuffer_getByteCount(growing) == inserted);
+
+                assert(ChunkedBuffer_lockRange(growing, 0, 0, &range));
+                assert(ChunkedBufferRange_insertString(&range, 0, big, num));
+                ChunkedBuffer_unlockRange(&range);
+                assert(ChunkedBuffer_getByteCount(growing) == inserted + num);
+                ChunkedBuffer_destroy(growing);
+                free(big);
+
+                // A grown chunk counts in the resident bytes with
+                // its actual size. It's only split when no range
+                // is locked, so another one is kept locked.
+                static char block[4096];
+                memset(block, 'a', sizeof(block));
+                growing = ChunkedBuffer_create(0);
+                assert(growing != NULL);
+                while (ChunkedBuffer_getByteCount(growing) < (3 << 16))
+                    assert(ChunkedBuffer_insertString(growing, ChunkedBuffer_getByteCount(growing), block, sizeof(block)));
+                ChunkedBufferRange other;
+                assert(ChunkedBuffer_lockRange(growing, ChunkedBuffer_getByteCount(growing), 0, &other));
+                assert(ChunkedBuffer_lockRange(growing, 0, 0, &range));
+                for (size_t grown = 0; grown < (8 << 16); grown += sizeof(block))
+                    assert(ChunkedBufferRange_insertString(&range, 0, block, sizeof(block)));
+                ChunkedBuffer_unlockRange(&range);
+                assert(ChunkedBuffer_getResidentBytes(growing) > (8 << 16) + (3 << 16));
+                ChunkedBuffer_unlockRange(&other);
+                ChunkedBuffer_destroy(growing);
+                break;
+            }
+
+            case 36:
+            {
+                // Read, move in and append to a buffer whose
+                // relocation is in progress and check the text
+                // against a copy. Reading must not complete the
+                // relocation.
+                size_t lines = generateUnsignedIntegerBetween(1, 2000);
+                fprintf(stderr, "RELOCATING_READS %ld\n", lines);
+                char *model = malloc(lines * 82 + 128);
+                assert(model != NULL);
+                size_t len = 0;
+                for (size_t i = 0; i < lines; i++) {
+                    size_t n = generateUnsignedIntegerBetween(0, 80);
+                    for (size_t k = 0; k < n; k++)
+                        model[len++] = 'a' + generateUnsignedIntegerBetween(0, 25);
+                    model[len++] = '\n';
+                }
+
+                GapBuffer *moving = GapBuffer_create(len);
+                assert(moving != NULL && GapBuffer_insertString(moving, model, len));
+                GapBuffer_moveAbsolute(moving, generateUnsignedIntegerBetween(0, len));
+                size_t cap = 2 * len + 1024;
+                moving = GapBuffer_relocateUsingMemory(malloc(cap), cap, free, moving);
+                assert(moving != NULL);
+
+                GapBufferIter iter;
+                GapBufferLine line;
+                GapBufferIter_init(&iter, moving);
+                size_t cur = 0;
+                while (GapBufferIter_next(&iter, &line)) {
+                    assert(cur + line.len < len && !memcmp(model + cur, line.str, line.len));
+                    assert(model[cur + line.len] == '\n');
+                    cur += line.len + 1;
+                }
+                assert(cur == len);
+                GapBufferIter_free(&iter);
+                assert(GapBuffer_continueRelocation(moving, 0));
+
+                GapBufferDocument *doc = GapBufferStore_save(store, moving);
+                assert(doc != NULL && GapBufferDocument_getByteCount(doc) == len);
+                GapBuffer *saved = GapBufferDocument_load(doc, 0);
+                assert(saved != NULL);
+                size_t saved_len;
+                char *saved_text = copyText(saved, &saved_len);
+                assert(saved_len == len && !memcmp(saved_text, model, len));
+                free(saved_text);
+                GapBuffer_destroy(saved);
+                GapBufferDocument_release(doc);
+                assert(GapBuffer_continueRelocation(moving, 0));
+
+                size_t pos = generateUnsignedIntegerBetween(0, len - 1);
+                GapBuffer_moveAbsolute(moving, pos);
+                assert(GapBuffer_insertString(moving, "\n", 1));
+                memmove(model + pos + 1, model + pos, len - pos);
+                model[pos] = '\n';
+                len++;
+
+                assert(GapBuffer_appendDroppingLines(moving, "tail\n", 5));
+                memcpy(model + len, "tail\n", 5);
+                len += 5;
+
+                size_t moved_len;
+                char *moved_text = copyText(moving, &moved_len);
+                assert(moved_len == len && !memcmp(moved_text, model, len));
+                free(moved_text);
+                GapBuffer_destroy(moving);
+                free(model);
+                break;
+            }
+
         }
     }
+    for (size_t i = 0; i < MIN(num_versions, KEPT_VERSIONS); i++) {
+        GapBufferVersion_release(versions[i].version);
+        free(versions[i].text);
+    }
+    GapBufferStream_destroy(stream);
+    GapBuffer_destroy(follower);
+    GapBufferStore_destroy(store);
+    GapBufferRegistry_destroy(registry);
+    ChunkedBuffer_destroy(chunked_buffer);
+    MultiGapBuffer_destroy(multi_gap_buffer);
     GapBuffer_destroy(gap_buffer);
     return 0;
 }
\ No newline at end of file